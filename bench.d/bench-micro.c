@@ -0,0 +1,479 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Micro-benchmarks of library functions, compiled and run by ./bench
+ * before the display is started. The arguments name the benchmarks
+ * to run, see `main`. */
+
+#include <libmdsserver/hash-help.h>
+#include <libmdsserver/hash-table.h>
+#include <libmdsclient/inbound.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+
+
+/**
+ * Header lines, as mds-server hashes them when it
+ * looks for interceptors, and names, as the servers
+ * use them as keys in their tables
+ */
+static const char *const header_lines[] = {
+	"Command: echo",
+	"Command: key-sent",
+	"Command: get-colour",
+	"Command: intercept",
+	"Command: keyboard-enumeration",
+	"Client ID: 0:1",
+	"Client ID: 4294967295:4294967295",
+	"Message ID: 12",
+	"Message ID: 4294967295",
+	"To: 0:42",
+	"In response to: 17",
+	"Length: 4096",
+	"Origin command: list-colours",
+	"Modifying: yes",
+	"Priority: -4611686018427387904",
+	"Stop: no",
+	"Action: add",
+	"Time to live: 5",
+	"Keyboard: keyboard",
+	"Name: background",
+	"Bytes: 2",
+	"echo",
+	"key-sent",
+	"background",
+};
+
+#define HEADER_LINES (sizeof(header_lines) / sizeof(*header_lines))
+
+
+/**
+ * The number of keys whose byte-wise hashes collide
+ * in the collision benchmark, must be a power of two
+ */
+#define COLLIDING_KEYS 2048
+
+
+/**
+ * The number of messages spooled in each run of the spool benchmark
+ */
+#define SPOOLED_MESSAGES 200000
+
+/**
+ * The most spooling threads in the spool benchmark
+ */
+#define SPOOLERS_MAX 8
+
+/**
+ * The message limit of the lane in the spool benchmark
+ */
+#define SPOOL_LIMIT 32
+
+
+/**
+ * Optimisation barrier for results
+ */
+static volatile size_t sink;
+
+
+
+/**
+ * Get the current time in nanoseconds
+ * 
+ * @return  The current time in nanoseconds
+ */
+static long long int
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (long long int)ts.tv_sec * 1000000000LL + (long long int)ts.tv_nsec;
+}
+
+
+/**
+ * Measure `string_hash` over `header_lines`
+ * 
+ * @param   rounds  The number of times to hash every line
+ * @return          Nanoseconds per hash
+ */
+static double
+time_hash(size_t rounds)
+{
+	long long int start = now();
+	size_t r, i, acc = 0;
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < HEADER_LINES; i++)
+			acc += string_hash(header_lines[i]);
+	sink = acc;
+	return (double)(now() - start) / (double)(rounds * HEADER_LINES);
+}
+
+
+/**
+ * Fill a hash table with string keys and measure lookups of them
+ * 
+ * @param   keys    The keys
+ * @param   n       The number of keys
+ * @param   rounds  The number of times to look up every key
+ * @return          Nanoseconds per lookup, -1 on error
+ */
+static double
+time_lookup(char **keys, size_t n, size_t rounds)
+{
+	hash_table_t table;
+	long long int start;
+	size_t r, i, acc = 0;
+	double rc = -1;
+
+	if (hash_table_create(&table))
+		return -1;
+	table.key_comparator = (compare_func *)string_comparator;
+	table.hasher = (hash_func *)string_hash;
+
+	for (i = 0; i < n; i++)
+		if (errno = 0, !hash_table_put(&table, (size_t)(void *)keys[i], i + 1) && errno)
+			goto done;
+
+	start = now();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < n; i++)
+			acc += hash_table_get(&table, (size_t)(void *)keys[i]);
+	sink = acc;
+	rc = (double)(now() - start) / (double)(rounds * n);
+
+done:
+	hash_table_destroy(&table, NULL, NULL);
+	return rc;
+}
+
+
+/**
+ * Compare the byte-wise string hash with the seeded string hash
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+bench_hash(void)
+{
+	char *lines[HEADER_LINES];
+	char *colliding[COLLIDING_KEYS];
+	double results[2][3];
+	size_t i, j;
+	int bytewise, rc = -1;
+
+	/* "Aa" and "BB" have the same byte-wise hash, so do all
+	   concatenations of equally many of them, as a client can
+	   choose its commands and the header lines it sends. */
+	for (i = 0; i < COLLIDING_KEYS; i++) {
+		colliding[i] = malloc(sizeof("Command: ") + 2 * 11);
+		if (!colliding[i]) {
+			while (i--)
+				free(colliding[i]);
+			return -1;
+		}
+		strcpy(colliding[i], "Command: ");
+		for (j = 0; (1UL << j) < COLLIDING_KEYS; j++)
+			strcat(colliding[i], (i >> j) & 1 ? "BB" : "Aa");
+	}
+	for (i = 0; i < HEADER_LINES; i++)
+		lines[i] = (char *)(size_t)header_lines[i];
+
+	string_hash_seed_initialise();
+	for (bytewise = 0; bytewise < 2; bytewise++) {
+		string_hash_bytewise = bytewise;
+		time_hash(10000);
+		results[bytewise][0] = time_hash(200000);
+		results[bytewise][1] = time_lookup(lines, HEADER_LINES, 100000);
+		results[bytewise][2] = time_lookup(colliding, COLLIDING_KEYS, 4);
+		if (results[bytewise][1] < 0 || results[bytewise][2] < 0)
+			goto fail;
+	}
+
+	printf("string hash, %zu header lines and names, %i colliding commands (ns per call):\n",
+	       HEADER_LINES, COLLIDING_KEYS);
+	printf("  %-38s %10s %10s\n", "", "byte-wise", "seeded");
+	printf("  %-38s %10.1f %10.1f\n", "string_hash", results[1][0], results[0][0]);
+	printf("  %-38s %10.1f %10.1f\n", "hash_table_get", results[1][1], results[0][1]);
+	printf("  hash_table_get, %-22s %10.1f %10.1f\n", "colliding commands", results[1][2], results[0][2]);
+	rc = 0;
+
+fail:
+	for (i = 0; i < COLLIDING_KEYS; i++)
+		free(colliding[i]);
+	return rc;
+}
+
+
+/**
+ * State shared by the threads in the spool benchmark
+ */
+struct spool_run
+{
+	/**
+	 * The message spool
+	 */
+	libmds_mspool_t spool;
+
+	/**
+	 * The messages to spool
+	 */
+	libmds_message_t **messages;
+
+	/**
+	 * The number of spooling threads
+	 */
+	size_t spoolers;
+
+	/**
+	 * The most messages a spooler has seen
+	 * in the lane after it spooled one
+	 */
+	size_t max_queued;
+
+	/**
+	 * The most bytes a spooler has seen
+	 * in the lane after it spooled a message
+	 */
+	size_t max_bytes;
+
+	/**
+	 * The byte limit of the lane
+	 */
+	size_t limit_bytes;
+
+	/**
+	 * Whether a spooler failed
+	 */
+	int failed;
+};
+
+/**
+ * The arguments for a spooling thread
+ */
+struct spooler
+{
+	/**
+	 * The run
+	 */
+	struct spool_run *run;
+
+	/**
+	 * The index of the thread
+	 */
+	size_t index;
+};
+
+
+/**
+ * Raise a maximum shared by threads
+ * 
+ * @param  max    The maximum
+ * @param  value  The new value
+ */
+static void
+atomic_raise(size_t *max, size_t value)
+{
+	size_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while (old < value && !__atomic_compare_exchange_n(max, &old, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/**
+ * Spool every `run->spoolers`:th message, starting at `index`
+ * 
+ * @param   data  The thread's `struct spooler`
+ * @return        `NULL`
+ */
+static void *
+spool_thread(void *data)
+{
+	struct spooler *spooler = data;
+	struct spool_run *run = spooler->run;
+	libmds_mspool_lane_t *lane = run->spool.lanes;
+	libmds_message_t *message;
+	size_t i, head, tail;
+
+	for (i = spooler->index; i < SPOOLED_MESSAGES; i += run->spoolers) {
+		/* The spool takes ownership of the message even on failure. */
+		message = run->messages[i];
+		run->messages[i] = NULL;
+		if (libmds_mspool_spool(&(run->spool), message)) {
+			run->failed = 1;
+			break;
+		}
+		tail = __atomic_load_n(&(lane->tail), __ATOMIC_SEQ_CST);
+		head = __atomic_load_n(&(lane->head), __ATOMIC_SEQ_CST);
+		atomic_raise(&(run->max_queued), head - tail);
+		atomic_raise(&(run->max_bytes), __atomic_load_n(&(lane->spooled_bytes), __ATOMIC_SEQ_CST));
+	}
+	return NULL;
+}
+
+
+/**
+ * Measure spooling messages from several threads to one poller,
+ * through a lane that blocks when it reaches `SPOOL_LIMIT` messages
+ * 
+ * @param   message   A flat message to spool copies of
+ * @param   spoolers  The number of spooling threads
+ * @param   run       Output parameter for the run, the limits and the maxima are set
+ * @return            Nanoseconds per message, -1 on error
+ */
+static double
+time_spool(libmds_message_t *message, size_t spoolers, struct spool_run *run)
+{
+	struct spooler args[SPOOLERS_MAX];
+	pthread_t threads[SPOOLERS_MAX];
+	libmds_message_t *polled;
+	long long int start;
+	size_t i, started = 0;
+	double rc = -1;
+
+	run->spoolers = spoolers;
+	run->max_queued = run->max_bytes = 0;
+	run->failed = 0;
+	if (libmds_mspool_initialise(&(run->spool)))
+		return -1;
+	/* Fixed limits, so that runs are comparable. */
+	run->spool.lanes->latency_target = 0;
+	run->spool.lanes->spool_limit_messages = SPOOL_LIMIT;
+
+	run->messages = calloc(SPOOLED_MESSAGES, sizeof(*run->messages));
+	if (!run->messages)
+		goto done;
+	for (i = 0; i < SPOOLED_MESSAGES; i++)
+		if (!(run->messages[i] = libmds_message_duplicate(message, NULL)))
+			goto done;
+	run->limit_bytes = SPOOL_LIMIT * run->messages[0]->flattened;
+	run->spool.lanes->spool_limit_bytes = run->limit_bytes;
+
+	start = now();
+	for (; started < spoolers; started++) {
+		args[started].run = run;
+		args[started].index = started;
+		if ((errno = pthread_create(threads + started, NULL, spool_thread, args + started)))
+			goto join;
+	}
+	for (i = 0; i < SPOOLED_MESSAGES; i++) {
+		if (!(polled = libmds_mspool_poll(&(run->spool))))
+			goto join;
+		libmds_message_release(polled);
+	}
+	rc = (double)(now() - start) / (double)SPOOLED_MESSAGES;
+
+join:
+	while (started--)
+		pthread_join(threads[started], NULL);
+	if (run->failed)
+		rc = -1;
+done:
+	/* Only the messages that were not spooled are left. */
+	for (i = 0; run->messages && i < SPOOLED_MESSAGES; i++)
+		if (run->messages[i])
+			libmds_message_release(run->messages[i]);
+	free(run->messages);
+	libmds_mspool_destroy(&(run->spool));
+	return rc;
+}
+
+
+/**
+ * Measure the throughput of a message spool with
+ * 1 to `SPOOLERS_MAX` threads spooling to one poller
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+bench_spool(void)
+{
+	static const char text[] = "Command: bench\nMessage ID: 1\nLength: 64\n\n"
+		"0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
+	libmds_message_t message;
+	struct spool_run run;
+	double ns;
+	size_t spoolers;
+	int fds[2], rc = -1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+		return -1;
+	if (libmds_message_initialise(&message))
+		goto close;
+	if (write(fds[1], text, sizeof(text) - 1) != (ssize_t)sizeof(text) - 1 || libmds_message_read(&message, fds[0]))
+		goto destroy;
+
+	printf("message spool, %i messages of %zu bytes, one poller, blocking lane (ns per message):\n",
+	       SPOOLED_MESSAGES, sizeof(text) - 1);
+	printf("  %-38s %10s %10s %10s\n", "", "time", "queued", "bytes");
+	for (spoolers = 1; spoolers <= SPOOLERS_MAX; spoolers *= 2) {
+		if ((ns = time_spool(&message, spoolers, &run)) < 0)
+			goto destroy;
+		if (spoolers == 1)
+			printf("  %-38s %10s %10i %10zu\n", "limit", "", SPOOL_LIMIT, run.limit_bytes);
+		printf("  libmds_mspool_spool, %2zu %-15s %10.1f %10zu %10zu\n", spoolers,
+		       spoolers == 1 ? "spooler" : "spoolers", ns, run.max_queued, run.max_bytes);
+	}
+	rc = 0;
+
+destroy:
+	libmds_message_destroy(&message);
+close:
+	close(fds[0]);
+	close(fds[1]);
+	return rc;
+}
+
+
+/**
+ * Run the micro-benchmarks named by the arguments
+ * 
+ * @param   argc  The number of elements in `argv`
+ * @param   argv  The benchmarks to run: "hash" and "spool"
+ * @return        0 on success, 1 on error
+ */
+int
+main(int argc, char *argv[])
+{
+	int i, r;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "hash")) {
+			r = bench_hash();
+		} else if (!strcmp(argv[i], "spool")) {
+			r = bench_spool();
+		} else {
+			fprintf(stderr, "%s: unknown benchmark: %s\n", *argv, argv[i]);
+			return 1;
+		}
+		if (r) {
+			perror(*argv);
+			return 1;
+		}
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -149,7 +149,7 @@ endif
 bin/libmdsserver.so.$(LIBMDSSERVER_VERSION): $(foreach O,$(SERVEROBJ),obj/libmdsserver/$(O).o)
 	@printf '\e[00;01;31mLD\e[34m %s\e[00m\n' "$@"
 	@mkdir -p $(shell dirname $@)
-	$(CC) $(C_FLAGS) -shared -Wl,-soname,libmdsclient.so.$(LIBMDSSERVER_MAJOR) -o $@ $^
+	$(CC) $(C_FLAGS) -shared -Wl,-soname,libmdsserver.so.$(LIBMDSSERVER_MAJOR) -o $@ $^
 	@echo
 
 bin/libmdsserver.so.$(LIBMDSSERVER_MAJOR): bin/libmdsserver.so.$(LIBMDSSERVER_VERSION)
@@ -189,6 +189,12 @@ src/libmdsserver/config.h: src/libmdsserver/config.h.in
 	sed -i 's:@RESPAWN_TIME_LIMIT_SECONDS@:$(RESPAWN_TIME_LIMIT_SECONDS):g' $@
 	sed -i 's:@DISPLAY_ENV@:$(DISPLAY_ENV):g' $@
 	sed -i 's:@PGROUP_ENV@:$(PGROUP_ENV):g' $@
+	sed -i 's:@REEXEC_FD_ENV@:$(REEXEC_FD_ENV):g' $@
+	sed -i 's:@BENCH_LOG_ENV@:$(BENCH_LOG_ENV):g' $@
+	sed -i 's:@READY_FD_ENV@:$(READY_FD_ENV):g' $@
+	sed -i 's:@STANDBY_FD_ENV@:$(STANDBY_FD_ENV):g' $@
+	sed -i 's:@MEMORY_PRESSURE_ENV@:$(MEMORY_PRESSURE_ENV):g' $@
+	sed -i 's:@MEMORY_PRESSURE_TRIGGER@:$(MEMORY_PRESSURE_TRIGGER):g' $@
 	sed -i 's:@INITRC_FILE@:$(INITRC_FILE):g' $@
 	sed -i 's:@SELF_EXE@:$(SELF_EXE):g' $@
 	sed -i 's:@SELF_FD@:$(SELF_FD):g' $@
@@ -214,7 +220,8 @@ bin/libmdsserver.pc: src/libmdsserver/libmdsserver.pc.in
 
 # Build libmdsclient.
 
-bin/libmdsclient.so.$(LIBMDSCLIENT_VERSION): $(foreach O,$(CLIENTOBJ),obj/libmdsclient/$(O).o)
+bin/libmdsclient.so.$(LIBMDSCLIENT_VERSION): $(foreach O,$(CLIENTOBJ),obj/libmdsclient/$(O).o)  \
+                                           $(foreach O,$(SHAREDOBJ),obj/libmdsclient/libmdsserver/$(O).o)
 	@printf '\e[00;01;31mLD\e[34m %s\e[00m\n' "$@"
 	@mkdir -p $(shell dirname $@)
 	$(CC) $(C_FLAGS) -shared -Wl,-soname,libmdsclient.so.$(LIBMDSCLIENT_MAJOR) -o $@ $^
@@ -230,12 +237,19 @@ bin/libmdsclient.so: bin/libmdsclient.so.$(LIBMDSCLIENT_VERSION)
 	ln -sf libmdsclient.so.$(LIBMDSCLIENT_VERSION) $@
 	@echo
 
-obj/libmdsclient/%.o: src/libmdsclient/%.c src/libmdsclient/*.h $(SEDED)
+obj/libmdsclient/%.o: src/libmdsclient/%.c src/libmdsclient/*.h src/libmdsserver/*.h $(SEDED)
 	@printf '\e[00;01;31mCC\e[34m %s\e[00m\n' "$@"
 	@mkdir -p $(shell dirname $@)
 	$(CC) $(C_FLAGS) -fPIC -Isrc -c -o $@ $<
 	@echo
 
+# The shared objects are not exported from libmdsclient.
+obj/libmdsclient/libmdsserver/%.o: src/libmdsserver/%.c src/libmdsserver/*.h $(SEDED)
+	@printf '\e[00;01;31mCC\e[34m %s\e[00m\n' "$@"
+	@mkdir -p $(shell dirname $@)
+	$(CC) $(C_FLAGS) -fPIC -fvisibility=hidden -c -o $@ $<
+	@echo
+
 bin/libmdsclient.pc: src/libmdsclient/libmdsclient.pc.in
 	@printf '\e[00;01;31mSED\e[34m %s\e[00m\n' "$@"
 	@mkdir -p $(shell dirname $@)
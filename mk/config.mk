@@ -73,6 +73,8 @@ LIBEXEC_ARGC_EXTRA_LIMIT = 5
 DISPLAY_MAX = 1000
 # The minimum time that most have elapsed for respawning to be allowed.
 RESPAWN_TIME_LIMIT_SECONDS = 5
+# The PSI trigger, on memory, that makes servers free unneeded memory: some|full STALL_USEC WINDOW_USEC.
+MEMORY_PRESSURE_TRIGGER = some 150000 2000000
 # Pattern for the names of shared object to which states are marshalled.
 SHM_PATH_PATTERN = /.proc-pid-%ji
 
@@ -80,6 +82,16 @@ SHM_PATH_PATTERN = /.proc-pid-%ji
 DISPLAY_ENV = MDS_DISPLAY
 # The name of the environment variable that indicates the display server's process group.
 PGROUP_ENV = MDS_PGROUP
+# The name of the environment variable that indicates the file descriptor of the memfd a re-executing server has marshalled its state to.
+REEXEC_FD_ENV = MDS_REEXEC_FD
+# The name of the environment variable that names the file benchmark events are appended to.
+BENCH_LOG_ENV = MDS_BENCH_LOG
+# The name of the environment variable that indicates the file descriptor a server reports that it has been initialised to.
+READY_FD_ENV = MDS_READY_FD
+# The name of the environment variable that indicates the file descriptor a standby instance of a server waits on.
+STANDBY_FD_ENV = MDS_STANDBY_FD
+# The name of the environment variable that overrides the PSI trigger servers free memory on, empty to disable it.
+MEMORY_PRESSURE_ENV = MDS_MEMORY_PRESSURE
 # The dot-prefixless basename of the initrc file that the master server executes.
 INITRC_FILE = mdsinitrc
 # The root directory of all runtime data stored by mds.
@@ -122,11 +134,28 @@ DEBUG_FLAGS += -D'DEBUG'
 DEBUG_FLAGS += -D'LIBEXECDIR="$(shell pwd)/bin"'
 endif
 
+# Set to y to use the classic byte-wise string hash by default rather
+# than the seeded word-at-a-time hash.
+BYTEWISE_STRING_HASH ?= n
+
+# Set to y to validate UTF-8 without vector instructions.
+SCALAR_UTF8 ?= n
+
+# C compiler feature flags.
+FEATURE_FLAGS =
+ifeq ($(BYTEWISE_STRING_HASH),y)
+FEATURE_FLAGS += -D'BYTEWISE_STRING_HASH'
+endif
+ifeq ($(SCALAR_UTF8),y)
+FEATURE_FLAGS += -D'SCALAR_UTF8'
+endif
+
 # Options for the C compiler.
 C_FLAGS = $(OPTIMISE) $(WARN) -std=$(STD) $(CPPFLAGS) $(CFLAGS) $(LDFLAGS)  \
           -ftree-vrp -fstrict-aliasing -fipa-pure-const -fstack-usage       \
           -fstrict-overflow -funsafe-loop-optimizations -fno-builtin        \
-	  -D'_GNU_SOURCE' -D'PKGNAME="$(PKGNAME)"' $(DEBUG_FLAGS)
+	  -D'_GNU_SOURCE' -D'PKGNAME="$(PKGNAME)"' $(DEBUG_FLAGS)         \
+          $(FEATURE_FLAGS)
 
 
 # Flags to pass into the manual compilers.
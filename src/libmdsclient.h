@@ -22,6 +22,8 @@
 #include "libmdsclient/proto-util.h"
 #include "libmdsclient/comm.h"
 #include "libmdsclient/address.h"
+#include "libmdsclient/request.h"
+#include "libmdsclient/channel.h"
 
 
 #endif
@@ -0,0 +1,244 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "channel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+
+
+#define static_strlen(str) (sizeof(str) / sizeof(char) - 1)
+
+
+
+/**
+ * Parse a client ID
+ * 
+ * @param   str  The client ID, as two 32-bit integers delimited by a colon
+ * @param   id   Output parameter for the client ID
+ * @return       Zero on success, -1 if `str` is malformatted
+ */
+static int
+parse_client_id(const char *restrict str, uint64_t *restrict id)
+{
+	uint32_t high, low;
+	int end = 0;
+	if ((sscanf(str, "%" SCNu32 ":%" SCNu32 "%n", &high, &low, &end) != 2) || str[end])
+		return -1;
+	*id = ((uint64_t)high << 32) | (uint64_t)low;
+	return 0;
+}
+
+
+/**
+ * Send a request without a payload, with the message
+ * ID in `connection->message_id`, and in full
+ * 
+ * @param   connection  The connection
+ * @param   header      The `Channel`-header to send, `NULL` if none
+ * @param   command     The value of the `Command`-header
+ * @return              Zero on success, -1 on error
+ */
+static int
+send_command(libmds_connection_t *restrict connection, const char *header, const char *command)
+{
+	char buf[LIBMDS_CHANNEL_HEADER_MAX + 64];
+	size_t n;
+	n = (size_t)snprintf(buf, sizeof(buf), "%sCommand: %s\n" "Message ID: %" PRIu32 "\n\n",
+	                     header ? header : "", command, connection->message_id);
+	return libmds_connection_send_unlocked(connection, buf, n, 1) < n ? -1 : 0;
+}
+
+
+/**
+ * Request that a channel is opened over a connection
+ * 
+ * The request is sent with the message ID in `connection->message_id`,
+ * so the connection must be locked by the caller, and the message ID
+ * chosen, for example with `libmds_request_register`, beforehand.
+ * The reply shall be passed to `libmds_channel_initialise`.
+ * 
+ * @param   connection  The connection
+ * @return              Zero on success, -1 on error, `errno` will have been set
+ *                      accordingly on error
+ * 
+ * @throws  Any error specified for `libmds_connection_send_unlocked`
+ */
+int
+libmds_channel_open_unlocked(libmds_connection_t *restrict connection)
+{
+	return send_command(connection, NULL, "open-channel");
+}
+
+
+/**
+ * Initialise a channel from the reply to a request,
+ * sent with `libmds_channel_open_unlocked`, to open it
+ * 
+ * @param   this        The channel
+ * @param   connection  The connection the channel was opened over
+ * @param   reply       The reply
+ * @return              Zero on success, -1 on error, `errno` will have been set
+ *                      accordingly on error
+ * 
+ * @throws  EBADMSG  If `reply` does not assign a channel
+ * @throws  ENOMEM   Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                   RLIMIT_DATA limit described in getrlimit(2).
+ */
+int
+libmds_channel_initialise(libmds_channel_t *restrict this, libmds_connection_t *restrict connection,
+                          const libmds_message_t *restrict reply)
+{
+	const char *value = libmds_message_get_header(reply, "Channel assignment");
+
+	if (!value || parse_client_id(value, &(this->id)))
+		return errno = EBADMSG, -1;
+	if (!(this->client_id = strdup(value)))
+		return -1;
+
+	this->connection = connection;
+	this->header_length = (size_t)sprintf(this->header, "Channel: %s\n", value);
+	return 0;
+}
+
+
+/**
+ * Release all resources in a channel, the
+ * channel is not closed on the display server
+ * 
+ * @param  this  The channel
+ */
+void
+libmds_channel_destroy(libmds_channel_t *restrict this)
+{
+	free(this->client_id);
+	this->client_id = NULL;
+}
+
+
+/**
+ * Send a message on a channel
+ * 
+ * The `Channel`-header is prepended to the message
+ * 
+ * @param   this     The channel
+ * @param   message  The message to send, must not be `NULL`
+ * @param   length   The length of the message, should be positive
+ * @return           The number of sent bytes of the message. Less than `length`
+ *                   on error, `ernno` will have been set accordingly on error
+ * 
+ * @throws  Any error specified for `libmds_connection_send`
+ */
+size_t
+libmds_channel_send(libmds_channel_t *restrict this, const char *restrict message, size_t length)
+{
+	int saved_errno;
+	size_t r;
+
+	if (libmds_connection_lock(this->connection))
+		return 0;
+
+	r = libmds_channel_send_unlocked(this, message, length, 1);
+
+	saved_errno = errno;
+	(void) libmds_connection_unlock(this->connection);
+	return errno = saved_errno, r;
+}
+
+
+/**
+ * Send a message on a channel, without locking the mutex of the connection
+ * 
+ * The `Channel`-header is prepended to the message and is always sent
+ * in full. If only a part of the message was sent, the rest shall
+ * be sent with `libmds_connection_send_unlocked`, lest the header is
+ * sent again.
+ * 
+ * @param   this                   The channel
+ * @param   message                The message to send, must not be `NULL`
+ * @param   length                 The length of the message, should be positive
+ * @param   continue_on_interrupt  Whether to continue sending if interrupted by a signal
+ * @return                         The number of sent bytes of the message. Less than
+ *                                 `length` on error, `ernno` will have been set
+ *                                 accordingly on error
+ * 
+ * @throws  Any error specified for `libmds_connection_send_unlocked`
+ */
+size_t
+libmds_channel_send_unlocked(libmds_channel_t *restrict this, const char *restrict message,
+                             size_t length, int continue_on_interrupt)
+{
+	if (libmds_connection_send_unlocked(this->connection, this->header, this->header_length, 1) < this->header_length)
+		return 0;
+	return libmds_connection_send_unlocked(this->connection, message, length, continue_on_interrupt);
+}
+
+
+/**
+ * Request that a channel is closed
+ * 
+ * The request is sent with the message ID in `this->connection->message_id`,
+ * so the connection must be locked by the caller, and the message ID chosen
+ * beforehand. The channel must be destroyed with `libmds_channel_destroy`
+ * when the display server has closed it, which is announced with a
+ * `Client closed`-message.
+ * 
+ * @param   this  The channel
+ * @return        Zero on success, -1 on error, `errno` will have been set
+ *                accordingly on error
+ * 
+ * @throws  Any error specified for `libmds_connection_send_unlocked`
+ */
+int
+libmds_channel_close_unlocked(libmds_channel_t *restrict this)
+{
+	return send_command(this->connection, this->header, "close-channel");
+}
+
+
+/**
+ * Get the channel a received message was sent to
+ * 
+ * If the message was sent to a channel, its first
+ * header is the `Channel`-header, which should be
+ * skipped when the message is parsed
+ * 
+ * @param   message  The message
+ * @param   channel  Output parameter for the ID of the channel
+ * @return           1 if the message was sent to a channel, 0 if it was sent
+ *                   to the connection itself, -1 on error, `errno` will have
+ *                   been set accordingly on error
+ * 
+ * @throws  EBADMSG  If the `Channel`-header is malformatted
+ */
+int
+libmds_channel_demultiplex(const libmds_message_t *restrict message, uint64_t *restrict channel)
+{
+	const char *header;
+
+	/* The `Channel`-header is always first, so the header index is not needed. */
+	if (!message->header_count || strncmp(header = message->headers[0], "Channel: ", static_strlen("Channel: ")))
+		return 0;
+
+	if (parse_client_id(header + static_strlen("Channel: "), channel))
+		return errno = EBADMSG, -1;
+	return 1;
+}
@@ -0,0 +1,200 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSCLIENT_CHANNEL_H
+#define MDS_LIBMDSCLIENT_CHANNEL_H
+
+
+#include "comm.h"
+#include "inbound.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+
+/**
+ * The maximum length of a `Channel`-header, including its line feed
+ */
+#define LIBMDS_CHANNEL_HEADER_MAX  (sizeof("Channel: 4294967295:4294967295\n") / sizeof(char) - 1)
+
+
+
+/**
+ * A channel, that is, a logical client with its own
+ * client ID and its own interception conditions,
+ * multiplexed with other channels over a connection
+ * 
+ * Messages sent to the channel by the display server are
+ * received on the connection, their first header being
+ * `Channel`, use `libmds_channel_demultiplex` to tell
+ * which channel a received message was sent to
+ */
+typedef struct libmds_channel
+{
+	/**
+	 * The connection the channel is multiplexed over
+	 */
+	libmds_connection_t *connection;
+
+	/**
+	 * The ID of the channel, it is also its client ID
+	 */
+	uint64_t id;
+
+	/**
+	 * The client ID of the channel, as a string,
+	 * so that `LIBMDS_HEADER_CLIENT_ID` can be
+	 * used with the channel
+	 */
+	char *client_id;
+
+	/**
+	 * The `Channel`-header that prefixes messages
+	 * sent on the channel (internal data)
+	 */
+	char header[LIBMDS_CHANNEL_HEADER_MAX + 1];
+
+	/**
+	 * The length of `header` (internal data)
+	 */
+	size_t header_length;
+
+} libmds_channel_t;
+
+
+
+/**
+ * Request that a channel is opened over a connection
+ * 
+ * The request is sent with the message ID in `connection->message_id`,
+ * so the connection must be locked by the caller, and the message ID
+ * chosen, for example with `libmds_request_register`, beforehand.
+ * The reply shall be passed to `libmds_channel_initialise`.
+ * 
+ * @param   connection  The connection
+ * @return              Zero on success, -1 on error, `errno` will have been set
+ *                      accordingly on error
+ * 
+ * @throws  Any error specified for `libmds_connection_send_unlocked`
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_channel_open_unlocked(libmds_connection_t *restrict connection);
+
+/**
+ * Initialise a channel from the reply to a request,
+ * sent with `libmds_channel_open_unlocked`, to open it
+ * 
+ * @param   this        The channel
+ * @param   connection  The connection the channel was opened over
+ * @param   reply       The reply
+ * @return              Zero on success, -1 on error, `errno` will have been set
+ *                      accordingly on error
+ * 
+ * @throws  EBADMSG  If `reply` does not assign a channel
+ * @throws  ENOMEM   Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                   RLIMIT_DATA limit described in getrlimit(2).
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_channel_initialise(libmds_channel_t *restrict this, libmds_connection_t *restrict connection,
+                              const libmds_message_t *restrict reply);
+
+/**
+ * Release all resources in a channel, the
+ * channel is not closed on the display server
+ * 
+ * @param  this  The channel
+ */
+__attribute__((nonnull))
+void libmds_channel_destroy(libmds_channel_t *restrict this);
+
+/**
+ * Send a message on a channel
+ * 
+ * The `Channel`-header is prepended to the message
+ * 
+ * @param   this     The channel
+ * @param   message  The message to send, must not be `NULL`
+ * @param   length   The length of the message, should be positive
+ * @return           The number of sent bytes of the message. Less than `length`
+ *                   on error, `ernno` will have been set accordingly on error
+ * 
+ * @throws  Any error specified for `libmds_connection_send`
+ */
+__attribute__((nonnull))
+size_t libmds_channel_send(libmds_channel_t *restrict this, const char *restrict message, size_t length);
+
+/**
+ * Send a message on a channel, without locking the mutex of the connection
+ * 
+ * The `Channel`-header is prepended to the message and is always sent
+ * in full. If only a part of the message was sent, the rest shall
+ * be sent with `libmds_connection_send_unlocked`, lest the header is
+ * sent again.
+ * 
+ * @param   this                   The channel
+ * @param   message                The message to send, must not be `NULL`
+ * @param   length                 The length of the message, should be positive
+ * @param   continue_on_interrupt  Whether to continue sending if interrupted by a signal
+ * @return                         The number of sent bytes of the message. Less than
+ *                                 `length` on error, `ernno` will have been set
+ *                                 accordingly on error
+ * 
+ * @throws  Any error specified for `libmds_connection_send_unlocked`
+ */
+__attribute__((nonnull))
+size_t libmds_channel_send_unlocked(libmds_channel_t *restrict this, const char *restrict message,
+                                    size_t length, int continue_on_interrupt);
+
+/**
+ * Request that a channel is closed
+ * 
+ * The request is sent with the message ID in `this->connection->message_id`,
+ * so the connection must be locked by the caller, and the message ID chosen
+ * beforehand. The channel must be destroyed with `libmds_channel_destroy`
+ * when the display server has closed it, which is announced with a
+ * `Client closed`-message.
+ * 
+ * @param   this  The channel
+ * @return        Zero on success, -1 on error, `errno` will have been set
+ *                accordingly on error
+ * 
+ * @throws  Any error specified for `libmds_connection_send_unlocked`
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_channel_close_unlocked(libmds_channel_t *restrict this);
+
+/**
+ * Get the channel a received message was sent to
+ * 
+ * If the message was sent to a channel, its first
+ * header is the `Channel`-header, which should be
+ * skipped when the message is parsed
+ * 
+ * @param   message  The message
+ * @param   channel  Output parameter for the ID of the channel
+ * @return           1 if the message was sent to a channel, 0 if it was sent
+ *                   to the connection itself, -1 on error, `errno` will have
+ *                   been set accordingly on error
+ * 
+ * @throws  EBADMSG  If the `Channel`-header is malformatted
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_channel_demultiplex(const libmds_message_t *restrict message, uint64_t *restrict channel);
+
+
+#endif
@@ -17,15 +17,41 @@
  */
 #include "comm.h"
 
+#include <libmdsserver/memfd.h>
+#include <libmdsserver/ring.h>
+#include <libmdsserver/binary.h>
+
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <limits.h>
 
 
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define static_strlen(str) (sizeof(str) / sizeof(char) - 1)
+
+
+/**
+ * The default value for `cork_threshold` in `libmds_connection_t`
+ */
+#ifndef LIBMDS_CORK_THRESHOLD
+# define LIBMDS_CORK_THRESHOLD  (16 << 10)
+#endif
+
+/**
+ * The default value for `cork_max_delay` in `libmds_connection_t`
+ */
+#ifndef LIBMDS_CORK_MAX_DELAY
+# define LIBMDS_CORK_MAX_DELAY  1000000L
+#endif
 
 
 
@@ -46,6 +72,24 @@ int libmds_connection_initialise(libmds_connection_t *restrict this)
 	this->message_id = UINT32_MAX;
 	this->client_id = NULL;
 	this->mutex_initialised = 0;
+	this->memfd_threshold = 0;
+	this->pending = NULL;
+	this->pending_size = 0;
+	this->pending_off = 0;
+	this->pending_ptr = 0;
+	this->corked = 0;
+	this->cork_threshold = LIBMDS_CORK_THRESHOLD;
+	this->cork_max_delay = LIBMDS_CORK_MAX_DELAY;
+	this->cork_syscalls_saved = 0;
+	this->cork_buffer = NULL;
+	this->cork_buffer_size = 0;
+	this->cork_length = 0;
+	this->cork_count = 0;
+	this->ring = NULL;
+	this->ring_eventfd = -1;
+	this->binary = NULL;
+	this->binary_buffer = NULL;
+	this->binary_buffer_size = 0;
 	errno = pthread_mutex_init(&(this->mutex), NULL);
 	if (errno)
 		return -1;
@@ -94,6 +138,26 @@ libmds_connection_destroy(libmds_connection_t *restrict this)
 	free(this->client_id);
 	this->client_id = NULL;
 
+	free(this->pending);
+	this->pending = NULL;
+	this->pending_size = this->pending_off = this->pending_ptr = 0;
+
+	free(this->cork_buffer);
+	this->cork_buffer = NULL;
+	this->cork_buffer_size = this->cork_length = this->cork_count = 0;
+
+	ring_destroy(this->ring);
+	free(this->ring);
+	this->ring = NULL;
+	this->ring_eventfd = -1;
+
+	binary_encoder_destroy(this->binary);
+	free(this->binary);
+	this->binary = NULL;
+	free(this->binary_buffer);
+	this->binary_buffer = NULL;
+	this->binary_buffer_size = 0;
+
 	if (this->mutex_initialised) {
 		this->mutex_initialised = 0;
 		pthread_mutex_destroy(&(this->mutex)); /* Can return EBUSY. */
@@ -254,10 +318,539 @@ libmds_connection_send(libmds_connection_t *restrict this, const char *restrict
 }
 
 
+/**
+ * Make room in `this->binary_buffer`
+ * 
+ * @param   this  The connection descriptor
+ * @param   size  The number of bytes required
+ * @return        Zero on success, -1 on error, `errno` will have been set
+ *                accordingly on error
+ */
+static int __attribute__((nonnull))
+reserve_binary_buffer(libmds_connection_t *restrict this, size_t size)
+{
+	size_t new_size = this->binary_buffer_size ? this->binary_buffer_size : 512;
+	char *new;
+	if (size <= this->binary_buffer_size)
+		return 0;
+	while (new_size < size)
+		new_size <<= 1;
+	new = realloc(this->binary_buffer, new_size * sizeof(char));
+	if (!new)
+		return -1;
+	this->binary_buffer = new;
+	this->binary_buffer_size = new_size;
+	return 0;
+}
+
+
+/**
+ * Translate messages to the binary encoding,
+ * and store them in `this->binary_buffer`
+ * 
+ * @param   this     The connection descriptor
+ * @param   message  The messages, in the text encoding, the first
+ *                   or last may be the beginning or end of a message
+ * @param   length   The length of `message`
+ * @param   out      Output parameter for the number of bytes stored
+ *                   in `this->binary_buffer`
+ * @return           Zero on success, -1 on error, `errno` will have been set
+ *                   accordingly on error
+ * 
+ * @throws  ENOMEM   Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                   RLIMIT_DATA limit described in getrlimit(2).
+ * @throws  EBADMSG  If a header is malformatted
+ */
+static int __attribute__((nonnull))
+encode_binary(libmds_connection_t *restrict this, const char *restrict message,
+              size_t length, size_t *restrict out)
+{
+	binary_encoder_t *encoder = this->binary;
+	size_t n;
+	ssize_t r;
+
+	*out = 0;
+	while (length) {
+		if (encoder->payload_left) {
+			/* The payload is the same in both encodings. */
+			n = (size_t)min(encoder->payload_left, (uint64_t)length);
+			if (reserve_binary_buffer(this, *out + n))
+				return -1;
+			memcpy(this->binary_buffer + *out, message, n * sizeof(char));
+			encoder->payload_left -= n;
+			*out += n;
+		} else {
+			if ((r = binary_encode_headers(encoder, message, length)) < 0)
+				return -1;
+			n = (size_t)r;
+			if (encoder->frame_length) {
+				if (reserve_binary_buffer(this, *out + encoder->frame_length))
+					return -1;
+				memcpy(this->binary_buffer + *out, encoder->frame, encoder->frame_length * sizeof(char));
+				*out += encoder->frame_length;
+				encoder->frame_length = 0;
+			}
+		}
+		message += n;
+		length -= n;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Send a message, inline, to the display server
+ * 
+ * @param   this                   The connection descriptor
+ * @param   message                The message to send
+ * @param   length                 The length of the message
+ * @param   continue_on_interrupt  Whether to continue sending if interrupted by a signal
+ * @return                         The number of sent bytes. Less than `length` on error,
+ *                                 `ernno` will have been set accordingly on error
+ */
+static size_t __attribute__((nonnull))
+send_inline(libmds_connection_t *restrict this, const char *restrict message,
+            size_t length, int continue_on_interrupt)
+{
+	size_t block_size = length;
+	size_t sent = 0;
+	ssize_t just_sent;
+
+	if (this->ring) {
+		while ((sent += ring_send(this->ring, message + sent, length - sent, this->socket_fd)) < length)
+			if (errno != EINTR || !continue_on_interrupt)
+				break;
+		return sent;
+	}
+
+	errno = 0;
+	while (length > 0) {
+		if ((just_sent = send(this->socket_fd, message + sent, min(block_size, length), MSG_NOSIGNAL)) < 0) {
+			if (errno == EPIPE)
+				errno = ECONNRESET;
+			if (errno == EMSGSIZE) {
+				block_size >>= 1;
+				if (!block_size)
+					return sent;
+			} else if (errno == EINTR && continue_on_interrupt) {
+				continue;
+			} else {
+				return sent;
+			}
+		} else {
+			sent += (size_t)just_sent;
+			length -= (size_t)just_sent;
+		}
+	}
+
+	return sent;
+}
+
+
+/**
+ * Send a message to the display server with its payload
+ * in a memfd, if it is a single message with a payload
+ * of at least `this->memfd_threshold` bytes
+ * 
+ * The message is sent with its ‘Length’ header replaced
+ * by a ‘Memfd-Length’ header, and with the sealed memfd
+ * attached to its first byte
+ * 
+ * @param   this     The connection descriptor
+ * @param   message  The message to send
+ * @param   length   The length of the message
+ * @return           Zero on success, 1 if the message shall be sent
+ *                   inline, -1 on error, `errno` will have been set
+ *                   accordingly on error
+ */
+static int __attribute__((nonnull))
+send_in_memfd(libmds_connection_t *restrict this, const char *restrict message, size_t length)
+{
+	const char *end, *header = NULL, *line;
+	char *headers = NULL;
+	size_t header_length, payload_size, n, sent;
+	ssize_t r;
+	int fd = -1, saved_errno;
+
+	/* Find the end of the headers, and the ‘Length’ header. */
+	end = memmem(message, length, "\n\n", 2);
+	if (!end || *message == '\n')
+		return 1;
+	header_length = (size_t)(end - message) + 2;
+	for (line = message; line < end; line = strchr(line, '\n') + 1) {
+		if (!strncmp(line, "Length: ", static_strlen("Length: "))) {
+			header = line;
+			break;
+		}
+	}
+	if (!header)
+		return 1;
+	payload_size = (size_t)strtoull(header + static_strlen("Length: "), NULL, 10);
+	if (payload_size < this->memfd_threshold || header_length + payload_size != length)
+		return 1;
+
+	/* "Length: N" becomes "Memfd-Length: N". */
+	n = static_strlen(MEMFD_LENGTH_HEADER) - static_strlen("Length: ");
+	headers = malloc((header_length + n) * sizeof(char));
+	if (!headers)
+		goto fail;
+	memcpy(headers, message, (size_t)(header - message) * sizeof(char));
+	memcpy(headers + (header - message), MEMFD_LENGTH_HEADER, n * sizeof(char));
+	memcpy(headers + (header - message) + n, header, (header_length - (size_t)(header - message)) * sizeof(char));
+	header_length += n;
+
+	fd = memfd_create_payload(message + (length - payload_size), payload_size);
+	if (fd < 0)
+		goto fail;
+
+	while ((r = memfd_send(this->socket_fd, headers, header_length, fd)) < 0 && errno == EINTR);
+	if (r < 0)
+		goto fail;
+	sent = (size_t)r;
+	if (sent < header_length)
+		if (send_inline(this, headers + sent, header_length - sent, 1) < header_length - sent)
+			goto fail;
+
+	close(fd);
+	free(headers);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (fd >= 0)
+		close(fd);
+	free(headers);
+	return errno = saved_errno, -1;
+}
+
+
+/**
+ * Write the batched messages, and optionally another message
+ * after them, with as few system calls as possible
+ * 
+ * @param   this     The connection descriptor
+ * @param   message  Message to write after the batch, `NULL` if none
+ * @param   length   The length of `message`
+ * @return           Zero on success, -1 on error, `errno` will have been set
+ *                   accordingly on error
+ */
+static int __attribute__((nonnull(1)))
+flush_cork(libmds_connection_t *restrict this, const char *message, size_t length)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	size_t i = 0, n = 0, sent, calls = 0, count = this->cork_count + !!message;
+	ssize_t r;
+
+	if (this->cork_length) {
+		iov[n].iov_base = this->cork_buffer;
+		iov[n++].iov_len = this->cork_length;
+	}
+	if (message && length) {
+		iov[n].iov_base = (void *)(uintptr_t)message;
+		iov[n++].iov_len = length;
+	}
+	this->cork_length = this->cork_count = 0;
+
+	/* A ring is written without system calls. */
+	if (this->ring) {
+		for (; i < n; i++)
+			if (send_inline(this, iov[i].iov_base, iov[i].iov_len, 1) < iov[i].iov_len)
+				return -1;
+		return 0;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	while (i < n) {
+		msg.msg_iov = iov + i;
+		msg.msg_iovlen = n - i;
+		r = sendmsg(this->socket_fd, &msg, MSG_NOSIGNAL);
+		calls++;
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EPIPE)
+				errno = ECONNRESET;
+			return -1;
+		}
+		for (sent = (size_t)r; (i < n) && (sent >= iov[i].iov_len); i++)
+			sent -= iov[i].iov_len;
+		if (i < n) {
+			iov[i].iov_base = (char *)(iov[i].iov_base) + sent;
+			iov[i].iov_len -= sent;
+		}
+	}
+
+	if (count > calls)
+		this->cork_syscalls_saved += count - calls;
+	return 0;
+}
+
+
+/**
+ * Add a message to the batch of a corked connection,
+ * writing the batch if it is full or too old
+ * 
+ * @param   this     The connection descriptor
+ * @param   message  The message
+ * @param   length   The length of the message
+ * @return           Zero on success, -1 on error, `errno` will have been set
+ *                   accordingly on error
+ */
+static int __attribute__((nonnull))
+cork_message(libmds_connection_t *restrict this, const char *restrict message, size_t length)
+{
+	struct timespec now;
+	long long int elapsed;
+	size_t size;
+	char *new;
+
+	if (this->cork_length + length > this->cork_threshold)
+		return flush_cork(this, message, length);
+
+	if (this->cork_max_delay) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (!this->cork_count) {
+			this->cork_time = now;
+		} else {
+			elapsed  = (long long int)(now.tv_sec - this->cork_time.tv_sec) * 1000000000LL;
+			elapsed += (long long int)(now.tv_nsec - this->cork_time.tv_nsec);
+			if (elapsed >= this->cork_max_delay)
+				return flush_cork(this, message, length);
+		}
+	}
+
+	if (this->cork_length + length > this->cork_buffer_size) {
+		size = this->cork_buffer_size ? this->cork_buffer_size : 512;
+		while (size < this->cork_length + length)
+			size <<= 1;
+		new = realloc(this->cork_buffer, size * sizeof(char));
+		if (!new)
+			return flush_cork(this, message, length);
+		this->cork_buffer = new;
+		this->cork_buffer_size = size;
+	}
+
+	memcpy(this->cork_buffer + this->cork_length, message, length * sizeof(char));
+	this->cork_length += length;
+	this->cork_count++;
+	return 0;
+}
+
+
+/**
+ * Request that the rest of the conversation with the display
+ * server takes place over a pair of shared-memory rings, rather
+ * than over the socket, which is kept to detect hangups
+ * 
+ * The request is sent with the message ID in `this->message_id`,
+ * so the connection must be locked by the caller, and the message
+ * ID chosen beforehand. Messages sent after the request are written
+ * to the ring, and messages shall be read from the ring once the reply
+ * has been read, by passing it to `libmds_message_use_ring`.
+ * 
+ * @param   this      The connection descriptor, must not be `NULL`
+ * @param   capacity  The number of bytes each ring shall be able to
+ *                    hold, rounded up to a power of two, at least 4096
+ * @return            Zero on success, -1 on error, `errno` will have been set
+ *                    accordingly on error
+ * 
+ * @throws  EALREADY  If a ring has already been requested
+ * @throws  ENOMEM    Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                    RLIMIT_DATA limit described in getrlimit(2).
+ * @throws            Any error specified for memfd_create(2)
+ * @throws            Any error specified for eventfd(2)
+ * @throws            Any error specified for mmap(2)
+ * @throws            Any error specified for `libmds_connection_send_unlocked`
+ */
+int
+libmds_connection_use_ring_unlocked(libmds_connection_t *restrict this, size_t capacity)
+{
+	char buf[64];
+	const char *msg = buf;
+	ring_t *ring = NULL;
+	size_t n, sent;
+	ssize_t r;
+	int fds[3], saved_errno;
+
+	if (this->ring)
+		return errno = EALREADY, -1;
+
+	/* Everything sent before the request must precede it on the socket. */
+	if (this->cork_count && flush_cork(this, NULL, 0))
+		return -1;
+	if (this->pending_off < this->pending_ptr) {
+		n = this->pending_ptr - this->pending_off;
+		if (send_inline(this, this->pending + this->pending_off, n, 1) < n)
+			return -1;
+		this->pending_off = this->pending_ptr = 0;
+	}
+
+	ring = malloc(sizeof(ring_t));
+	if (!ring || ring_create(ring, capacity))
+		goto fail;
+
+	/* The server is rung by `peer_bell`, and rings `bell`. */
+	fds[0] = ring->memfd;
+	fds[1] = ring->peer_bell;
+	fds[2] = ring->bell;
+	n = (size_t)snprintf(buf, sizeof(buf), "Command: ring\nMessage ID: %" PRIu32 "\n\n", this->message_id);
+	if (this->binary) {
+		if (encode_binary(this, buf, n, &n))
+			goto fail;
+		msg = this->binary_buffer;
+	}
+	while ((r = memfd_send_fds(this->socket_fd, msg, n, fds, 3)) < 0 && errno == EINTR);
+	if (r < 0)
+		goto fail;
+	sent = (size_t)r;
+	if (sent < n && send_inline(this, msg + sent, n - sent, 1) < n - sent)
+		goto fail;
+
+	this->ring = ring;
+	this->ring_eventfd = ring->bell;
+	return 0;
+
+fail:
+	saved_errno = errno;
+	ring_destroy(ring);
+	free(ring);
+	return errno = saved_errno, -1;
+}
+
+
+/**
+ * Request that the rest of the conversation with the display
+ * server takes place in the binary encoding, in which the
+ * headers of each message are sent in a frame, with interned
+ * header names, that the display server does not need to parse
+ * line by line
+ * 
+ * The request is sent with the message ID in `this->message_id`,
+ * so the connection must be locked by the caller, and the message
+ * ID chosen beforehand. Messages sent after the request are translated
+ * to the binary encoding, and messages shall be read in the binary
+ * encoding once the reply has been read, by passing it to
+ * `libmds_message_use_binary`.
+ * 
+ * @param   this  The connection descriptor, must not be `NULL`
+ * @return        Zero on success, -1 on error, `errno` will have been set
+ *                accordingly on error
+ * 
+ * @throws  EALREADY  If the binary encoding has already been requested
+ * @throws  ENOMEM    Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                    RLIMIT_DATA limit described in getrlimit(2).
+ * @throws            Any error specified for `libmds_connection_send_unlocked`
+ */
+int
+libmds_connection_use_binary_unlocked(libmds_connection_t *restrict this)
+{
+	char buf[64];
+	binary_encoder_t *encoder;
+	size_t n;
+	int saved_errno;
+
+	if (this->binary)
+		return errno = EALREADY, -1;
+
+	encoder = calloc(1, sizeof(binary_encoder_t));
+	if (!encoder)
+		return -1;
+
+	/* The request itself is the last message in the text encoding. */
+	n = (size_t)snprintf(buf, sizeof(buf), "Command: binary\nMessage ID: %" PRIu32 "\n\n", this->message_id);
+	if (libmds_connection_send_unlocked(this, buf, n, 1) < n) {
+		saved_errno = errno;
+		free(encoder);
+		return errno = saved_errno, -1;
+	}
+
+	this->binary = encoder;
+	return 0;
+}
+
+
+/**
+ * Undo one call to `libmds_connection_cork`, and write
+ * the batched messages if it was the outermost call
+ * 
+ * The connection must be locked by the caller
+ * 
+ * @param   this  The connection descriptor, must not be `NULL`
+ * @return        Zero on success, -1 on error, `errno` will have been set
+ *                accordingly on error, in which case the connection shall
+ *                be considered lost
+ * 
+ * @throws  Any error specified for `libmds_connection_send_unlocked`
+ */
+int
+libmds_connection_uncork(libmds_connection_t *restrict this)
+{
+	if ((this->corked > 0) && --(this->corked))
+		return 0;
+	return this->cork_count ? flush_cork(this, NULL, 0) : 0;
+}
+
+
+/**
+ * Write the batch of a corked connection if it has been held
+ * for `this->cork_max_delay` nanoseconds, and get how long an
+ * event loop may wait before calling this function again
+ * 
+ * The connection must be locked by the caller
+ * 
+ * @param   this     The connection descriptor, must not be `NULL`
+ * @param   timeout  Output parameter for the number of milliseconds,
+ *                   rounded up, until the batch must be written, or
+ *                   -1 if there is no batch or `this->cork_max_delay`
+ *                   is zero
+ * @return           Zero on success, -1 on error, `errno` will have been set
+ *                   accordingly on error, in which case the connection shall
+ *                   be considered lost
+ * 
+ * @throws  Any error specified for `libmds_connection_send_unlocked`
+ */
+int
+libmds_connection_cork_timeout(libmds_connection_t *restrict this, int *restrict timeout)
+{
+	struct timespec now;
+	long long int left;
+
+	*timeout = -1;
+	if (!this->cork_count || !this->cork_max_delay)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left  = (long long int)this->cork_max_delay;
+	left -= (long long int)(now.tv_sec - this->cork_time.tv_sec) * 1000000000LL;
+	left -= (long long int)(now.tv_nsec - this->cork_time.tv_nsec);
+	if (left <= 0)
+		return flush_cork(this, NULL, 0);
+
+	left = (left + 999999LL) / 1000000LL;
+	*timeout = left > INT_MAX ? INT_MAX : (int)left;
+	return 0;
+}
+
+
 /**
  * Send a message to the display server, without locking the
  * mutex of the conncetion
  * 
+ * If `continue_on_interrupt` is non-zero and the message is a
+ * single message whose payload is at least `this->memfd_threshold`
+ * bytes large, the payload is sent in a memfd. In that case, either
+ * `length` or zero is returned.
+ * 
+ * If the connection is corked, the message is batched, and
+ * `length` is returned unless the batch had to be written
+ * and that failed, in which case zero is returned.
+ * 
+ * If the connection has switched to the binary encoding, with
+ * `libmds_connection_use_binary_unlocked`, the message is
+ * translated, and either `length` or zero is returned.
+ * 
  * @param   this                   The connection descriptor, must not be `NULL`
  * @param   message                The message to send, must not be `NULL`
  * @param   length                 The length of the message, should be positive
@@ -281,30 +874,192 @@ libmds_connection_send(libmds_connection_t *restrict this, const char *restrict
 size_t
 libmds_connection_send_unlocked(libmds_connection_t *restrict this, const char *restrict message,
                                 size_t length, int continue_on_interrupt)
+{
+	size_t sent, text_length = length;
+	int r, memfd;
+
+	/* The translated message is sent in full, or not at all. */
+	if (this->binary) {
+		if (encode_binary(this, message, text_length, &length))
+			return 0;
+		message = this->binary_buffer;
+		continue_on_interrupt = 1;
+	}
+
+	memfd = this->memfd_threshold && continue_on_interrupt && length >= this->memfd_threshold;
+	memfd = memfd && !this->ring && !this->binary;
+
+	/* Batch the message if corked, messages whose
+	 * payloads may be sent in memfds end the batch. */
+	if (this->corked && !memfd)
+		return cork_message(this, message, length) ? 0 : text_length;
+	if (this->cork_count && flush_cork(this, NULL, 0))
+		return 0;
+
+	if (memfd) {
+		r = send_in_memfd(this, message, length);
+		if (r <= 0)
+			return r ? 0 : length;
+	}
+
+	sent = send_inline(this, message, length, continue_on_interrupt);
+	return this->binary ? (sent < length ? 0 : text_length) : sent;
+}
+
+
+/**
+ * Write as much as possible of some data to
+ * the display server without blocking
+ * 
+ * @param   this    The connection descriptor
+ * @param   data    The data to send
+ * @param   length  The length of the data
+ * @param   sent    Output parameter for the number of written bytes
+ * @return          Zero on success, even if not everything could be
+ *                  written, -1 on error, `errno` will have been set
+ *                  accordingly on error
+ */
+static int __attribute__((nonnull))
+send_nonblocking(libmds_connection_t *restrict this, const char *restrict data,
+                 size_t length, size_t *restrict sent)
 {
 	size_t block_size = length;
-	size_t sent = 0;
 	ssize_t just_sent;
 
-	errno = 0;
-	while (length > 0) {
-		if ((just_sent = send(this->socket_fd, message + sent, min(block_size, length), MSG_NOSIGNAL)) < 0) {
+	*sent = 0;
+	if (this->ring) {
+		just_sent = ring_write(this->ring, data, length);
+		if (just_sent < 0)
+			return -1;
+		*sent = (size_t)just_sent;
+		return 0;
+	}
+
+	while (*sent < length) {
+		just_sent = send(this->socket_fd, data + *sent, min(block_size, length - *sent),
+		                 MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (just_sent >= 0) {
+			*sent += (size_t)just_sent;
+		} else if (errno == EAGAIN) {
+			break;
+		} else if (errno == EMSGSIZE) {
+			if (!(block_size >>= 1))
+				return -1;
+		} else if (errno != EINTR) {
 			if (errno == EPIPE)
 				errno = ECONNRESET;
-			if (errno == EMSGSIZE) {
-				block_size >>= 1;
-				if (!block_size)
-					return sent;
-			} else if (errno == EINTR && continue_on_interrupt) {
-				continue;
-			} else {
-				return sent;
-			}
-		} else {
-			sent += (size_t)just_sent;
-			length -= (size_t)just_sent;
+			return -1;
 		}
 	}
 
-	return sent;
+	return 0;
+}
+
+
+/**
+ * Send a message to the display server without blocking, and
+ * without locking the mutex of the connection
+ * 
+ * Whatever part of the message cannot be written immediately is
+ * kept in the connection descriptor, and is written, before any
+ * message sent later with this function, by `libmds_connection_flush`
+ * once the socket is writable. The socket does not need to be in
+ * nonblocking mode. Payloads are always sent inline. Messages sent
+ * with `libmds_connection_send_unlocked` may overtake queued data,
+ * so the two functions should not be mixed on the same connection.
+ * 
+ * @param   this     The connection descriptor, must not be `NULL`
+ * @param   message  The message to send, must not be `NULL`
+ * @param   length   The length of the message
+ * @return           Zero if the entire message has been sent, 1 if data is
+ *                   queued and `libmds_connection_flush` shall be called when
+ *                   the socket is writable, -1 on error, `errno` will have
+ *                   been set accordingly on error; if `errno` is ENOMEM
+ *                   nothing has been sent
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for `libmds_connection_send_unlocked`,
+ *                  except EWOULDBLOCK and EINTR
+ */
+int
+libmds_connection_send_nonblocking(libmds_connection_t *restrict this, const char *restrict message, size_t length)
+{
+	size_t sent = 0, size;
+	char *new;
+	int r;
+
+	if (this->binary) {
+		if (encode_binary(this, message, length, &length))
+			return -1;
+		message = this->binary_buffer;
+	}
+
+	/* Data that is already queued must be written first. */
+	r = libmds_connection_flush(this);
+	if (r < 0)
+		return -1;
+	if (!r && send_nonblocking(this, message, length, &sent))
+		return -1;
+	if (sent == length)
+		return 0;
+
+	/* Queue the rest, rebasing the queue if it has been half written. */
+	if (this->pending_off && (this->pending_off << 1 >= this->pending_ptr)) {
+		memmove(this->pending, this->pending + this->pending_off,
+		        (this->pending_ptr - this->pending_off) * sizeof(char));
+		this->pending_ptr -= this->pending_off;
+		this->pending_off = 0;
+	}
+	if (this->pending_ptr + (length - sent) > this->pending_size) {
+		size = this->pending_size ? this->pending_size : 128;
+		while (size < this->pending_ptr + (length - sent))
+			size <<= 1;
+		new = realloc(this->pending, size * sizeof(char));
+		if (!new) {
+			/* Part of the message has been written, the connection is unusable. */
+			if (sent)
+				errno = ECONNRESET;
+			return -1;
+		}
+		this->pending = new;
+		this->pending_size = size;
+	}
+	memcpy(this->pending + this->pending_ptr, message + sent, (length - sent) * sizeof(char));
+	this->pending_ptr += length - sent;
+	return 1;
+}
+
+
+/**
+ * Write data queued by `libmds_connection_send_nonblocking`
+ * without blocking
+ * 
+ * @param   this  The connection descriptor, must not be `NULL`
+ * @return        Zero if no data is queued anymore, 1 if data is still
+ *                queued and the function shall be called again when the
+ *                socket is writable, -1 on error, `errno` will have been
+ *                set accordingly on error
+ * 
+ * @throws  Any error specified for `libmds_connection_send_unlocked`,
+ *          except EWOULDBLOCK and EINTR
+ */
+int
+libmds_connection_flush(libmds_connection_t *restrict this)
+{
+	size_t sent;
+
+	if (this->pending_off == this->pending_ptr)
+		return 0;
+
+	if (send_nonblocking(this, this->pending + this->pending_off,
+	                     this->pending_ptr - this->pending_off, &sent))
+		return -1;
+
+	this->pending_off += sent;
+	if (this->pending_off < this->pending_ptr)
+		return 1;
+
+	this->pending_off = this->pending_ptr = 0;
+	return 0;
 }
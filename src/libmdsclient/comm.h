@@ -27,6 +27,12 @@
 #include <time.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <poll.h>
+
+
+
+struct ring;
+struct binary_encoder;
 
 
 
@@ -66,6 +72,122 @@ typedef struct libmds_connection
 	 */
 	int mutex_initialised;
 
+	/**
+	 * If non-zero, messages sent with `libmds_connection_send`,
+	 * whose payloads are at least this large, have their payloads
+	 * sent in sealed memfds rather than inline, so that the display
+	 * server and the recipients need not copy them
+	 */
+	size_t memfd_threshold;
+
+	/**
+	 * Data accepted by `libmds_connection_send_nonblocking`
+	 * that has not yet been written to the socket (internal data)
+	 */
+	char *pending;
+
+	/**
+	 * The allocation size of `pending` (internal data)
+	 */
+	size_t pending_size;
+
+	/**
+	 * The number of bytes at the beginning of `pending`
+	 * that have been written to the socket (internal data)
+	 */
+	size_t pending_off;
+
+	/**
+	 * The number of bytes used in `pending` (internal data)
+	 */
+	size_t pending_ptr;
+
+	/**
+	 * The number of calls to `libmds_connection_cork` that have
+	 * not been matched by a call to `libmds_connection_uncork`,
+	 * while non-zero, sent messages are batched and written
+	 * together with as few system calls as possible
+	 */
+	int corked;
+
+	/**
+	 * A batch is written as soon as it would grow beyond this
+	 * number of bytes, larger messages are written together with
+	 * the batch without being copied into it
+	 */
+	size_t cork_threshold;
+
+	/**
+	 * If non-zero, a batch is written when a message is sent
+	 * this many nanoseconds or later after the first message
+	 * in the batch was sent, or when `libmds_connection_cork_timeout`
+	 * is called that late
+	 */
+	long cork_max_delay;
+
+	/**
+	 * The number of system calls that batching has saved
+	 */
+	uint64_t cork_syscalls_saved;
+
+	/**
+	 * Batched messages (internal data)
+	 */
+	char *cork_buffer;
+
+	/**
+	 * The allocation size of `cork_buffer` (internal data)
+	 */
+	size_t cork_buffer_size;
+
+	/**
+	 * The number of bytes used in `cork_buffer` (internal data)
+	 */
+	size_t cork_length;
+
+	/**
+	 * The number of messages in `cork_buffer` (internal data)
+	 */
+	size_t cork_count;
+
+	/**
+	 * The CLOCK_MONOTONIC time the first message
+	 * in `cork_buffer` was sent (internal data)
+	 */
+	struct timespec cork_time;
+
+	/**
+	 * If not `NULL`, the shared-memory ring pair that messages
+	 * are sent over instead of the socket, set up by
+	 * `libmds_connection_use_ring_unlocked` (internal data)
+	 */
+	struct ring *ring;
+
+	/**
+	 * eventfd(2) that becomes readable when data is written to
+	 * `ring`, an event loop shall poll it instead of the socket
+	 * once the ring has been accepted, -1 if there is no ring
+	 */
+	int ring_eventfd;
+
+	/**
+	 * If not `NULL`, the encoder that translates messages
+	 * to the binary encoding, set up by
+	 * `libmds_connection_use_binary_unlocked` (internal data)
+	 */
+	struct binary_encoder *binary;
+
+	/**
+	 * Buffer for messages translated to the
+	 * binary encoding (internal data)
+	 */
+	char *binary_buffer;
+
+	/**
+	 * The allocation size of `binary_buffer` (internal data)
+	 */
+	size_t binary_buffer_size;
+
 } libmds_connection_t;
 
 
@@ -186,6 +308,19 @@ size_t libmds_connection_send(libmds_connection_t *restrict this, const char *re
  * Send a message to the display server, without locking the
  * mutex of the conncetion
  * 
+ * If `continue_on_interrupt` is non-zero and the message is a
+ * single message whose payload is at least `this->memfd_threshold`
+ * bytes large, the payload is sent in a memfd. In that case, either
+ * `length` or zero is returned.
+ * 
+ * If the connection is corked, the message is batched, and
+ * `length` is returned unless the batch had to be written
+ * and that failed, in which case zero is returned.
+ * 
+ * If the connection has switched to the binary encoding, with
+ * `libmds_connection_use_binary_unlocked`, the message is
+ * translated, and either `length` or zero is returned.
+ * 
  * @param   this                   The connection descriptor, must not be `NULL`
  * @param   message                The message to send, must not be `NULL`
  * @param   length                 The length of the message, should be positive
@@ -210,6 +345,179 @@ __attribute__((nonnull))
 size_t libmds_connection_send_unlocked(libmds_connection_t *restrict this, const char *restrict message,
                                        size_t length, int continue_on_interrupt);
 
+/**
+ * Send a message to the display server without blocking, and
+ * without locking the mutex of the connection
+ * 
+ * Whatever part of the message cannot be written immediately is
+ * kept in the connection descriptor, and is written, before any
+ * message sent later with this function, by `libmds_connection_flush`
+ * once the socket is writable. The socket does not need to be in
+ * nonblocking mode. Payloads are always sent inline. Messages sent
+ * with `libmds_connection_send_unlocked` may overtake queued data,
+ * so the two functions should not be mixed on the same connection.
+ * 
+ * @param   this     The connection descriptor, must not be `NULL`
+ * @param   message  The message to send, must not be `NULL`
+ * @param   length   The length of the message
+ * @return           Zero if the entire message has been sent, 1 if data is
+ *                   queued and `libmds_connection_flush` shall be called when
+ *                   the socket is writable, -1 on error, `errno` will have
+ *                   been set accordingly on error; if `errno` is ENOMEM
+ *                   nothing has been sent
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for `libmds_connection_send_unlocked`,
+ *                  except EWOULDBLOCK and EINTR
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_connection_send_nonblocking(libmds_connection_t *restrict this, const char *restrict message, size_t length);
+
+/**
+ * Write data queued by `libmds_connection_send_nonblocking`
+ * without blocking
+ * 
+ * @param   this  The connection descriptor, must not be `NULL`
+ * @return        Zero if no data is queued anymore, 1 if data is still
+ *                queued and the function shall be called again when the
+ *                socket is writable, -1 on error, `errno` will have been
+ *                set accordingly on error
+ * 
+ * @throws  Any error specified for `libmds_connection_send_unlocked`,
+ *          except EWOULDBLOCK and EINTR
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_connection_flush(libmds_connection_t *restrict this);
+
+/**
+ * Request that the rest of the conversation with the display
+ * server takes place over a pair of shared-memory rings, rather
+ * than over the socket, which is kept to detect hangups
+ * 
+ * The request is sent with the message ID in `this->message_id`,
+ * so the connection must be locked by the caller, and the message
+ * ID chosen beforehand. Messages sent after the request are written
+ * to the ring, and messages shall be read from the ring once the reply
+ * has been read, by passing it to `libmds_message_use_ring`. Payloads
+ * are never sent in memfds over a ring, and data that cannot be written
+ * to a full ring by `libmds_connection_send_nonblocking` is written by
+ * `libmds_connection_flush`, which then needs to be called again soon,
+ * as the socket, which the event loop waits on, is always writable.
+ * 
+ * @param   this      The connection descriptor, must not be `NULL`
+ * @param   capacity  The number of bytes each ring shall be able to
+ *                    hold, rounded up to a power of two, at least 4096
+ * @return            Zero on success, -1 on error, `errno` will have been set
+ *                    accordingly on error
+ * 
+ * @throws  EALREADY  If a ring has already been requested
+ * @throws  ENOMEM    Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                    RLIMIT_DATA limit described in getrlimit(2).
+ * @throws            Any error specified for memfd_create(2)
+ * @throws            Any error specified for eventfd(2)
+ * @throws            Any error specified for mmap(2)
+ * @throws            Any error specified for `libmds_connection_send_unlocked`
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_connection_use_ring_unlocked(libmds_connection_t *restrict this, size_t capacity);
+
+/**
+ * Request that the rest of the conversation with the display
+ * server takes place in the binary encoding, in which the
+ * headers of each message are sent in a frame, with interned
+ * header names, that the display server does not need to parse
+ * line by line
+ * 
+ * The request is sent with the message ID in `this->message_id`,
+ * so the connection must be locked by the caller, and the message
+ * ID chosen beforehand. Messages are still passed to the functions
+ * that send them in the text encoding, but messages sent after the
+ * request are translated to the binary encoding, and, once the reply
+ * has been read, messages shall be read in the binary encoding, by
+ * passing the reply to `libmds_message_use_binary`. Payloads are
+ * never sent in memfds in the binary encoding, messages are always
+ * sent in full, as if `continue_on_interrupt` were non-zero, and
+ * if sending fails, the connection shall be considered lost.
+ * 
+ * @param   this  The connection descriptor, must not be `NULL`
+ * @return        Zero on success, -1 on error, `errno` will have been set
+ *                accordingly on error
+ * 
+ * @throws  EALREADY  If the binary encoding has already been requested
+ * @throws  ENOMEM    Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                    RLIMIT_DATA limit described in getrlimit(2).
+ * @throws            Any error specified for `libmds_connection_send_unlocked`
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_connection_use_binary_unlocked(libmds_connection_t *restrict this);
+
+/**
+ * Start batching messages sent with `libmds_connection_send`
+ * and `libmds_connection_send_unlocked`, calls may be nested
+ * 
+ * The connection must be locked by the caller
+ * 
+ * @param  this:libmds_connection_t*  The connection descriptor, must not be `NULL`
+ */
+#define libmds_connection_cork(this)\
+	((void)((this)->corked++))
+
+/**
+ * Undo one call to `libmds_connection_cork`, and write
+ * the batched messages if it was the outermost call
+ * 
+ * The connection must be locked by the caller
+ * 
+ * @param   this  The connection descriptor, must not be `NULL`
+ * @return        Zero on success, -1 on error, `errno` will have been set
+ *                accordingly on error, in which case the connection shall
+ *                be considered lost
+ * 
+ * @throws  Any error specified for `libmds_connection_send_unlocked`
+ */
+__attribute__((nonnull))
+int libmds_connection_uncork(libmds_connection_t *restrict this);
+
+/**
+ * Write the batch of a corked connection if it has been held
+ * for `this->cork_max_delay` nanoseconds, and get how long an
+ * event loop may wait before calling this function again
+ * 
+ * `this->cork_max_delay` is otherwise only checked when the
+ * next message is sent, so a connection that goes quiet while
+ * corked would hold its batch until it is uncorked
+ * 
+ * The connection must be locked by the caller
+ * 
+ * @param   this     The connection descriptor, must not be `NULL`
+ * @param   timeout  Output parameter for the number of milliseconds,
+ *                   rounded up, until the batch must be written, or
+ *                   -1 if there is no batch or `this->cork_max_delay`
+ *                   is zero; suitable as the timeout for poll(3p)
+ *                   and epoll_wait(2)
+ * @return           Zero on success, -1 on error, `errno` will have been set
+ *                   accordingly on error, in which case the connection shall
+ *                   be considered lost
+ * 
+ * @throws  Any error specified for `libmds_connection_send_unlocked`
+ */
+__attribute__((nonnull))
+int libmds_connection_cork_timeout(libmds_connection_t *restrict this, int *restrict timeout);
+
+/**
+ * Get the events an event loop shall wait for on the
+ * socket of a connection
+ * 
+ * @param   this:const libmds_connection_t*  The connection descriptor, must not be `NULL`
+ * @return  :int                             `POLLIN`, or `POLLIN | POLLOUT` if data
+ *                                           queued by `libmds_connection_send_nonblocking`
+ *                                           is waiting for the socket to become writable;
+ *                                           the values are equal to `EPOLLIN` and `EPOLLOUT`
+ */
+#define libmds_connection_events(this)\
+	(POLLIN | ((this)->pending_off < (this)->pending_ptr ? POLLOUT : 0))
+
 /**
  * Lock the connection descriptor for being modified,
  * or used to send data to the display, by another thread
@@ -221,7 +529,7 @@ size_t libmds_connection_send_unlocked(libmds_connection_t *restrict this, const
  * @throws  See pthread_mutex_lock(3)
  */
 #define libmds_connection_lock(this)\
-	(errno = pthread_mutex_lock(&((this)->mutex)), (errno ? 0 : -1))
+	(errno = pthread_mutex_lock(&((this)->mutex)), (errno ? -1 : 0))
 
 /**
  * Lock the connection descriptor for being modified,
@@ -234,7 +542,7 @@ size_t libmds_connection_send_unlocked(libmds_connection_t *restrict this, const
  * @throws  See pthread_mutex_trylock(3)
  */
 #define libmds_connection_trylock(this)\
-	(errno = pthread_mutex_trylock(&((this)->mutex)), (errno ? 0 : -1))
+	(errno = pthread_mutex_trylock(&((this)->mutex)), (errno ? -1 : 0))
 
 /**
  * Lock the connection descriptor for being modified,
@@ -249,7 +557,7 @@ size_t libmds_connection_send_unlocked(libmds_connection_t *restrict this, const
  * @throws  See pthread_mutex_timedlock(3)
  */
 #define libmds_connection_timedlock(this, deadline)\
-	(errno = pthread_mutex_timedlock(&((this)->mutex), deadline), (errno ? 0 : -1))
+	(errno = pthread_mutex_timedlock(&((this)->mutex), deadline), (errno ? -1 : 0))
 
 /**
  * Undo the action of `libmds_connection_lock`, `libmds_connection_trylock`
@@ -262,7 +570,7 @@ size_t libmds_connection_send_unlocked(libmds_connection_t *restrict this, const
  * @throws  See pthread_mutex_unlock(3)
  */
 #define libmds_connection_unlock(this)\
-	(errno = pthread_mutex_unlock(&((this)->mutex)), (errno ? 0 : -1))
+	(errno = pthread_mutex_unlock(&((this)->mutex)), (errno ? -1 : 0))
 
 /**
  * Arguments for `libmds_compose` to compose the `Client ID`-header
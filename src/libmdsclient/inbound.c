@@ -19,18 +19,90 @@
 /* Some optimisations have been attempted. Verify that this implementation
  * works, then update the implementation in libmdsserver. */
 
+#include <libmdsserver/utf8.h>
+#include <libmdsserver/memfd.h>
+#include <libmdsserver/ring.h>
+#include <libmdsserver/binary.h>
+
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
-#include <stdio.h>
-#include <assert.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 
 #define try(INSTRUCTION)   do { if ((r = INSTRUCTION) < 0) return r; } while (0)
 #define static_strlen(str) (sizeof(str) / sizeof(char) - 1)
 
+/**
+ * The number of bytes, before a read buffer, that
+ * holds its reference count, keeps the buffer aligned
+ */
+#define BUFFER_PREFIX  (2 * sizeof(size_t))
+
+/**
+ * Get the reference count of a read buffer
+ * 
+ * @param   buf:char*  The read buffer
+ * @return  :size_t*   The reference count
+ */
+#define buffer_refs(buf)  ((size_t *)(void *)((buf) - BUFFER_PREFIX / sizeof(char)))
+
+
+
+/**
+ * Allocate a read buffer with one reference
+ * 
+ * @param   size  The size of the buffer
+ * @return        The buffer, `NULL` on error
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+static char * __attribute__((malloc, warn_unused_result))
+alloc_buffer(size_t size)
+{
+	char *buf = malloc(BUFFER_PREFIX + size * sizeof(char));
+	if (!buf)
+		return NULL;
+	buf += BUFFER_PREFIX / sizeof(char);
+	*buffer_refs(buf) = 1;
+	return buf;
+}
+
+
+/**
+ * Drop a reference to a read buffer,
+ * and deallocate it if it was the last
+ * 
+ * @param  buf  The read buffer, may be `NULL`
+ */
+static void
+release_buffer(char *restrict buf)
+{
+	if (buf && !__atomic_sub_fetch(buffer_refs(buf), 1, __ATOMIC_ACQ_REL))
+		free(buf - BUFFER_PREFIX / sizeof(char));
+}
+
+
+/**
+ * Check whether a read buffer is referenced by duplicates
+ * 
+ * @param   buf  The read buffer
+ * @return       Whether the buffer is shared
+ */
+static int __attribute__((nonnull))
+buffer_is_shared(char *restrict buf)
+{
+	return __atomic_load_n(buffer_refs(buf), __ATOMIC_ACQUIRE) > 1;
+}
+
 
 
 /**
@@ -53,9 +125,21 @@ libmds_message_initialise(libmds_message_t *restrict this)
 	this->payload_size = 0;
 	this->buffer_size = 128;
 	this->buffer_ptr = 0;
+	this->buffer_off = 0;
 	this->stage = 0;
 	this->flattened = 0;
-	this->buffer = malloc(this->buffer_size * sizeof(char));
+	this->payload_mapped = 0;
+	this->fds = NULL;
+	this->fd_count = 0;
+	this->index_headers = 0;
+	this->header_index = NULL;
+	this->header_index_size = 0;
+	this->header_index_alloc = 0;
+	this->zero_copy = 0;
+	this->buffer_shared = 0;
+	this->ring = NULL;
+	this->binary = 0;
+	this->buffer = alloc_buffer(this->buffer_size);
 	return this->buffer == NULL ? -1 : 0;
 }
 
@@ -68,136 +152,186 @@ libmds_message_initialise(libmds_message_t *restrict this)
 void
 libmds_message_destroy(libmds_message_t *restrict this)
 {
+	size_t i;
 	if (!this->flattened) {
 		free(this->headers), this->headers = NULL;
-		free(this->buffer),  this->buffer  = NULL;
+		release_buffer(this->buffer), this->buffer = NULL;
+		if (this->payload_mapped)
+			munmap(this->payload, this->payload_size);
+		this->payload_mapped = 0;
+		for (i = 0; i < this->fd_count; i++)
+			close(this->fds[i]);
+		free(this->fds), this->fds = NULL;
+		this->fd_count = 0;
+		free(this->header_index), this->header_index = NULL;
+		this->header_index_size = this->header_index_alloc = 0;
 	}
 }
 
 
 /**
- * Release all resources in a message, should
- * be done even if initialisation fails
+ * Allocate memory for a flat message
  * 
- * @param   this  The message
- * @param   pool  Message allocation pool, may be `NULL`
- * @return        The duplicate, you do not need to call `libmds_message_destroy`
- *                on it before you call `free` on it. However, you cannot use
- *                this is an `libmds_message_t` array (libmds_message_t*), only
- *                in an `libmds_message_t*` array (libmds_message_t**).
+ * @param   pool    Message allocation pool, may be `NULL`
+ * @param   size    The number of bytes required
+ * @param   reused  Output parameter for the size of the allocation
+ *                  if it was taken from `pool`, zero otherwise
+ * @return          The allocation, `NULL` on error
  * 
  * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
  *                  RLIMIT_DATA limit described in getrlimit(2).
  */
-libmds_message_t *
-libmds_message_duplicate(libmds_message_t *restrict this, libmds_mpool_t *restrict pool)
+static libmds_message_t * __attribute__((nonnull(3), warn_unused_result))
+allocate_flat(libmds_mpool_t *restrict pool, size_t size, size_t *restrict reused)
 {
-	size_t flattened_size, reused, i, n = this->header_count;
 	libmds_message_t *rc;
-
-	flattened_size = sizeof(libmds_message_t) + this->buffer_off * sizeof(char) + n * sizeof(void*);
 repoll:
-	reused = 0;
+	*reused = 0;
 	rc = !pool ? NULL : libmds_mpool_poll(pool);
 	if (rc) {
-		if ((reused = rc->flattened) < flattened_size) {
+		if ((*reused = rc->flattened) < size) {
 			free(rc);
 			goto repoll;
 		}
+		return rc;
 	}
-	if (!rc && !(rc = malloc(flattened_size)))
+	return malloc(size);
+}
+
+
+/**
+ * Duplicate a message without copying its buffer
+ * 
+ * @param   this  The message, its payload must not be mapped
+ * @param   pool  Message allocation pool, may be `NULL`
+ * @return        The duplicate, `NULL` on error
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+static libmds_message_t * __attribute__((nonnull(1), warn_unused_result))
+duplicate_shared(libmds_message_t *restrict this, libmds_mpool_t *restrict pool)
+{
+	size_t size, reused, n = this->header_count;
+	libmds_message_t *rc;
+
+	size = sizeof(libmds_message_t) + n * sizeof(void*);
+	size += this->header_index_size * sizeof(libmds_header_slot_t);
+	if (!(rc = allocate_flat(pool, size, &reused)))
 		return NULL;
 
 	*rc = *this;
-	rc->flattened   = reused ? reused : flattened_size;
-	rc->buffer_size = this->buffer_off;
-
-	rc->buffer  = ((char*)rc) + sizeof(libmds_message_t) / sizeof(char);
-	rc->headers = rc->header_count ? (char**)(void*)(rc->buffer + this->buffer_off)        : NULL;
-	rc->payload = rc->payload_size ? (rc->buffer + (size_t)(this->payload - this->buffer)) : NULL;
-	for (i = 0; i < n; i++)
-		rc->headers[i] = rc->buffer + (size_t)(this->headers[i] - this->buffer);
+	rc->flattened     = reused ? reused : size;
+	rc->buffer_size   = this->buffer_off;
+	rc->buffer_shared = 1;
+	rc->payload       = rc->payload_size ? this->payload : NULL;
+
+	/* The headers and the payload are left in the buffer,
+	   only the pointers to them, and the index, are copied. */
+	rc->headers = n ? (char**)(void*)(((char*)rc) + sizeof(libmds_message_t) / sizeof(char)) : NULL;
+	memcpy(rc->headers, this->headers, n * sizeof(char*));
+	rc->header_index = NULL;
+	rc->header_index_alloc = this->header_index_size;
+	if (this->header_index_size) {
+		rc->header_index = (libmds_header_slot_t *)(void *)(rc->headers + n);
+		memcpy(rc->header_index, this->header_index, this->header_index_size * sizeof(libmds_header_slot_t));
+	}
+	rc->fds = NULL;
+	rc->fd_count = 0;
+	rc->ring = NULL;
+	rc->binary = 0;
 
-	memcpy(rc->buffer, this->buffer, this->buffer_off * sizeof(char));
+	__atomic_add_fetch(buffer_refs(this->buffer), 1, __ATOMIC_RELAXED);
 	return rc;
 }
 
 
 /**
- * Check whether a NUL-terminated string is encoded in UTF-8
+ * Release all resources in a message, should
+ * be done even if initialisation fails
+ * 
+ * @param   this  The message
+ * @param   pool  Message allocation pool, may be `NULL`
+ * @return        The duplicate, you do not need to call `libmds_message_destroy`
+ *                on it before you call `free` on it. However, you cannot use
+ *                this is an `libmds_message_t` array (libmds_message_t*), only
+ *                in an `libmds_message_t*` array (libmds_message_t**).
  * 
- * @param   string              The string
- * @param   allow_modified_nul  Whether Modified UTF-8 is allowed, which allows a two-byte encoding for NUL
- * @return                      Zero if good, -1 on encoding error
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
  */
-static int __attribute__((nonnull, warn_unused_result)) /* Cannibalised from <libmdsserver/util.h>. */
-verify_utf8(const char *string, int allow_modified_nul)
+libmds_message_t *
+libmds_message_duplicate(libmds_message_t *restrict this, libmds_mpool_t *restrict pool)
 {
-	static long BYTES_TO_MIN_BITS[] = {0, 0,  8, 12, 17, 22, 37};
-	static long BYTES_TO_MAX_BITS[] = {0, 7, 11, 16, 21, 26, 31};
-	long bytes = 0, read_bytes = 0, bits = 0, c, character;
-
-	/*                                                      min bits  max bits
-	  0.......                                                 0         7
-	  110..... 10......                                        8        11
-	  1110.... 10...... 10......                              12        16
-	  11110... 10...... 10...... 10......                     17        21
-	  111110.. 10...... 10...... 10...... 10......            22        26
-	  1111110. 10...... 10...... 10...... 10...... 10......   27        31
-	 */
+	size_t flattened_size, reused, mapped, i, n = this->header_count;
+	libmds_message_t *rc;
 
-	while ((c = (long)(*string++))) {
-		if (!read_bytes) {
-			/* First byte of the character. */
+	if (this->zero_copy && !this->payload_mapped)
+		return duplicate_shared(this, pool);
 
-			if (!(c & 0x80))
-				/* Single-byte character. */
-				continue;
+	/* A mapped payload is copied into the buffer, after the
+	   message it belongs to, so that it is copied along with
+	   the buffer if the duplicate is duplicated. */
+	mapped = this->payload_mapped ? this->payload_size : 0;
 
-			if ((c & 0xC0) == 0x80)
-				/* Single-byte character marked as multibyte, or
-				   a non-first byte in a multibyte character. */
-				return -1;
-
-			/* Multibyte character. */
-			while ((c & 0x80))
-				bytes++, c <<= 1;
-			read_bytes = 1;
-			character = c & 0x7F;
-			if (bytes > 6)
-				/* 31-bit characters can be encoded with 6-bytes,
-				   and UTF-8 does not cover higher code points. */
-				return -1;
-		} else {
-			/* Not first byte of the character. */
+	flattened_size = sizeof(libmds_message_t) + (this->buffer_off + mapped) * sizeof(char) + n * sizeof(void*);
+	flattened_size += this->header_index_size * sizeof(libmds_header_slot_t);
+	if (!(rc = allocate_flat(pool, flattened_size, &reused)))
+		return NULL;
 
-			if ((c & 0xC0) != 0x80)
-				/* Beginning of new character before a
-				   multibyte character has ended. */
-				return -1;
+	*rc = *this;
+	rc->flattened   = reused ? reused : flattened_size;
+	rc->buffer_off  = this->buffer_off + mapped;
+	rc->buffer_size = rc->buffer_off;
+	rc->buffer_shared = 0;
+	/* The copy's buffer is not reference counted, so
+	   duplicates of it must be copies as well. */
+	rc->zero_copy = 0;
 
-			character = (character << 6) | (c & 0x7F);
+	rc->buffer  = ((char*)rc) + sizeof(libmds_message_t) / sizeof(char);
+	rc->headers = rc->header_count ? (char**)(void*)(rc->buffer + rc->buffer_off)          : NULL;
+	rc->payload = rc->payload_size ? (rc->buffer + (size_t)(this->payload - this->buffer)) : NULL;
+	for (i = 0; i < n; i++)
+		rc->headers[i] = rc->buffer + (size_t)(this->headers[i] - this->buffer);
 
-			if (++read_bytes < bytes)
-				/* Not at last byte yet. */
-				continue;
+	memcpy(rc->buffer, this->buffer, this->buffer_off * sizeof(char));
 
-			/* Check that the character is not unnecessarily long. */
-			while (character)
-				character >>= 1, bits++;
-			bits = ((bits == 0) && (bytes == 2) && allow_modified_nul) ? 8 : bits;
-			if ((bits < BYTES_TO_MIN_BITS[bytes]) || (BYTES_TO_MAX_BITS[bytes] < bits))
-				return -1;
+	/* The duplicate does not own the file descriptor queue. */
+	if (this->payload_mapped) {
+		rc->payload = rc->buffer + this->buffer_off;
+		memcpy(rc->payload, this->payload, this->payload_size * sizeof(char));
+		rc->payload_mapped = 0;
+	}
 
-			read_bytes = bytes = bits = 0;
-		}
+	/* The header index is copied to after the header list. */
+	rc->header_index = NULL;
+	rc->header_index_alloc = this->header_index_size;
+	if (this->header_index_size) {
+		rc->header_index = (libmds_header_slot_t *)(void *)(rc->headers + n);
+		memcpy(rc->header_index, this->header_index, this->header_index_size * sizeof(libmds_header_slot_t));
 	}
 
-	/* Make sure we did not stop at the middle of a multibyte character. */
-	return read_bytes == 0 ? 0 : -1;
+	rc->fds = NULL;
+	rc->fd_count = 0;
+	rc->ring = NULL;
+	rc->binary = 0;
+	return rc;
 }
 
 
+/**
+ * Deallocate a message returned by `libmds_message_duplicate`
+ * 
+ * @param  this  The message
+ */
+void
+libmds_message_release(libmds_message_t *restrict this)
+{
+	if (this->buffer_shared)
+		release_buffer(this->buffer);
+	free(this);
+}
+
 
 /**
  * Extend the header list's allocation
@@ -233,39 +367,75 @@ extend_headers(libmds_message_t *restrict this, size_t extent)
 static int __attribute__((nonnull, warn_unused_result))
 extend_buffer(libmds_message_t *restrict this, int shift)
 {
-	size_t i, n = this->header_count;
-	char *new_buf = realloc(this->buffer, (this->buffer_size << shift) * sizeof(char));
-	if (!new_buf)
-		return -1;
-	if (new_buf != this->buffer)
+	size_t i, n = this->header_count, size = this->buffer_size << shift;
+	char *new_buf, *old_buf = NULL;
+
+	if (buffer_is_shared(this->buffer)) {
+		/* Duplicates refer to the buffer, so it must not be moved. */
+		if (!(new_buf = alloc_buffer(size)))
+			return -1;
+		memcpy(new_buf, this->buffer, this->buffer_ptr * sizeof(char));
+		old_buf = this->buffer;
+	} else {
+		new_buf = realloc(this->buffer - BUFFER_PREFIX / sizeof(char), BUFFER_PREFIX + size * sizeof(char));
+		if (!new_buf)
+			return -1;
+		new_buf += BUFFER_PREFIX / sizeof(char);
+	}
+
+	if (new_buf != this->buffer) {
 		for (i = 0; i < n; i++)
 			this->headers[i] = new_buf + (size_t)(this->headers[i] - this->buffer);
+		if (this->payload && !this->payload_mapped)
+			this->payload = new_buf + (size_t)(this->payload - this->buffer);
+	}
 	this->buffer = new_buf;
-	this->buffer_size <<= shift;
+	this->buffer_size = size;
+	release_buffer(old_buf);
 	return 0;
 }
 
 /**
  * Reset the header list and the payload
  * 
- * @param  this  The message
+ * @param   this  The message
+ * @return        Zero on success, -1 on error
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
  */
-static void __attribute__((nonnull))
+static int __attribute__((nonnull, warn_unused_result))
 reset_message(libmds_message_t *restrict this)
 {
 	size_t overrun = this->buffer_ptr - this->buffer_off;
-
-	if (overrun)
+	char *new_buf;
+
+	if (buffer_is_shared(this->buffer)) {
+		/* Duplicates refer to the previous message in the buffer,
+		   so the beginning of the next message is moved to a new
+		   buffer, and the old buffer is left to the duplicates. */
+		if (!(new_buf = alloc_buffer(this->buffer_size)))
+			return -1;
+		memcpy(new_buf, this->buffer + this->buffer_off, overrun * sizeof(char));
+		release_buffer(this->buffer);
+		this->buffer = new_buf;
+	} else if (overrun) {
 		memmove(this->buffer, this->buffer + this->buffer_off, overrun * sizeof(char));
+	}
 	this->buffer_ptr -= this->buffer_off;
 	this->buffer_off = 0;
 
 	free(this->headers);
 	this->headers = NULL;
 	this->header_count = 0;
+	this->header_index_size = 0;
 
+	if (this->payload_mapped)
+		munmap(this->payload, this->payload_size);
+	this->payload_mapped = 0;
 	this->payload = NULL;
 	this->payload_size = 0;
+	return 0;
 }
 
 
@@ -273,30 +443,81 @@ reset_message(libmds_message_t *restrict this)
  * Read the headers the message and determine, and store, its payload's length
  * 
  * @param   this  The message
- * @return        Zero on success, negative on error (malformated message: unrecoverable state)
+ * @return        Zero on success, 1 if the payload is in a memfd,
+ *                negative on error (malformated message: unrecoverable state)
  */
 static int __attribute__((pure, nonnull, warn_unused_result))
 get_payload_length(libmds_message_t *restrict this)
 {
 	char *header;
 	size_t i;
+	int found = 0, memfd = 0;
 
 	for (i = 0; i < this->header_count; i++) {
 		if (strstr(this->headers[i], "Length: ") == this->headers[i]) {
-			/* Store the message length. */
 			header = this->headers[i] + static_strlen("Length: ");
-			this->payload_size = (size_t)atoll(header);
+		} else if (strstr(this->headers[i], MEMFD_LENGTH_HEADER) == this->headers[i]) {
+			header = this->headers[i] + static_strlen(MEMFD_LENGTH_HEADER);
+			memfd = 1;
+		} else {
+			continue;
+		}
 
-			/* Do not except a length that is not correctly formated. */
-			for (; *header; header++)
-				if (*header < '0' || '9' < *header)
-					return -2; /* Malformated value, enters unrecoverable state. */
+		/* Do not accept both an inline payload and a payload in a memfd. */
+		if (found++)
+			return -2;
 
-			/* Stop searching for the ‘Length’ header, we have found and parsed it. */
-			break;
+		/* Store the message length. */
+		this->payload_size = (size_t)atoll(header);
+
+		/* Do not except a length that is not correctly formated. */
+		for (; *header; header++)
+			if (*header < '0' || '9' < *header)
+				return -2; /* Malformated value, enters unrecoverable state. */
+	}
+
+	return memfd;
+}
+
+
+/**
+ * Map the memfd that was sent with the message as the payload
+ * 
+ * @param   this  The message
+ * @return        The return value follows the rules of `mds_message_read`
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for mmap(2)
+ */
+static int __attribute__((nonnull))
+map_memfd(libmds_message_t *restrict this)
+{
+	int saved_errno, fd = memfd_take(this->fds, &(this->fd_count));
+	void *map;
+
+	/* The memfd is sent with the first byte of the message, so
+	   it has been received, unless the sender did not send it. */
+	if (fd < 0)
+		return -2;
+	/* The memfd must be sealed, lest the sender truncates it under our feet. */
+	if (memfd_verify(fd, this->payload_size)) {
+		close(fd);
+		return -2;
+	}
+
+	if (this->payload_size > 0) {
+		map = mmap(NULL, this->payload_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			saved_errno = errno;
+			close(fd);
+			return errno = saved_errno, -1;
 		}
+		this->payload = map;
+		this->payload_mapped = 1;
 	}
 
+	close(fd);
 	return 0;
 }
 
@@ -313,7 +534,7 @@ validate_header(const char *header, size_t length)
 {
 	char *p = memchr(header, ':', length * sizeof(char));
 
-	if (verify_utf8(header, 0) < 0)
+	if (verify_utf8_n(header, length, 0) < 0)
 		/* Either the string is not UTF-8, or your are under an UTF-8 attack,
 		   let's just call this unrecoverable because the client will not correct. */
 		return -2;
@@ -327,27 +548,20 @@ validate_header(const char *header, size_t length)
 
 
 /**
- * Remove the header–payload delimiter from the buffer,
- * get the payload's size and allocate the payload
+ * Make sure the full payload fits the buffer,
+ * and set the payload buffer pointer
  * 
- * @param   this  The message
+ * @param   this  The message, `payload_size` must be set
  * @return        The return value follows the rules of `mds_message_read`
  * 
  * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
  *                  RLIMIT_DATA limit described in getrlimit(2).
  */
 static int __attribute__((nonnull))
-initialise_payload(libmds_message_t *restrict this)
+place_payload(libmds_message_t *restrict this)
 {
 	int shift = 0;
 
-	/* Skip over the \n (end of empty line) we found from the buffer. */
-	this->buffer_off++;
-
-	/* Get the length of the payload. */
-	if (get_payload_length(this) < 0)
-		return -2; /* Malformated value, enters unrecoverable state. */
-
 	/* Reallocate the buffer if it is too small. */
 	while (this->buffer_off + this->payload_size > this->buffer_size << shift)
 		shift++;
@@ -361,6 +575,36 @@ initialise_payload(libmds_message_t *restrict this)
 }
 
 
+/**
+ * Remove the header–payload delimiter from the buffer,
+ * get the payload's size and allocate the payload
+ * 
+ * @param   this  The message
+ * @return        The return value follows the rules of `mds_message_read`
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+static int __attribute__((nonnull))
+initialise_payload(libmds_message_t *restrict this)
+{
+	int r;
+
+	/* Skip over the \n (end of empty line) we found from the buffer. */
+	this->buffer_off++;
+
+	/* Get the length of the payload. */
+	if ((r = get_payload_length(this)) < 0)
+		return -2; /* Malformated value, enters unrecoverable state. */
+
+	/* The payload may have been sent in a memfd rather than inline. */
+	if (r)
+		return map_memfd(this);
+
+	return place_payload(this);
+}
+
+
 /**
  * Store a header
  * 
@@ -382,7 +626,7 @@ store_header(libmds_message_t *restrict this, size_t length)
 	header[length - 1] = '\0';
 
 	/* Update read offset. */
-	this->buffer += length;
+	this->buffer_off += length;
 
 	/* Make sure the the header syntax is correct so that
 	   the program does not need to care about it. */
@@ -396,19 +640,153 @@ store_header(libmds_message_t *restrict this, size_t length)
 }
 
 
+/**
+ * Translate the headers of a frame in the binary encoding,
+ * whose fixed header and header section are in the read
+ * buffer, to the text encoding, in place of the frame,
+ * and make sure the full payload fits the buffer
+ * 
+ * The headers are not validated as in the text encoding,
+ * the display server has validated them before sending them
+ * 
+ * @param   this            The message
+ * @param   header_length   The length of the header section
+ * @param   payload_length  The length of the payload
+ * @return                  The return value follows the rules of `mds_message_read`
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+static int __attribute__((nonnull, warn_unused_result))
+decode_frame(libmds_message_t *restrict this, size_t header_length, uint64_t payload_length)
+{
+	size_t name_length, value_length, text_length = 0, count = 0, length_header = 0;
+	size_t frame_length = BINARY_FRAME_HEADER_SIZE + header_length;
+	size_t received = this->buffer_ptr - this->buffer_off, tail, scratch;
+	const char *p, *end, *name, *value;
+	char *out, buf[sizeof("Length: ") + 3 * sizeof(size_t)];
+	uint64_t id, n;
+	int r, shift = 0;
+
+	if (payload_length > SIZE_MAX)
+		return -2;
+
+	/* Measure the headers in the text encoding. */
+	p = this->buffer + this->buffer_off + BINARY_FRAME_HEADER_SIZE;
+	end = p + header_length;
+	for (; (r = binary_next_header(&p, end, &name, &name_length, &value, &value_length)) > 0; count++)
+		text_length += name_length + value_length + 3;
+	if (r < 0)
+		return -2;
+	if (payload_length) {
+		length_header = (size_t)sprintf(buf, "Length: %zu", (size_t)payload_length) + 1;
+		text_length += length_header;
+		count++;
+	}
+
+	/* Copy the header section past everything that has been received, and
+	   move the rest of the data, which may include subsequent messages,
+	   once, to where it belongs after the headers in the text encoding. */
+	tail = received - frame_length;
+	scratch = this->buffer_off + (text_length > frame_length ? text_length - frame_length : 0) + received;
+	while (scratch + header_length > this->buffer_size << shift)
+		shift++;
+	if (shift ? (extend_buffer(this, shift) < 0) : 0)
+		return -1;
+	if (count && extend_headers(this, count) < 0)
+		return -1;
+	out = this->buffer + this->buffer_off;
+	memcpy(this->buffer + scratch, out + BINARY_FRAME_HEADER_SIZE, header_length * sizeof(char));
+	memmove(out + text_length, out + frame_length, tail * sizeof(char));
+
+	/* Write the headers where the frame began, the header
+	   section has been validated, so it is not done again. */
+	p = this->buffer + scratch;
+	end = p + header_length;
+	while (p != end) {
+		binary_get_varint(&p, end, &id);
+		if (id) {
+			name = binary_header_names[id - 1].name;
+			name_length = binary_header_names[id - 1].length;
+		} else {
+			binary_get_varint(&p, end, &n);
+			name = p, name_length = (size_t)n, p += n;
+		}
+		binary_get_varint(&p, end, &n);
+		value = p, value_length = (size_t)n, p += n;
+		this->headers[this->header_count++] = out;
+		memcpy(out, name, name_length * sizeof(char)), out += name_length;
+		*out++ = ':', *out++ = ' ';
+		memcpy(out, value, value_length * sizeof(char)), out += value_length;
+		*out++ = '\0';
+	}
+	if (length_header) {
+		this->headers[this->header_count++] = out;
+		memcpy(out, buf, length_header * sizeof(char));
+	}
+	this->buffer_off += text_length;
+	this->buffer_ptr = this->buffer_off + tail;
+
+	this->payload_size = (size_t)payload_length;
+	return place_payload(this);
+}
+
+
+/**
+ * Build the header index of a message
+ * 
+ * @param   this  The message, all its headers must have been read
+ * @return        Zero on success, -1 on error
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+static int __attribute__((nonnull, warn_unused_result))
+build_header_index(libmds_message_t *restrict this)
+{
+	libmds_header_slot_t *new, *slot;
+	size_t i, j, size = 8, mask;
+	uint32_t hash;
+
+	while (size < this->header_count << 1)
+		size <<= 1;
+	if (size > this->header_index_alloc) {
+		new = realloc(this->header_index, size * sizeof(libmds_header_slot_t));
+		if (!new)
+			return -1;
+		this->header_index = new;
+		this->header_index_alloc = size;
+	}
+	memset(this->header_index, 0, size * sizeof(libmds_header_slot_t));
+	this->header_index_size = size;
+
+	mask = size - 1;
+	for (i = 0; i < this->header_count; i++) {
+		hash = libmds_header_hash(this->headers[i]);
+		for (j = hash & mask; (slot = this->header_index + j)->header; j = (j + 1) & mask);
+		slot->hash = hash;
+		slot->header = (uint32_t)(i + 1);
+		slot->value_offset = (uint32_t)(strchr(this->headers[i], ':') - this->headers[i]) + 2;
+	}
+
+	return 0;
+}
+
+
 /**
  * Continue reading from the socket into the buffer
  * 
- * @param   this  The message
- * @param   fd    The file descriptor of the socket
- * @return        The return value follows the rules of `mds_message_read`
+ * @param   this   The message
+ * @param   fd     The file descriptor of the socket
+ * @param   flags  Additional flags for recv(3)
+ * @return         The return value follows the rules of `mds_message_read`
  * 
  * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
  *                  RLIMIT_DATA limit described in getrlimit(2).
  * @throws          Any error specified for recv(3)
  */
 static int __attribute__((nonnull))
-continue_read(libmds_message_t *restrict this, int fd)
+continue_read(libmds_message_t *restrict this, int fd, int flags)
 {
 	size_t n;
 	ssize_t got;
@@ -426,11 +804,21 @@ continue_read(libmds_message_t *restrict this, int fd)
 		n = this->buffer_size - this->buffer_ptr;
 	}
 
-	/* Then read from the socket. */
+	/* In the binary encoding, leave room for the headers to be
+	   translated in place, without growing the buffer to fit
+	   the frames of subsequent messages that were read along. */
+	if (this->binary)
+		n = (n + 1) / 2;
+
+	/* Then read from the socket, or the ring if one has been set up. */
 	errno = 0;
-	got = recv(fd, this->buffer + this->buffer_ptr, n, 0);
+	if (this->ring)
+		got = ring_recv(this->ring, this->buffer + this->buffer_ptr, n, fd, flags & MSG_DONTWAIT);
+	else
+		got = memfd_recv(fd, this->buffer + this->buffer_ptr, n, MSG_CMSG_CLOEXEC | flags,
+		                 &(this->fds), &(this->fd_count));
 	this->buffer_ptr += (size_t)(got < 0 ? 0 : got);
-	if (errno)
+	if (got < 0)
 		return -1;
 	if (!got)
 		return errno = ECONNRESET, -1;
@@ -442,24 +830,16 @@ continue_read(libmds_message_t *restrict this, int fd)
 /**
  * Read the next message from a file descriptor
  * 
- * @param   this  Memory slot in which to store the new message
- * @param   fd    The file descriptor
- * @return        Zero on success, -1 on error or interruption, `errno`
- *                will be set accordingly. Destroy the message on error,
- *                be aware that the reading could have been
- *                interrupted by a signal rather than canonical error.
- *                If -2 is returned `errno` will not have been set,
- *                -2 indicates that the message is malformated,
- *                which is a state that cannot be recovered from.
- * 
- * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
- *                  RLIMIT_DATA limit described in getrlimit(2).
- * @throws          Any error specified for recv(3)
+ * @param   this   Memory slot in which to store the new message
+ * @param   fd     The file descriptor
+ * @param   flags  Additional flags for recv(3)
+ * @return         The return value follows the rules of `libmds_message_read`
  */
-int
-libmds_message_read(libmds_message_t *restrict this, int fd)
+static int __attribute__((nonnull, warn_unused_result))
+message_read(libmds_message_t *restrict this, int fd, int flags)
 {
 	size_t header_commit_buffer = 0;
+	uint64_t payload_length;
 	int r;
 	char *p;
 	size_t length;
@@ -467,16 +847,26 @@ libmds_message_read(libmds_message_t *restrict this, int fd)
 	/* If we are at stage 2, we are done and it is time to start over.
 	   This is important because the function could have been interrupted. */
 	if (this->stage == 2) {
-		reset_message(this);
+		try (reset_message(this));
 		this->stage = 0;
 	}
 
 	/* Read from file descriptor until we have a full message. */
 	for (;;) {
 		/* Stage 0: headers. */
+		/* In the binary encoding, the headers are translated once the header section has been received. */
+		if (this->binary && !this->stage &&
+		    binary_frame_header(this->buffer + this->buffer_off, this->buffer_ptr - this->buffer_off,
+		                        &length, &payload_length)) {
+			try (decode_frame(this, length, payload_length));
+			if (this->index_headers)
+				try (build_header_index(this));
+			this->stage = 1;
+		}
 		/* Read all headers that we have stored into the read buffer. */
-		while (!this->stage && ((p = memchr(this->buffer + this->buffer_off, '\n',
-		                                    (this->buffer_ptr - this->buffer_off) * sizeof(char))))) {
+		while (!this->binary && !this->stage &&
+		       ((p = memchr(this->buffer + this->buffer_off, '\n',
+		                    (this->buffer_ptr - this->buffer_off) * sizeof(char))))) {
 			if ((length = (size_t)(p - (this->buffer + this->buffer_off)))) {
 				/* We have found a header. */
 
@@ -495,6 +885,8 @@ libmds_message_read(libmds_message_t *restrict this, int fd)
 				/* Make sure the full payload fits the buffer, and set
 				 * the payload buffer pointer. */
 				try (initialise_payload(this));
+				if (this->index_headers)
+					try (build_header_index(this));
 
 				/* Mark end of stage, next stage is getting the payload. */
 				this->stage = 1;
@@ -503,6 +895,11 @@ libmds_message_read(libmds_message_t *restrict this, int fd)
 
 
 		/* Stage 1: payload. */
+		if (this->stage == 1 && this->payload_mapped) {
+			/* The payload is not in the buffer, it was received in a memfd. */
+			this->stage = 2;
+			return 0;
+		}
 		if (this->stage == 1 && this->buffer_ptr - this->buffer_off >= this->payload_size) {
 			/* If we have filled the payload (or there was no payload),
 			   mark the end of this stage, i.e. that the message is
@@ -519,48 +916,306 @@ libmds_message_read(libmds_message_t *restrict this, int fd)
 		/* If stage 1 was not completed. */
 
 		/* Continue reading from the socket into the buffer. */
-		try (continue_read(this, fd));
+		try (continue_read(this, fd, flags));
 	}
 }
 
 
-
 /**
- * Initialise a message spool
- * 
- * @param   this  The message spool
- * @return        Zero on success, -1 on error, `errno` will be set accordingly
+ * Read the next message from a file descriptor
  * 
- * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ * @param   this  Memory slot in which to store the new message
+ * @param   fd    The file descriptor
+ * @return        Zero on success, -1 on error or interruption, `errno`
+ *                will be set accordingly. Destroy the message on error,
+ *                be aware that the reading could have been
+ *                interrupted by a signal rather than canonical error.
+ *                If -2 is returned `errno` will not have been set,
+ *                -2 indicates that the message is malformated,
+ *                which is a state that cannot be recovered from.
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for recv(3)
+ */
+int
+libmds_message_read(libmds_message_t *restrict this, int fd)
+{
+	return message_read(this, fd, 0);
+}
+
+
+/**
+ * Read the next message from a file descriptor without blocking
+ * 
+ * If the message is not complete, -1 is returned with `errno` set
+ * to EAGAIN, and the read is resumed when the function is called
+ * again, preferably when the file descriptor is readable. Messages
+ * that have been received in full are returned without reading,
+ * so with edge-triggered polling, the function shall be called
+ * until it fails with EAGAIN.
+ * 
+ * @param   this  Memory slot in which to store the new message
+ * @param   fd    The file descriptor, it does not need to be in nonblocking mode
+ * @return        The return value follows the rules of `libmds_message_read`
+ * 
+ * @throws  EAGAIN  If the message is not complete and no more data is available
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for recv(3)
+ */
+int
+libmds_message_read_nonblocking(libmds_message_t *restrict this, int fd)
+{
+	return message_read(this, fd, MSG_DONTWAIT);
+}
+
+
+
+/**
+ * Start reading from a shared-memory ring, requested with
+ * `libmds_connection_use_ring_unlocked`, if the message that
+ * has just been read is the display server's acceptance of it
+ * 
+ * @param   this  The message slot the reply was read into
+ * @param   ring  The `ring` of the connection
+ * @return        Zero on success, -1 on error, `errno` will be set
+ *                accordingly on error
+ * 
+ * @throws  ECONNREFUSED  If the display server did not accept the ring,
+ *                        it will close the connection
+ * @throws  EBADMSG       If the message is not a reply to such a request
+ */
+int
+libmds_message_use_ring(libmds_message_t *restrict this, struct ring *ring)
+{
+	const char *value = libmds_message_get_header(this, "Ring");
+	if (!value)
+		return errno = EBADMSG, -1;
+	if (strcmp(value, "yes"))
+		return errno = ECONNREFUSED, -1;
+	this->ring = ring;
+	return 0;
+}
+
+
+/**
+ * Start reading in the binary encoding, requested with
+ * `libmds_connection_use_binary_unlocked`, if the message that
+ * has just been read is the display server's acceptance of it
+ * 
+ * @param   this  The message slot the reply was read into
+ * @return        Zero on success, -1 on error, `errno` will be set
+ *                accordingly on error
+ * 
+ * @throws  ECONNREFUSED  If the display server did not accept the binary
+ *                        encoding, it will close the connection
+ * @throws  EBADMSG       If the message is not a reply to such a request
+ */
+int
+libmds_message_use_binary(libmds_message_t *restrict this)
+{
+	const char *value = libmds_message_get_header(this, "Binary");
+	if (!value)
+		return errno = EBADMSG, -1;
+	if (strcmp(value, "yes"))
+		return errno = ECONNREFUSED, -1;
+	this->binary = 1;
+	return 0;
+}
+
+
+/**
+ * Wait on a futex word
+ * 
+ * @param   word      The futex word
+ * @param   value     The value `word` must have for the thread to sleep
+ * @param   deadline  The CLOCK_REALTIME time to stop waiting, `NULL` to wait indefinitely
+ * @return            Zero on success, -1 on error, `errno` will be set accordingly,
+ *                    EAGAIN means that `word` did not have the value `value`
+ */
+static int __attribute__((nonnull(1)))
+futex_wait(int *word, int value, const struct timespec *restrict deadline)
+{
+	if (!deadline)
+		return (int)syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+	return (int)syscall(SYS_futex, word, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+	                    value, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+
+/**
+ * Wake threads waiting on a futex word
+ * 
+ * @param  word   The futex word
+ * @param  count  The maximum number of threads to wake
+ */
+static void __attribute__((nonnull))
+futex_wake(int *word, int count)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+
+/**
+ * Get the current CLOCK_MONOTONIC time
+ * 
+ * @return  The time, in nanoseconds
+ */
+static uint64_t
+monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)(ts.tv_sec) * UINT64_C(1000000000) + (uint64_t)(ts.tv_nsec);
+}
+
+
+/**
+ * Initialise a lane in a message spool
+ * 
+ * @param   lane  The lane
+ * @return        Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+static int __attribute__((nonnull, warn_unused_result))
+lane_initialise(libmds_mspool_lane_t *restrict lane)
+{
+	size_t i;
+	lane->head = 0;
+	lane->tail = 0;
+	lane->spooled_bytes = 0;
+	lane->spool_limit_bytes = lane->min_limit_bytes = 4 << 10;
+	lane->max_limit_bytes = 256 << 10;
+	lane->spool_limit_messages = lane->min_limit_messages = 8;
+	lane->max_limit_messages = LIBMDS_MSPOOL_CAPACITY;
+	lane->latency_target = LIBMDS_MSPOOL_LATENCY_TARGET;
+	lane->policy = LIBMDS_MSPOOL_BLOCK;
+	lane->merge = NULL;
+	lane->merge_data = NULL;
+	lane->dropped = 0;
+	lane->merged = 0;
+	lane->polled_event = 0;
+	lane->spoolers_waiting = 0;
+	lane->window_messages = 0;
+	lane->window_bytes = 0;
+	lane->window_start = monotonic_ns();
+	lane->slots = malloc(LIBMDS_MSPOOL_CAPACITY * sizeof(libmds_mspool_slot_t));
+	if (!lane->slots)
+		return -1;
+	for (i = 0; i < LIBMDS_MSPOOL_CAPACITY; i++)
+		lane->slots[i].sequence = i;
+	return 0;
+}
+
+
+/**
+ * Initialise a message spool
+ * 
+ * @param   this  The message spool
+ * @return        Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
  *                  RLIMIT_DATA limit described in getrlimit(2).
  */
 int
 libmds_mspool_initialise(libmds_mspool_t *restrict this)
 {
-	int stage = 0, saved_errno;
-	this->size = 1;
-	this->head = 0;
-	this->tail = 0;
-	this->spooled_bytes = 0;
-	this->spool_limit_bytes = 4 << 10;
-	this->spool_limit_messages = 8;
-	this->please_post = 0;
-	this->messages = malloc(sizeof(libmds_message_t*));
-	if (!this->messages)
+	return libmds_mspool_initialise_lanes(this, 1);
+}
+
+
+/**
+ * Initialise a message spool with multiple lanes
+ * 
+ * @param   this   The message spool
+ * @param   lanes  The number of lanes, at least 1
+ * @return         Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  EINVAL  If `lanes` is zero
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+int
+libmds_mspool_initialise_lanes(libmds_mspool_t *restrict this, size_t lanes)
+{
+	int saved_errno;
+	this->lanes = NULL;
+	this->lane_count = 0;
+	this->classify = NULL;
+	this->classify_data = NULL;
+	this->spooled_event = 0;
+	this->pollers_waiting = 0;
+	if (!lanes)
+		return errno = EINVAL, -1;
+	this->lanes = malloc(lanes * sizeof(libmds_mspool_lane_t));
+	if (!this->lanes)
 		return -1;
-	if (sem_init(&(this->lock),           0, 1) < 0) goto fail; else stage++;
-	if (sem_init(&(this->semaphore),      0, 0) < 0) goto fail; else stage++;
-	if (sem_init(&(this->wait_semaphore), 0, 0) < 0) goto fail;
+	for (; this->lane_count < lanes; this->lane_count++)
+		if (lane_initialise(this->lanes + this->lane_count))
+			goto fail;
 	return 0;
- fail:
+fail:
 	saved_errno = errno;
-	if (stage >= 1) sem_destroy(&(this->lock));
-	if (stage >= 2) sem_destroy(&(this->semaphore));
-	free(this->messages), this->messages = NULL;
+	libmds_mspool_destroy(this);
 	return errno = saved_errno, -1;
 }
 
 
+/**
+ * Take the oldest message from a lane without blocking
+ * 
+ * @param   lane  The lane
+ * @return        The message, `NULL` if the lane is empty
+ */
+static libmds_message_t * __attribute__((nonnull))
+mspool_pop(libmds_mspool_lane_t *restrict lane)
+{
+	libmds_mspool_slot_t *slot;
+	libmds_message_t *msg;
+	size_t pos, seq;
+
+	pos = __atomic_load_n(&(lane->tail), __ATOMIC_RELAXED);
+	for (;;) {
+		slot = lane->slots + (pos & (LIBMDS_MSPOOL_CAPACITY - 1));
+		seq = __atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE);
+		if ((ssize_t)(seq - (pos + 1)) < 0)
+			return NULL;
+		if (seq != pos + 1)
+			pos = __atomic_load_n(&(lane->tail), __ATOMIC_RELAXED);
+		else if (__atomic_compare_exchange_n(&(lane->tail), &pos, pos + 1, 1,
+		                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	msg = slot->message;
+	__atomic_store_n(&(slot->sequence), pos + LIBMDS_MSPOOL_CAPACITY, __ATOMIC_RELEASE);
+	return msg;
+}
+
+
+/**
+ * Take the oldest message from the first
+ * non-empty lane in a spool without blocking
+ * 
+ * @param   this  The message spool
+ * @param   lane  Output parameter for the lane the message was taken from
+ * @return        The message, `NULL` if the spool is empty
+ */
+static libmds_message_t * __attribute__((nonnull))
+mspool_pop_any(libmds_mspool_t *restrict this, libmds_mspool_lane_t **restrict lane)
+{
+	libmds_message_t *msg;
+	size_t i;
+	for (i = 0; i < this->lane_count; i++)
+		if ((msg = mspool_pop(*lane = this->lanes + i)))
+			return msg;
+	return NULL;
+}
+
+
 /**
  * Destroy a message spool, deallocate its resources
  * 
@@ -569,15 +1224,144 @@ libmds_mspool_initialise(libmds_mspool_t *restrict this)
 void
 libmds_mspool_destroy(libmds_mspool_t *restrict this)
 {
-	if (!this->messages)
+	libmds_message_t *msg;
+	size_t i;
+	if (!this->lanes)
 		return;
-	while (this->tail < this->head)
-		free(this->messages[this->tail++]);
-	sem_destroy(&(this->lock));
-	sem_destroy(&(this->semaphore));
-	sem_destroy(&(this->wait_semaphore));
-	free(this->messages);
-	this->messages = NULL;
+	for (i = 0; i < this->lane_count; i++) {
+		while ((msg = mspool_pop(this->lanes + i)))
+			libmds_message_release(msg);
+		free(this->lanes[i].slots);
+	}
+	free(this->lanes);
+	this->lanes = NULL;
+	this->lane_count = 0;
+}
+
+
+/**
+ * Check whether a lane in a message spool is full
+ * 
+ * @param   lane  The lane
+ * @return        Whether the lane is full
+ */
+static int __attribute__((nonnull))
+mspool_is_full(libmds_mspool_lane_t *restrict lane)
+{
+	size_t count = __atomic_load_n(&(lane->head), __ATOMIC_SEQ_CST);
+	count -= __atomic_load_n(&(lane->tail), __ATOMIC_SEQ_CST);
+	return (__atomic_load_n(&(lane->spooled_bytes), __ATOMIC_SEQ_CST) >=
+	        __atomic_load_n(&(lane->spool_limit_bytes), __ATOMIC_RELAXED)) ||
+	       (count >= __atomic_load_n(&(lane->spool_limit_messages), __ATOMIC_RELAXED)) ||
+	       (count >= LIBMDS_MSPOOL_CAPACITY);
+}
+
+
+/**
+ * Check whether all lanes in a message spool are empty
+ * 
+ * @param   this  The message spool
+ * @return        Whether the spool is empty
+ */
+static int __attribute__((nonnull))
+mspool_is_empty(libmds_mspool_t *restrict this)
+{
+	size_t i;
+	for (i = 0; i < this->lane_count; i++)
+		if (__atomic_load_n(&(this->lanes[i].head), __ATOMIC_SEQ_CST) !=
+		    __atomic_load_n(&(this->lanes[i].tail), __ATOMIC_SEQ_CST))
+			return 0;
+	return 1;
+}
+
+
+/**
+ * Add a message to a lane without blocking
+ * 
+ * The limits are checked in the same atomic operations that
+ * reserve the bytes and the slot, so that concurrent spoolers
+ * cannot all see room for one more message and exceed them
+ * 
+ * @param   lane     The lane
+ * @param   message  The message
+ * @param   limited  Whether to respect the lane's limits, otherwise
+ *                   only the capacity of the ring is respected
+ * @return           Zero on success, -1 if the lane is full
+ */
+static int __attribute__((nonnull))
+mspool_push(libmds_mspool_lane_t *restrict lane, libmds_message_t *restrict message, int limited)
+{
+	libmds_mspool_slot_t *slot;
+	size_t pos, seq, bytes;
+
+	/* The size is charged before the message is made visible so
+	 * that a poller never sees `spooled_bytes` drop below zero. */
+	bytes = __atomic_load_n(&(lane->spooled_bytes), __ATOMIC_SEQ_CST);
+	do {
+		if (limited && (bytes >= __atomic_load_n(&(lane->spool_limit_bytes), __ATOMIC_RELAXED)))
+			return -1;
+	} while (!__atomic_compare_exchange_n(&(lane->spooled_bytes), &bytes, bytes + message->flattened, 1,
+	                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+	pos = __atomic_load_n(&(lane->head), __ATOMIC_RELAXED);
+	for (;;) {
+		slot = lane->slots + (pos & (LIBMDS_MSPOOL_CAPACITY - 1));
+		seq = __atomic_load_n(&(slot->sequence), __ATOMIC_ACQUIRE);
+		if (((ssize_t)(seq - pos) < 0) ||
+		    (limited && (pos - __atomic_load_n(&(lane->tail), __ATOMIC_SEQ_CST) >=
+		                 __atomic_load_n(&(lane->spool_limit_messages), __ATOMIC_RELAXED)))) {
+			__atomic_sub_fetch(&(lane->spooled_bytes), message->flattened, __ATOMIC_SEQ_CST);
+			return -1;
+		}
+		if (seq != pos)
+			pos = __atomic_load_n(&(lane->head), __ATOMIC_RELAXED);
+		else if (__atomic_compare_exchange_n(&(lane->head), &pos, pos + 1, 1,
+		                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	slot->message = message;
+	__atomic_store_n(&(slot->sequence), pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/**
+ * Make room in a full lane, that does not block,
+ * according to the lane's policy
+ * 
+ * @param   lane     The lane
+ * @param   message  The message being spooled, will be updated if
+ *                   merged, and set to `NULL` if nothing shall be spooled
+ * @return           1 if the spooler shall try again, zero if `*message`
+ *                   shall be spooled regardless of the lane's limits
+ */
+static int __attribute__((nonnull))
+make_room(libmds_mspool_lane_t *restrict lane, libmds_message_t *restrict *message)
+{
+	libmds_message_t *old;
+
+	if (lane->policy == LIBMDS_MSPOOL_DROP_NEWEST) {
+		__atomic_add_fetch(&(lane->dropped), 1, __ATOMIC_RELAXED);
+		libmds_message_release(*message);
+		*message = NULL;
+		return 0;
+	}
+
+	/* The lane can be empty but full if its limits are zero. */
+	if (!(old = mspool_pop(lane)))
+		return 0;
+	__atomic_sub_fetch(&(lane->spooled_bytes), old->flattened, __ATOMIC_SEQ_CST);
+
+	if ((lane->policy == LIBMDS_MSPOOL_MERGE) && lane->merge) {
+		__atomic_add_fetch(&(lane->merged), 1, __ATOMIC_RELAXED);
+		*message = lane->merge(old, *message, lane->merge_data);
+		return !!*message;
+	}
+
+	__atomic_add_fetch(&(lane->dropped), 1, __ATOMIC_RELAXED);
+	libmds_message_release(old);
+	return 1;
 }
 
 
@@ -588,104 +1372,143 @@ libmds_mspool_destroy(libmds_mspool_t *restrict this)
  * @param   message  The message to spool, must be flat (created with `libmds_message_duplicate`)
  * @return           Zero on success, -1 on error, `errno` will be set accordingly
  * 
- * @throws  EINTR   If interrupted
- * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
- *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws  EINTR  If interrupted
  */
 int
 libmds_mspool_spool(libmds_mspool_t *restrict this, libmds_message_t *restrict message)
 {
-	libmds_message_t **new;
-	int saved_errno;
-
-start_over:
-	/* Lock. */
-	if (sem_wait(&(this->lock)) < 0)
-		return -1;
+	libmds_mspool_lane_t *lane = this->lanes;
+	int event, r, saved_errno;
+	size_t i;
 
-	/* Block if spool is full. */
-	if ((this->spooled_bytes     >= this->spool_limit_bytes) ||
-	    (this->head - this->tail >= this->spool_limit_messages)) {
-		this->please_post++;
-		if (sem_post(&this->lock) < 0 || sem_wait(&this->wait_semaphore) < 0)
-			return this->please_post--, -1;
-		goto start_over;
+	if (this->classify) {
+		i = this->classify(message, this->classify_data);
+		lane += i < this->lane_count ? i : this->lane_count - 1;
 	}
 
-	/* Rebase if the tail has come too far. */
-	if (this->tail << 1 > this->size) {
-		memmove(this->messages, this->messages + this->tail,
-		        (this->head - this->tail) * sizeof(sizeof(libmds_message_t *)));
-		this->head -= this->tail, this->tail = 0;
-	}
+	for (;;) {
+		/* Spool unless the lane is full. */
+		if (!mspool_push(lane, message, 1))
+			break;
 
-	/* Grow the spool if necessary. */
-	if (this->size == this->head) {
-		new = realloc(this->messages, (this->size << 1) * sizeof(libmds_message_t *));
-		if (!new)
+		/* Lanes that do not block discard or merge messages instead. */
+		if (lane->policy != LIBMDS_MSPOOL_BLOCK) {
+			if (make_room(lane, &message))
+				continue;
+			if (!message)
+				return 0;
+			if (!mspool_push(lane, message, 0))
+				break;
+			continue;
+		}
+
+		/* Block until a message is polled. Pollers only wake us
+		 * if they see us in `spoolers_waiting`, so announce before
+		 * checking one last time. */
+		__atomic_add_fetch(&(lane->spoolers_waiting), 1, __ATOMIC_SEQ_CST);
+		event = __atomic_load_n(&(lane->polled_event), __ATOMIC_SEQ_CST);
+		r = mspool_is_full(lane) ? futex_wait(&(lane->polled_event), event, NULL) : 0;
+		__atomic_sub_fetch(&(lane->spoolers_waiting), 1, __ATOMIC_SEQ_CST);
+		if ((r < 0) && (errno != EAGAIN))
 			goto fail;
-		this->messages = new;
-		this->size <<= 1;
 	}
 
-	/* Spool. */
-	this->spooled_bytes += message->flattened;
-	this->messages[this->head++] = message;
-
 	/* Signal. */
-	if (sem_post(&(this->semaphore)) < 0)
-		goto fail;
+	__atomic_add_fetch(&(this->spooled_event), 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(this->pollers_waiting), __ATOMIC_SEQ_CST))
+		futex_wake(&(this->spooled_event), INT_MAX);
 
-	/* Unlock. */
-	if (sem_post(&(this->lock)) < 0)
-		return -1;
+	/* Pollers only wake one spooler per message, pass
+	 * it on if there is still room for another one. */
+	if (__atomic_load_n(&(lane->spoolers_waiting), __ATOMIC_SEQ_CST) && !mspool_is_full(lane))
+		futex_wake(&(lane->polled_event), 1);
 
 	return 0;
 fail:
+	/* We may have consumed the wakeup of another spooler. */
 	saved_errno = errno;
-	sem_post(&(this->lock));
+	if (__atomic_load_n(&(lane->spoolers_waiting), __ATOMIC_SEQ_CST))
+		futex_wake(&(lane->polled_event), 1);
 	return errno = saved_errno, -1;
 }
 
 
+/**
+ * Account for a polled message, and adapt the limits
+ * of the lane to how much the consumers poll within
+ * the lane's target latency once per measurement window
+ * 
+ * @param  lane  The lane the message was polled from
+ * @param  size  The size of the message
+ */
+static void __attribute__((nonnull))
+lane_adapt(libmds_mspool_lane_t *restrict lane, size_t size)
+{
+	uint64_t now, start, elapsed, target, messages, bytes;
+
+	if (lane->latency_target <= 0)
+		return;
+
+	__atomic_add_fetch(&(lane->window_messages), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(lane->window_bytes), size, __ATOMIC_RELAXED);
+
+	/* Only one poller closes the window. */
+	now = monotonic_ns();
+	start = __atomic_load_n(&(lane->window_start), __ATOMIC_RELAXED);
+	if ((elapsed = now - start) < (uint64_t)LIBMDS_MSPOOL_ADAPT_WINDOW)
+		return;
+	if (!__atomic_compare_exchange_n(&(lane->window_start), &start, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+	messages = __atomic_exchange_n(&(lane->window_messages), 0, __ATOMIC_RELAXED);
+	bytes    = __atomic_exchange_n(&(lane->window_bytes),    0, __ATOMIC_RELAXED);
+
+	target = (uint64_t)(lane->latency_target);
+	messages = messages * target / elapsed;
+	bytes    = bytes    * target / elapsed;
+	if (messages < lane->min_limit_messages)  messages = lane->min_limit_messages;
+	if (messages > lane->max_limit_messages)  messages = lane->max_limit_messages;
+	if (bytes    < lane->min_limit_bytes)     bytes    = lane->min_limit_bytes;
+	if (bytes    > lane->max_limit_bytes)     bytes    = lane->max_limit_bytes;
+	__atomic_store_n(&(lane->spool_limit_messages), (size_t)messages, __ATOMIC_RELAXED);
+	__atomic_store_n(&(lane->spool_limit_bytes),    (size_t)bytes,    __ATOMIC_RELAXED);
+}
+
+
 /**
  * Poll a message from a spool
  * 
- * @param   this  The message spool, must not be empty
- * @return        A spooled message, `NULL`on error, `errno` will be set accordingly
+ * @param   this      The message spool
+ * @param   block     Whether to wait if the spool is empty
+ * @param   deadline  The CLOCK_REALTIME time to stop waiting, `NULL` to wait indefinitely
+ * @return            A spooled message, `NULL`on error, `errno` will be set accordingly
  */
-static inline libmds_message_t *
-mspool_poll(libmds_mspool_t *restrict this)
+static libmds_message_t * __attribute__((nonnull(1)))
+mspool_poll(libmds_mspool_t *restrict this, int block, const struct timespec *restrict deadline)
 {
+	libmds_mspool_lane_t *lane;
 	libmds_message_t *msg;
+	int event, r;
 
-	/* Lock. */
-	if (sem_wait(&(this->lock)) < 0)
-		return sem_post(&(this->semaphore)), NULL;
-
-	/* Fetch message. */
-	assert(this->tail < this->head);
-	msg = this->messages[this->tail++];
-	this->spooled_bytes -= msg->flattened;
-
-	/* Unblock spooler, takes effect when this->lock is unlocked. */
-	if (this->please_post) {
-		if (sem_post(&(this->wait_semaphore)) < 0)
-			perror("libmsdclient");
-		else
-			this->please_post--;
+	/* Wait until there is a message available. */
+	while (!(msg = mspool_pop_any(this, &lane))) {
+		if (!block)
+			return errno = EAGAIN, NULL;
+		__atomic_add_fetch(&(this->pollers_waiting), 1, __ATOMIC_SEQ_CST);
+		event = __atomic_load_n(&(this->spooled_event), __ATOMIC_SEQ_CST);
+		r = mspool_is_empty(this) ? futex_wait(&(this->spooled_event), event, deadline) : 0;
+		__atomic_sub_fetch(&(this->pollers_waiting), 1, __ATOMIC_SEQ_CST);
+		if ((r < 0) && (errno != EAGAIN))
+			return NULL;
 	}
 
-	/* Unlock. */
-	if (sem_post(&(this->lock)) < 0)
-		goto fail;
+	/* Unblock spoolers. */
+	__atomic_sub_fetch(&(lane->spooled_bytes), msg->flattened, __ATOMIC_SEQ_CST);
+	lane_adapt(lane, msg->flattened);
+	__atomic_add_fetch(&(lane->polled_event), 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(lane->spoolers_waiting), __ATOMIC_SEQ_CST))
+		futex_wake(&(lane->polled_event), 1);
 
 	return msg;
-fail:
-	sem_post(&(this->semaphore));
-	this->messages[--(this->tail)] = msg;
-	this->spooled_bytes += msg->flattened;
-	return NULL;
 }
 
 
@@ -700,11 +1523,7 @@ fail:
 libmds_message_t *
 libmds_mspool_poll(libmds_mspool_t *restrict this)
 {
-	/* Wait until there is a message available. */
-	if (sem_wait(&(this->semaphore)) < 0)
-		return NULL;
-
-	return mspool_poll(this);
+	return mspool_poll(this, 1, NULL);
 }
 
 
@@ -725,13 +1544,7 @@ libmds_mspool_poll(libmds_mspool_t *restrict this)
 libmds_message_t *
 libmds_mspool_poll_try(libmds_mspool_t *restrict this, const struct timespec *restrict deadline)
 {
-	/* Is a message available? */
-	if (!deadline && sem_trywait(&this->semaphore) < 0)
-		return NULL;
-	if (deadline && sem_timedwait(&this->semaphore, deadline) < 0)
-		return NULL;
-
-	return mspool_poll(this);
+	return mspool_poll(this, !!deadline, deadline);
 }
 
 
@@ -796,6 +1609,12 @@ libmds_mpool_destroy(libmds_mpool_t *restrict this)
 int
 libmds_mpool_offer(libmds_mpool_t *restrict this, libmds_message_t *restrict message)
 {
+	/* Only the allocation is pooled, not the buffer it shares. */
+	if (message->buffer_shared) {
+		release_buffer(message->buffer);
+		message->buffer_shared = 0;
+	}
+
 	/* Discard if pool is full. */
 	if (this->tip == this->size)
 		return free(message), 0;
@@ -854,3 +1673,86 @@ libmds_mpool_poll(libmds_mpool_t *restrict this)
 	return errno = 0, msg;
 }
 
+
+
+/**
+ * Look up a header in the header index of a message
+ * 
+ * @param   this  The message, must have a header index
+ * @param   name  The name of the header
+ * @param   hash  `libmds_header_hash(name)`
+ * @return        The value of the first header with the
+ *                specified name, `NULL` if there is none
+ */
+static char * __attribute__((pure, nonnull))
+index_lookup(const libmds_message_t *restrict this, const char *restrict name, uint32_t hash)
+{
+	const libmds_header_slot_t *slot;
+	size_t j, mask = this->header_index_size - 1;
+	char *header, *rc = NULL;
+
+	/* Headers are inserted in order, but a later header may have been
+	 * moved before an earlier header with the same name by probing. */
+	for (j = hash & mask; (slot = this->header_index + j)->header; j = (j + 1) & mask) {
+		if (slot->hash != hash)
+			continue;
+		header = this->headers[slot->header - 1];
+		if (strncmp(header, name, slot->value_offset - 2) || name[slot->value_offset - 2])
+			continue;
+		if (!rc || (header < rc))
+			rc = header + slot->value_offset;
+	}
+
+	return rc;
+}
+
+
+/**
+ * Get the value of a header in a message, in constant
+ * time if the message has a header index
+ * 
+ * @param   this  The message
+ * @param   name  The name of the header
+ * @return        The value of the first header with the
+ *                specified name, `NULL` if there is none
+ */
+char *
+libmds_message_get_header(const libmds_message_t *restrict this, const char *restrict name)
+{
+	size_t i, n = strlen(name);
+
+	if (this->header_index_size)
+		return index_lookup(this, name, libmds_header_hash(name));
+
+	for (i = 0; i < this->header_count; i++)
+		if (!strncmp(this->headers[i], name, n) && (this->headers[i][n] == ':'))
+			return this->headers[i] + n + 2;
+	return NULL;
+}
+
+
+/**
+ * Extract the values of the headers in a header set from a message,
+ * with one hash probe per header name in the set if the message has
+ * a header index, and one per header in the message otherwise
+ * 
+ * @param   this    The message
+ * @param   set     The header set
+ * @param   values  Output array with one element per header name in `set`,
+ *                  each element is set to the value of the first header
+ *                  with the corresponding name, or to `NULL` if not found
+ * @return          The number of header names in `set` that were found
+ */
+size_t
+libmds_message_extract(const libmds_message_t *restrict this, const libmds_header_set_t *restrict set,
+                       char **restrict values)
+{
+	size_t i, found = 0;
+
+	if (!this->header_index_size || (this->header_count < set->count))
+		return libmds_headers_extract(set, this->headers, this->header_count, values);
+
+	for (i = 0; i < set->count; i++)
+		found += !!(values[i] = index_lookup(this, set->names[i], set->hashes[i]));
+	return found;
+}
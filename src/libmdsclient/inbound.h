@@ -21,11 +21,41 @@
  * somethings have been removed, some things have been added. */
 
 
+#include "proto-util.h"
+
 #include <stddef.h>
+#include <stdint.h>
 #include <semaphore.h>
 
 
 
+struct ring;
+
+
+
+/**
+ * Slot in the header index of a message
+ */
+typedef struct libmds_header_slot
+{
+	/**
+	 * `libmds_header_hash` of the name of the header
+	 */
+	uint32_t hash;
+
+	/**
+	 * One plus the index of the header, zero if the slot is empty
+	 */
+	uint32_t header;
+
+	/**
+	 * The offset of the header's value in the header
+	 */
+	uint32_t value_offset;
+
+} libmds_header_slot_t;
+
+
 /**
  * Message passed between a server and a client or between two of either
  */
@@ -89,32 +119,208 @@ typedef struct libmds_message
 	 */
 	int stage;
 
+	/**
+	 * Whether `payload` is a read-only mapping of
+	 * a memfd the payload was received in (internal data)
+	 */
+	int payload_mapped;
+
+	/**
+	 * File descriptors that have been received but
+	 * not yet claimed by a message (internal data)
+	 */
+	int *fds;
+
+	/**
+	 * The number of elements in `fds` (internal data)
+	 */
+	size_t fd_count;
+
+	/**
+	 * If non-zero, `libmds_message_read` and
+	 * `libmds_message_read_nonblocking` builds
+	 * a hash table of the headers in `header_index`
+	 */
+	int index_headers;
+
+	/**
+	 * Hash table, with linear probing, of the headers keyed by
+	 * `libmds_header_hash` of their names (internal data)
+	 */
+	libmds_header_slot_t *header_index;
+
+	/**
+	 * The number of slots in `header_index`, a power of two,
+	 * zero if the index has not been built (internal data)
+	 */
+	size_t header_index_size;
+
+	/**
+	 * The number of slots allocated for `header_index` (internal data)
+	 */
+	size_t header_index_alloc;
+
+	/**
+	 * If non-zero, `libmds_message_duplicate` does not copy the
+	 * message, instead the duplicate refers to the read buffer,
+	 * which is reference counted, and that the message was
+	 * received into directly
+	 */
+	int zero_copy;
+
+	/**
+	 * Whether the object is a duplicate that shares `buffer`
+	 * with the message it was duplicated from (internal data)
+	 */
+	int buffer_shared;
+
+	/**
+	 * If not `NULL`, the shared-memory ring that `libmds_message_read`
+	 * and `libmds_message_read_nonblocking` read from instead of the
+	 * socket, set by `libmds_message_use_ring`; the socket is only
+	 * watched for hangup (internal data)
+	 */
+	struct ring *ring;
+
+	/**
+	 * Whether `libmds_message_read` and `libmds_message_read_nonblocking`
+	 * read messages in the binary encoding, set by `libmds_message_use_binary`;
+	 * the headers are translated to the text encoding in the read buffer,
+	 * and a ‘Length’ header is added if the message has a payload (internal data)
+	 */
+	int binary;
+
 } libmds_message_t;
 
 
 /**
- * Queue of spooled messages
+ * The number of slots in the ring of each lane
+ * in a message spool, `spool_limit_messages`
+ * is effectively capped to this value, must be
+ * a power of two
  */
-typedef struct libmds_mspool
+#ifndef LIBMDS_MSPOOL_CAPACITY
+# define LIBMDS_MSPOOL_CAPACITY  256
+#endif
+
+/**
+ * The default for `latency_target` in
+ * the lanes of a message spool, in nanoseconds
+ */
+#ifndef LIBMDS_MSPOOL_LATENCY_TARGET
+# define LIBMDS_MSPOOL_LATENCY_TARGET  10000000L
+#endif
+
+/**
+ * The number of nanoseconds over which the throughput
+ * of the consumers of a message spool lane is measured
+ * before the lane's limits are adapted
+ */
+#ifndef LIBMDS_MSPOOL_ADAPT_WINDOW
+# define LIBMDS_MSPOOL_ADAPT_WINDOW  100000000L
+#endif
+
+
+/**
+ * Slot in the ring of a message spool
+ */
+typedef struct libmds_mspool_slot
 {
 	/**
-	 * Array of messages (internal data)
+	 * The position the slot is ready for, the slot
+	 * holds a message when this is one greater than
+	 * the poll position and is free when this is
+	 * equal to the push position (internal data)
 	 */
-	libmds_message_t **messages;
+	size_t sequence;
 
 	/**
-	 * The number of elements the current
-	 * allocation of `messages` can hold (internal data)
+	 * The spooled message (internal data)
 	 */
-	size_t size;
+	libmds_message_t *message;
+
+} libmds_mspool_slot_t;
+
+
+/**
+ * What to do when a message is spooled
+ * to a lane that is full
+ */
+typedef enum libmds_mspool_policy
+{
+	/**
+	 * Wait until a message has been polled from
+	 * the lane, this is the default
+	 * 
+	 * This option is guaranteed to always have the value 0
+	 */
+	LIBMDS_MSPOOL_BLOCK = 0,
+
+	/**
+	 * Discard the message being spooled
+	 */
+	LIBMDS_MSPOOL_DROP_NEWEST = 1,
+
+	/**
+	 * Discard the oldest message in the lane
+	 */
+	LIBMDS_MSPOOL_DROP_OLDEST = 2,
+
+	/**
+	 * Merge the oldest message in the
+	 * lane with the message being spooled
+	 */
+	LIBMDS_MSPOOL_MERGE = 3
+
+} libmds_mspool_policy_t;
+
+
+/**
+ * Function that merges two messages
+ * 
+ * @param   older      The message that was taken out of the lane
+ * @param   newer      The message being spooled
+ * @param   user_data  `merge_data` of the lane
+ * @return             The message to spool in place of both messages, or `NULL`
+ *                     to spool neither; the function shall release, with
+ *                     `libmds_message_release`, the messages it does not return
+ */
+typedef libmds_message_t *libmds_mspool_merge_t(libmds_message_t *restrict older, libmds_message_t *restrict newer,
+                                                void *user_data);
+
+
+/**
+ * Function that selects the lane a message is spooled to
+ * 
+ * @param   message    The message
+ * @param   user_data  `classify_data` of the spool
+ * @return             The index of the lane, lanes with lower indices are
+ *                     polled first; values beyond the last lane select the
+ *                     last lane
+ */
+typedef size_t libmds_mspool_classifier_t(const libmds_message_t *restrict message, void *user_data);
+
+
+/**
+ * Lane in a message spool
+ * 
+ * Each lane is a bounded lock-free ring, any number of
+ * threads may spool and poll messages concurrently
+ */
+typedef struct libmds_mspool_lane
+{
+	/**
+	 * Ring of `LIBMDS_MSPOOL_CAPACITY` slots (internal data)
+	 */
+	libmds_mspool_slot_t *slots;
 
 	/**
-	 * Push end (internal data)
+	 * Push end, only ever incremented (internal data)
 	 */
 	size_t head;
 
 	/**
-	 * Poll end (internal data)
+	 * Poll end, only ever incremented (internal data)
 	 */
 	size_t tail;
 
@@ -127,48 +333,153 @@ typedef struct libmds_mspool
 	/**
 	 * Do not spool additional messages if
 	 * `spooled_bytes` is equal to or exceeds
-	 * to value
+	 * to value, adapted to the throughput of
+	 * the consumers unless `latency_target` is zero
 	 */
 	size_t spool_limit_bytes;
 
 	/**
-	 * Do not spool more than this amount
-	 * of messages
+	 * Do not spool more than this amount of messages,
+	 * adapted to the throughput of the consumers
+	 * unless `latency_target` is zero
 	 */
 	size_t spool_limit_messages;
 
 	/**
-	 * If non-zero, `wait_semaphore` shall
-	 * be incremented when a message is
-	 * polled (internal data)
+	 * The lowest value `spool_limit_bytes` is adapted to
 	 */
-	int please_post;
+	size_t min_limit_bytes;
 
-	/* POSIX semaphores are lighter weight than XSI semaphores, so we use POSIX here. */
+	/**
+	 * The highest value `spool_limit_bytes` is adapted to
+	 */
+	size_t max_limit_bytes;
 
 	/**
-	 * Binary semaphore used to lock the spool whilst
-	 * manipulating it (internal data)
+	 * The lowest value `spool_limit_messages` is adapted to
 	 */
-	sem_t lock;
+	size_t min_limit_messages;
 
 	/**
-	 * Semaphore used to signal addition of messages.
-	 * Each time a message is spooled, this semaphore
-	 * is increased, the polling thread decreases the
-	 * semaphore before despooling a message, causing
-	 * it to block when the spool is empty
-	 * (internal data)
+	 * The highest value `spool_limit_messages` is adapted to
+	 */
+	size_t max_limit_messages;
+
+	/**
+	 * The number of nanoseconds a message should at most
+	 * have to wait in the lane; the limits are set to
+	 * what the consumers poll in this time. Zero if the
+	 * limits shall not be adapted
+	 */
+	long latency_target;
+
+	/**
+	 * What to do when the lane is full
+	 */
+	libmds_mspool_policy_t policy;
+
+	/**
+	 * Function that merges messages if `policy`
+	 * is `LIBMDS_MSPOOL_MERGE`
+	 */
+	libmds_mspool_merge_t *merge;
+
+	/**
+	 * User-defined data for `merge`
+	 */
+	void *merge_data;
+
+	/**
+	 * The number of messages that have been
+	 * discarded because the lane was full
+	 */
+	size_t dropped;
+
+	/**
+	 * The number of times messages have
+	 * been merged because the lane was full
+	 */
+	size_t merged;
+
+	/**
+	 * Futex word incremented each time a message
+	 * is polled, spoolers wait on it when the lane
+	 * is full (internal data)
+	 */
+	int polled_event;
+
+	/**
+	 * The number of threads waiting on
+	 * `polled_event` (internal data)
+	 */
+	int spoolers_waiting;
+
+	/**
+	 * The number of messages polled since
+	 * `window_start` (internal data)
+	 */
+	size_t window_messages;
+
+	/**
+	 * The total size of the messages polled
+	 * since `window_start` (internal data)
+	 */
+	size_t window_bytes;
+
+	/**
+	 * The CLOCK_MONOTONIC time, in nanoseconds, the
+	 * current throughput measurement began (internal data)
+	 */
+	uint64_t window_start;
+
+} libmds_mspool_lane_t;
+
+
+/**
+ * Queue of spooled messages
+ * 
+ * The spool is divided into lanes, each with its own
+ * limits and policy for when it is full, so that slow
+ * consumption of messages of one kind does not delay
+ * messages of another kind. Threads only enter the
+ * kernel when they have to wait because the spool is
+ * empty or a lane is full
+ */
+typedef struct libmds_mspool
+{
+	/**
+	 * The lanes, highest priority first
+	 */
+	libmds_mspool_lane_t *lanes;
+
+	/**
+	 * The number of elements in `lanes`
+	 */
+	size_t lane_count;
+
+	/**
+	 * Function that selects the lane a message is spooled to,
+	 * `NULL` if all messages shall be spooled to the first lane
 	 */
-	sem_t semaphore;
+	libmds_mspool_classifier_t *classify;
 
 	/**
-	 * If the spool is full, the semaphore is acquired
-	 * so that the spool function blocks, it is then
-	 * posted when a message is polled so that the
-	 * spool function may try again (internal data)
+	 * User-defined data for `classify`
 	 */
-	sem_t wait_semaphore;
+	void *classify_data;
+
+	/**
+	 * Futex word incremented each time a message
+	 * is spooled, pollers wait on it when the spool
+	 * is empty (internal data)
+	 */
+	int spooled_event;
+
+	/**
+	 * The number of threads waiting on
+	 * `spooled_event` (internal data)
+	 */
+	int pollers_waiting;
 
 } libmds_mspool_t;
 
@@ -230,12 +541,18 @@ void libmds_message_destroy(libmds_message_t *restrict this);
  * Release all resources in a message, should
  * be done even if initialisation fails
  * 
+ * If `this->zero_copy` is set, only the header list is
+ * copied, and the duplicate keeps a reference to the
+ * buffer the message was read into, unless the payload
+ * was received in a memfd
+ * 
  * @param   this  The message
  * @param   pool  Message allocation pool, may be `NULL`
  * @return        The duplicate, you do not need to call `libmds_message_destroy`
- *                on it before you call `free` on it. However, you cannot use
- *                this is an `libmds_message_t` array (libmds_message_t*), only
- *                in an `libmds_message_t*` array (libmds_message_t**).
+ *                on it before you call `libmds_message_release` on it. However,
+ *                you cannot use this is an `libmds_message_t` array
+ *                (libmds_message_t*), only in an `libmds_message_t*` array
+ *                (libmds_message_t**).
  * 
  * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
  *                  RLIMIT_DATA limit described in getrlimit(2).
@@ -243,6 +560,17 @@ void libmds_message_destroy(libmds_message_t *restrict this);
 __attribute__((nonnull(1), malloc, warn_unused_result))
 libmds_message_t *libmds_message_duplicate(libmds_message_t *restrict this, libmds_mpool_t *restrict pool);
 
+/**
+ * Deallocate a message returned by `libmds_message_duplicate`
+ * 
+ * This is equivalent to free(3) unless the
+ * message was duplicated in zero-copy mode
+ * 
+ * @param  this  The message
+ */
+__attribute__((nonnull))
+void libmds_message_release(libmds_message_t *restrict this);
+
 /**
  * Read the next message from a file descriptor
  * 
@@ -263,6 +591,99 @@ libmds_message_t *libmds_message_duplicate(libmds_message_t *restrict this, libm
 __attribute__((nonnull, warn_unused_result))
 int libmds_message_read(libmds_message_t *restrict this, int fd);
 
+/**
+ * Read the next message from a file descriptor without blocking
+ * 
+ * If the message is not complete, -1 is returned with `errno` set
+ * to EAGAIN, and the read is resumed when the function is called
+ * again, preferably when the file descriptor is readable. Messages
+ * that have been received in full are returned without reading,
+ * so with edge-triggered polling, the function shall be called
+ * until it fails with EAGAIN.
+ * 
+ * @param   this  Memory slot in which to store the new message
+ * @param   fd    The file descriptor, it does not need to be in nonblocking mode
+ * @return        The return value follows the rules of `libmds_message_read`
+ * 
+ * @throws  EAGAIN  If the message is not complete and no more data is available
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for recv(3)
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_message_read_nonblocking(libmds_message_t *restrict this, int fd);
+
+/**
+ * Start reading from a shared-memory ring, requested with
+ * `libmds_connection_use_ring_unlocked`, if the message that
+ * has just been read is the display server's acceptance of it
+ * 
+ * This must be done before the next message is read, as the
+ * reply is the last message the display server sends over the
+ * socket. Afterwards, `libmds_message_read_nonblocking` shall
+ * be called when `connection->ring_eventfd`, rather than the
+ * socket, is readable.
+ * 
+ * @param   this  The message slot the reply was read into
+ * @param   ring  The `ring` of the connection
+ * @return        Zero on success, -1 on error, `errno` will be set
+ *                accordingly on error
+ * 
+ * @throws  ECONNREFUSED  If the display server did not accept the ring,
+ *                        it will close the connection
+ * @throws  EBADMSG       If the message is not a reply to such a request
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_message_use_ring(libmds_message_t *restrict this, struct ring *ring);
+
+/**
+ * Start reading in the binary encoding, requested with
+ * `libmds_connection_use_binary_unlocked`, if the message that
+ * has just been read is the display server's acceptance of it
+ * 
+ * This must be done before the next message is read, as the
+ * reply is the last message the display server sends in the
+ * text encoding.
+ * 
+ * @param   this  The message slot the reply was read into
+ * @return        Zero on success, -1 on error, `errno` will be set
+ *                accordingly on error
+ * 
+ * @throws  ECONNREFUSED  If the display server did not accept the binary
+ *                        encoding, it will close the connection
+ * @throws  EBADMSG       If the message is not a reply to such a request
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_message_use_binary(libmds_message_t *restrict this);
+
+/**
+ * Get the value of a header in a message, in constant
+ * time if the message has a header index
+ * 
+ * @param   this  The message
+ * @param   name  The name of the header
+ * @return        The value of the first header with the
+ *                specified name, `NULL` if there is none
+ */
+__attribute__((pure, nonnull))
+char *libmds_message_get_header(const libmds_message_t *restrict this, const char *restrict name);
+
+/**
+ * Extract the values of the headers in a header set from a message,
+ * with one hash probe per header name in the set if the message has
+ * a header index, and one per header in the message otherwise
+ * 
+ * @param   this    The message
+ * @param   set     The header set
+ * @param   values  Output array with one element per header name in `set`,
+ *                  each element is set to the value of the first header
+ *                  with the corresponding name, or to `NULL` if not found
+ * @return          The number of header names in `set` that were found
+ */
+__attribute__((nonnull))
+size_t libmds_message_extract(const libmds_message_t *restrict this, const libmds_header_set_t *restrict set,
+                              char **restrict values);
+
 
 
 /**
@@ -277,6 +698,24 @@ int libmds_message_read(libmds_message_t *restrict this, int fd);
 __attribute__((nonnull, warn_unused_result))
 int libmds_mspool_initialise(libmds_mspool_t *restrict this);
 
+/**
+ * Initialise a message spool with multiple lanes
+ * 
+ * The lanes are initialised with the same configuration
+ * as the lane created by `libmds_mspool_initialise`,
+ * the caller may reconfigure them before the spool is used
+ * 
+ * @param   this   The message spool
+ * @param   lanes  The number of lanes, at least 1
+ * @return         Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  EINVAL  If `lanes` is zero
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_mspool_initialise_lanes(libmds_mspool_t *restrict this, size_t lanes);
+
 /**
  * Destroy a message spool, deallocate its resources
  * 
@@ -288,13 +727,16 @@ void libmds_mspool_destroy(libmds_mspool_t *restrict this);
 /**
  * Spool a message
  * 
+ * The message is spooled to the lane selected by `this->classify`,
+ * if the lane is full, the lane's policy decides whether to wait,
+ * to discard a message, or to merge messages
+ * 
  * @param   this     The message spool
- * @param   message  The message to spool, must be flat (created with `libmds_message_duplicate`)
+ * @param   message  The message to spool, must be flat (created with `libmds_message_duplicate`),
+ *                   the spool takes ownership of it even if it is discarded
  * @return           Zero on success, -1 on error, `errno` will be set accordingly
  * 
- * @throws  EINTR   If interrupted
- * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
- *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws  EINTR  If interrupted
  */
 __attribute__((nonnull, warn_unused_result))
 int libmds_mspool_spool(libmds_mspool_t *restrict this, libmds_message_t *restrict message);
@@ -302,6 +744,9 @@ int libmds_mspool_spool(libmds_mspool_t *restrict this, libmds_message_t *restri
 /**
  * Poll a message from a spool, wait if empty
  * 
+ * The oldest message in the first lane
+ * that is not empty is polled
+ * 
  * @param   this  The message spool
  * @return        A spooled message, `NULL`on error, `errno` will be set accordingly
  * 
@@ -567,6 +567,218 @@ libmds_headers_sort(char **restrict headers, size_t header_count)
 }
 
 
+/**
+ * Hash the name of a header
+ * 
+ * @param   header  The name of the header, or the header with its value, the
+ *                  name ends at the first colon or at the NUL-termination
+ * @return          The hash of the name
+ */
+uint32_t
+libmds_header_hash(const char *restrict header)
+{
+	uint32_t hash = UINT32_C(2166136261);
+	for (; *header && (*header != ':'); header++)
+		hash = (hash ^ (uint32_t)(unsigned char)*header) * UINT32_C(16777619);
+	return hash;
+}
+
+
+/**
+ * Create a perfect hash table for a set of header names
+ * 
+ * @param   this   The header set
+ * @param   names  The header names, must be distinct, the array is
+ *                 not copied and must be kept until the set is destroyed
+ * @param   count  The number of elements in `names`
+ * @return         Zero on success, -1 on error, `errno` will have been set
+ *                 accordingly on error
+ * 
+ * @throws  EINVAL  If two names have the same hash
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+int
+libmds_header_set_initialise(libmds_header_set_t *restrict this, const char *const *names, size_t count)
+{
+	size_t i, j, size, *slots;
+	uint32_t multiplier, attempt;
+	int bits, saved_errno;
+
+	this->names = names;
+	this->count = count;
+	this->slots = NULL;
+	this->hashes = malloc((count ? count : 1) * sizeof(uint32_t));
+	if (!this->hashes)
+		return -1;
+	for (i = 0; i < count; i++) {
+		this->hashes[i] = libmds_header_hash(names[i]);
+		for (j = 0; j < i; j++)
+			if (this->hashes[i] == this->hashes[j])
+				return errno = EINVAL, free(this->hashes), this->hashes = NULL, -1;
+	}
+
+	/* Search for a multiplier that maps the hashes to distinct
+	 * slots, with a table at least twice as large as the set,
+	 * and a larger table if none is found in reasonable time. */
+	for (bits = 1; ((size_t)1 << bits) < (count << 1); bits++);
+	for (;; bits++) {
+		size = (size_t)1 << bits;
+		slots = realloc(this->slots, size * sizeof(size_t));
+		if (!slots)
+			goto fail;
+		this->slots = slots;
+		for (attempt = 0, multiplier = UINT32_C(0x9E3779B1); attempt < 4096; attempt++, multiplier += 2) {
+			memset(slots, 0, size * sizeof(size_t));
+			for (i = 0; i < count; i++) {
+				j = (size_t)((uint32_t)(this->hashes[i] * multiplier) >> (32 - bits));
+				if (slots[j])
+					break;
+				slots[j] = i + 1;
+			}
+			if (i == count) {
+				this->multiplier = multiplier;
+				this->shift = 32 - bits;
+				return 0;
+			}
+		}
+	}
+
+fail:
+	saved_errno = errno;
+	free(this->hashes), this->hashes = NULL;
+	free(this->slots), this->slots = NULL;
+	return errno = saved_errno, -1;
+}
+
+
+/**
+ * Release all resources in a header set
+ * 
+ * @param  this  The header set
+ */
+void
+libmds_header_set_destroy(libmds_header_set_t *restrict this)
+{
+	free(this->hashes), this->hashes = NULL;
+	free(this->slots), this->slots = NULL;
+}
+
+
+/**
+ * Extract the values of the headers in a header set from a
+ * message, with one perfect hash probe per header in the message
+ * 
+ * @param   set           The header set
+ * @param   headers       The headers in the message
+ * @param   header_count  The number of headers
+ * @param   values        Output array with one element per header name in `set`,
+ *                        each element is set to the value of the first header
+ *                        with the corresponding name, or to `NULL` if not found
+ * @return                The number of header names in `set` that were found
+ */
+size_t
+libmds_headers_extract(const libmds_header_set_t *restrict set, char **restrict headers,
+                       size_t header_count, char **restrict values)
+{
+	size_t i, slot, found = 0;
+	uint32_t hash;
+	char *header;
+
+	memset(values, 0, set->count * sizeof(char *));
+
+	for (i = 0; (i < header_count) && (found < set->count); i++) {
+		header = headers[i];
+		hash = libmds_header_hash(header);
+		slot = set->slots[(uint32_t)(hash * set->multiplier) >> set->shift];
+		if (!slot-- || (set->hashes[slot] != hash) || values[slot])
+			continue;
+		if (headercmp(header, set->names[slot]))
+			continue;
+		values[slot] = header + strlen(set->names[slot]) + 2;
+		found++;
+	}
+
+	return found;
+}
+
+
+/**
+ * Make sure that a compose buffer can hold a number of `char`:s
+ * 
+ * @param   buffer       Pointer to the buffer, will be updated if reallocated
+ * @param   buffer_size  Pointer to the allocation size of the buffer, will be
+ *                       updated if the buffer is reallocated
+ * @param   need         The number of `char`:s the buffer must be able to hold
+ * @return               Zero on success, -1 on error, `errno` will have been set
+ *                       accordingly on error; `*buffer` is left intact on error
+ */
+static int __attribute__((nonnull))
+compose_reserve(char **restrict buffer, size_t *restrict buffer_size, size_t need)
+{
+	size_t bufsize = *buffer_size ? *buffer_size : 128;
+	char *new;
+	if (need <= *buffer_size)
+		return 0;
+	while (bufsize < need)
+		bufsize <<= 1;
+	new = realloc(*buffer, bufsize * sizeof(char));
+	if (!new)
+		return -1;
+	*buffer = new;
+	*buffer_size = bufsize;
+	return 0;
+}
+
+
+/**
+ * Write a non-negative integer in decimal
+ * 
+ * @param   out    The output buffer, must have room for `3 * sizeof(value)` `char`:s
+ * @param   value  The integer
+ * @return         The number of written `char`:s
+ */
+static size_t __attribute__((nonnull))
+compose_uint(char *restrict out, uintmax_t value)
+{
+	char digits[3 * sizeof(uintmax_t)];
+	size_t n = sizeof(digits);
+	do
+		digits[--n] = (char)('0' + (value % 10));
+	while (value /= 10);
+	memcpy(out, digits + n, (sizeof(digits) - n) * sizeof(char));
+	return sizeof(digits) - n;
+}
+
+
+/**
+ * Get the conversion at the end of a header line format
+ * if it is the only conversion in the format and it can
+ * be formatted without printf(3)
+ * 
+ * @param   format  The header line format
+ * @param   prefix  Output parameter for the number of `char`:s before the conversion
+ * @return          The conversion character, 'z' for `%zu`, 0 if there is no conversion,
+ *                  -1 if the line must be formatted with printf(3)
+ */
+static int __attribute__((pure, nonnull))
+compose_conversion(const char *restrict format, size_t *restrict prefix)
+{
+	const char *p = strchr(format, '%');
+	if (!p)
+		return *prefix = strlen(format), 0;
+	*prefix = (size_t)(p - format);
+	switch (p[1]) {
+	case 's': case 'd': case 'i': case 'u':
+		return p[2] ? -1 : p[1];
+	case 'z':
+		return ((p[2] == 'u') && !p[3]) ? 'z' : -1;
+	default:
+		return -1;
+	}
+}
+
+
 /**
  * Compose a message
  * 
@@ -603,6 +815,10 @@ libmds_headers_sort(char **restrict headers, size_t header_count)
  *                          more headers. The `Length`-header should not be included, it is
  *                          added automatically. A header may not have a length larger than
  *                          2¹⁵, otherwise the behaviour of this function is undefined.
+ *                          Lines without conversions, and lines whose only conversion
+ *                          is a trailing `%s`, `%i`, `%d`, `%u` or `%zu`, are written
+ *                          without printf(3); other lines are formatted directly into
+ *                          the buffer. No memory is allocated unless the buffer must grow.
  * @return                  Zero on success, -1 on error, `errno` will have been set
  *                          accordingly on error.
  * 
@@ -660,6 +876,10 @@ libmds_compose(char **restrict buffer, size_t *restrict buffer_size, size_t *res
  *                          more headers. The `Length`-header should not be included, it is
  *                          added automatically. A header may not have a length larger than
  *                          2¹⁵, otherwise the behaviour of this function is undefined.
+ *                          Lines without conversions, and lines whose only conversion
+ *                          is a trailing `%s`, `%i`, `%d`, `%u` or `%zu`, are written
+ *                          without printf(3); other lines are formatted directly into
+ *                          the buffer. No memory is allocated unless the buffer must grow.
  * @return                  Zero on success, -1 on error, `errno` will have been set
  *                          accordingly on error.
  * 
@@ -670,27 +890,21 @@ int
 libmds_compose_v(char **restrict buffer, size_t *restrict buffer_size, size_t *restrict length,
                  const char *restrict payload, const size_t *restrict payload_length, va_list args)
 {
-	char *buf = *buffer;
-	size_t bufsize = *buffer_size;
-	size_t len = 0;
-	int part_len;
-	char *part_msg;
+	size_t len = 0, prefix, value_len;
 	size_t payload_len = 0;
-	const char* format;
-	int include;
-	int saved_errno;
+	const char *format;
+	const char *value;
+	uintmax_t uvalue;
+	int include, conversion, part_len, ivalue;
+	va_list args_copy;
 
 	*length = 0;
 
 	if (payload)
 		payload_len = payload_length == NULL ? strlen(payload) : *payload_length;
 
-	if (!bufsize) {
-		bufsize = 128;
-		buf = realloc(buf, bufsize * sizeof(char));
-		if (!buf)
-			return -1;
-	}
+	if (compose_reserve(buffer, buffer_size, 128))
+		return -1;
 
 	for (;;) {
 		format = va_arg(args, const char*);
@@ -703,67 +917,99 @@ libmds_compose_v(char **restrict buffer, size_t *restrict buffer_size, size_t *r
 			format++;
 		}
 
+		conversion = compose_conversion(format, &prefix);
+
+		/* Fast path: fixed string, or a single trailing string or integer. */
+		if (conversion >= 0) {
+			value = NULL, ivalue = 0, uvalue = 0;
+			switch (conversion) {
+			case 's':
+				value = va_arg(args, const char *);
+				break;
+			case 'd':
+			case 'i':
+				ivalue = va_arg(args, int);
+				uvalue = ivalue < 0 ? -(uintmax_t)ivalue : (uintmax_t)ivalue;
+				break;
+			case 'u':
+				uvalue = va_arg(args, unsigned int);
+				break;
+			case 'z':
+				uvalue = va_arg(args, size_t);
+				break;
+			default:
+				break;
+			}
+			if (!include)
+				continue;
+			if (conversion == 's')
+				value = value ? value : "(null)", value_len = strlen(value);
+			else
+				value_len = conversion ? 3 * sizeof(uintmax_t) + 1 : 0;
+			if (compose_reserve(buffer, buffer_size, len + prefix + value_len + 1))
+				return -1;
+			memcpy(*buffer + len, format, prefix * sizeof(char));
+			len += prefix;
+			if (conversion == 's') {
+				memcpy(*buffer + len, value, value_len * sizeof(char));
+				len += value_len;
+			} else if (conversion) {
+				if (ivalue < 0)
+					(*buffer)[len++] = '-';
+				len += compose_uint(*buffer + len, uvalue);
+			}
+			(*buffer)[len++] = '\n';
+			continue;
+		}
+
+		/* Format directly into the buffer, and try again
+		 * from a copy of the arguments if it did not fit. */
+		va_copy(args_copy, args);
 #if defined(__GNUC__)
 # pragma GCC diagnostic push
 # pragma GCC diagnostic ignored "-Wformat-nonliteral"
 # pragma GCC diagnostic ignored "-Wsuggest-attribute=format"
 #endif
-		part_len = vasprintf(&part_msg, format, args);
-		/* XXX vbprintf in slibc will be a nice replacement for this horror. */
+		part_len = vsnprintf(*buffer + len, *buffer_size - len, format, args);
+		if ((part_len >= 0) && include && (len + (size_t)part_len + 1 > *buffer_size)) {
+			if (compose_reserve(buffer, buffer_size, len + (size_t)part_len + 1))
+				return va_end(args_copy), -1;
+			part_len = vsnprintf(*buffer + len, *buffer_size - len, format, args_copy);
+		}
 #if defined(__GNUC__)
 # pragma GCC diagnostic pop
 #endif
+		va_end(args_copy);
 
-		if (!include) {
-			if (part_len >= 0)
-				free(part_msg);
+		if (!include)
 			continue;
-		}
 
 		if (part_len < 0)
 			return -1;
-      
-		if (len + (size_t)part_len >= bufsize) {
-			*buffer_size = bufsize;
-			*buffer = buf;
-			do
-				bufsize <<= 1;
-			while (len + (size_t)part_len >= bufsize);
-			buf = realloc(buf, bufsize * sizeof(char));
-			if (!buf)
-				return saved_errno = errno, free(part_msg), errno = saved_errno, -1;
-		}
 
-		memcpy(buf + len, part_msg, ((size_t)part_len) * sizeof(char));
 		len += (size_t)part_len;
-		buf[len++] = '\n';
-		free(part_msg);
+		(*buffer)[len++] = '\n';
 	}
 
 #define LENGTH_LEN \
 	(payload_len > 0 ? ((sizeof("Length: \n") / sizeof(char) - 1) + 3 * sizeof(size_t)) : 0)
 
-	if (len + LENGTH_LEN + 1 + payload_len + 1 > bufsize) {
-		*buffer_size = bufsize;
-		*buffer = buf;
-		bufsize = len + LENGTH_LEN + 1 + payload_len + 1;
-		buf = realloc(buf, bufsize * sizeof(char));
-		if (!buf)
-			return -1;
-	}
+	if (compose_reserve(buffer, buffer_size, len + LENGTH_LEN + 1 + payload_len + 1))
+		return -1;
 
 #undef LENGTH_LEN
 
+	if (payload_len > 0) {
+		memcpy(*buffer + len, "Length: ", (sizeof("Length: ") / sizeof(char) - 1) * sizeof(char));
+		len += sizeof("Length: ") / sizeof(char) - 1;
+		len += compose_uint(*buffer + len, payload_len);
+		(*buffer)[len++] = '\n';
+	}
+	(*buffer)[len++] = '\n';
 	if (payload_len > 0)
-		sprintf(buf + len, "Length: %zu\n%n", payload_len, &part_len),
-			len += (size_t)part_len;
-	buf[len++] = '\n';
-	if (payload_len > 0)
-		memcpy(buf + len, payload, payload_len * sizeof(char)),
+		memcpy(*buffer + len, payload, payload_len * sizeof(char)),
 			len += payload_len;
 
-	*buffer_size = bufsize;
-	*buffer = buf;
 	*length = len;
 	return 0;
 }
@@ -85,6 +85,49 @@ typedef enum libmds_cherrypick_optimisation
 } libmds_cherrypick_optimisation_t;
 
 
+/**
+ * A set of header names that a program extracts from
+ * messages, indexed by a perfect hash of the names
+ */
+typedef struct libmds_header_set
+{
+	/**
+	 * The names of the headers, the array is not copied
+	 */
+	const char *const *names;
+
+	/**
+	 * `libmds_header_hash` of each element in `names`
+	 */
+	uint32_t *hashes;
+
+	/**
+	 * The number of elements in `names`
+	 */
+	size_t count;
+
+	/**
+	 * The multiplier of the perfect hash function,
+	 * a header whose name has the hash `h` can only
+	 * be the one in `names` with the index
+	 * `slots[(h * multiplier) >> shift] - 1`
+	 */
+	uint32_t multiplier;
+
+	/**
+	 * The shift of the perfect hash function
+	 */
+	int shift;
+
+	/**
+	 * Perfect hash table, each element is zero
+	 * or one plus an index in `names`
+	 */
+	size_t *slots;
+
+} libmds_header_set_t;
+
+
 /**
  * Cherrypick headers from a message
  * 
@@ -327,6 +370,57 @@ size_t libmds_headers_cherrypick_binary_sorted_v(char **restrict headers, size_t
  */
 void libmds_headers_sort(char **restrict headers, size_t header_count);
 
+/**
+ * Hash the name of a header
+ * 
+ * @param   header  The name of the header, or the header with its value, the
+ *                  name ends at the first colon or at the NUL-termination
+ * @return          The hash of the name
+ */
+__attribute__((pure, nonnull))
+uint32_t libmds_header_hash(const char *restrict header);
+
+/**
+ * Create a perfect hash table for a set of header names
+ * 
+ * @param   this   The header set
+ * @param   names  The header names, must be distinct, the array is
+ *                 not copied and must be kept until the set is destroyed
+ * @param   count  The number of elements in `names`
+ * @return         Zero on success, -1 on error, `errno` will have been set
+ *                 accordingly on error
+ * 
+ * @throws  EINVAL  If two names have the same hash
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+__attribute__((nonnull(1), warn_unused_result))
+int libmds_header_set_initialise(libmds_header_set_t *restrict this, const char *const *names, size_t count);
+
+/**
+ * Release all resources in a header set
+ * 
+ * @param  this  The header set
+ */
+__attribute__((nonnull))
+void libmds_header_set_destroy(libmds_header_set_t *restrict this);
+
+/**
+ * Extract the values of the headers in a header set from a
+ * message, with one perfect hash probe per header in the message
+ * 
+ * @param   set           The header set
+ * @param   headers       The headers in the message
+ * @param   header_count  The number of headers
+ * @param   values        Output array with one element per header name in `set`,
+ *                        each element is set to the value of the first header
+ *                        with the corresponding name, or to `NULL` if not found
+ * @return                The number of header names in `set` that were found
+ */
+__attribute__((nonnull(1, 4)))
+size_t libmds_headers_extract(const libmds_header_set_t *restrict set, char **restrict headers,
+                              size_t header_count, char **restrict values);
+
 /**
  * Compose a message
  * 
@@ -363,6 +457,10 @@ void libmds_headers_sort(char **restrict headers, size_t header_count);
  *                          more headers. The `Length`-header should not be included, it is
  *                          added automatically. A header may not have a length larger than
  *                          2¹⁵, otherwise the behaviour of this function is undefined.
+ *                          Lines without conversions, and lines whose only conversion
+ *                          is a trailing `%s`, `%i`, `%d`, `%u` or `%zu`, are written
+ *                          without printf(3); other lines are formatted directly into
+ *                          the buffer. No memory is allocated unless the buffer must grow.
  * @return                  Zero on success, -1 on error, `errno` will have been set
  *                          accordingly on error.
  * 
@@ -409,6 +507,10 @@ int libmds_compose(char **restrict buffer, size_t *restrict buffer_size, size_t
  *                          more headers. The `Length`-header should not be included, it is
  *                          added automatically. A header may not have a length larger than
  *                          2¹⁵, otherwise the behaviour of this function is undefined.
+ *                          Lines without conversions, and lines whose only conversion
+ *                          is a trailing `%s`, `%i`, `%d`, `%u` or `%zu`, are written
+ *                          without printf(3); other lines are formatted directly into
+ *                          the buffer. No memory is allocated unless the buffer must grow.
  * @return                  Zero on success, -1 on error, `errno` will have been set
  *                          accordingly on error.
  * 
@@ -0,0 +1,418 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "request.h"
+#include "proto-util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+
+
+/**
+ * The initial number of buckets in a table of requests in flight
+ */
+#ifndef LIBMDS_REQUESTS_INITIAL_CAPACITY
+# define LIBMDS_REQUESTS_INITIAL_CAPACITY  16
+#endif
+
+#define static_strlen(str) (sizeof(str) / sizeof(char) - 1)
+
+
+
+/**
+ * Initialise a table of requests in flight
+ * 
+ * @param   this        The table
+ * @param   connection  The connection the requests are sent over
+ * @return              Zero on success, -1 on error, `errno` will have been set
+ *                      accordingly on error
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for eventfd(2)
+ * @throws          Any error specified for pthread_mutex_init(3)
+ * @throws          Any error specified for pthread_cond_init(3)
+ */
+int
+libmds_requests_initialise(libmds_requests_t *restrict this, libmds_connection_t *restrict connection)
+{
+	int saved_errno;
+	this->connection = connection;
+	this->capacity = LIBMDS_REQUESTS_INITIAL_CAPACITY;
+	this->count = 0;
+	this->initialised = 0;
+	this->eventfd = -1;
+	this->buckets = calloc(this->capacity, sizeof(libmds_request_t *));
+	if (!this->buckets)
+		return -1;
+	this->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (this->eventfd < 0)
+		goto fail;
+	if ((errno = pthread_mutex_init(&(this->mutex), NULL)))
+		goto fail;
+	if ((errno = pthread_cond_init(&(this->cond), NULL))) {
+		pthread_mutex_destroy(&(this->mutex));
+		goto fail;
+	}
+	this->initialised = 1;
+	return 0;
+fail:
+	saved_errno = errno;
+	if (this->eventfd >= 0)
+		close(this->eventfd), this->eventfd = -1;
+	free(this->buckets), this->buckets = NULL;
+	return errno = saved_errno, -1;
+}
+
+
+/**
+ * Mark a request without a callback as completed, and notify waiters
+ * 
+ * @param  this     The table, must be locked
+ * @param  request  The request, must have been taken out of the table
+ * @param  reply    The reply, `NULL` if none
+ */
+static void __attribute__((nonnull(1, 2)))
+complete_future(libmds_requests_t *restrict this, libmds_request_t *restrict request,
+                libmds_message_t *restrict reply)
+{
+	uint64_t one = 1;
+	request->reply = reply;
+	__atomic_store_n(&(request->completed), 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&(this->cond));
+	if (write(this->eventfd, &one, sizeof(one)) < 0) {
+		/* The counter can only be full if nobody reads it, so nobody will miss it. */
+	}
+}
+
+
+/**
+ * Release all resources in a table of requests in flight
+ * 
+ * Requests still in flight are completed without a reply
+ * 
+ * @param  this  The table
+ */
+void
+libmds_requests_destroy(libmds_requests_t *restrict this)
+{
+	libmds_request_t *request;
+	size_t i;
+	if (!this->buckets)
+		return;
+	for (i = 0; i < this->capacity; i++) {
+		while ((request = this->buckets[i])) {
+			this->buckets[i] = request->next;
+			if (request->callback) {
+				__atomic_store_n(&(request->completed), 1, __ATOMIC_RELEASE);
+				request->callback(request, NULL);
+			} else {
+				complete_future(this, request, NULL);
+			}
+		}
+	}
+	this->count = 0;
+	if (this->initialised) {
+		pthread_cond_destroy(&(this->cond));
+		pthread_mutex_destroy(&(this->mutex));
+		this->initialised = 0;
+	}
+	close(this->eventfd), this->eventfd = -1;
+	free(this->buckets), this->buckets = NULL;
+}
+
+
+/**
+ * Find a request in flight
+ * 
+ * @param   this        The table, must be locked
+ * @param   message_id  The message ID of the request
+ * @return              The link to the request, the link
+ *                      the request would have if it is not found
+ */
+static libmds_request_t ** __attribute__((pure, nonnull))
+find_request(libmds_requests_t *restrict this, uint32_t message_id)
+{
+	libmds_request_t **link = this->buckets + (message_id & (this->capacity - 1));
+	while (*link && ((*link)->message_id != message_id))
+		link = &((*link)->next);
+	return link;
+}
+
+
+/**
+ * Test function for `libmds_next_message_id` that
+ * rejects message ID:s of requests in flight
+ * 
+ * @param   message_id  The message ID
+ * @param   data        The table, must be locked
+ * @return              1 if the message ID is free, 0 if it is in use
+ */
+static int __attribute__((nonnull))
+message_id_free(uint32_t message_id, void *data)
+{
+	return !*find_request(data, message_id);
+}
+
+
+/**
+ * Double the number of buckets in a table of requests in flight
+ * 
+ * @param   this  The table, must be locked
+ * @return        Zero on success, -1 on error, `errno` will have been set
+ *                accordingly on error
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ */
+static int __attribute__((nonnull))
+grow_table(libmds_requests_t *restrict this)
+{
+	libmds_request_t **old = this->buckets;
+	libmds_request_t *request;
+	size_t i, n = this->capacity;
+
+	this->buckets = calloc(n << 1, sizeof(libmds_request_t *));
+	if (!this->buckets)
+		return this->buckets = old, -1;
+	this->capacity = n << 1;
+
+	for (i = 0; i < n; i++) {
+		while ((request = old[i])) {
+			old[i] = request->next;
+			request->next = NULL;
+			*find_request(this, request->message_id) = request;
+		}
+	}
+
+	free(old);
+	return 0;
+}
+
+
+/**
+ * Put a request in flight and assign it a message ID
+ * 
+ * The connection must be locked by the caller, who shall, before
+ * unlocking it, send the request with the message ID stored in
+ * `request->message_id` (and in `this->connection->message_id`,
+ * so that `LIBMDS_HEADER_MESSAGE_ID` can be used), and call
+ * `libmds_request_cancel` if the request could not be sent
+ * 
+ * @param   this       The table
+ * @param   request    The request, does not need to be initialised
+ * @param   callback   Function to call with the reply, `NULL` to store the
+ *                     reply in `request->reply` instead
+ * @param   user_data  Stored in `request->user_data`
+ * @return             Zero on success, -1 on error, `errno` will have been set
+ *                     accordingly on error
+ * 
+ * @throws  EAGAIN  If there are no free message ID:s
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for pthread_mutex_lock(3)
+ */
+int
+libmds_request_register(libmds_requests_t *restrict this, libmds_request_t *restrict request,
+                        libmds_request_callback_t *callback, void *user_data)
+{
+	int saved_errno;
+
+	request->callback = callback;
+	request->user_data = user_data;
+	request->reply = NULL;
+	request->completed = 0;
+	request->next = NULL;
+
+	if ((errno = pthread_mutex_lock(&(this->mutex))))
+		return -1;
+
+	if ((this->count >= this->capacity) && grow_table(this))
+		goto fail;
+	if (libmds_next_message_id(&(this->connection->message_id), message_id_free, this))
+		goto fail;
+
+	request->message_id = this->connection->message_id;
+	*find_request(this, request->message_id) = request;
+	this->count++;
+
+	pthread_mutex_unlock(&(this->mutex));
+	return 0;
+fail:
+	saved_errno = errno;
+	pthread_mutex_unlock(&(this->mutex));
+	return errno = saved_errno, -1;
+}
+
+
+/**
+ * Take a request out of flight without completing it
+ * 
+ * @param   this     The table
+ * @param   request  The request
+ * @return           1 if the request was cancelled, 0 if it was not in flight,
+ *                   -1 on error, `errno` will have been set accordingly on error
+ * 
+ * @throws  Any error specified for pthread_mutex_lock(3)
+ */
+int
+libmds_request_cancel(libmds_requests_t *restrict this, libmds_request_t *restrict request)
+{
+	libmds_request_t **link;
+	int r = 0;
+
+	if ((errno = pthread_mutex_lock(&(this->mutex))))
+		return -1;
+
+	link = find_request(this, request->message_id);
+	if (*link == request) {
+		*link = request->next;
+		request->next = NULL;
+		this->count--;
+		r = 1;
+	}
+
+	pthread_mutex_unlock(&(this->mutex));
+	return r;
+}
+
+
+/**
+ * Get the message ID a message is a reply to
+ * 
+ * @param   message     The message
+ * @param   message_id  Output parameter for the message ID
+ * @return              Whether the message has a valid `In response to`-header
+ */
+static int __attribute__((nonnull))
+get_in_response_to(const libmds_message_t *restrict message, uint32_t *restrict message_id)
+{
+	const char *value;
+	uint32_t id;
+	size_t i;
+
+	for (i = 0; i < message->header_count; i++) {
+		if (strncmp(message->headers[i], "In response to: ", static_strlen("In response to: ")))
+			continue;
+		value = message->headers[i] + static_strlen("In response to: ");
+		if (!*value)
+			return 0;
+		for (id = 0; *value; value++) {
+			if ((*value < '0') || ('9' < *value) || (id > (UINT32_MAX - 9) / 10))
+				return 0;
+			id = id * 10 + (uint32_t)(*value - '0');
+		}
+		return *message_id = id, 1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Complete the request a received message is a reply to, if any
+ * 
+ * The callback of the request, if any, is called before this
+ * function returns, without the table locked
+ * 
+ * @param   this     The table
+ * @param   message  The received message, it is not modified
+ * @return           1 if the message was a reply to a request in flight,
+ *                   0 if it was not and should be processed by the caller,
+ *                   -1 on error, `errno` will have been set accordingly on error
+ * 
+ * @throws  Any error specified for pthread_mutex_lock(3)
+ */
+int
+libmds_requests_dispatch(libmds_requests_t *restrict this, libmds_message_t *restrict message)
+{
+	libmds_request_t **link;
+	libmds_request_t *request;
+	uint32_t message_id;
+
+	if (!get_in_response_to(message, &message_id))
+		return 0;
+
+	if ((errno = pthread_mutex_lock(&(this->mutex))))
+		return -1;
+
+	link = find_request(this, message_id);
+	request = *link;
+	if (!request) {
+		pthread_mutex_unlock(&(this->mutex));
+		return 0;
+	}
+	*link = request->next;
+	request->next = NULL;
+	this->count--;
+
+	if (!request->callback)
+		complete_future(this, request, libmds_message_duplicate(message, NULL));
+
+	pthread_mutex_unlock(&(this->mutex));
+
+	if (request->callback) {
+		__atomic_store_n(&(request->completed), 1, __ATOMIC_RELEASE);
+		request->callback(request, message);
+	}
+
+	return 1;
+}
+
+
+/**
+ * Wait until a request without a callback has been completed by
+ * another thread calling `libmds_requests_dispatch`
+ * 
+ * @param   this      The table
+ * @param   request   The request
+ * @param   deadline  The CLOCK_REALTIME time the function must return,
+ *                    `NULL` to wait indefinitely
+ * @return            Zero on success, -1 on error, `errno` will have been set
+ *                    accordingly on error
+ * 
+ * @throws  ETIMEDOUT  If `deadline` passed before the request was completed
+ * @throws             Any error specified for pthread_mutex_lock(3)
+ * @throws             Any error specified for pthread_cond_timedwait(3)
+ */
+int
+libmds_request_wait(libmds_requests_t *restrict this, libmds_request_t *restrict request,
+                    const struct timespec *restrict deadline)
+{
+	if (libmds_request_completed(request))
+		return 0;
+
+	if ((errno = pthread_mutex_lock(&(this->mutex))))
+		return -1;
+
+	while (!request->completed) {
+		if (deadline)
+			errno = pthread_cond_timedwait(&(this->cond), &(this->mutex), deadline);
+		else
+			errno = pthread_cond_wait(&(this->cond), &(this->mutex));
+		if (errno)
+			break;
+	}
+
+	pthread_mutex_unlock(&(this->mutex));
+	return errno ? -1 : 0;
+}
+
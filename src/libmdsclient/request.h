@@ -0,0 +1,260 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSCLIENT_REQUEST_H
+#define MDS_LIBMDSCLIENT_REQUEST_H
+
+
+#include "comm.h"
+#include "inbound.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+
+
+
+struct libmds_request;
+
+
+/**
+ * Function called when a reply to a request has been received
+ * 
+ * @param  request  The request, it has been removed from the table of
+ *                  requests in flight and may be reused or deallocated
+ * @param  reply    The reply, `NULL` if the request was abandoned because
+ *                  the table was destroyed; only valid until the function
+ *                  returns, use `libmds_message_duplicate` to keep it
+ */
+typedef void libmds_request_callback_t(struct libmds_request *restrict request, libmds_message_t *restrict reply);
+
+
+/**
+ * A request sent to a server, for which a reply is expected
+ * 
+ * The allocation is owned by the caller, and must be
+ * kept until the request has been completed or cancelled
+ */
+typedef struct libmds_request
+{
+	/**
+	 * The ID of the message the request was sent in,
+	 * replies refer to it in their `In response to`-header
+	 */
+	uint32_t message_id;
+
+	/**
+	 * Function to call with the reply, `NULL` if the reply shall
+	 * be stored in `reply` instead, so that the request can be
+	 * used as a future
+	 */
+	libmds_request_callback_t *callback;
+
+	/**
+	 * User-defined data for `callback`
+	 */
+	void *user_data;
+
+	/**
+	 * The reply, once received, if `callback` is `NULL`.
+	 * It shall be released with `libmds_message_release`.
+	 * `NULL` if the request was abandoned or could not be duplicated
+	 */
+	libmds_message_t *reply;
+
+	/**
+	 * Whether the request has been completed,
+	 * read with `libmds_request_completed`
+	 */
+	volatile int completed;
+
+	/**
+	 * The next request in the same bucket (internal data)
+	 */
+	struct libmds_request *next;
+
+} libmds_request_t;
+
+
+/**
+ * Table of requests in flight on a connection
+ */
+typedef struct libmds_requests
+{
+	/**
+	 * The connection the requests are sent over
+	 */
+	libmds_connection_t *connection;
+
+	/**
+	 * Hash table of requests in flight, keyed by
+	 * message ID, chained by `next` (internal data)
+	 */
+	libmds_request_t **buckets;
+
+	/**
+	 * The number of elements in `buckets`,
+	 * always a power of two (internal data)
+	 */
+	size_t capacity;
+
+	/**
+	 * The number of requests in flight
+	 */
+	size_t count;
+
+	/**
+	 * eventfd(2) that is incremented each time a request without
+	 * a callback is completed, so that the completion of futures
+	 * can be awaited with poll(2) alongside other files
+	 */
+	int eventfd;
+
+	/**
+	 * Mutex protecting the table
+	 */
+	pthread_mutex_t mutex;
+
+	/**
+	 * Condition signalled when a request without a callback is completed
+	 */
+	pthread_cond_t cond;
+
+	/**
+	 * Whether `mutex` and `cond` are initialised (internal data)
+	 */
+	int initialised;
+
+} libmds_requests_t;
+
+
+
+/**
+ * Initialise a table of requests in flight
+ * 
+ * @param   this        The table
+ * @param   connection  The connection the requests are sent over
+ * @return              Zero on success, -1 on error, `errno` will have been set
+ *                      accordingly on error
+ * 
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for eventfd(2)
+ * @throws          Any error specified for pthread_mutex_init(3)
+ * @throws          Any error specified for pthread_cond_init(3)
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_requests_initialise(libmds_requests_t *restrict this, libmds_connection_t *restrict connection);
+
+/**
+ * Release all resources in a table of requests in flight
+ * 
+ * Requests still in flight are completed without a reply
+ * 
+ * @param  this  The table
+ */
+__attribute__((nonnull))
+void libmds_requests_destroy(libmds_requests_t *restrict this);
+
+/**
+ * Put a request in flight and assign it a message ID
+ * 
+ * The connection must be locked by the caller, who shall, before
+ * unlocking it, send the request with the message ID stored in
+ * `request->message_id` (and in `this->connection->message_id`,
+ * so that `LIBMDS_HEADER_MESSAGE_ID` can be used), and call
+ * `libmds_request_cancel` if the request could not be sent
+ * 
+ * @param   this       The table
+ * @param   request    The request, does not need to be initialised
+ * @param   callback   Function to call with the reply, `NULL` to store the
+ *                     reply in `request->reply` instead
+ * @param   user_data  Stored in `request->user_data`
+ * @return             Zero on success, -1 on error, `errno` will have been set
+ *                     accordingly on error
+ * 
+ * @throws  EAGAIN  If there are no free message ID:s
+ * @throws  ENOMEM  Out of memory. Possibly, the process hit the RLIMIT_AS or
+ *                  RLIMIT_DATA limit described in getrlimit(2).
+ * @throws          Any error specified for pthread_mutex_lock(3)
+ */
+__attribute__((nonnull(1, 2), warn_unused_result))
+int libmds_request_register(libmds_requests_t *restrict this, libmds_request_t *restrict request,
+                            libmds_request_callback_t *callback, void *user_data);
+
+/**
+ * Take a request out of flight without completing it
+ * 
+ * @param   this     The table
+ * @param   request  The request
+ * @return           1 if the request was cancelled, 0 if it was not in flight,
+ *                   -1 on error, `errno` will have been set accordingly on error
+ * 
+ * @throws  Any error specified for pthread_mutex_lock(3)
+ */
+__attribute__((nonnull))
+int libmds_request_cancel(libmds_requests_t *restrict this, libmds_request_t *restrict request);
+
+/**
+ * Complete the request a received message is a reply to, if any
+ * 
+ * The callback of the request, if any, is called before this
+ * function returns, without the table locked
+ * 
+ * @param   this     The table
+ * @param   message  The received message, it is not modified
+ * @return           1 if the message was a reply to a request in flight,
+ *                   0 if it was not and should be processed by the caller,
+ *                   -1 on error, `errno` will have been set accordingly on error
+ * 
+ * @throws  Any error specified for pthread_mutex_lock(3)
+ */
+__attribute__((nonnull, warn_unused_result))
+int libmds_requests_dispatch(libmds_requests_t *restrict this, libmds_message_t *restrict message);
+
+/**
+ * Check whether a request has been completed
+ * 
+ * @param   request:libmds_request_t*  The request
+ * @return  :int                       Whether the request has been completed
+ */
+#define libmds_request_completed(request)\
+	__atomic_load_n(&((request)->completed), __ATOMIC_ACQUIRE)
+
+/**
+ * Wait until a request without a callback has been completed by
+ * another thread calling `libmds_requests_dispatch`
+ * 
+ * @param   this      The table
+ * @param   request   The request
+ * @param   deadline  The CLOCK_REALTIME time the function must return,
+ *                    `NULL` to wait indefinitely
+ * @return            Zero on success, -1 on error, `errno` will have been set
+ *                    accordingly on error
+ * 
+ * @throws  ETIMEDOUT  If `deadline` passed before the request was completed
+ * @throws             Any error specified for pthread_mutex_lock(3)
+ * @throws             Any error specified for pthread_cond_timedwait(3)
+ */
+__attribute__((nonnull(1, 2)))
+int libmds_request_wait(libmds_requests_t *restrict this, libmds_request_t *restrict request,
+                        const struct timespec *restrict deadline);
+
+
+#endif
+
@@ -0,0 +1,360 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "binary.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+#define BINARY_NAME(name)  {name, sizeof(name) / sizeof(char) - 1}
+
+/**
+ * The dictionary of interned header names, the name at
+ * index i has the ID i + 1, ID 0 means that the name
+ * is spelled out; this list may only be appended to
+ * 
+ * "Length" is not in the list, it is implied by the fixed
+ * header, and "Memfd-Length" is not allowed, file descriptors
+ * are not passed with messages in the binary encoding
+ */
+const struct binary_name binary_header_names[] = {
+	BINARY_NAME("Command"),
+	BINARY_NAME("Message ID"),
+	BINARY_NAME("In response to"),
+	BINARY_NAME("To"),
+	BINARY_NAME("Origin command"),
+	BINARY_NAME("Modify ID"),
+	BINARY_NAME("Channel"),
+	BINARY_NAME("Client closed"),
+	BINARY_NAME("Client ID"),
+	BINARY_NAME("Modify"),
+	BINARY_NAME("Modifying"),
+	BINARY_NAME("Priority"),
+	BINARY_NAME("Stop"),
+	BINARY_NAME("Error"),
+	BINARY_NAME("ID assignment"),
+	BINARY_NAME("Channel assignment"),
+	BINARY_NAME("Keyboard"),
+	BINARY_NAME("Keycode"),
+	BINARY_NAME("Scancode"),
+	BINARY_NAME("Released"),
+	BINARY_NAME("Event"),
+	BINARY_NAME("Action"),
+	BINARY_NAME("Size"),
+	BINARY_NAME("Time to live"),
+	BINARY_NAME("Memfd"),
+	BINARY_NAME("Ring"),
+	BINARY_NAME("Binary"),
+};
+
+#undef BINARY_NAME
+
+/**
+ * The number of names in `binary_header_names`
+ */
+#define BINARY_HEADER_NAMES  (sizeof(binary_header_names) / sizeof(*binary_header_names))
+
+
+
+/**
+ * Encode a variable-length integer, seven bits per byte,
+ * least significant first, with the highest bit set on
+ * all bytes but the last
+ * 
+ * @param   out    Output buffer, must have room for `BINARY_VARINT_MAX` bytes
+ * @param   value  The integer
+ * @return         The number of bytes written to `out`
+ */
+static size_t __attribute__((nonnull))
+binary_put_varint(char *restrict out, uint64_t value)
+{
+	size_t n = 0;
+	for (; value >= 0x80; value >>= 7)
+		out[n++] = (char)((value & 0x7F) | 0x80);
+	out[n++] = (char)value;
+	return n;
+}
+
+
+/**
+ * Decode a variable-length integer
+ * 
+ * @param   p      Pointer to the read position, it will be moved past the integer
+ * @param   end    The end of the data
+ * @param   value  Output parameter for the integer
+ * @return         Zero on success, -1 if the integer is truncated or too large
+ */
+int
+binary_get_varint(const char **restrict p, const char *end, uint64_t *restrict value)
+{
+	unsigned char c;
+	int shift;
+
+	*value = 0;
+	for (shift = 0; *p < end && shift < 7 * BINARY_VARINT_MAX; shift += 7) {
+		c = (unsigned char)*(*p)++;
+		if (shift == 63 && c > 1)
+			return -1;
+		*value |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+
+/**
+ * Get the ID of an interned header name
+ * 
+ * @param   name    The name of the header
+ * @param   length  The length of `name`
+ * @return          The ID of the name, zero if it is not interned
+ */
+static size_t __attribute__((nonnull, pure))
+binary_header_id(const char *restrict name, size_t length)
+{
+	size_t i;
+	for (i = 0; i < BINARY_HEADER_NAMES; i++)
+		if (binary_header_names[i].length == length && *binary_header_names[i].name == *name &&
+		    !memcmp(binary_header_names[i].name, name, length * sizeof(char)))
+			return i + 1;
+	return 0;
+}
+
+
+/**
+ * Release all resources in an encoder
+ * 
+ * @param  this  The encoder, may be `NULL`
+ */
+void
+binary_encoder_destroy(binary_encoder_t *restrict this)
+{
+	if (this) {
+		free(this->text), this->text = NULL;
+		free(this->frame), this->frame = NULL;
+	}
+}
+
+
+/**
+ * Encode the collected headers into `this->frame`
+ * 
+ * @param   this  The encoder
+ * @return        Zero on success, -1 on error, `errno` will be set accordingly
+ * 
+ * @throws  ENOMEM   Out of memory
+ * @throws  EBADMSG  If a header is malformatted
+ */
+static int __attribute__((nonnull))
+binary_encode_frame(binary_encoder_t *restrict this)
+{
+	const char *line = this->text, *end = this->text + this->text_length, *lf, *colon, *value;
+	size_t size, id, n = BINARY_FRAME_HEADER_SIZE, name_length, value_length;
+	uint64_t payload = 0;
+	char *new, *out;
+	int i;
+
+	/* An entry is never more than twice as long as its line. */
+	size = BINARY_FRAME_HEADER_SIZE + 2 * this->text_length;
+	if (size > this->frame_size) {
+		if (!(new = realloc(this->frame, size * sizeof(char))))
+			return -1;
+		this->frame = new;
+		this->frame_size = size;
+	}
+	out = this->frame;
+
+	for (; line < end; line = lf + 1) {
+		lf = memchr(line, '\n', (size_t)(end - line));
+		colon = memchr(line, ':', (size_t)(lf - line));
+		if (!colon || colon + 1 == lf || colon[1] != ' ' || colon == line)
+			return errno = EBADMSG, -1;
+		name_length = (size_t)(colon - line);
+		value = colon + 2;
+		value_length = (size_t)(lf - value);
+
+		/* The length of the payload is in the fixed header. */
+		if (name_length == 6 && !memcmp(line, "Length", 6)) {
+			for (payload = 0; value < lf; value++) {
+				if (*value < '0' || '9' < *value || payload > (UINT64_MAX - 9) / 10)
+					return errno = EBADMSG, -1;
+				payload = payload * 10 + (uint64_t)(*value & 15);
+			}
+			continue;
+		}
+
+		id = binary_header_id(line, name_length);
+		n += binary_put_varint(out + n, id);
+		if (!id) {
+			n += binary_put_varint(out + n, name_length);
+			memcpy(out + n, line, name_length * sizeof(char));
+			n += name_length;
+		}
+		n += binary_put_varint(out + n, value_length);
+		memcpy(out + n, value, value_length * sizeof(char));
+		n += value_length;
+	}
+
+	if (n - BINARY_FRAME_HEADER_SIZE > BINARY_HEADERS_MAX)
+		return errno = EBADMSG, -1;
+	for (i = 0; i < 4; i++)
+		out[i] = (char)((n - BINARY_FRAME_HEADER_SIZE) >> (8 * i));
+	for (i = 0; i < 8; i++)
+		out[4 + i] = (char)(payload >> (8 * i));
+
+	this->frame_length = n;
+	this->payload_left = payload;
+	this->text_length = 0;
+	return 0;
+}
+
+
+/**
+ * Feed the headers of a message in the text encoding to an encoder
+ * 
+ * This function may only be called when `this->payload_left`
+ * and `this->frame_length` are zero. When the end of the headers
+ * is reached, the frame is stored in `this->frame`, it shall be
+ * sent, and the next `this->payload_left` bytes shall be sent as
+ * they are, before the next message is fed to the encoder.
+ * 
+ * @param   this    The encoder
+ * @param   text    The beginning of the rest of the message
+ * @param   length  The number of available bytes in `text`
+ * @return          The number of bytes consumed from `text`, -1 on
+ *                  error, `errno` will be set accordingly; the
+ *                  encoder cannot be used after an error
+ * 
+ * @throws  ENOMEM   Out of memory
+ * @throws  EBADMSG  If a header is malformatted
+ */
+ssize_t
+binary_encode_headers(binary_encoder_t *restrict this, const char *restrict text, size_t length)
+{
+	const char *p = text, *end = text + length, *lf;
+	size_t n, size;
+	char *new;
+
+	/* Find the empty line, a LF at the beginning of a line. */
+	for (; (lf = memchr(p, '\n', (size_t)(end - p))); p = lf + 1)
+		if (lf == p && (p > text || !this->text_length || this->text[this->text_length - 1] == '\n'))
+			break;
+
+	n = lf ? (size_t)(lf - text) : length;
+	if (this->text_length + n > this->text_size) {
+		size = this->text_size ? this->text_size : 128;
+		while (size < this->text_length + n)
+			size <<= 1;
+		if (!(new = realloc(this->text, size * sizeof(char))))
+			return -1;
+		this->text = new;
+		this->text_size = size;
+	}
+	memcpy(this->text + this->text_length, text, n * sizeof(char));
+	this->text_length += n;
+
+	if (!lf)
+		return (ssize_t)n;
+	if (binary_encode_frame(this))
+		return -1;
+	return (ssize_t)n + 1;
+}
+
+
+/**
+ * Parse the fixed header of a frame
+ * 
+ * @param   data            The beginning of the frame
+ * @param   length          The number of available bytes in `data`
+ * @param   header_length   Output parameter for the length of the header section
+ * @param   payload_length  Output parameter for the length of the payload
+ * @return                  1 if the fixed header and the header section are
+ *                          available, 0 if more data is needed
+ */
+int
+binary_frame_header(const char *restrict data, size_t length,
+                    size_t *restrict header_length, uint64_t *restrict payload_length)
+{
+	const unsigned char *d = (const unsigned char *)data;
+	uint32_t headers = 0;
+	uint64_t payload = 0;
+	int i;
+
+	if (length < BINARY_FRAME_HEADER_SIZE)
+		return 0;
+	for (i = 4; i--;)
+		headers = (headers << 8) | d[i];
+	for (i = 8; i--;)
+		payload = (payload << 8) | d[4 + i];
+	*header_length = (size_t)headers;
+	*payload_length = payload;
+	return length - BINARY_FRAME_HEADER_SIZE >= (size_t)headers;
+}
+
+
+/**
+ * Decode the next header in the header section of a frame
+ * 
+ * Spelled-out names must be non-empty, and may not contain
+ * colons or LF:s, nor be ‘Length’ or ‘Memfd-Length’, and
+ * values may not contain LF:s, so that the header can be
+ * written in the text encoding
+ * 
+ * @param   p             Pointer to the read position, it will be moved past the header
+ * @param   end           The end of the header section
+ * @param   name          Output parameter for the name of the header, not NUL-terminated
+ * @param   name_length   Output parameter for the length of `*name`
+ * @param   value         Output parameter for the value of the header, not NUL-terminated
+ * @param   value_length  Output parameter for the length of `*value`
+ * @return                1 if a header was decoded, 0 at the end of the
+ *                        header section, -1 if the header is malformatted
+ */
+int
+binary_next_header(const char **restrict p, const char *end, const char **restrict name,
+                   size_t *restrict name_length, const char **restrict value, size_t *restrict value_length)
+{
+	uint64_t id, n;
+
+	if (*p == end)
+		return 0;
+
+	if (binary_get_varint(p, end, &id) || id > BINARY_HEADER_NAMES)
+		return -1;
+	if (id) {
+		*name = binary_header_names[id - 1].name;
+		*name_length = binary_header_names[id - 1].length;
+	} else {
+		if (binary_get_varint(p, end, &n) || !n || n > (uint64_t)(end - *p))
+			return -1;
+		*name = *p, *name_length = (size_t)n, *p += n;
+		if (memchr(*name, ':', *name_length) || memchr(*name, '\n', *name_length))
+			return -1;
+		if ((n == 6 && !memcmp(*name, "Length", 6)) || (n == 12 && !memcmp(*name, "Memfd-Length", 12)))
+			return -1;
+	}
+
+	if (binary_get_varint(p, end, &n) || n > (uint64_t)(end - *p))
+		return -1;
+	*value = *p, *value_length = (size_t)n, *p += n;
+	if (memchr(*value, '\n', *value_length))
+		return -1;
+
+	return 1;
+}
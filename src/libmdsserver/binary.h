@@ -0,0 +1,211 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSSERVER_BINARY_H
+#define MDS_LIBMDSSERVER_BINARY_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+
+/**
+ * The size of the fixed header of a frame in the binary encoding:
+ * the length of the header section as a 32-bit little-endian
+ * integer, followed by the length of the payload as a 64-bit
+ * little-endian integer
+ */
+#define BINARY_FRAME_HEADER_SIZE  12
+
+/**
+ * The maximum number of bytes in an encoded variable-length integer
+ */
+#define BINARY_VARINT_MAX  10
+
+/**
+ * The maximum length of the header section of a frame
+ */
+#define BINARY_HEADERS_MAX  UINT32_MAX
+
+
+
+/**
+ * A header name in the dictionary of interned header names
+ */
+struct binary_name
+{
+	/**
+	 * The name of the header
+	 */
+	const char *name;
+
+	/**
+	 * The length of `name`
+	 */
+	size_t length;
+};
+
+/**
+ * The dictionary of interned header names, the name at
+ * index i has the ID i + 1, ID 0 means that the name
+ * is spelled out; this list may only be appended to
+ * 
+ * "Length" is not in the list, it is implied by the fixed
+ * header, and "Memfd-Length" is not allowed, file descriptors
+ * are not passed with messages in the binary encoding
+ */
+extern const struct binary_name binary_header_names[];
+
+
+
+/**
+ * State for translating messages in the text encoding,
+ * which may be passed in arbitrary pieces, to frames
+ * in the binary encoding
+ * 
+ * The headers are collected until the empty line that ends
+ * them, then the fixed header and the header section of the
+ * frame are stored in `frame`, and then the payload, whose
+ * length is taken from the ‘Length’ header, is the same in
+ * both encodings, so it is passed through unchanged
+ */
+typedef struct binary_encoder
+{
+	/**
+	 * The headers, in the text encoding, of
+	 * the message being translated, collected
+	 * until the end of the headers
+	 */
+	char *text;
+
+	/**
+	 * The allocation size of `text`
+	 */
+	size_t text_size;
+
+	/**
+	 * The number of bytes used in `text`
+	 */
+	size_t text_length;
+
+	/**
+	 * The number of bytes of the payload of the
+	 * current message that are yet to be passed through
+	 */
+	uint64_t payload_left;
+
+	/**
+	 * The fixed header and the header section of the frame
+	 * of the current message, once all its headers have
+	 * been collected
+	 */
+	char *frame;
+
+	/**
+	 * The allocation size of `frame`
+	 */
+	size_t frame_size;
+
+	/**
+	 * The number of bytes in `frame` that are yet to be sent,
+	 * the user shall set this to zero once it has sent them
+	 */
+	size_t frame_length;
+
+} binary_encoder_t;
+
+
+
+/**
+ * Decode a variable-length integer
+ * 
+ * @param   p      Pointer to the read position, it will be moved past the integer
+ * @param   end    The end of the data
+ * @param   value  Output parameter for the integer
+ * @return         Zero on success, -1 if the integer is truncated or too large
+ */
+__attribute__((nonnull))
+int binary_get_varint(const char **restrict p, const char *end, uint64_t *restrict value);
+
+/**
+ * Release all resources in an encoder
+ * 
+ * @param  this  The encoder, may be `NULL`
+ */
+void binary_encoder_destroy(binary_encoder_t *restrict this);
+
+/**
+ * Feed the headers of a message in the text encoding to an encoder
+ * 
+ * This function may only be called when `this->payload_left`
+ * and `this->frame_length` are zero. When the end of the headers
+ * is reached, the frame is stored in `this->frame`, it shall be
+ * sent, and the next `this->payload_left` bytes shall be sent as
+ * they are, before the next message is fed to the encoder.
+ * 
+ * @param   this    The encoder
+ * @param   text    The beginning of the rest of the message
+ * @param   length  The number of available bytes in `text`
+ * @return          The number of bytes consumed from `text`, -1 on
+ *                  error, `errno` will be set accordingly; the
+ *                  encoder cannot be used after an error
+ * 
+ * @throws  ENOMEM   Out of memory
+ * @throws  EBADMSG  If a header is malformatted
+ */
+__attribute__((nonnull))
+ssize_t binary_encode_headers(binary_encoder_t *restrict this, const char *restrict text, size_t length);
+
+/**
+ * Parse the fixed header of a frame
+ * 
+ * @param   data            The beginning of the frame
+ * @param   length          The number of available bytes in `data`
+ * @param   header_length   Output parameter for the length of the header section
+ * @param   payload_length  Output parameter for the length of the payload
+ * @return                  1 if the fixed header and the header section are
+ *                          available, 0 if more data is needed
+ */
+__attribute__((nonnull))
+int binary_frame_header(const char *restrict data, size_t length,
+                        size_t *restrict header_length, uint64_t *restrict payload_length);
+
+/**
+ * Decode the next header in the header section of a frame
+ * 
+ * Spelled-out names must be non-empty, and may not contain
+ * colons or LF:s, nor be ‘Length’ or ‘Memfd-Length’, and
+ * values may not contain LF:s, so that the header can be
+ * written in the text encoding
+ * 
+ * @param   p             Pointer to the read position, it will be moved past the header
+ * @param   end           The end of the header section
+ * @param   name          Output parameter for the name of the header, not NUL-terminated
+ * @param   name_length   Output parameter for the length of `*name`
+ * @param   value         Output parameter for the value of the header, not NUL-terminated
+ * @param   value_length  Output parameter for the length of `*value`
+ * @return                1 if a header was decoded, 0 at the end of the
+ *                        header section, -1 if the header is malformatted
+ */
+__attribute__((nonnull))
+int binary_next_header(const char **restrict p, const char *end, const char **restrict name,
+                       size_t *restrict name_length, const char **restrict value, size_t *restrict value_length);
+
+
+#endif
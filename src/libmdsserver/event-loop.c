@@ -0,0 +1,552 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "event-loop.h"
+
+#include "macros.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+
+
+/**
+ * The maximum number of events to dispatch per call to `event_loop_dispatch`
+ */
+#define EVENT_LOOP_BATCH  32
+
+
+
+/**
+ * Register a file descriptor in an event loop
+ * 
+ * @param   this    The event loop
+ * @param   fd      The file descriptor
+ * @param   events  The events to wait for, as for epoll_ctl(2)
+ * @param   kind    What the file descriptor is
+ * @return          The handler of the file descriptor, `NULL` on error,
+ *                  `errno` will have been set accordingly
+ */
+static event_loop_handler_t *__attribute__((nonnull))
+add_handler(event_loop_t *restrict this, int fd, uint32_t events, event_loop_kind_t kind)
+{
+	struct epoll_event event;
+	event_loop_handler_t *old;
+	size_t size;
+
+	fail_if (fd < 0 && ((errno = EBADF)));
+	if ((size_t)fd >= this->handlers_size) {
+		for (size = this->handlers_size ? this->handlers_size : 16; size <= (size_t)fd; size <<= 1);
+		fail_if (yrealloc(old, this->handlers, size, event_loop_handler_t));
+		memset(this->handlers + this->handlers_size, 0,
+		       (size - this->handlers_size) * sizeof(event_loop_handler_t));
+		this->handlers_size = size;
+	}
+	fail_if (this->handlers[fd].kind != EVENT_LOOP_NONE && ((errno = EEXIST)));
+
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.fd = fd;
+	fail_if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0);
+
+	memset(this->handlers + fd, 0, sizeof(event_loop_handler_t));
+	this->handlers[fd].kind = kind;
+	return this->handlers + fd;
+fail:
+	return NULL;
+}
+
+
+/**
+ * Unregister a file descriptor from an event loop
+ * 
+ * @param  this  The event loop
+ * @param  fd    The file descriptor
+ * @param  kind  What the file descriptor must be
+ * @return       Whether the file descriptor was registered as `kind`
+ */
+static int __attribute__((nonnull))
+remove_handler(event_loop_t *restrict this, int fd, event_loop_kind_t kind)
+{
+	if (fd < 0 || (size_t)fd >= this->handlers_size || this->handlers[fd].kind != kind)
+		return 0;
+	epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	memset(this->handlers + fd, 0, sizeof(event_loop_handler_t));
+	return 1;
+}
+
+
+/**
+ * Create an event loop
+ * 
+ * @param   this  Memory slot in which to store the new event loop
+ * @return        Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+int
+event_loop_initialise(event_loop_t *restrict this)
+{
+	this->epoll_fd = -1;
+	this->signal_fd = -1;
+	this->wakeup_fd = -1;
+	sigemptyset(&(this->signals));
+	this->handlers = NULL;
+	this->handlers_size = 0;
+	this->signal_handlers = NULL;
+
+	fail_if ((this->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0);
+	fail_if ((this->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0);
+	fail_if (!add_handler(this, this->wakeup_fd, EPOLLIN, EVENT_LOOP_WAKEUP));
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Release all resources in an event loop, should be done even
+ * if construction fails, file descriptors that have been added
+ * with `event_loop_add_fd` are not closed, and signals that have
+ * been added remain blocked
+ * 
+ * @param  this  The event loop
+ */
+void
+event_loop_destroy(event_loop_t *restrict this)
+{
+	size_t fd;
+
+	for (fd = 0; fd < this->handlers_size; fd++)
+		if (this->handlers[fd].kind == EVENT_LOOP_TIMER)
+			xclose((int)fd);
+	if (this->signal_fd >= 0)
+		xclose(this->signal_fd);
+	if (this->wakeup_fd >= 0)
+		xclose(this->wakeup_fd);
+	if (this->epoll_fd >= 0)
+		xclose(this->epoll_fd);
+	free(this->handlers);
+	free(this->signal_handlers);
+
+	this->epoll_fd = -1;
+	this->signal_fd = -1;
+	this->wakeup_fd = -1;
+	this->handlers = NULL;
+	this->handlers_size = 0;
+	this->signal_handlers = NULL;
+}
+
+
+/**
+ * Wait for a file descriptor to become ready
+ * 
+ * @param   this       The event loop
+ * @param   fd         The file descriptor
+ * @param   events     The events to wait for, as for epoll_ctl(2),
+ *                     `EPOLLIN` to wait until it is readable
+ * @param   callback   The function to call when the file descriptor is ready
+ * @param   user_data  Data to pass to `callback`
+ * @return             Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+int
+event_loop_add_fd(event_loop_t *restrict this, int fd, uint32_t events,
+                  event_loop_fd_callback_t *callback, void *user_data)
+{
+	event_loop_handler_t *handler;
+
+	fail_if (!(handler = add_handler(this, fd, events, EVENT_LOOP_FD)));
+	handler->fd_callback = callback;
+	handler->user_data = user_data;
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Change the events to wait for on a file descriptor
+ * that has been added with `event_loop_add_fd`
+ * 
+ * @param   this    The event loop
+ * @param   fd      The file descriptor
+ * @param   events  The events to wait for, as for epoll_ctl(2)
+ * @return          Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+int
+event_loop_modify_fd(event_loop_t *restrict this, int fd, uint32_t events)
+{
+	struct epoll_event event;
+
+	fail_if ((fd < 0 || (size_t)fd >= this->handlers_size ||
+	          this->handlers[fd].kind != EVENT_LOOP_FD) && ((errno = ENOENT)));
+
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.fd = fd;
+	fail_if (epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0);
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Stop waiting for a file descriptor, this shall
+ * be done before the file descriptor is closed
+ * 
+ * @param  this  The event loop
+ * @param  fd    The file descriptor
+ */
+void
+event_loop_remove_fd(event_loop_t *restrict this, int fd)
+{
+	remove_handler(this, fd, EVENT_LOOP_FD);
+}
+
+
+/**
+ * Convert a delay and an interval to a timer specification
+ * 
+ * @param  spec      Output parameter for the timer specification
+ * @param  delay     The time until the timer expires the first time, `NULL` to disarm the timer
+ * @param  interval  The time between subsequent expirations, `NULL` if the timer shall only expire once
+ */
+static void __attribute__((nonnull(1)))
+make_timer_spec(struct itimerspec *restrict spec, const struct timespec *delay, const struct timespec *interval)
+{
+	memset(spec, 0, sizeof(*spec));
+	if (delay) {
+		spec->it_value = *delay;
+		/* A zero delay would disarm the timer. */
+		if (!spec->it_value.tv_sec && !spec->it_value.tv_nsec)
+			spec->it_value.tv_nsec = 1;
+	}
+	if (interval)
+		spec->it_interval = *interval;
+}
+
+
+/**
+ * Create a timer on the monotonic clock
+ * 
+ * @param   this       The event loop
+ * @param   delay      The time until the timer expires the first time,
+ *                     `NULL` to create the timer disarmed
+ * @param   interval   The time between subsequent expirations,
+ *                     `NULL` if the timer shall only expire once
+ * @param   callback   The function to call when the timer expires
+ * @param   user_data  Data to pass to `callback`
+ * @return             The ID of the timer, -1 on error, `errno`
+ *                     will have been set accordingly
+ */
+int
+event_loop_add_timer(event_loop_t *restrict this, const struct timespec *delay,
+                     const struct timespec *interval, event_loop_timer_callback_t *callback,
+                     void *user_data)
+{
+	struct itimerspec spec;
+	event_loop_handler_t *handler;
+	int fd, saved_errno;
+
+	fail_if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0);
+	make_timer_spec(&spec, delay, interval);
+	fail_if (timerfd_settime(fd, 0, &spec, NULL) < 0);
+	fail_if (!(handler = add_handler(this, fd, EPOLLIN, EVENT_LOOP_TIMER)));
+	handler->timer_callback = callback;
+	handler->user_data = user_data;
+
+	return fd;
+fail:
+	saved_errno = errno;
+	if (fd >= 0)
+		xclose(fd);
+	return errno = saved_errno, -1;
+}
+
+
+/**
+ * Rearm or disarm a timer
+ * 
+ * @param   this      The event loop
+ * @param   timer     The ID of the timer
+ * @param   delay     The time until the timer expires the first time,
+ *                    `NULL` to disarm the timer
+ * @param   interval  The time between subsequent expirations,
+ *                    `NULL` if the timer shall only expire once
+ * @return            Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+int
+event_loop_set_timer(event_loop_t *restrict this, int timer,
+                     const struct timespec *delay, const struct timespec *interval)
+{
+	struct itimerspec spec;
+
+	fail_if ((timer < 0 || (size_t)timer >= this->handlers_size ||
+	          this->handlers[timer].kind != EVENT_LOOP_TIMER) && ((errno = ENOENT)));
+	make_timer_spec(&spec, delay, interval);
+	fail_if (timerfd_settime(timer, 0, &spec, NULL) < 0);
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Destroy a timer
+ * 
+ * @param  this   The event loop
+ * @param  timer  The ID of the timer
+ */
+void
+event_loop_remove_timer(event_loop_t *restrict this, int timer)
+{
+	if (remove_handler(this, timer, EVENT_LOOP_TIMER))
+		xclose(timer);
+}
+
+
+/**
+ * Create or update the signalfd of an event loop
+ * 
+ * @param   this  The event loop
+ * @return        Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+static int __attribute__((nonnull))
+update_signal_fd(event_loop_t *restrict this)
+{
+	int fd;
+
+	if (this->signal_fd >= 0) {
+		fail_if (signalfd(this->signal_fd, &(this->signals), 0) < 0);
+	} else {
+		fail_if ((fd = signalfd(-1, &(this->signals), SFD_NONBLOCK | SFD_CLOEXEC)) < 0);
+		if (!add_handler(this, fd, EPOLLIN, EVENT_LOOP_SIGNAL)) {
+			xclose(fd);
+			fail_if (1);
+		}
+		this->signal_fd = fd;
+	}
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Receive a signal with the event loop rather than with a signal
+ * handler, the signal is blocked in the calling thread, it should
+ * therefore be added before other threads are created
+ * 
+ * @param   this       The event loop
+ * @param   signo      The signal
+ * @param   callback   The function to call when the signal has been received
+ * @param   user_data  Data to pass to `callback`
+ * @return             Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+int
+event_loop_add_signal(event_loop_t *restrict this, int signo,
+                      event_loop_signal_callback_t *callback, void *user_data)
+{
+	sigset_t set;
+	int saved_errno;
+
+	fail_if ((signo <= 0 || signo >= NSIG) && ((errno = EINVAL)));
+	if (!this->signal_handlers)
+		fail_if (xcalloc(this->signal_handlers, NSIG, event_loop_signal_t));
+
+	sigemptyset(&set);
+	sigaddset(&set, signo);
+	fail_if ((errno = pthread_sigmask(SIG_BLOCK, &set, NULL)));
+	sigaddset(&(this->signals), signo);
+	if (update_signal_fd(this) < 0) {
+		saved_errno = errno;
+		sigdelset(&(this->signals), signo);
+		if (!this->signal_handlers[signo].callback)
+			pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+		errno = saved_errno;
+		fail_if (1);
+	}
+
+	this->signal_handlers[signo].callback = callback;
+	this->signal_handlers[signo].user_data = user_data;
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Stop receiving a signal with the event loop,
+ * and unblock it in the calling thread
+ * 
+ * @param   this   The event loop
+ * @param   signo  The signal
+ * @return         Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+int
+event_loop_remove_signal(event_loop_t *restrict this, int signo)
+{
+	sigset_t set;
+
+	if (signo <= 0 || signo >= NSIG || !this->signal_handlers || !this->signal_handlers[signo].callback)
+		return 0;
+
+	sigdelset(&(this->signals), signo);
+	fail_if (update_signal_fd(this) < 0);
+	this->signal_handlers[signo].callback = NULL;
+	this->signal_handlers[signo].user_data = NULL;
+
+	sigemptyset(&set);
+	sigaddset(&set, signo);
+	fail_if ((errno = pthread_sigmask(SIG_UNBLOCK, &set, NULL)));
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Make the thread that is waiting in `event_loop_dispatch`
+ * return, or make the next call return immediately
+ * 
+ * This function is async-signal-safe, and may
+ * be called from any thread
+ * 
+ * @param   this  The event loop
+ * @return        Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+int
+event_loop_wake(event_loop_t *restrict this)
+{
+	uint64_t one = 1;
+	int saved_errno = errno;
+
+	/* EAGAIN means that the counter is saturated, so the loop will wake anyway. */
+	if (write(this->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		return -1;
+	errno = saved_errno;
+	return 0;
+}
+
+
+/**
+ * Call the functions of the signals that have been received
+ * 
+ * @param   this  The event loop
+ * @return        Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+static int __attribute__((nonnull))
+dispatch_signals(event_loop_t *restrict this)
+{
+	struct signalfd_siginfo info;
+	event_loop_signal_t *handler;
+	ssize_t got;
+
+	for (;;) {
+		got = read(this->signal_fd, &info, sizeof(info));
+		if (got < 0 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		fail_if (got < 0);
+		if ((size_t)got < sizeof(info) || info.ssi_signo >= NSIG)
+			continue;
+		handler = this->signal_handlers + info.ssi_signo;
+		if (handler->callback)
+			fail_if (handler->callback((int)(info.ssi_signo), handler->user_data) < 0);
+	}
+fail:
+	return -1;
+}
+
+
+/**
+ * Wait until at least one event has occurred, and
+ * call the functions of all events that have occurred
+ * 
+ * @param   this     The event loop
+ * @param   timeout  The maximum number of milliseconds to wait,
+ *                   -1 to wait until an event occurs
+ * @return           The number of events that were dispatched, -1 on
+ *                   error, `errno` will have been set accordingly.
+ *                   Zero is returned if the wait was interrupted,
+ *                   timed out, or `event_loop_wake` was called
+ */
+int
+event_loop_dispatch(event_loop_t *restrict this, int timeout)
+{
+	struct epoll_event events[EVENT_LOOP_BATCH];
+	event_loop_handler_t *handler;
+	uint64_t counter;
+	int i, n, fd, dispatched = 0;
+
+	n = epoll_wait(this->epoll_fd, events, EVENT_LOOP_BATCH, timeout);
+	if (n < 0 && errno == EINTR)
+		return 0;
+	fail_if (n < 0);
+
+	for (i = 0; i < n; i++) {
+		fd = events[i].data.fd;
+		/* An earlier function may have removed the file descriptor. */
+		if ((size_t)fd >= this->handlers_size)
+			continue;
+		handler = this->handlers + fd;
+		switch (handler->kind) {
+		case EVENT_LOOP_FD:
+			fail_if (handler->fd_callback(fd, events[i].events, handler->user_data) < 0);
+			dispatched++;
+			break;
+
+		case EVENT_LOOP_TIMER:
+			/* EAGAIN if the timer was rearmed after it expired. */
+			if (read(fd, &counter, sizeof(counter)) < (ssize_t)sizeof(counter))
+				break;
+			fail_if (handler->timer_callback(fd, counter, handler->user_data) < 0);
+			dispatched++;
+			break;
+
+		case EVENT_LOOP_SIGNAL:
+			fail_if (dispatch_signals(this) < 0);
+			dispatched++;
+			break;
+
+		case EVENT_LOOP_WAKEUP:
+			if (read(fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+				fail_if (errno != EINTR);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return dispatched;
+fail:
+	return -1;
+}
+
@@ -0,0 +1,349 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSSERVER_EVENT_LOOP_H
+#define MDS_LIBMDSSERVER_EVENT_LOOP_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <signal.h>
+#include <time.h>
+
+
+
+/**
+ * Function called when a file descriptor is ready
+ * 
+ * @param   fd         The file descriptor
+ * @param   events     The events that occurred, as reported by epoll(7)
+ * @param   user_data  The data the file descriptor was added with
+ * @return             Zero on success, -1 on error, `errno` shall
+ *                     be set accordingly, and the dispatch stops
+ */
+typedef int event_loop_fd_callback_t(int fd, uint32_t events, void *user_data);
+
+/**
+ * Function called when a timer expires
+ * 
+ * @param   timer        The ID of the timer
+ * @param   expirations  The number of times the timer has expired
+ *                       since it was set or the function was called
+ * @param   user_data    The data the timer was added with
+ * @return               Zero on success, -1 on error, `errno` shall
+ *                       be set accordingly, and the dispatch stops
+ */
+typedef int event_loop_timer_callback_t(int timer, uint64_t expirations, void *user_data);
+
+/**
+ * Function called when a signal has been received
+ * 
+ * @param   signo      The signal
+ * @param   user_data  The data the signal was added with
+ * @return             Zero on success, -1 on error, `errno` shall
+ *                     be set accordingly, and the dispatch stops
+ */
+typedef int event_loop_signal_callback_t(int signo, void *user_data);
+
+
+/**
+ * What a file descriptor in an event loop is
+ */
+typedef enum event_loop_kind {
+	/**
+	 * The file descriptor is not in the event loop
+	 */
+	EVENT_LOOP_NONE = 0,
+
+	/**
+	 * The file descriptor was added with `event_loop_add_fd`
+	 */
+	EVENT_LOOP_FD,
+
+	/**
+	 * The file descriptor is a timerfd created by `event_loop_add_timer`
+	 */
+	EVENT_LOOP_TIMER,
+
+	/**
+	 * The file descriptor is the signalfd of the event loop
+	 */
+	EVENT_LOOP_SIGNAL,
+
+	/**
+	 * The file descriptor is the eventfd of the event loop
+	 */
+	EVENT_LOOP_WAKEUP
+
+} event_loop_kind_t;
+
+
+/**
+ * A file descriptor in an event loop
+ */
+typedef struct event_loop_handler {
+	/**
+	 * What the file descriptor is
+	 */
+	event_loop_kind_t kind;
+
+	/**
+	 * The function to call, if `kind` is `EVENT_LOOP_FD`
+	 */
+	event_loop_fd_callback_t *fd_callback;
+
+	/**
+	 * The function to call, if `kind` is `EVENT_LOOP_TIMER`
+	 */
+	event_loop_timer_callback_t *timer_callback;
+
+	/**
+	 * The data to pass to the function
+	 */
+	void *user_data;
+
+} event_loop_handler_t;
+
+
+/**
+ * A signal in an event loop
+ */
+typedef struct event_loop_signal {
+	/**
+	 * The function to call, `NULL` if the signal is not in the event loop
+	 */
+	event_loop_signal_callback_t *callback;
+
+	/**
+	 * The data to pass to the function
+	 */
+	void *user_data;
+
+} event_loop_signal_t;
+
+
+/**
+ * An event loop, that waits for file descriptors, timers,
+ * and signals with a single epoll(7) instance, using
+ * timerfd_create(2) for timers and signalfd(2) for signals
+ * 
+ * An event loop may only be modified and dispatched by one
+ * thread, other threads and signal handlers may however
+ * call `event_loop_wake`
+ * 
+ * Be aware, this structure cannot be marshalled, file
+ * descriptors are added to the event loop again after
+ * re-exec, and timers and the event loop are created anew
+ */
+typedef struct event_loop {
+	/**
+	 * The epoll(7) instance
+	 */
+	int epoll_fd;
+
+	/**
+	 * The signalfd(2), -1 if no signal has been added
+	 */
+	int signal_fd;
+
+	/**
+	 * eventfd(2) used by `event_loop_wake`
+	 */
+	int wakeup_fd;
+
+	/**
+	 * The signals that have been added, they are
+	 * blocked in the thread that added them
+	 */
+	sigset_t signals;
+
+	/**
+	 * Map from file descriptors to what they are
+	 */
+	event_loop_handler_t *handlers;
+
+	/**
+	 * The number of elements in `handlers`
+	 */
+	size_t handlers_size;
+
+	/**
+	 * Map from signal numbers to the functions to call,
+	 * `NULL` if no signal has been added
+	 */
+	event_loop_signal_t *signal_handlers;
+
+} event_loop_t;
+
+
+
+/**
+ * Create an event loop
+ * 
+ * @param   this  Memory slot in which to store the new event loop
+ * @return        Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+__attribute__((nonnull))
+int event_loop_initialise(event_loop_t *restrict this);
+
+/**
+ * Release all resources in an event loop, should be done even
+ * if construction fails, file descriptors that have been added
+ * with `event_loop_add_fd` are not closed, and signals that have
+ * been added remain blocked
+ * 
+ * @param  this  The event loop
+ */
+__attribute__((nonnull))
+void event_loop_destroy(event_loop_t *restrict this);
+
+/**
+ * Wait for a file descriptor to become ready
+ * 
+ * @param   this       The event loop
+ * @param   fd         The file descriptor
+ * @param   events     The events to wait for, as for epoll_ctl(2),
+ *                     `EPOLLIN` to wait until it is readable
+ * @param   callback   The function to call when the file descriptor is ready
+ * @param   user_data  Data to pass to `callback`
+ * @return             Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+__attribute__((nonnull(1, 4)))
+int event_loop_add_fd(event_loop_t *restrict this, int fd, uint32_t events,
+                      event_loop_fd_callback_t *callback, void *user_data);
+
+/**
+ * Change the events to wait for on a file descriptor
+ * that has been added with `event_loop_add_fd`
+ * 
+ * @param   this    The event loop
+ * @param   fd      The file descriptor
+ * @param   events  The events to wait for, as for epoll_ctl(2)
+ * @return          Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+__attribute__((nonnull))
+int event_loop_modify_fd(event_loop_t *restrict this, int fd, uint32_t events);
+
+/**
+ * Stop waiting for a file descriptor, this shall
+ * be done before the file descriptor is closed
+ * 
+ * @param  this  The event loop
+ * @param  fd    The file descriptor
+ */
+__attribute__((nonnull))
+void event_loop_remove_fd(event_loop_t *restrict this, int fd);
+
+/**
+ * Create a timer on the monotonic clock
+ * 
+ * @param   this       The event loop
+ * @param   delay      The time until the timer expires the first time,
+ *                     `NULL` to create the timer disarmed
+ * @param   interval   The time between subsequent expirations,
+ *                     `NULL` if the timer shall only expire once
+ * @param   callback   The function to call when the timer expires
+ * @param   user_data  Data to pass to `callback`
+ * @return             The ID of the timer, -1 on error, `errno`
+ *                     will have been set accordingly
+ */
+__attribute__((nonnull(1, 4)))
+int event_loop_add_timer(event_loop_t *restrict this, const struct timespec *delay,
+                         const struct timespec *interval, event_loop_timer_callback_t *callback,
+                         void *user_data);
+
+/**
+ * Rearm or disarm a timer
+ * 
+ * @param   this      The event loop
+ * @param   timer     The ID of the timer
+ * @param   delay     The time until the timer expires the first time,
+ *                    `NULL` to disarm the timer
+ * @param   interval  The time between subsequent expirations,
+ *                    `NULL` if the timer shall only expire once
+ * @return            Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+__attribute__((nonnull(1)))
+int event_loop_set_timer(event_loop_t *restrict this, int timer,
+                         const struct timespec *delay, const struct timespec *interval);
+
+/**
+ * Destroy a timer
+ * 
+ * @param  this   The event loop
+ * @param  timer  The ID of the timer
+ */
+__attribute__((nonnull))
+void event_loop_remove_timer(event_loop_t *restrict this, int timer);
+
+/**
+ * Receive a signal with the event loop rather than with a signal
+ * handler, the signal is blocked in the calling thread, it should
+ * therefore be added before other threads are created
+ * 
+ * @param   this       The event loop
+ * @param   signo      The signal
+ * @param   callback   The function to call when the signal has been received
+ * @param   user_data  Data to pass to `callback`
+ * @return             Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+__attribute__((nonnull(1, 3)))
+int event_loop_add_signal(event_loop_t *restrict this, int signo,
+                          event_loop_signal_callback_t *callback, void *user_data);
+
+/**
+ * Stop receiving a signal with the event loop,
+ * and unblock it in the calling thread
+ * 
+ * @param   this   The event loop
+ * @param   signo  The signal
+ * @return         Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+__attribute__((nonnull))
+int event_loop_remove_signal(event_loop_t *restrict this, int signo);
+
+/**
+ * Make the thread that is waiting in `event_loop_dispatch`
+ * return, or make the next call return immediately
+ * 
+ * This function is async-signal-safe, and may
+ * be called from any thread
+ * 
+ * @param   this  The event loop
+ * @return        Zero on success, -1 on error, `errno` will have been set accordingly
+ */
+__attribute__((nonnull))
+int event_loop_wake(event_loop_t *restrict this);
+
+/**
+ * Wait until at least one event has occurred, and
+ * call the functions of all events that have occurred
+ * 
+ * @param   this     The event loop
+ * @param   timeout  The maximum number of milliseconds to wait,
+ *                   -1 to wait until an event occurs
+ * @return           The number of events that were dispatched, -1 on
+ *                   error, `errno` will have been set accordingly.
+ *                   Zero is returned if the wait was interrupted,
+ *                   timed out, or `event_loop_wake` was called
+ */
+__attribute__((nonnull))
+int event_loop_dispatch(event_loop_t *restrict this, int timeout);
+
+
+#endif
+
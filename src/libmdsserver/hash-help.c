@@ -0,0 +1,180 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "hash-help.h"
+#include "config.h"
+#include "macros.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+
+
+/**
+ * The seed used by `string_hash`
+ * 
+ * This is randomised by `string_hash_seed_initialise`
+ * and must be preserved across re-exec as hashes are
+ * marshalled
+ */
+uint64_t string_hash_seed = 0;
+
+/**
+ * Whether `string_hash` uses the classic byte-wise,
+ * unseeded hash, rather than the seeded hash
+ * 
+ * This is set when the state is unmarshalled from an
+ * image that only had the byte-wise hash, and must be
+ * preserved across re-exec as hashes are marshalled
+ */
+#ifdef BYTEWISE_STRING_HASH
+int string_hash_bytewise = 1;
+#else
+int string_hash_bytewise = 0;
+#endif
+
+
+
+/**
+ * Randomise `string_hash_seed`
+ * 
+ * This must be done before any string is hashed,
+ * and must not be done after a re-exec, instead the
+ * old seed should be unmarshalled
+ * 
+ * @return  Zero on success, -1 on error, the seed will
+ *          be set to a (poorer) non-constant value on error
+ */
+int
+string_hash_seed_initialise(void)
+{
+	struct timespec now;
+	uint64_t seed = 0;
+	ssize_t got = -1;
+	int fd, saved_errno;
+
+	fd = open(TOKEN_RANDOM, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		do
+			got = read(fd, &seed, sizeof(seed));
+		while (got < 0 && errno == EINTR);
+		saved_errno = errno;
+		xclose(fd);
+		errno = saved_errno;
+	}
+
+	if (got != (ssize_t)sizeof(seed)) {
+		saved_errno = got < 0 ? errno : EIO;
+		monotone(&now);
+		seed  = (uint64_t)getpid() << 32;
+		seed ^= (uint64_t)now.tv_sec * UINT64_C(1000000007);
+		seed ^= (uint64_t)now.tv_nsec;
+		string_hash_seed = seed;
+		return errno = saved_errno, -1;
+	}
+
+	string_hash_seed = seed;
+	return 0;
+}
+
+
+/**
+ * Multiply two 64-bit integers and fold the
+ * upper and lower halves of the 128-bit
+ * product into one 64-bit integer
+ * 
+ * @param   a  One of the factors
+ * @param   b  The other factor
+ * @return     The folded product
+ */
+static uint64_t __attribute__((const))
+string_hash_mix(uint64_t a, uint64_t b)
+{
+	__extension__ typedef unsigned __int128 uint128_t;
+	uint128_t r = (uint128_t)a * (uint128_t)b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+
+/**
+ * Read up to 8 bytes of a string, in little-endian order
+ * 
+ * @param   str  The string
+ * @param   n    The number of bytes to read, at most 8
+ * @return       The read bytes
+ */
+static uint64_t __attribute__((pure))
+string_hash_read(const char *str, size_t n)
+{
+	uint64_t word = 0;
+	size_t i;
+
+	if (n == 8) {
+		__builtin_memcpy(&word, str, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		word = __builtin_bswap64(word);
+#endif
+	} else {
+		for (i = 0; i < n; i++)
+			word |= (uint64_t)(unsigned char)str[i] << (i * 8);
+	}
+
+	return word;
+}
+
+
+/**
+ * Calculate the hash of a string
+ * 
+ * Unless `string_hash_bytewise` is set, the string
+ * is hashed 8 bytes at a time (with a function in
+ * the spirit of wyhash) and the hash depends on
+ * `string_hash_seed`
+ * 
+ * @param   str  The string
+ * @return       The hash of the string
+ */
+size_t
+string_hash(const char *str)
+{
+	const uint64_t p0 = UINT64_C(0xa0761d6478bd642f);
+	const uint64_t p1 = UINT64_C(0xe7037ed1a0b428db);
+	uint64_t hash = string_hash_seed ^ p0;
+	size_t n, len;
+
+	if (!str)
+		return 0;
+
+	if (string_hash_bytewise) {
+		for (n = 0; *str; str++)
+			n = n * 31 + (size_t)(unsigned char)*str;
+		return n;
+	}
+
+	n = len = strlen(str);
+	for (; n > 16; n -= 16, str += 16)
+		hash = string_hash_mix(string_hash_read(str, 8) ^ p1,
+		                       string_hash_read(str + 8, 8) ^ hash);
+	if (n > 8)
+		hash = string_hash_mix(string_hash_read(str, 8) ^ p1,
+		                       string_hash_read(str + 8, n - 8) ^ hash);
+	else
+		hash = string_hash_mix(string_hash_read(str, n) ^ p1, hash);
+
+	return (size_t)string_hash_mix(hash ^ (uint64_t)len, p1);
+}
@@ -21,25 +21,56 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+
+
+
+/**
+ * The seed used by `string_hash`
+ * 
+ * This is randomised by `string_hash_seed_initialise`
+ * and must be preserved across re-exec as hashes are
+ * marshalled
+ */
+extern uint64_t string_hash_seed;
+
+/**
+ * Whether `string_hash` uses the classic byte-wise,
+ * unseeded hash, rather than the seeded hash
+ * 
+ * This is set when the state is unmarshalled from an
+ * image that only had the byte-wise hash, and must be
+ * preserved across re-exec as hashes are marshalled
+ */
+extern int string_hash_bytewise;
+
+
+/**
+ * Randomise `string_hash_seed`
+ * 
+ * This must be done before any string is hashed,
+ * and must not be done after a re-exec, instead the
+ * old seed should be unmarshalled
+ * 
+ * @return  Zero on success, -1 on error, the seed will
+ *          be set to a (poorer) non-constant value on error
+ */
+int string_hash_seed_initialise(void);
 
 
 /**
  * Calculate the hash of a string
  * 
+ * Unless `string_hash_bytewise` is set, the string
+ * is hashed 8 bytes at a time (with a function in
+ * the spirit of wyhash) and the hash depends on
+ * `string_hash_seed`
+ * 
  * @param   str  The string
  * @return       The hash of the string
  */
-static inline size_t __attribute__((pure))
-string_hash(const char *str)
-{
-	size_t hash = 0;
-
-	if (str)
-		while (*str != '\0')
-			hash = hash * 31 + (size_t)(unsigned char)*str++;
-
-	return hash;
-}
+__attribute__((pure))
+size_t string_hash(const char *str);
 
 
 /**
@@ -309,6 +309,20 @@ T##_clone(const T##_t *restrict this, T##_t *restrict out)\
 }\
 \
 \
+/**
+ * Calculate the number of bytes that `T##_pack` would free
+ * 
+ * @param   this  The list
+ * @return        The number of bytes that packing the list would free
+ */\
+static inline size_t __attribute__((unused, pure, nonnull))\
+T##_reclaimable(const T##_t *restrict this)\
+{\
+	size_t n = this->used - this->unused;\
+	return (this->allocated - (n ? n : 1)) * sizeof(T##_entry_t);\
+}\
+\
+\
 /**
  * Pack the list so that there are no reusable
  * positions, and reduce the capacity to the
@@ -336,12 +350,14 @@ T##_pack(T##_t *restrict this)\
 		this->last = 0;\
 	}\
 	\
-	if (this->used < this->allocated) {\
-		slots = realloc(slots, this->used * sizeof(T##_entry_t));\
+	/* Keep one slot, the allocation cannot grow from zero slots. */\
+	n = this->used ? this->used : 1;\
+	if (n < this->allocated) {\
+		slots = realloc(slots, n * sizeof(T##_entry_t));\
 		if (!slots)\
 			return -1;\
 		this->slots = slots;\
-		this->allocated = this->used;\
+		this->allocated = n;\
 	}\
 	\
 	return 0;\
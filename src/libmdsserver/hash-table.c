@@ -84,7 +84,7 @@ rehash(hash_table_t *restrict this)
 	this->threshold = (size_t)((float)(this->capacity) * this->load_factor);
 
 	while (i--) {
-		bucket = this->buckets[i];
+		bucket = old_buckets[i];
 		while (bucket) {
 			index = truncate_hash(this, bucket->hash);
 			if ((destination = this->buckets[index])) {
@@ -134,6 +134,21 @@ fail:
 }
 
 
+/**
+ * Calculate the number of bytes that
+ * `linked_list_pack` would free
+ * 
+ * @param   this  The list
+ * @return        The number of bytes that packing the list would free
+ */
+size_t
+linked_list_reclaimable(const linked_list_t *restrict this)
+{
+	size_t cap = to_power_of_two(this->end - this->reuse_head);
+	return (this->capacity - cap) * (sizeof(size_t) + 3 * sizeof(ssize_t));
+}
+
+
 /**
  * Pack the list so that there are no reusable
  * positions, and reduce the capacity to the
@@ -194,7 +209,9 @@ linked_list_pack(linked_list_t *restrict this)
 		this->previous[i] = (ssize_t)(i - 1);
 	this->previous[0] = (ssize_t)(size - 1);
 
+	free(this->values);
 	this->values = vals;
+	this->capacity = cap;
 	this->end = size;
 	this->reuse_head = 0;
 
@@ -205,6 +222,7 @@ fail:
 	free(vals);
 	free(new_next);
 	free(new_previous);
+	free(new_reusable);
 	return errno = saved_errno, -1;
 }
 
@@ -136,6 +136,16 @@ void linked_list_destroy(linked_list_t *restrict this);
 __attribute__((nonnull))
 int linked_list_clone(const linked_list_t *restrict this, linked_list_t *restrict out);
 
+/**
+ * Calculate the number of bytes that
+ * `linked_list_pack` would free
+ * 
+ * @param   this  The list
+ * @return        The number of bytes that packing the list would free
+ */
+__attribute__((pure, nonnull))
+size_t linked_list_reclaimable(const linked_list_t *restrict this);
+
 /**
  * Pack the list so that there are no reusable
  * positions, and reduce the capacity to the
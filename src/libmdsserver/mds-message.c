@@ -19,10 +19,15 @@
 
 #include "macros.h"
 #include "util.h"
+#include "utf8.h"
+#include "memfd.h"
+#include "ring.h"
+#include "binary.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/socket.h>
 
@@ -49,6 +54,15 @@ mds_message_initialise(mds_message_t *restrict this)
 	this->buffer_size = 128;
 	this->buffer_ptr = 0;
 	this->stage = 0;
+	this->stream_threshold = 0;
+	this->streaming = 0;
+	this->payload_fd = -1;
+	this->keep_payload_fd = 0;
+	this->fds = NULL;
+	this->fd_count = 0;
+	this->fd_batches = 0;
+	this->ring = NULL;
+	this->binary = 0;
 	fail_if (xmalloc(this->buffer, this->buffer_size, char));
 	return 0;
 fail:
@@ -73,6 +87,15 @@ mds_message_zero_initialise(mds_message_t *restrict this)
 	this->buffer_size = 0;
 	this->buffer_ptr = 0;
 	this->stage = 0;
+	this->stream_threshold = 0;
+	this->streaming = 0;
+	this->payload_fd = -1;
+	this->keep_payload_fd = 0;
+	this->fds = NULL;
+	this->fd_count = 0;
+	this->fd_batches = 0;
+	this->ring = NULL;
+	this->binary = 0;
 }
 
 
@@ -91,6 +114,14 @@ mds_message_destroy(mds_message_t *restrict this)
 
 	free(this->payload), this->payload = NULL;
 	free(this->buffer),  this->buffer  = NULL;
+
+	if (this->payload_fd >= 0)
+		close(this->payload_fd), this->payload_fd = -1;
+	for (i = 0; i < this->fd_count; i++)
+		close(this->fds[i]);
+	free(this->fds), this->fds = NULL;
+	this->fd_count = 0;
+	this->fd_batches = 0;
 }
 
 
@@ -113,6 +144,32 @@ fail:
 }
 
 
+/**
+ * Calculate the size of a read buffer that is large
+ * enough, the size is a 2-power-multiple of 128 bytes
+ * 
+ * @param   used  The number of bytes used in the buffer
+ * @return        The size the buffer should be allocated with
+ */
+static size_t __attribute__((const))
+buffer_size_for(size_t used)
+{
+	size_t size = (used + 127) >> 7;
+	if (!size)
+		return 128;
+	size -= 1;
+	size |= size >> 1;
+	size |= size >> 2;
+	size |= size >> 4;
+	size |= size >> 8;
+	size |= size >> 16;
+#if SIZE_MAX == UINT64_MAX
+	size |= size >> 32;
+#endif
+	return (size + 1) << 7;
+}
+
+
 /**
  * Extend the read buffer by way of doubling
  * 
@@ -133,14 +190,38 @@ fail:
 
 
 /**
- * Reset the header list and the payload
+ * Get the number of file descriptors, at the beginning
+ * of the queue, that belong to the message being read,
+ * or the message that was last read
+ * 
+ * @param   this  The message
+ * @return        The number of file descriptors
+ */
+static size_t __attribute__((pure, nonnull))
+owned_fds(const mds_message_t *restrict this)
+{
+	size_t i, pending = 0;
+	for (i = 0; i < this->fd_batches; i++)
+		pending += this->fd_batch_sizes[i];
+	return this->fd_count > pending ? this->fd_count - pending : 0;
+}
+
+
+/**
+ * Reset the header list and the payload, and close the file
+ * descriptors the last message was sent with but that were not
+ * claimed, so that a client cannot make the server keep an
+ * unlimited number of file descriptors open
  * 
  * @param  this  The message
  */
 static void __attribute__((nonnull))
 reset_message(mds_message_t *restrict this)
 {
-	size_t i;
+	size_t i, n = owned_fds(this);
+	for (i = 0; i < n; i++)
+		close(memfd_take(this->fds, &(this->fd_count)));
+
 	if (this->headers)
 		xfree(this->headers, this->header_count);
 	this->header_count = 0;
@@ -149,6 +230,10 @@ reset_message(mds_message_t *restrict this)
 	this->payload = NULL;
 	this->payload_size = 0;
 	this->payload_ptr = 0;
+	this->streaming = 0;
+
+	if (this->payload_fd >= 0)
+		close(this->payload_fd), this->payload_fd = -1;
 }
 
 
@@ -156,31 +241,81 @@ reset_message(mds_message_t *restrict this)
  * Read the headers the message and determine, and store, its payload's length
  * 
  * @param   this  The message
- * @return        Zero on success, negative on error (malformated message: unrecoverable state)
+ * @return        Zero on success, 1 if the payload is in a memfd,
+ *                negative on error (malformated message: unrecoverable state)
  */
 static int __attribute__((pure, nonnull))
 get_payload_length(mds_message_t *restrict this)
 {
 	char *header;
 	size_t i;
-  
+	int found = 0, memfd = 0;
+
 	for (i = 0; i < this->header_count; i++) {
 		if (strstr(this->headers[i], "Length: ") == this->headers[i]) {
-			/* Store the message length. */
 			header = this->headers[i] + strlen("Length: ");
-			this->payload_size = atoz(header);
+		} else if (strstr(this->headers[i], MEMFD_LENGTH_HEADER) == this->headers[i]) {
+			header = this->headers[i] + strlen(MEMFD_LENGTH_HEADER);
+			memfd = 1;
+		} else {
+			continue;
+		}
 
-			/* Do not except a length that is not correctly formated. */
-			for (; *header; header++)
-				if (*header < '0' || '9' < *header)
-					return -2; /* Malformated value, enters unrecoverable state. */
+		/* Do not accept both an inline payload and a payload in a memfd. */
+		if (found++)
+			return -2;
 
-			/* Stop searching for the ‘Length’ header, we have found and parsed it. */
-			break;
-		}
+		/* Store the message length. */
+		this->payload_size = atoz(header);
+
+		/* Do not except a length that is not correctly formated. */
+		for (; *header; header++)
+			if (*header < '0' || '9' < *header)
+				return -2; /* Malformated value, enters unrecoverable state. */
+	}
+
+	return memfd;
+}
+
+
+/**
+ * Claim the memfd that was sent with the message and
+ * either keep it or read the payload from it
+ * 
+ * @param   this  The message
+ * @return        The return value follows the rules of `mds_message_read`
+ */
+static int __attribute__((nonnull))
+claim_memfd(mds_message_t *restrict this)
+{
+	int fd;
+
+	/* The memfd is sent with the first bytes of the message, so it
+	   has been received, unless the sender did not send it, and
+	   no other file descriptor may be sent with the message. */
+	if (owned_fds(this) != 1)
+		return -2;
+	fd = memfd_take(this->fds, &(this->fd_count));
+	if (memfd_verify(fd, this->payload_size)) {
+		close(fd);
+		return -2;
+	}
+
+	if (this->keep_payload_fd) {
+		this->payload_fd = fd;
+	} else if (this->payload_size > 0) {
+		fail_if (xmalloc(this->payload, this->payload_size, char));
+		fail_if (memfd_read(fd, this->payload, this->payload_size));
+		close(fd);
+	} else {
+		close(fd);
 	}
 
+	this->payload_ptr = this->payload_size;
 	return 0;
+fail:
+	close(fd);
+	return -1;
 }
 
 
@@ -196,7 +331,7 @@ validate_header(const char *header, size_t length)
 {
 	char *p = memchr(header, ':', length * sizeof(char));
 
-	if (verify_utf8(header, 0) < 0)
+	if (verify_utf8_n(header, length, 0) < 0)
 		/* Either the string is not UTF-8, or your are under an UTF-8 attack,
 		   let's just call this unrecoverable because the client will not correct. */
 		return -2;
@@ -219,9 +354,44 @@ validate_header(const char *header, size_t length)
 static void __attribute__((nonnull))
 unbuffer_beginning(mds_message_t *restrict this, size_t length, int update_ptr)
 {
+	size_t i;
+
 	memmove(this->buffer, this->buffer + length, (this->buffer_ptr - length) * sizeof(char));
 	if (update_ptr)
 		this->buffer_ptr -= length;
+
+	/* A batch of file descriptors belongs to the message
+	   that contains the last byte received with it. */
+	while (this->fd_batches && this->fd_batch_ends[0] <= length) {
+		this->fd_batches -= 1;
+		memmove(this->fd_batch_sizes, this->fd_batch_sizes + 1, this->fd_batches * sizeof(size_t));
+		memmove(this->fd_batch_ends, this->fd_batch_ends + 1, this->fd_batches * sizeof(size_t));
+	}
+	for (i = 0; i < this->fd_batches; i++)
+		this->fd_batch_ends[i] -= length;
+}
+
+
+/**
+ * Allocate the payload, unless it is to be streamed
+ * 
+ * @param   this  The message, `payload_size` must be set
+ * @return        The return value follows the rules of `mds_message_read`
+ */
+static int __attribute__((nonnull))
+allocate_payload(mds_message_t *restrict this)
+{
+	/* Large payloads are streamed instead of buffered if so requested. */
+	if (this->stream_threshold && this->payload_size >= this->stream_threshold)
+		return this->streaming = 1;
+
+	/* Allocate the payload buffer. */
+	if (this->payload_size > 0)
+		fail_if (xmalloc(this->payload, this->payload_size, char));
+
+	return 0;
+fail:
+	return -1;
 }
 
 
@@ -235,20 +405,20 @@ unbuffer_beginning(mds_message_t *restrict this, size_t length, int update_ptr)
 static int __attribute__((nonnull))
 initialise_payload(mds_message_t *restrict this)
 {
+	int r;
+
 	/* Remove the \n (end of empty line) we found from the buffer. */
 	unbuffer_beginning(this, 1, 1);
 
 	/* Get the length of the payload. */
-	if (get_payload_length(this) < 0)
+	if ((r = get_payload_length(this)) < 0)
 		return -2; /* Malformated value, enters unrecoverable state. */
 
-	/* Allocate the payload buffer. */
-	if (this->payload_size > 0)
-		fail_if (xmalloc(this->payload, this->payload_size, char));
+	/* The payload may have been sent in a memfd rather than inline. */
+	if (r)
+		return claim_memfd(this);
 
-	return 0;
-fail:
-	return -1;
+	return allocate_payload(this);
 }
 
 
@@ -290,17 +460,90 @@ fail:
 }
 
 
+/**
+ * Translate the headers of a frame in the binary encoding,
+ * whose fixed header and header section are in the read
+ * buffer, to the text encoding, remove them from the
+ * buffer and allocate the payload
+ * 
+ * @param   this            The message
+ * @param   header_length   The length of the header section
+ * @param   payload_length  The length of the payload
+ * @return                  The return value follows the rules of `mds_message_read`
+ */
+static int __attribute__((nonnull))
+decode_frame(mds_message_t *restrict this, size_t header_length, uint64_t payload_length)
+{
+	const char *p = this->buffer + BINARY_FRAME_HEADER_SIZE, *end = p + header_length;
+	const char *name, *value;
+	size_t name_length, value_length, header_commit_buffer = 0;
+	char *header, buf[sizeof("Length: ") + 3 * sizeof(size_t)];
+	int r;
+
+	if (payload_length > SIZE_MAX)
+		return -2;
+
+	while ((r = binary_next_header(&p, end, &name, &name_length, &value, &value_length)) > 0) {
+		/* Make sure that the header is UTF-8, like in the text encoding. */
+		if (verify_utf8_n(name, name_length, 0) < 0 || verify_utf8_n(value, value_length, 0) < 0)
+			return -2;
+
+		if (!header_commit_buffer)
+			fail_if (mds_message_extend_headers(this, header_commit_buffer = 8));
+		fail_if (xmalloc(header, name_length + value_length + 3, char));
+		memcpy(header, name, name_length * sizeof(char));
+		memcpy(header + name_length, ": ", 2 * sizeof(char));
+		memcpy(header + name_length + 2, value, value_length * sizeof(char));
+		header[name_length + 2 + value_length] = '\0';
+		this->headers[this->header_count++] = header;
+		header_commit_buffer -= 1;
+	}
+	if (r < 0)
+		return -2;
+
+	/* The ‘Length’ header is implied by the fixed header. */
+	this->payload_size = (size_t)payload_length;
+	if (this->payload_size) {
+		name_length = (size_t)xsnprintf(buf, "Length: %zu", this->payload_size);
+		fail_if (mds_message_extend_headers(this, 1));
+		fail_if (xmemdup(header, buf, name_length + 1, char));
+		this->headers[this->header_count++] = header;
+	}
+
+	unbuffer_beginning(this, BINARY_FRAME_HEADER_SIZE + header_length, 1);
+	return allocate_payload(this);
+fail:
+	return -1;
+}
+
+
+/**
+ * Close file descriptors that were received
+ * with bytes that they cannot belong to
+ * 
+ * @param  this  The message
+ * @param  keep  The number of file descriptors to keep
+ */
+static void __attribute__((nonnull))
+discard_fds(mds_message_t *restrict this, size_t keep)
+{
+	while (this->fd_count > keep)
+		close(this->fds[--(this->fd_count)]);
+}
+
+
 /**
  * Continue reading from the socket into the buffer
  * 
- * @param   this  The message
- * @param   fd    The file descriptor of the socket
- * @return        The return value follows the rules of `mds_message_read`
+ * @param   this   The message
+ * @param   fd     The file descriptor of the socket
+ * @param   flags  Additional flags for recv(3)
+ * @return         The return value follows the rules of `mds_message_read`
  */
 static int __attribute__((nonnull))
-continue_read(mds_message_t *restrict this, int fd)
+continue_read(mds_message_t *restrict this, int fd, int flags)
 {
-	size_t n;
+	size_t n, fd_count = this->fd_count;
 	ssize_t got;
 	int r;
 
@@ -316,11 +559,28 @@ continue_read(mds_message_t *restrict this, int fd)
 		n = this->buffer_size - this->buffer_ptr;
 	}
 
-	/* Then read from the socket. */
+	/* Then read from the socket, or the ring if the client has set one up. */
 	errno = 0;
-	got = recv(fd, this->buffer + this->buffer_ptr, n, 0);
+	if (this->ring)
+		got = ring_recv(this->ring, this->buffer + this->buffer_ptr, n, fd, flags & MSG_DONTWAIT);
+	else
+		got = memfd_recv(fd, this->buffer + this->buffer_ptr, n, flags, &(this->fds), &(this->fd_count));
 	this->buffer_ptr += (size_t)(got < 0 ? 0 : got);
-	fail_if (errno);
+
+	/* Remember which bytes file descriptors were received with, a sender
+	   sends at most one batch with each message, so at most the message
+	   being read and the next message can have batches that are pending. */
+	if (got > 0 && this->fd_count > fd_count) {
+		if (this->fd_batches == MDS_MESSAGE_FD_BATCHES_MAX) {
+			discard_fds(this, fd_count);
+			return -2;
+		}
+		this->fd_batch_sizes[this->fd_batches] = this->fd_count - fd_count;
+		this->fd_batch_ends[this->fd_batches++] = this->buffer_ptr;
+	}
+	if (got < 0 && errno == EAGAIN)
+		return -1;
+	fail_if (got < 0);
 	if (!got)
 		fail_if ((errno = ECONNRESET));
 
@@ -333,20 +593,16 @@ fail:
 /**
  * Read the next message from a file descriptor of the socket
  * 
- * @param   this  Memory slot in which to store the new message
- * @param   fd    The file descriptor of the socket
- * @return        Non-zero on error or interruption, `errno` will be
- *                set accordingly. Destroy the message on error,
- *                be aware that the reading could have been
- *                interrupted by a signal rather than canonical error.
- *                If -2 is returned `errno` will not have been set,
- *                -2 indicates that the message is malformated,
- *                which is a state that cannot be recovered from.
+ * @param   this   Memory slot in which to store the new message
+ * @param   fd     The file descriptor of the socket
+ * @param   flags  Additional flags for recv(3)
+ * @return         The return value follows the rules of `mds_message_read`
  */
-int
-mds_message_read(mds_message_t *restrict this, int fd)
+static int __attribute__((nonnull))
+message_read(mds_message_t *restrict this, int fd, int flags)
 {
 	size_t header_commit_buffer = 0, length, need, move;
+	uint64_t payload_length;
 	int r;
 	char *p;
 
@@ -357,11 +613,26 @@ mds_message_read(mds_message_t *restrict this, int fd)
 		this->stage = 0;
 	}
 
+	/* If the caller does not want to stream the payload after all, buffer it. */
+	if (this->streaming) {
+		fail_if (xmalloc(this->payload, this->payload_size, char));
+		this->streaming = 0;
+	}
+
 	/* Read from file descriptor until we have a full message. */
 	for (;;) {
 		/* Stage 0: headers. */
+		/* In the binary encoding, the headers are decoded once the header section has been received. */
+		if (this->binary && !this->stage &&
+		    binary_frame_header(this->buffer, this->buffer_ptr, &length, &payload_length)) {
+			try (decode_frame(this, length, payload_length));
+			this->stage = 1;
+			if (r)
+				return 1;
+		}
 		/* Read all headers that we have stored into the read buffer. */
-		while (!this->stage && ((p = memchr(this->buffer, '\n', this->buffer_ptr * sizeof(char))))) {
+		while (!this->binary && !this->stage &&
+		       ((p = memchr(this->buffer, '\n', this->buffer_ptr * sizeof(char))))) {
 			if ((length = (size_t)(p - this->buffer))) {
 				/* We have found a header. */
 
@@ -383,12 +654,16 @@ mds_message_read(mds_message_t *restrict this, int fd)
 
 				/* Mark end of stage, next stage is getting the payload. */
 				this->stage = 1;
+
+				/* Let the caller stream the payload if it is large. */
+				if (r)
+					return 1;
 			}
 		}
 
 
 		/* Stage 1: payload. */
-		if (this->stage == 1 && this->payload_size > 0) {
+		if (this->stage == 1 && this->payload_ptr < this->payload_size) {
 			/* How much of the payload that has not yet been filled. */
 			need = this->payload_size - this->payload_ptr;
 			/* How much we have of that what is needed. */
@@ -413,8 +688,233 @@ mds_message_read(mds_message_t *restrict this, int fd)
 		/* If stage 1 was not completed. */
 
 		/* Continue reading from the socket into the buffer. */
-		try (continue_read(this, fd));
+		try (continue_read(this, fd, flags));
+	}
+fail:
+	return -1;
+}
+
+
+/**
+ * Calculate the number of bytes that
+ * `mds_message_shrink` would free
+ * 
+ * @param   this  The message
+ * @return        The number of bytes that shrinking the message would free
+ */
+size_t
+mds_message_reclaimable(const mds_message_t *restrict this)
+{
+	return this->buffer ? this->buffer_size - buffer_size_for(this->buffer_ptr) : 0;
+}
+
+
+/**
+ * Shrink the read buffer to the smallest size that
+ * can hold the data that has been read but not yet
+ * used, the buffer is never shrunk on its own, and
+ * can be large after a large message has been read
+ * 
+ * @param   this  The message
+ * @return        Zero on success, -1 on error, `errno`
+ *                will be set accordingly, errors are
+ *                non-fatal
+ */
+int
+mds_message_shrink(mds_message_t *restrict this)
+{
+	size_t size;
+	char *new_buf;
+
+	if (!this->buffer)
+		return 0;
+	size = buffer_size_for(this->buffer_ptr);
+	if (size < this->buffer_size) {
+		new_buf = this->buffer;
+		fail_if (xrealloc(new_buf, size, char));
+		this->buffer = new_buf;
+		this->buffer_size = size;
+	}
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Read the next message from a file descriptor of the socket
+ * 
+ * @param   this  Memory slot in which to store the new message
+ * @param   fd    The file descriptor of the socket
+ * @return        Non-zero on error or interruption, `errno` will be
+ *                set accordingly. Destroy the message on error,
+ *                be aware that the reading could have been
+ *                interrupted by a signal rather than canonical error.
+ *                If -2 is returned `errno` will not have been set,
+ *                -2 indicates that the message is malformated,
+ *                which is a state that cannot be recovered from.
+ */
+int
+mds_message_read(mds_message_t *restrict this, int fd)
+{
+	return message_read(this, fd, 0);
+}
+
+
+/**
+ * Read the next message from a file descriptor of the socket
+ * without blocking, messages that have been received in full
+ * are returned without reading, so when the socket is readable,
+ * this function shall be called until it fails with EAGAIN
+ * 
+ * @param   this  Memory slot in which to store the new message
+ * @param   fd    The file descriptor of the socket, it does
+ *                not need to be in nonblocking mode
+ * @return        The return value follows the rules of `mds_message_read`,
+ *                if the message is not complete, -1 is returned with
+ *                `errno` set to EAGAIN, and the read is resumed when
+ *                the function is called again
+ */
+int
+mds_message_read_nonblocking(mds_message_t *restrict this, int fd)
+{
+	return message_read(this, fd, MSG_DONTWAIT);
+}
+
+
+/**
+ * Wait until data can be read, or the peer hangs up
+ * 
+ * @param   fd       The file descriptor to wait for data on
+ * @param   socket   The socket connected to the peer
+ * @param   timeout  The number of milliseconds to wait, -1 to wait indefinitely
+ * @return           Zero on success, -1 on error or interruption, `errno`
+ *                   will be set accordingly, EAGAIN if the timeout expired
+ */
+static int
+await_input(int fd, int socket, int timeout)
+{
+	struct pollfd pfds[2];
+	int r;
+
+	pfds[0].fd = fd, pfds[0].events = POLLIN, pfds[0].revents = 0;
+	pfds[1].fd = socket, pfds[1].events = POLLRDHUP, pfds[1].revents = 0;
+	r = poll(pfds, fd == socket ? 1 : 2, timeout);
+	if (r < 0)
+		return -1;
+	if (!r)
+		return errno = EAGAIN, -1;
+	return 0;
+}
+
+
+/**
+ * Read the next piece of a payload that is being streamed,
+ * that is, after `mds_message_read` has returned 1
+ * 
+ * @param   this     The message
+ * @param   fd       The file descriptor
+ * @param   buf      Output buffer for the piece of the payload
+ * @param   size     The size of `buf`
+ * @param   got      Output parameter for the number of bytes stored in `buf`,
+ *                   this may be non-zero even if the function fails
+ * @param   timeout  The number of milliseconds to wait for data,
+ *                   -1 to wait indefinitely
+ * @return           Zero on success, -1 on error or interruption, `errno`
+ *                   will be set accordingly, EAGAIN if the timeout
+ *                   expired. The message is complete when
+ *                   `this->payload_ptr == this->payload_size`.
+ */
+int
+mds_message_read_chunk(mds_message_t *restrict this, int fd, char *restrict buf,
+                       size_t size, size_t *restrict got, int timeout)
+{
+	size_t need = this->payload_size - this->payload_ptr, fd_count = this->fd_count;
+	ssize_t n;
+
+	*got = 0;
+	size = min(size, need);
+
+	/* First hand out whatever was read past the headers. */
+	if (this->buffer_ptr) {
+		*got = min(this->buffer_ptr, size);
+		memcpy(buf, this->buffer, *got * sizeof(char));
+		unbuffer_beginning(this, *got, 1);
+	} else if (size) {
+		/* Then read directly into the caller's buffer, but never
+		   past the payload, the next message stays in the socket. */
+		errno = 0;
+		if (this->ring) {
+			/* A ring that is found empty will have its bell rung when written to. */
+			n = ring_recv(this->ring, buf, size, fd, timeout >= 0);
+			if (n < 0 && errno == EAGAIN) {
+				fail_if (await_input(this->ring->bell, fd, timeout));
+				n = ring_recv(this->ring, buf, size, fd, 1);
+			}
+		} else {
+			if (timeout >= 0)
+				fail_if (await_input(fd, fd, timeout));
+			n = memfd_recv(fd, buf, size, 0, &(this->fds), &(this->fd_count));
+		}
+		/* File descriptors are sent with the first bytes of a message, not with its payload. */
+		if (this->fd_count > fd_count) {
+			discard_fds(this, fd_count);
+			fail_if ((errno = EBADMSG));
+		}
+		fail_if (n < 0);
+		if (!n)
+			fail_if ((errno = ECONNRESET));
+		*got = (size_t)n;
 	}
+
+	this->payload_ptr += *got;
+	if (this->payload_ptr == this->payload_size)
+		this->stage = 2;
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Read a payload that was received in a memfd, and kept in
+ * `payload_fd`, into `payload`, and replace the ‘Memfd-Length’
+ * header with a ‘Length’ header
+ * 
+ * @param   this  The message
+ * @return        Zero on success, -1 on error, `errno` will be set accordingly
+ */
+int
+mds_message_inline_payload(mds_message_t *restrict this)
+{
+	char *header = NULL;
+	size_t i, n = strlen(MEMFD_LENGTH_HEADER);
+
+	if (this->payload_fd < 0)
+		return 0;
+
+	for (i = 0; i < this->header_count; i++)
+		if (strstr(this->headers[i], MEMFD_LENGTH_HEADER) == this->headers[i])
+			break;
+	fail_if (i == this->header_count && (errno = EINVAL));
+
+	/* "Memfd-Length: N" ends with "Length: N". */
+	fail_if (xstrdup_nn(header, this->headers[i] + (n - strlen("Length: "))));
+
+	if (this->payload_size > 0) {
+		fail_if (xmalloc(this->payload, this->payload_size, char));
+		fail_if (memfd_read(this->payload_fd, this->payload, this->payload_size));
+	}
+
+	free(this->headers[i]);
+	this->headers[i] = header;
+	close(this->payload_fd);
+	this->payload_fd = -1;
+	return 0;
+fail:
+	free(header);
+	free(this->payload), this->payload = NULL;
+	return -1;
 }
 
 
@@ -428,11 +928,12 @@ mds_message_read(mds_message_t *restrict this, int fd)
 size_t
 mds_message_marshal_size(const mds_message_t *restrict this)
 {
-	size_t i, rc = this->header_count + this->payload_size;
+	size_t i, rc = this->header_count + this->payload_size + this->buffer_ptr;
 	for (i = 0; i < this->header_count; i++)
 		rc += strlen(this->headers[i]);
 	rc *= sizeof(char);
-	rc += 4 * sizeof(size_t) + 2 * sizeof(int);
+	rc += (6 + 2 * MDS_MESSAGE_FD_BATCHES_MAX) * sizeof(size_t) + 3 * sizeof(int);
+	rc += this->fd_count * sizeof(int);
 	return rc;
 }
 
@@ -447,14 +948,25 @@ void
 mds_message_marshal(const mds_message_t *restrict this, char *restrict data)
 {
 	size_t i, n;
+	int streamed;
 
 	buf_set_next(data, int, MDS_MESSAGE_T_VERSION);
 
+	/* A streamed payload is not buffered, and has already been passed on. */
+	streamed = this->payload_fd < 0 && !this->payload;
+
 	buf_set_next(data, size_t, this->header_count);
-	buf_set_next(data, size_t, this->payload_size);
-	buf_set_next(data, size_t, this->payload_ptr);
+	buf_set_next(data, size_t, streamed ? 0 : this->payload_size);
+	buf_set_next(data, size_t, streamed ? 0 : this->payload_ptr);
 	buf_set_next(data, size_t, this->buffer_ptr);
 	buf_set_next(data, int, this->stage);
+	buf_set_next(data, int, this->payload_fd);
+	buf_set_next(data, size_t, this->fd_count);
+	buf_set_next(data, size_t, this->fd_batches);
+	for (i = 0; i < MDS_MESSAGE_FD_BATCHES_MAX; i++) {
+		buf_set_next(data, size_t, i < this->fd_batches ? this->fd_batch_sizes[i] : 0);
+		buf_set_next(data, size_t, i < this->fd_batches ? this->fd_batch_ends[i] : 0);
+	}
 
 	for (i = 0; i < this->header_count; i++) {
 		n = strlen(this->headers[i]) + 1;
@@ -462,10 +974,16 @@ mds_message_marshal(const mds_message_t *restrict this, char *restrict data)
 		buf_next(data, char, n);
 	}
 
-	memcpy(data, this->payload, this->payload_ptr * sizeof(char));
-	buf_next(data, char, this->payload_ptr);
+	/* A payload kept in a memfd is passed on by its file descriptor. */
+	if (!streamed && this->payload_fd < 0) {
+		memcpy(data, this->payload, this->payload_ptr * sizeof(char));
+		buf_next(data, char, this->payload_ptr);
+	}
 
 	memcpy(data, this->buffer, this->buffer_ptr * sizeof(char));
+	buf_next(data, char, this->buffer_ptr);
+
+	memcpy(data, this->fds, this->fd_count * sizeof(int));
 }
 
 
@@ -480,10 +998,10 @@ mds_message_marshal(const mds_message_t *restrict this, char *restrict data)
 int
 mds_message_unmarshal(mds_message_t *restrict this, char *restrict data)
 {
-	size_t i, n, header_count;
+	size_t i, n, header_count, fd_count = 0;
+	int version;
 
-	/* buf_get(data, int, 0, MDS_MESSAGE_T_VERSION); */
-	buf_next(data, int, 1);
+	buf_get_next(data, int, version);
 
 	this->header_count = 0;
 	buf_get_next(data, size_t, header_count);
@@ -491,6 +1009,31 @@ mds_message_unmarshal(mds_message_t *restrict this, char *restrict data)
 	buf_get_next(data, size_t, this->payload_ptr);
 	buf_get_next(data, size_t, this->buffer_size = this->buffer_ptr);
 	buf_get_next(data, int, this->stage);
+	this->payload_fd = -1;
+	this->fd_batches = 0;
+	if (version >= 1) {
+		buf_get_next(data, int, this->payload_fd);
+		buf_get_next(data, size_t, fd_count);
+	}
+	if (version >= 2) {
+		buf_get_next(data, size_t, this->fd_batches);
+		for (i = 0; i < MDS_MESSAGE_FD_BATCHES_MAX; i++) {
+			buf_get_next(data, size_t, this->fd_batch_sizes[i]);
+			buf_get_next(data, size_t, this->fd_batch_ends[i]);
+		}
+	} else if (fd_count && this->buffer_ptr) {
+		/* Older versions did not record which bytes the file descriptors were
+		   received with, they belong to a message that has not been read. */
+		this->fd_batches = 1;
+		this->fd_batch_sizes[0] = fd_count;
+		this->fd_batch_ends[0] = this->buffer_ptr;
+	}
+	this->stream_threshold = 0;
+	this->streaming = 0;
+	this->keep_payload_fd = 0;
+	this->fd_count = 0;
+	this->ring = NULL;
+	this->binary = 0;
 
 	/* Make sure that the pointers are NULL so that they are
 	   not freed without being allocated when the message is
@@ -498,36 +1041,24 @@ mds_message_unmarshal(mds_message_t *restrict this, char *restrict data)
 	this->headers = NULL;
 	this->payload = NULL;
 	this->buffer  = NULL;
+	this->fds     = NULL;
 
-	/* To 2-power-multiple of 128 bytes. */
-	this->buffer_size >>= 7;
-	if (!this->buffer_size) {
-		this->buffer_size = 1;
-	} else {
-		this->buffer_size -= 1;
-		this->buffer_size |= this->buffer_size >> 1;
-		this->buffer_size |= this->buffer_size >> 2;
-		this->buffer_size |= this->buffer_size >> 4;
-		this->buffer_size |= this->buffer_size >> 8;
-		this->buffer_size |= this->buffer_size >> 16;
-#if SIZE_MAX == UINT64_MAX
-		this->buffer_size |= this->buffer_size >> 32;
-#endif
-		this->buffer_size += 1;
-	}
-	this->buffer_size <<= 7;
+	this->buffer_size = buffer_size_for(this->buffer_size);
 
 	/* Allocate header list, payload and read buffer. */
 
 	if (header_count > 0)
 		fail_if (xmalloc(this->headers, header_count, char*));
 
-	if (this->payload_size > 0)
+	if (this->payload_size > 0 && this->payload_fd < 0)
 		fail_if (xmalloc(this->payload, this->payload_size, char));
 
 	fail_if (xmalloc(this->buffer, this->buffer_size, char));
 
-	/* Fill the header list, payload and read buffer. */
+	if (fd_count > 0)
+		fail_if (xmalloc(this->fds, fd_count, int));
+
+	/* Fill the header list, payload, read buffer and file descriptor queue. */
 
 	for (i = 0; i < header_count; i++) {
 		n = strlen(data) + 1;
@@ -536,10 +1067,16 @@ mds_message_unmarshal(mds_message_t *restrict this, char *restrict data)
 		this->header_count++;
 	}
 
-	memcpy(this->payload, data, this->payload_ptr * sizeof(char));
-	buf_next(data, char, this->payload_ptr);
+	if (this->payload_fd < 0) {
+		memcpy(this->payload, data, this->payload_ptr * sizeof(char));
+		buf_next(data, char, this->payload_ptr);
+	}
 
 	memcpy(this->buffer, data, this->buffer_ptr * sizeof(char));
+	buf_next(data, char, this->buffer_ptr);
+
+	memcpy(this->fds, data, fd_count * sizeof(int));
+	this->fd_count = fd_count;
 
 	return 0;
 
@@ -558,7 +1095,7 @@ fail:
 size_t
 mds_message_compose_size(const mds_message_t *restrict this)
 {
-	size_t rc = 1 + this->payload_size;
+	size_t rc = 1 + (this->payload_fd < 0 ? this->payload_size : 0);
 	size_t i;
 	for (i = 0; i < this->header_count; i++)
 		rc += strlen(this->headers[i]) + 1;
@@ -585,7 +1122,7 @@ mds_message_compose(const mds_message_t *restrict this, char *restrict data)
 	}
 	buf_set_next(data, char, '\n');
 
-	if (this->payload_size > 0)
+	if (this->payload_size > 0 && this->payload_fd < 0)
 		memcpy(data, this->payload, this->payload_size * sizeof(char));
 }
 
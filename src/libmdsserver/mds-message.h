@@ -22,7 +22,19 @@
 #include <stddef.h>
 
 
-#define MDS_MESSAGE_T_VERSION 0
+struct ring;
+
+
+#define MDS_MESSAGE_T_VERSION 2
+
+/**
+ * The maximum number of batches of file descriptors
+ * that may have been received with bytes that have
+ * not yet been read; a sender attaches at most one
+ * batch to each message, and only the message being
+ * read and the next one can have been received
+ */
+#define MDS_MESSAGE_FD_BATCHES_MAX  2
 
 /**
  * Message passed between a server and a client or between two of either
@@ -79,6 +91,83 @@ typedef struct mds_message
 	 */
 	int stage;
 
+	/**
+	 * If non-zero, `mds_message_read` will not buffer payloads
+	 * of at least this size, but return as soon as the headers
+	 * have been read, so that the payload can be read piecewise
+	 * with `mds_message_read_chunk`
+	 */
+	size_t stream_threshold;
+
+	/**
+	 * Whether the payload is being streamed rather
+	 * than buffered in `payload` (internal data)
+	 */
+	int streaming;
+
+	/**
+	 * If the payload was received in a memfd and
+	 * `keep_payload_fd` is set, the memfd, otherwise -1;
+	 * `payload` is `NULL` whilst this is set
+	 */
+	int payload_fd;
+
+	/**
+	 * Whether payloads received in memfds should be kept
+	 * in `payload_fd` rather than be read into `payload`
+	 */
+	int keep_payload_fd;
+
+	/**
+	 * File descriptors that have been received but
+	 * not yet claimed by a message (internal data)
+	 */
+	int *fds;
+
+	/**
+	 * The number of elements in `fds` (internal data)
+	 */
+	size_t fd_count;
+
+	/**
+	 * The number of batches of file descriptors, at the end of
+	 * `fds`, that were received with bytes that are still in
+	 * `buffer`, the file descriptors in a batch belong to the
+	 * message that contains the last byte received with them;
+	 * the other file descriptors in `fds` belong to the message
+	 * being read, or the message that was last read (internal data)
+	 */
+	size_t fd_batches;
+
+	/**
+	 * The number of file descriptors in each batch (internal data)
+	 */
+	size_t fd_batch_sizes[MDS_MESSAGE_FD_BATCHES_MAX];
+
+	/**
+	 * For each batch, the number of bytes in `buffer`
+	 * up to and including the last byte that was
+	 * received with the batch (internal data)
+	 */
+	size_t fd_batch_ends[MDS_MESSAGE_FD_BATCHES_MAX];
+
+	/**
+	 * If not `NULL`, the shared-memory ring, see
+	 * <libmdsserver/ring.h>, to read from instead of
+	 * the socket, the socket is only watched for hangup;
+	 * it is not marshalled, and not released with the message
+	 */
+	struct ring *ring;
+
+	/**
+	 * Whether messages are read in the binary encoding,
+	 * see <libmdsserver/binary.h>, rather than in the
+	 * text encoding; the headers are translated to the
+	 * text encoding, and a ‘Length’ header is added if
+	 * the message has a payload; it is not marshalled
+	 */
+	int binary;
+
 } mds_message_t;
 
 
@@ -120,6 +209,30 @@ void mds_message_destroy(mds_message_t *restrict this);
 __attribute__((nonnull))
 int mds_message_extend_headers(mds_message_t *restrict this, size_t extent);
 
+/**
+ * Calculate the number of bytes that
+ * `mds_message_shrink` would free
+ * 
+ * @param   this  The message
+ * @return        The number of bytes that shrinking the message would free
+ */
+__attribute__((pure, nonnull))
+size_t mds_message_reclaimable(const mds_message_t *restrict this);
+
+/**
+ * Shrink the read buffer to the smallest size that
+ * can hold the data that has been read but not yet
+ * used, the buffer is never shrunk on its own, and
+ * can be large after a large message has been read
+ * 
+ * @param   this  The message
+ * @return        Zero on success, -1 on error, `errno`
+ *                will be set accordingly, errors are
+ *                non-fatal
+ */
+__attribute__((nonnull))
+int mds_message_shrink(mds_message_t *restrict this);
+
 /**
  * Read the next message from a file descriptor
  * 
@@ -132,10 +245,65 @@ int mds_message_extend_headers(mds_message_t *restrict this, size_t extent);
  *                If -2 is returned `errno` will not have been set,
  *                -2 indicates that the message is malformated,
  *                which is a state that cannot be recovered from.
+ *                If `this->stream_threshold` is non-zero and the
+ *                payload is at least that large, 1 is returned
+ *                once the headers have been read; the payload must
+ *                then be read with `mds_message_read_chunk`, or,
+ *                if no chunk has been read, be buffered by calling
+ *                this function again.
  */
 __attribute__((nonnull))
 int mds_message_read(mds_message_t *restrict this, int fd);
 
+/**
+ * Read the next message from a file descriptor without
+ * blocking, messages that have been received in full
+ * are returned without reading, so when the file descriptor
+ * is readable, this function shall be called until it
+ * fails with EAGAIN
+ * 
+ * @param   this  Memory slot in which to store the new message
+ * @param   fd    The file descriptor, it does not need to be in nonblocking mode
+ * @return        The return value follows the rules of `mds_message_read`,
+ *                if the message is not complete, -1 is returned with
+ *                `errno` set to EAGAIN, and the read is resumed when
+ *                the function is called again
+ */
+__attribute__((nonnull))
+int mds_message_read_nonblocking(mds_message_t *restrict this, int fd);
+
+/**
+ * Read the next piece of a payload that is being streamed,
+ * that is, after `mds_message_read` has returned 1
+ * 
+ * @param   this     The message
+ * @param   fd       The file descriptor
+ * @param   buf      Output buffer for the piece of the payload
+ * @param   size     The size of `buf`
+ * @param   got      Output parameter for the number of bytes stored in `buf`,
+ *                   this may be non-zero even if the function fails
+ * @param   timeout  The number of milliseconds to wait for data,
+ *                   -1 to wait indefinitely
+ * @return           Zero on success, -1 on error or interruption, `errno`
+ *                   will be set accordingly, EAGAIN if the timeout
+ *                   expired. The message is complete when
+ *                   `this->payload_ptr == this->payload_size`.
+ */
+__attribute__((nonnull))
+int mds_message_read_chunk(mds_message_t *restrict this, int fd, char *restrict buf,
+                           size_t size, size_t *restrict got, int timeout);
+
+/**
+ * Read a payload that was received in a memfd, and kept in
+ * `payload_fd`, into `payload`, and replace the ‘Memfd-Length’
+ * header with a ‘Length’ header
+ * 
+ * @param   this  The message
+ * @return        Zero on success, -1 on error, `errno` will be set accordingly
+ */
+__attribute__((nonnull))
+int mds_message_inline_payload(mds_message_t *restrict this);
+
 /**
  * Get the required allocation size for `data` of the
  * function `mds_message_marshal`
@@ -0,0 +1,260 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "memfd.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+
+/**
+ * Receive data from a socket, and queue any file descriptors passed with it
+ * 
+ * @param   socket    The socket
+ * @param   buf       Output buffer for the data
+ * @param   n         The size of `buf`
+ * @param   flags     Flags for recvmsg(3), e.g. `MSG_CMSG_CLOEXEC`
+ * @param   fds       Queue of received, but not yet claimed, file descriptors
+ * @param   fd_count  The number of file descriptors in `*fds`
+ * @return            The number of received bytes, -1 on error, `errno` will be set
+ *                    accordingly, `EBADMSG` if file descriptors were discarded
+ */
+ssize_t
+memfd_recv(int socket, char *buf, size_t n, int flags, int **fds, size_t *fd_count)
+{
+	union {
+		char buf[CMSG_SPACE(MEMFD_RECV_FDS_MAX * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int *new_fds, *received;
+	size_t i, m;
+	ssize_t got;
+	int fail = 0;
+
+	iov.iov_base = buf;
+	iov.iov_len = n;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	got = recvmsg(socket, &msg, flags);
+	if (got < 0)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		received = (int *)(void *)CMSG_DATA(cmsg);
+		m = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		new_fds = fail ? NULL : realloc(*fds, (*fd_count + m) * sizeof(int));
+		if (!new_fds) {
+			/* The file descriptors cannot be matched with their messages anymore. */
+			for (i = 0; i < m; i++)
+				close(received[i]);
+			fail = 1;
+			continue;
+		}
+		memcpy(new_fds + *fd_count, received, m * sizeof(int));
+		*fds = new_fds;
+		*fd_count += m;
+	}
+
+	if (fail || (msg.msg_flags & MSG_CTRUNC))
+		return errno = EBADMSG, -1;
+	return got;
+}
+
+
+/**
+ * Take the oldest file descriptor from a queue of received file descriptors
+ * 
+ * @param   fds       Queue of received, but not yet claimed, file descriptors
+ * @param   fd_count  The number of file descriptors in `fds`
+ * @return            The file descriptor, -1 if the queue is empty
+ */
+int
+memfd_take(int *fds, size_t *fd_count)
+{
+	int fd;
+	if (!*fd_count)
+		return -1;
+	fd = *fds;
+	*fd_count -= 1;
+	memmove(fds, fds + 1, *fd_count * sizeof(int));
+	return fd;
+}
+
+
+/**
+ * Check that a file descriptor is a sealed memfd that is
+ * large enough to hold a payload, so that its content
+ * cannot change or disappear while it is being used
+ * 
+ * @param   fd    The file descriptor
+ * @param   size  The size of the payload
+ * @return        Zero if the memfd can be used, -1 otherwise
+ */
+int
+memfd_verify(int fd, size_t size)
+{
+	struct stat attr;
+	int seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || (seals & MEMFD_PAYLOAD_SEALS) != MEMFD_PAYLOAD_SEALS)
+		return -1;
+	if (fstat(fd, &attr) || attr.st_size < 0 || (size_t)(attr.st_size) < size)
+		return -1;
+	return 0;
+}
+
+
+/**
+ * Copy the content of a memfd
+ * 
+ * @param   fd    The file descriptor
+ * @param   buf   Output buffer
+ * @param   size  The number of bytes to read
+ * @return        Zero on success, -1 on error, `errno` will be set accordingly
+ */
+int
+memfd_read(int fd, char *buf, size_t size)
+{
+	size_t off = 0;
+	ssize_t got;
+	while (off < size) {
+		got = pread(fd, buf + off, size - off, (off_t)off);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return errno = got ? errno : EBADMSG, -1;
+		off += (size_t)got;
+	}
+	return 0;
+}
+
+
+/**
+ * Create a sealed memfd with a payload
+ * 
+ * @param   payload  The payload
+ * @param   size     The size of the payload
+ * @return           The file descriptor, -1 on error, `errno` will be set accordingly
+ */
+int
+memfd_create_payload(const char *payload, size_t size)
+{
+	int fd, saved_errno;
+	size_t off = 0;
+	ssize_t wrote;
+
+	fd = memfd_create("mds-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, (off_t)size))
+		goto fail;
+	while (off < size) {
+		wrote = pwrite(fd, payload + off, size - off, (off_t)off);
+		if (wrote < 0 && errno == EINTR)
+			continue;
+		if (wrote < 0)
+			goto fail;
+		off += (size_t)wrote;
+	}
+	if (fcntl(fd, F_ADD_SEALS, MEMFD_PAYLOAD_SEALS))
+		goto fail;
+	return fd;
+
+fail:
+	saved_errno = errno;
+	close(fd);
+	return errno = saved_errno, -1;
+}
+
+
+/**
+ * Send the beginning of a message, and file descriptors
+ * attached to its first byte
+ * 
+ * @param   socket   The socket
+ * @param   message  The message
+ * @param   length   The length of the message, must be positive
+ * @param   fds      The file descriptors to pass
+ * @param   count    The number of elements in `fds`, at most `MEMFD_RECV_FDS_MAX`
+ * @return           The number of sent bytes, -1 on error, `errno`
+ *                   will be set accordingly; the rest of the
+ *                   message should be sent without the file descriptors
+ */
+ssize_t
+memfd_send_fds(int socket, const char *message, size_t length, const int *fds, size_t count)
+{
+	union {
+		char buf[CMSG_SPACE(MEMFD_RECV_FDS_MAX * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t sent;
+
+	iov.iov_base = (void *)(uintptr_t)message; /* sendmsg(3) does not modify it. */
+	iov.iov_len = length;
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+	sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+	if (sent < 0 && errno == EPIPE)
+		errno = ECONNRESET;
+	return sent;
+}
+
+
+/**
+ * Send the beginning of a message, and a file descriptor
+ * attached to its first byte
+ * 
+ * @param   socket   The socket
+ * @param   message  The message
+ * @param   length   The length of the message, must be positive
+ * @param   fd       The file descriptor to pass
+ * @return           The number of sent bytes, -1 on error, `errno`
+ *                   will be set accordingly; the rest of the
+ *                   message should be sent without the file descriptor
+ */
+ssize_t
+memfd_send(int socket, const char *message, size_t length, int fd)
+{
+	return memfd_send_fds(socket, message, length, &fd, 1);
+}
@@ -0,0 +1,136 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSSERVER_MEMFD_H
+#define MDS_LIBMDSSERVER_MEMFD_H
+
+
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+
+
+/**
+ * The header that replaces ‘Length’ in messages whose payload
+ * is not sent inline, but in a sealed memfd that is passed,
+ * with SCM_RIGHTS, along with the first byte of the message
+ */
+#define MEMFD_LENGTH_HEADER  "Memfd-Length: "
+
+/**
+ * The seals a memfd must have for its content to be used as a payload
+ */
+#define MEMFD_PAYLOAD_SEALS  (F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+/**
+ * The maximum number of file descriptors that may be received at once
+ */
+#define MEMFD_RECV_FDS_MAX  8
+
+
+
+/**
+ * Receive data from a socket, and queue any file descriptors passed with it
+ * 
+ * @param   socket    The socket
+ * @param   buf       Output buffer for the data
+ * @param   n         The size of `buf`
+ * @param   flags     Flags for recvmsg(3), e.g. `MSG_CMSG_CLOEXEC`
+ * @param   fds       Queue of received, but not yet claimed, file descriptors
+ * @param   fd_count  The number of file descriptors in `*fds`
+ * @return            The number of received bytes, -1 on error, `errno` will be set
+ *                    accordingly, `EBADMSG` if file descriptors were discarded
+ */
+__attribute__((nonnull))
+ssize_t memfd_recv(int socket, char *buf, size_t n, int flags, int **fds, size_t *fd_count);
+
+/**
+ * Take the oldest file descriptor from a queue of received file descriptors
+ * 
+ * @param   fds       Queue of received, but not yet claimed, file descriptors
+ * @param   fd_count  The number of file descriptors in `fds`
+ * @return            The file descriptor, -1 if the queue is empty
+ */
+__attribute__((nonnull(2)))
+int memfd_take(int *fds, size_t *fd_count);
+
+/**
+ * Check that a file descriptor is a sealed memfd that is
+ * large enough to hold a payload, so that its content
+ * cannot change or disappear while it is being used
+ * 
+ * @param   fd    The file descriptor
+ * @param   size  The size of the payload
+ * @return        Zero if the memfd can be used, -1 otherwise
+ */
+int memfd_verify(int fd, size_t size);
+
+/**
+ * Copy the content of a memfd
+ * 
+ * @param   fd    The file descriptor
+ * @param   buf   Output buffer
+ * @param   size  The number of bytes to read
+ * @return        Zero on success, -1 on error, `errno` will be set accordingly
+ */
+__attribute__((nonnull))
+int memfd_read(int fd, char *buf, size_t size);
+
+/**
+ * Create a sealed memfd with a payload
+ * 
+ * @param   payload  The payload
+ * @param   size     The size of the payload
+ * @return           The file descriptor, -1 on error, `errno` will be set accordingly
+ */
+__attribute__((nonnull))
+int memfd_create_payload(const char *payload, size_t size);
+
+/**
+ * Send the beginning of a message, and file descriptors
+ * attached to its first byte
+ * 
+ * @param   socket   The socket
+ * @param   message  The message
+ * @param   length   The length of the message, must be positive
+ * @param   fds      The file descriptors to pass
+ * @param   count    The number of elements in `fds`, at most `MEMFD_RECV_FDS_MAX`
+ * @return           The number of sent bytes, -1 on error, `errno`
+ *                   will be set accordingly; the rest of the
+ *                   message should be sent without the file descriptors
+ */
+__attribute__((nonnull))
+ssize_t memfd_send_fds(int socket, const char *message, size_t length, const int *fds, size_t count);
+
+/**
+ * Send the beginning of a message, and a file descriptor
+ * attached to its first byte
+ * 
+ * @param   socket   The socket
+ * @param   message  The message
+ * @param   length   The length of the message, must be positive
+ * @param   fd       The file descriptor to pass
+ * @return           The number of sent bytes, -1 on error, `errno`
+ *                   will be set accordingly; the rest of the
+ *                   message should be sent without the file descriptor
+ */
+__attribute__((nonnull))
+ssize_t memfd_send(int socket, const char *message, size_t length, int fd);
+
+
+#endif
@@ -0,0 +1,423 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ring.h"
+
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+
+/**
+ * Point the fields of a ring pair into its mapping
+ * 
+ * @param  this    The ring pair, `map` and `capacity` must be set
+ * @param  server  Whether this process is the server
+ */
+static void __attribute__((nonnull))
+ring_set_pointers(ring_t *restrict this, int server)
+{
+	char *c2s = this->map;
+	char *s2c = c2s + sizeof(struct ring_shared) + this->capacity;
+	this->in  = (void *)(server ? c2s : s2c);
+	this->out = (void *)(server ? s2c : c2s);
+	this->in_data  = (char *)(this->in) + sizeof(struct ring_shared);
+	this->out_data = (char *)(this->out) + sizeof(struct ring_shared);
+}
+
+
+/**
+ * Release all resources in a ring pair
+ * 
+ * @param  this  The ring pair, may be `NULL`
+ */
+void
+ring_destroy(ring_t *restrict this)
+{
+	if (!this)
+		return;
+	if (this->map)
+		munmap(this->map, this->map_size);
+	if (this->memfd >= 0)
+		close(this->memfd);
+	if (this->bell >= 0)
+		close(this->bell);
+	if (this->peer_bell >= 0)
+		close(this->peer_bell);
+	this->map = NULL;
+	this->memfd = this->bell = this->peer_bell = -1;
+}
+
+
+/**
+ * Create a ring pair, this is done by the client, which then
+ * passes `memfd`, `peer_bell` and `bell`, in that order, to
+ * the server, which calls `ring_attach` with them
+ * 
+ * @param   this      Output parameter for the ring pair
+ * @param   capacity  The requested capacity of each ring, it is
+ *                    rounded up to a power of two
+ * @return            Zero on success, -1 on error, `errno` will be set accordingly
+ */
+int
+ring_create(ring_t *restrict this, size_t capacity)
+{
+	size_t size = RING_CAPACITY_MIN;
+	int saved_errno;
+
+	while (size < capacity)
+		if (!(size <<= 1))
+			return errno = EINVAL, -1;
+
+	this->map = NULL;
+	this->capacity = size;
+	this->map_size = RING_MAP_SIZE(size);
+	this->bell = this->peer_bell = -1;
+
+	this->memfd = memfd_create("mds-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (this->memfd < 0)
+		goto fail;
+	if (ftruncate(this->memfd, (off_t)(this->map_size)))
+		goto fail;
+	if (fcntl(this->memfd, F_ADD_SEALS, RING_SEALS))
+		goto fail;
+	this->map = mmap(NULL, this->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, this->memfd, 0);
+	if (this->map == MAP_FAILED) {
+		this->map = NULL;
+		goto fail;
+	}
+
+	ring_set_pointers(this, 0);
+	this->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPIN : 0;
+	this->in->capacity = this->out->capacity = (uint64_t)size;
+
+	if ((this->bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		goto fail;
+	if ((this->peer_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		goto fail;
+	return 0;
+
+fail:
+	saved_errno = errno;
+	ring_destroy(this);
+	return errno = saved_errno, -1;
+}
+
+
+/**
+ * Map a ring pair created by a client, this is done
+ * by the server, which takes ownership of the file
+ * descriptors even if the function fails
+ * 
+ * @param   this       Output parameter for the ring pair
+ * @param   memfd      The memfd holding the rings
+ * @param   bell       The eventfd the client writes to when the server is waiting
+ * @param   peer_bell  The eventfd the server writes to when the client is waiting
+ * @return             Zero on success, -1 on error, `errno` will be set
+ *                     accordingly, EBADMSG if the memfd is not a valid ring pair
+ */
+int
+ring_attach(ring_t *restrict this, int memfd, int bell, int peer_bell)
+{
+	struct stat attr;
+	struct ring_shared *c2s;
+	uint64_t capacity;
+	int seals, flags, saved_errno;
+
+	this->map = NULL;
+	this->memfd = memfd;
+	this->bell = bell;
+	this->peer_bell = peer_bell;
+
+	/* The client must not be able to shrink the memfd under our mapping. */
+	seals = fcntl(memfd, F_GET_SEALS);
+	if (seals < 0 || (seals & RING_SEALS) != RING_SEALS)
+		goto bad;
+	if (fstat(memfd, &attr) || (size_t)(attr.st_size) < RING_MAP_SIZE(RING_CAPACITY_MIN))
+		goto bad;
+	this->map_size = (size_t)(attr.st_size);
+	this->map = mmap(NULL, this->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (this->map == MAP_FAILED) {
+		this->map = NULL;
+		goto fail;
+	}
+
+	/* The capacity is read once, and never again trusted. */
+	c2s = this->map;
+	capacity = __atomic_load_n(&(c2s->capacity), __ATOMIC_RELAXED);
+	if (capacity < RING_CAPACITY_MIN || (capacity & (capacity - 1)) ||
+	    RING_MAP_SIZE((size_t)capacity) != this->map_size)
+		goto bad;
+	this->capacity = (size_t)capacity;
+	ring_set_pointers(this, 1);
+	this->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPIN : 0;
+
+	/* The server must never block on writing to a doorbell. */
+	if ((flags = fcntl(peer_bell, F_GETFL)) < 0 || fcntl(peer_bell, F_SETFL, flags | O_NONBLOCK))
+		goto fail;
+	if ((flags = fcntl(bell, F_GETFL)) < 0 || fcntl(bell, F_SETFL, flags | O_NONBLOCK))
+		goto fail;
+	return 0;
+
+bad:
+	errno = EBADMSG;
+fail:
+	saved_errno = errno;
+	ring_destroy(this);
+	return errno = saved_errno, -1;
+}
+
+
+/**
+ * Write as much as possible of some data to the outbound ring,
+ * without blocking, and ring the peer's doorbell if it is waiting
+ * 
+ * @param   this    The ring pair
+ * @param   buf     The data
+ * @param   length  The length of the data
+ * @return          The number of written bytes, zero if the ring is full,
+ *                  -1 on error, `errno` will be set to EBADMSG if the
+ *                  peer has corrupted the ring
+ */
+ssize_t
+ring_write(ring_t *restrict this, const char *restrict buf, size_t length)
+{
+	struct ring_shared *ring = this->out;
+	uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+	uint64_t tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+	size_t used = (size_t)(head - tail), off, n, first;
+
+	if (used > this->capacity)
+		return errno = EBADMSG, -1;
+
+	n = this->capacity - used;
+	n = n < length ? n : length;
+	if (!n)
+		return 0;
+	off = (size_t)head & (this->capacity - 1);
+	first = this->capacity - off;
+	first = first < n ? first : n;
+	memcpy(this->out_data + off, buf, first);
+	memcpy(this->out_data, buf + first, n - first);
+
+	/* Publish the data, and then check whether the reader sleeps;
+	 * the reader sets its flag and then checks for data, the
+	 * fences make sure at least one of us sees the other. */
+	__atomic_store_n(&(ring->head), head + n, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(ring->reader_sleeping), __ATOMIC_RELAXED))
+		write(this->peer_bell, &one, sizeof(one));
+
+	return (ssize_t)n;
+}
+
+
+/**
+ * Read as much as possible from the inbound ring, without
+ * blocking, and wake the peer if it is waiting for space
+ * 
+ * @param   this  The ring pair
+ * @param   buf   Output buffer for the data
+ * @param   size  The size of `buf`
+ * @return        The number of read bytes, zero if the ring is empty,
+ *                -1 on error, `errno` will be set to EBADMSG if the
+ *                peer has corrupted the ring
+ */
+static ssize_t __attribute__((nonnull))
+ring_read(ring_t *restrict this, char *restrict buf, size_t size)
+{
+	struct ring_shared *ring = this->in;
+	uint64_t tail = __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+	uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+	size_t n = (size_t)(head - tail), off, first;
+
+	if (n > this->capacity)
+		return errno = EBADMSG, -1;
+
+	n = n < size ? n : size;
+	if (!n)
+		return 0;
+	off = (size_t)tail & (this->capacity - 1);
+	first = this->capacity - off;
+	first = first < n ? first : n;
+	memcpy(buf, this->in_data + off, first);
+	memcpy(buf + first, this->in_data, n - first);
+
+	__atomic_store_n(&(ring->tail), tail + n, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(ring->writer_sleeping), __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&(ring->space_seq), 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &(ring->space_seq), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+
+	return (ssize_t)n;
+}
+
+
+/**
+ * Check, without blocking, whether the peer has closed its socket
+ * 
+ * @param   socket  The socket
+ * @return          Whether the connection is gone
+ */
+static int
+ring_hung_up(int socket)
+{
+	struct pollfd pfd = { .fd = socket, .events = POLLRDHUP, .revents = 0 };
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL));
+}
+
+
+/**
+ * Write a message to the outbound ring, waiting for space if it is full,
+ * this is the counterpart of `send_message` in <libmdsserver/util.h>
+ * 
+ * Like send(2), the function honours the send timeout (SO_SNDTIMEO)
+ * of the socket, and fails with EAGAIN if the peer makes no room
+ * in the ring within it
+ * 
+ * @param   this     The ring pair
+ * @param   message  The message
+ * @param   length   The length of the message
+ * @param   socket   The socket connected to the peer
+ * @return           The number of written bytes, less than `length`
+ *                   on error, `errno` will be set accordingly,
+ *                   ECONNRESET if the peer has hung up
+ */
+size_t
+ring_send(ring_t *restrict this, const char *restrict message, size_t length, int socket)
+{
+	struct ring_shared *ring = this->out;
+	struct timespec timeout = { .tv_sec = 0, .tv_nsec = RING_WRITE_TIMEOUT * 1000000L };
+	struct timeval limit;
+	socklen_t limit_size = sizeof(limit);
+	long int waited = 0, limit_ms = -1;
+	size_t sent = 0;
+	ssize_t r;
+	int seq;
+
+	errno = 0;
+	while (sent < length) {
+		r = ring_write(this, message + sent, length - sent);
+		if (r < 0)
+			return sent;
+		if (r > 0) {
+			sent += (size_t)r;
+			waited = 0;
+			continue;
+		}
+
+		/* The ring is full, wait for the reader to make room. */
+		seq = __atomic_load_n(&(ring->space_seq), __ATOMIC_ACQUIRE);
+		__atomic_store_n(&(ring->writer_sleeping), 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if ((size_t)(__atomic_load_n(&(ring->head), __ATOMIC_RELAXED) -
+		             __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE)) >= this->capacity)
+			r = syscall(SYS_futex, &(ring->space_seq), FUTEX_WAIT, seq, &timeout, NULL, 0);
+		__atomic_store_n(&(ring->writer_sleeping), 0, __ATOMIC_RELAXED);
+		if (r < 0 && errno == EINTR)
+			return sent;
+		if (ring_hung_up(socket))
+			return errno = ECONNRESET, sent;
+		if (r < 0 && errno == ETIMEDOUT) {
+			/* The send timeout is only looked up once the ring has been full for a while. */
+			if (limit_ms < 0)
+				limit_ms = getsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &limit, &limit_size) ? 0 :
+				           (long int)limit.tv_sec * 1000L + (long int)limit.tv_usec / 1000L;
+			if (limit_ms && (waited += RING_WRITE_TIMEOUT) >= limit_ms)
+				return errno = EAGAIN, sent;
+		}
+		errno = 0;
+	}
+
+	return sent;
+}
+
+
+/**
+ * Read from the inbound ring, waiting for data if it is empty,
+ * this is the counterpart of recv(3) on the socket
+ * 
+ * When the function fails with EAGAIN, the peer will write to
+ * `this->bell` when it writes data, so that it can be polled
+ * 
+ * @param   this         The ring pair
+ * @param   buf          Output buffer for the data
+ * @param   size         The size of `buf`
+ * @param   socket       The socket connected to the peer
+ * @param   nonblocking  Whether to fail with EAGAIN rather than wait
+ * @return               The number of read bytes, zero if the peer has hung
+ *                       up and there is no more data, -1 on error, `errno`
+ *                       will be set accordingly
+ */
+ssize_t
+ring_recv(ring_t *restrict this, char *restrict buf, size_t size, int socket, int nonblocking)
+{
+	struct ring_shared *ring = this->in;
+	struct pollfd pfds[2];
+	uint64_t count;
+	ssize_t got;
+	int i, r;
+
+	for (;;) {
+		/* A busy peer writes again shortly, spin before sleeping. */
+		for (i = 0; !nonblocking && i < this->spin; i++)
+			if (__atomic_load_n(&(ring->head), __ATOMIC_RELAXED) !=
+			    __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED))
+				break;
+		if ((got = ring_read(this, buf, size)))
+			goto out;
+
+		/* Announce that we are going to sleep, and check
+		 * again, lest data was written before the writer
+		 * could see that we are sleeping. */
+		__atomic_store_n(&(ring->reader_sleeping), 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if ((got = ring_read(this, buf, size)))
+			goto out;
+
+		pfds[0].fd = this->bell, pfds[0].events = POLLIN, pfds[0].revents = 0;
+		pfds[1].fd = socket, pfds[1].events = POLLRDHUP, pfds[1].revents = 0;
+		r = poll(pfds, 2, nonblocking ? 0 : -1);
+		if (r < 0)
+			return -1;
+		if (!r)
+			return errno = EAGAIN, -1;
+		if (pfds[0].revents & POLLIN)
+			read(this->bell, &count, sizeof(count));
+		if (pfds[1].revents) {
+			/* The peer is gone, but what it wrote can still be read. */
+			got = ring_read(this, buf, size);
+			goto out;
+		}
+	}
+
+out:
+	__atomic_store_n(&(ring->reader_sleeping), 0, __ATOMIC_RELAXED);
+	return got;
+}
@@ -0,0 +1,276 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSSERVER_RING_H
+#define MDS_LIBMDSSERVER_RING_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+
+
+/**
+ * The number of times a reader polls an empty ring before it
+ * goes to sleep and waits for its doorbell, on multiprocessor machines
+ */
+#ifndef RING_SPIN
+# define RING_SPIN  2048
+#endif
+
+/**
+ * The smallest capacity, in bytes, of a ring
+ */
+#define RING_CAPACITY_MIN  4096
+
+/**
+ * The number of milliseconds a writer waits for space
+ * in a full ring before it checks that the peer is alive
+ */
+#define RING_WRITE_TIMEOUT  100
+
+/**
+ * The seals the memfd holding the rings must have,
+ * so that it cannot be shrunk under the mapping
+ */
+#define RING_SEALS  (F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW)
+
+
+
+/**
+ * The control block at the beginning of a ring in shared memory,
+ * the data of the ring follows it
+ * 
+ * The producer and the consumer positions are on different
+ * cache lines, so that the two processes do not contend
+ */
+struct ring_shared
+{
+	/**
+	 * The total number of bytes that have been written,
+	 * only modified by the writer
+	 */
+	uint64_t head __attribute__((aligned(64)));
+
+	/**
+	 * The total number of bytes that have been read,
+	 * only modified by the reader
+	 */
+	uint64_t tail __attribute__((aligned(64)));
+
+	/**
+	 * Whether the reader is, or is about to go, to sleep,
+	 * in which case the writer rings the reader's doorbell
+	 */
+	int reader_sleeping __attribute__((aligned(64)));
+
+	/**
+	 * Whether the writer is, or is about to go, to sleep
+	 * waiting for space, in which case the reader wakes it
+	 * with a futex on `space_seq`
+	 */
+	int writer_sleeping;
+
+	/**
+	 * Incremented by the reader each time it
+	 * wakes the writer, the futex word
+	 */
+	int space_seq;
+
+	/**
+	 * The number of bytes in the ring, a power of
+	 * two, only trusted when the ring is created
+	 */
+	uint64_t capacity;
+};
+
+
+/**
+ * A pair of shared-memory rings, one per direction, between
+ * a client and the server, in a memfd that both have mapped
+ * 
+ * Each ring has a single reader and a single writer, messages
+ * are written to it in the same way as they are written to the
+ * socket, and the socket is kept to notice when the peer dies
+ */
+typedef struct ring
+{
+	/**
+	 * The ring this process reads from
+	 */
+	struct ring_shared *in;
+
+	/**
+	 * The data of `in`
+	 */
+	char *in_data;
+
+	/**
+	 * The ring this process writes to
+	 */
+	struct ring_shared *out;
+
+	/**
+	 * The data of `out`
+	 */
+	char *out_data;
+
+	/**
+	 * The capacity of each ring
+	 */
+	size_t capacity;
+
+	/**
+	 * The number of times to poll an empty ring before
+	 * sleeping, zero on uniprocessor machines, where
+	 * the peer cannot write while we spin
+	 */
+	int spin;
+
+	/**
+	 * The mapping of `memfd`
+	 */
+	void *map;
+
+	/**
+	 * The size of `map`
+	 */
+	size_t map_size;
+
+	/**
+	 * The memfd holding the rings, the ring from the
+	 * client to the server, then the ring from the
+	 * server to the client
+	 */
+	int memfd;
+
+	/**
+	 * eventfd(2) the peer writes to when
+	 * this process is waiting for data
+	 */
+	int bell;
+
+	/**
+	 * eventfd(2) this process writes to when
+	 * the peer is waiting for data
+	 */
+	int peer_bell;
+
+} ring_t;
+
+
+
+/**
+ * Get the number of bytes the memfd for two rings shall have
+ * 
+ * @param   capacity  The capacity of each ring
+ * @return            The size of the memfd
+ */
+#define RING_MAP_SIZE(capacity)  (2 * (sizeof(struct ring_shared) + (capacity)))
+
+
+/**
+ * Release all resources in a ring pair
+ * 
+ * @param  this  The ring pair, may be `NULL`
+ */
+void ring_destroy(ring_t *restrict this);
+
+/**
+ * Create a ring pair, this is done by the client, which then
+ * passes `memfd`, `peer_bell` and `bell`, in that order, to
+ * the server, which calls `ring_attach` with them
+ * 
+ * @param   this      Output parameter for the ring pair
+ * @param   capacity  The requested capacity of each ring, it is
+ *                    rounded up to a power of two
+ * @return            Zero on success, -1 on error, `errno` will be set accordingly
+ */
+__attribute__((nonnull))
+int ring_create(ring_t *restrict this, size_t capacity);
+
+/**
+ * Map a ring pair created by a client, this is done
+ * by the server, which takes ownership of the file
+ * descriptors even if the function fails
+ * 
+ * @param   this       Output parameter for the ring pair
+ * @param   memfd      The memfd holding the rings
+ * @param   bell       The eventfd the client writes to when the server is waiting
+ * @param   peer_bell  The eventfd the server writes to when the client is waiting
+ * @return             Zero on success, -1 on error, `errno` will be set
+ *                     accordingly, EBADMSG if the memfd is not a valid ring pair
+ */
+__attribute__((nonnull))
+int ring_attach(ring_t *restrict this, int memfd, int bell, int peer_bell);
+
+/**
+ * Write as much as possible of some data to the outbound ring,
+ * without blocking, and ring the peer's doorbell if it is waiting
+ * 
+ * @param   this    The ring pair
+ * @param   buf     The data
+ * @param   length  The length of the data
+ * @return          The number of written bytes, zero if the ring is full,
+ *                  -1 on error, `errno` will be set to EBADMSG if the
+ *                  peer has corrupted the ring
+ */
+__attribute__((nonnull))
+ssize_t ring_write(ring_t *restrict this, const char *restrict buf, size_t length);
+
+/**
+ * Write a message to the outbound ring, waiting for space if it is full,
+ * this is the counterpart of `send_message` in <libmdsserver/util.h>
+ * 
+ * Like send(2), the function honours the send timeout (SO_SNDTIMEO)
+ * of the socket, and fails with EAGAIN if the peer makes no room
+ * in the ring within it
+ * 
+ * @param   this     The ring pair
+ * @param   message  The message
+ * @param   length   The length of the message
+ * @param   socket   The socket connected to the peer
+ * @return           The number of written bytes, less than `length`
+ *                   on error, `errno` will be set accordingly,
+ *                   ECONNRESET if the peer has hung up
+ */
+__attribute__((nonnull))
+size_t ring_send(ring_t *restrict this, const char *restrict message, size_t length, int socket);
+
+/**
+ * Read from the inbound ring, waiting for data if it is empty,
+ * this is the counterpart of recv(3) on the socket
+ * 
+ * When the function fails with EAGAIN, the peer will write to
+ * `this->bell` when it writes data, so that it can be polled
+ * 
+ * @param   this         The ring pair
+ * @param   buf          Output buffer for the data
+ * @param   size         The size of `buf`
+ * @param   socket       The socket connected to the peer
+ * @param   nonblocking  Whether to fail with EAGAIN rather than wait
+ * @return               The number of read bytes, zero if the peer has hung
+ *                       up and there is no more data, -1 on error, `errno`
+ *                       will be set accordingly
+ */
+__attribute__((nonnull))
+ssize_t ring_recv(ring_t *restrict this, char *restrict buf, size_t size, int socket, int nonblocking);
+
+
+#endif
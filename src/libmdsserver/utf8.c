@@ -0,0 +1,372 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "utf8.h"
+
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(SCALAR_UTF8)
+# define UTF8_X86
+# include <immintrin.h>
+#endif
+
+
+
+/**
+ * Get the number of bytes at the beginning of a string
+ * that are non-NUL ASCII characters, 8 bytes at a time
+ * 
+ * @param   string              The string
+ * @param   length              The number of bytes to inspect at most
+ * @param   allow_modified_nul  Ignored
+ * @return                      The number of leading non-NUL ASCII characters
+ */
+static size_t __attribute__((pure))
+utf8_span_scalar(const char *string, size_t length, int allow_modified_nul)
+{
+	const uint64_t ones  = UINT64_C(0x0101010101010101);
+	const uint64_t highs = UINT64_C(0x8080808080808080);
+	uint64_t word;
+	size_t i = 0;
+
+	(void) allow_modified_nul;
+
+	/* A byte will have its high bit set, after the subtraction
+	   or before it, if and only if it is NUL or is not ASCII. */
+	for (; i + 8 <= length; i += 8) {
+		__builtin_memcpy(&word, string + i, 8);
+		if (((word - ones) | word) & highs)
+			break;
+	}
+
+	for (; i < length; i++)
+		if (!string[i] || (string[i] & 0x80))
+			break;
+
+	return i;
+}
+
+
+#ifdef UTF8_X86
+
+/**
+ * Get the number of bytes at the beginning of a string
+ * that are non-NUL ASCII characters, 16 bytes at a time
+ * 
+ * @param   string              The string
+ * @param   length              The number of bytes to inspect at most
+ * @param   allow_modified_nul  Ignored
+ * @return                      The number of leading non-NUL ASCII characters
+ */
+static size_t __attribute__((pure, target("sse2")))
+utf8_span_sse2(const char *string, size_t length, int allow_modified_nul)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i chunk;
+	size_t i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		chunk = _mm_loadu_si128((const __m128i *)(const void *)(string + i));
+		if (_mm_movemask_epi8(_mm_or_si128(chunk, _mm_cmpeq_epi8(chunk, zero))))
+			break;
+	}
+
+	return i + utf8_span_scalar(string + i, length - i, allow_modified_nul);
+}
+
+
+/* Errors found by looking at two consecutive bytes, see `utf8_span_avx2`. */
+#define TOO_SHORT   0x01 /* 11______ 0_______  or  11______ 11______ */
+#define TOO_LONG    0x02 /* 0_______ 10______ */
+#define OVERLONG_3  0x04 /* 11100000 100_____ */
+#define OVERLONG_2  0x20 /* 1100000_ 10______ */
+#define OVERLONG_4  0x40 /* 11110000 1000____ */
+#define TWO_CONTS   0x80 /* 10______ 10______ */
+#define CARRY       (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+/**
+ * What a byte may be the first of two bytes in an error, by its high nibble
+ */
+static const unsigned char utf8_byte_1_high[16] = {
+	TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+	TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+	TOO_SHORT | OVERLONG_2, TOO_SHORT, TOO_SHORT | OVERLONG_3, TOO_SHORT | OVERLONG_4
+};
+
+/**
+ * What a byte may be the first of two bytes in an error, by its low nibble
+ */
+static const unsigned char utf8_byte_1_low[16] = {
+	CARRY | OVERLONG_2 | OVERLONG_3 | OVERLONG_4, CARRY | OVERLONG_2,
+	CARRY, CARRY, CARRY, CARRY, CARRY, CARRY, CARRY, CARRY, CARRY, CARRY, CARRY, CARRY, CARRY, CARRY
+};
+
+/**
+ * What a byte may be the second of two bytes in an error, by its high nibble
+ */
+static const unsigned char utf8_byte_2_high[16] = {
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | OVERLONG_4,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3,
+	TOO_LONG | OVERLONG_2 | TWO_CONTS, TOO_LONG | OVERLONG_2 | TWO_CONTS,
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+};
+
+/**
+ * Look up a byte for each nibble in a vector
+ * 
+ * @param   table:__m256i    The 16 bytes to look up, in both lanes
+ * @param   nibbles:__m256i  The indices, each must be less than 16
+ * @return  :__m256i         The looked up bytes
+ */
+#define LOOKUP(table, nibbles)  _mm256_shuffle_epi8(table, nibbles)
+
+/**
+ * Load a 16-byte table into both lanes of a vector
+ * 
+ * @param   table:const unsigned char *  The table
+ * @return  :__m256i                     The vector
+ */
+#define TABLE(table)\
+	_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(const void *)(table)))
+
+/**
+ * Get the bytes that precede the bytes in a vector by some distance
+ * 
+ * @param   input:__m256i  The vector
+ * @param   prev:__m256i   The vector that precedes `input`
+ * @param   N:int          The distance, 1, 2, or 3
+ * @return  :__m256i       The preceding bytes
+ */
+#define PREV(input, prev, N)\
+	_mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 16 - (N))
+
+/**
+ * Get the number of bytes at the beginning of a string that are
+ * valid UTF-8, 32 bytes at a time, stopping at a character boundary
+ * 
+ * This is the validation by Keiser and Lemire, see ‘Validating UTF-8
+ * In Less Than One Instruction Per Byte’, with a few checks removed
+ * so that it accepts the same as `verify_utf8_n`: surrogates and
+ * four-byte characters above U+10FFFF are accepted. Chunks with bytes
+ * that it cannot check, NUL, which ends the string, the lead bytes of
+ * five- and six-byte characters, or of Modified UTF-8 NUL, are left
+ * to the byte-wise validation, as are chunks with errors.
+ * 
+ * @param   string              The string
+ * @param   length              The number of bytes to inspect at most
+ * @param   allow_modified_nul  Whether Modified UTF-8 is allowed, which allows a two-byte encoding for NUL
+ * @return                      The number of leading bytes that are
+ *                              valid UTF-8 and end at a character boundary
+ */
+static size_t __attribute__((pure, target("avx2")))
+utf8_span_avx2(const char *string, size_t length, int allow_modified_nul)
+{
+	const __m256i byte_1_high = TABLE(utf8_byte_1_high);
+	const __m256i byte_1_low = TABLE(utf8_byte_1_low);
+	const __m256i byte_2_high = TABLE(utf8_byte_2_high);
+	/* The last three bytes of a chunk are in the middle of a character if they exceed these. */
+	const __m256i last_max = _mm256_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		(char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	const __m256i high_bit = _mm256_set1_epi8((char)0x80);
+	const __m256i lead_5 = _mm256_set1_epi8((char)0xF8);
+	const __m256i modified_nul = allow_modified_nul ? _mm256_set1_epi8((char)0xC0) : zero;
+	__m256i input, prev = zero, prev1, special, error, incomplete = zero;
+	size_t i = 0;
+
+	for (; i + 32 <= length; i += 32) {
+		input = _mm256_loadu_si256((const __m256i *)(const void *)(string + i));
+
+		special = _mm256_or_si256(_mm256_cmpeq_epi8(input, zero),
+		                          _mm256_cmpeq_epi8(_mm256_max_epu8(input, lead_5), input));
+		special = _mm256_or_si256(special, _mm256_cmpeq_epi8(input, modified_nul));
+		if (!_mm256_testz_si256(special, special))
+			break;
+
+		if (!_mm256_movemask_epi8(input)) {
+			/* ASCII is only wrong after a character that is not finished. */
+			error = incomplete;
+		} else {
+			prev1 = PREV(input, prev, 1);
+			error = _mm256_and_si256(
+				_mm256_and_si256(LOOKUP(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+				                 LOOKUP(byte_1_low, _mm256_and_si256(prev1, nibble))),
+				LOOKUP(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+			/* The third and fourth bytes of a character must be continuation bytes,
+			   this is where two continuation bytes in a row are not an error. */
+			error = _mm256_xor_si256(error, _mm256_and_si256(high_bit, _mm256_or_si256(
+				_mm256_subs_epu8(PREV(input, prev, 2), _mm256_set1_epi8((char)(0xE0 - 0x80))),
+				_mm256_subs_epu8(PREV(input, prev, 3), _mm256_set1_epi8((char)(0xF0 - 0x80))))));
+		}
+		if (!_mm256_testz_si256(error, error))
+			break;
+
+		incomplete = _mm256_subs_epu8(input, last_max);
+		prev = input;
+	}
+
+	/* Stop before a character that the last chunk ended in the middle of. */
+	if (i >= 1 && (unsigned char)string[i - 1] >= 0xC0)
+		return i - 1;
+	if (i >= 2 && (unsigned char)string[i - 2] >= 0xE0)
+		return i - 2;
+	if (i >= 3 && (unsigned char)string[i - 3] >= 0xF0)
+		return i - 3;
+	return i + utf8_span_scalar(string + i, length - i, allow_modified_nul);
+}
+
+#undef TOO_SHORT
+#undef TOO_LONG
+#undef OVERLONG_3
+#undef OVERLONG_2
+#undef OVERLONG_4
+#undef TWO_CONTS
+#undef CARRY
+#undef LOOKUP
+#undef TABLE
+#undef PREV
+
+#endif
+
+
+/**
+ * Select the fastest implementation of `utf8_span`
+ * that the CPU supports, and use it
+ * 
+ * @param   string              The string
+ * @param   length              The number of bytes to inspect at most
+ * @param   allow_modified_nul  Whether Modified UTF-8 is allowed
+ * @return                      The number of leading bytes that
+ *                              have been validated
+ */
+static size_t utf8_span_dispatch(const char *string, size_t length, int allow_modified_nul);
+
+/**
+ * Get the number of bytes at the beginning of a string
+ * that are valid UTF-8, and end at a character boundary,
+ * as far as can be validated with vector instructions
+ * 
+ * This is set at the first call, a race here is harmless
+ * as all threads will select the same implementation
+ * 
+ * @param   string              The string
+ * @param   length              The number of bytes to inspect at most
+ * @param   allow_modified_nul  Whether Modified UTF-8 is allowed
+ * @return                      The number of leading bytes that
+ *                              have been validated
+ */
+static size_t (*utf8_span)(const char *string, size_t length, int allow_modified_nul) = utf8_span_dispatch;
+
+static size_t
+utf8_span_dispatch(const char *string, size_t length, int allow_modified_nul)
+{
+#ifdef UTF8_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		utf8_span = utf8_span_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		utf8_span = utf8_span_sse2;
+	else
+#endif
+		utf8_span = utf8_span_scalar;
+	return utf8_span(string, length, allow_modified_nul);
+}
+
+
+/**
+ * Check whether a string is encoded in UTF-8
+ * 
+ * @param   string              The string, it ends at `length` or at the first NUL, whichever comes first
+ * @param   length              The length of the string
+ * @param   allow_modified_nul  Whether Modified UTF-8 is allowed, which allows a two-byte encoding for NUL
+ * @return                      Zero if good, -1 on encoding error
+ */
+int
+verify_utf8_n(const char *string, size_t length, int allow_modified_nul)
+{
+	static const long BYTES_TO_MIN_BITS[] = {0, 0,  8, 12, 17, 22, 37};
+	static const long BYTES_TO_MAX_BITS[] = {0, 7, 11, 16, 21, 26, 31};
+	long bytes = 0, read_bytes = 0, bits = 0, c, character = 0;
+	size_t i = 0;
+
+	/*                                                      min bits  max bits
+	  0.......                                                 0         7
+	  110..... 10......                                        8        11
+	  1110.... 10...... 10......                              12        16
+	  11110... 10...... 10...... 10......                     17        21
+	  111110.. 10...... 10...... 10...... 10......            22        26
+	  1111110. 10...... 10...... 10...... 10...... 10......   27        31
+	*/
+
+	for (;;) {
+		if (!read_bytes && i < length)
+			/* Skip over what can be validated with vector instructions. */
+			i += utf8_span(string + i, length - i, allow_modified_nul);
+
+		if (i == length || !(c = (long)string[i++]))
+			break;
+
+		if (!read_bytes) {
+			/* First byte of the character. */
+
+			if ((c & 0xC0) == 0x80)
+				/* Single-byte character marked as multibyte, or
+				   a non-first byte in a multibyte character. */
+				return -1;
+
+			/* Multibyte character. */
+			while ((c & 0x80))
+				bytes++, c <<= 1;
+			read_bytes = 1;
+			/* The payload has been shifted up by the length marker. */
+			character = (c & 0x7F) >> bytes;
+			if (bytes > 6)
+				/* 31-bit characters can be encoded with 6-bytes,
+				   and UTF-8 does not cover higher code points. */
+				return -1;
+		} else {
+			/* Not first byte of the character. */
+
+			if ((c & 0xC0) != 0x80)
+				/* Beginning of new character before a
+				   multibyte character has ended. */
+				return -1;
+
+			character = (character << 6) | (c & 0x7F);
+
+			if (++read_bytes < bytes)
+				/* Not at last byte yet. */
+				continue;
+
+			/* Check that the character is not unnecessarily long. */
+			while (character)
+				character >>= 1, bits++;
+			bits = ((bits == 0) && (bytes == 2) && allow_modified_nul) ? 8 : bits;
+			if ((bits < BYTES_TO_MIN_BITS[bytes]) || (BYTES_TO_MAX_BITS[bytes] < bits))
+				return -1;
+
+			read_bytes = bytes = bits = 0;
+		}
+	}
+
+	/* Make sure we did not stop at the middle of a multibyte character. */
+	return read_bytes == 0 ? 0 : -1;
+}
@@ -0,0 +1,44 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_LIBMDSSERVER_UTF8_H
+#define MDS_LIBMDSSERVER_UTF8_H
+
+
+#include <stddef.h>
+
+
+
+/**
+ * Check whether a string is encoded in UTF-8
+ * 
+ * With AVX2, the string is validated 32 bytes at a time, except
+ * around NUL, the lead bytes of five- and six-byte characters,
+ * and, if `allow_modified_nul` is set, 0xC0. Otherwise, only runs
+ * of ASCII characters are skipped with wider reads, and the rest
+ * of the string is validated byte by byte
+ * 
+ * @param   string              The string, it ends at `length` or at the first NUL, whichever comes first
+ * @param   length              The length of the string
+ * @param   allow_modified_nul  Whether Modified UTF-8 is allowed, which allows a two-byte encoding for NUL
+ * @return                      Zero if good, -1 on encoding error
+ */
+__attribute__((nonnull))
+int verify_utf8_n(const char *string, size_t length, int allow_modified_nul);
+
+
+#endif
@@ -18,6 +18,7 @@
 #include "util.h"
 #include "config.h"
 #include "macros.h"
+#include "utf8.h"
 
 #include <alloca.h>
 #include <stdlib.h>
@@ -32,6 +33,8 @@
 #include <sys/wait.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 
 
@@ -153,6 +156,23 @@ fail:
 }
 
 
+/**
+ * Exec into the server's program with other command line
+ * arguments, this is used to start a new image of the server
+ * alongside the running one. This function only returns on failure.
+ * 
+ * If `prepare_reexec` failed or has not been called,
+ * `args[0]` will be used as a fallback.
+ * 
+ * @param  args  The command line arguments, `NULL`-terminated
+ */
+void
+exec_server(char **args)
+{
+	execv(self_exe[0] ? self_exe : args[0], args);
+}
+
+
 /**
  * Set up a signal trap.
  * This function should only be used for common mds
@@ -572,6 +592,43 @@ __strict_x(atou64, uint64_t, atouj, uintmax_t)
 #undef __strict_x
 
 
+/**
+ * Parse a list of CPUs, such as `0-3,6`, in the
+ * format of `taskset -c` and `/sys/devices/system/cpu/online`
+ * 
+ * @param   list  The list, comma-separated CPU numbers and ranges of CPU numbers
+ * @param   set   Output parameter for the CPUs in the list
+ * @return        Zero on success, -1 on error, `errno` is set to
+ *                `EINVAL` if the list is malformed or contains
+ *                a CPU that does not fit in a `cpu_set_t`
+ */
+int
+parse_cpu_list(const char *list, cpu_set_t *set)
+{
+	unsigned long int first, last;
+	char *end;
+
+	CPU_ZERO(set);
+	do {
+		if (!isdigit(*list))
+			return errno = EINVAL, -1;
+		first = last = strtoul(list, &end, 10);
+		if (*end == '-') {
+			if (!isdigit(end[1]))
+				return errno = EINVAL, -1;
+			last = strtoul(end + 1, &end, 10);
+		}
+		if (first > last || last >= CPU_SETSIZE)
+			return errno = EINVAL, -1;
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+		list = end + 1;
+	} while (*end == ',');
+
+	return *end ? (errno = EINVAL, -1) : 0;
+}
+
+
 /**
  * Send a buffer into a file and ignore interruptions
  * 
@@ -741,68 +798,7 @@ fail:
 int
 verify_utf8(const char *string, int allow_modified_nul)
 {
-	static long BYTES_TO_MIN_BITS[] = {0, 0,  8, 12, 17, 22, 37};
-	static long BYTES_TO_MAX_BITS[] = {0, 7, 11, 16, 21, 26, 31};
-	long bytes = 0, read_bytes = 0, bits = 0, c, character;
-
-	/*                                                      min bits  max bits
-	  0.......                                                 0         7
-	  110..... 10......                                        8        11
-	  1110.... 10...... 10......                              12        16
-	  11110... 10...... 10...... 10......                     17        21
-	  111110.. 10...... 10...... 10...... 10......            22        26
-	  1111110. 10...... 10...... 10...... 10...... 10......   27        31
-	*/
-
-	while ((c = (long)(*string++))) {
-		if (read_bytes == 0) {
-			/* First byte of the character. */
-
-			if (!(c & 0x80))
-				/* Single-byte character. */
-				continue;
-
-			if ((c & 0xC0) == 0x80)
-				/* Single-byte character marked as multibyte, or
-				   a non-first byte in a multibyte character. */
-				return -1;
-
-			/* Multibyte character. */
-			while ((c & 0x80))
-				bytes++, c <<= 1;
-			read_bytes = 1;
-			character = c & 0x7F;
-			if (bytes > 6)
-				/* 31-bit characters can be encoded with 6-bytes,
-				   and UTF-8 does not cover higher code points. */
-				return -1;
-		} else {
-			/* Not first byte of the character. */
-
-			if ((c & 0xC0) != 0x80)
-				/* Beginning of new character before a
-				   multibyte character has ended. */
-				return -1;
-
-			character = (character << 6) | (c & 0x7F);
-
-			if (++read_bytes < bytes)
-				/* Not at last byte yet. */
-				continue;
-
-			/* Check that the character is not unnecessarily long. */
-			while (character)
-				character >>= 1, bits++;
-			bits = ((bits == 0) && (bytes == 2) && allow_modified_nul) ? 8 : bits;
-			if ((bits < BYTES_TO_MIN_BITS[bytes]) || (BYTES_TO_MAX_BITS[bytes] < bits))
-				return -1;
-
-			read_bytes = bytes = bits = 0;
-		}
-	}
-
-	/* Make sure we did not stop at the middle of a multibyte character. */
-	return read_bytes == 0 ? 0 : -1;
+	return verify_utf8_n(string, strlen(string), allow_modified_nul);
 }
 
 
@@ -953,3 +949,53 @@ send_error(const char *restrict recv_client_id, const char *restrict recv_messag
 fail:
 	return -1;
 }
+
+
+/**
+ * Append an event to the benchmark log, that is named by
+ * the environment variable `BENCH_LOG_ENV`, nothing is
+ * recorded if the environment variable is not set, or
+ * if the process has privileges its user does not have,
+ * as the user could otherwise write to any file
+ * 
+ * Each event is written as one line, with a single write
+ * so that events from different processes are not mixed
+ * together: the time, in nanoseconds, of `CLOCK_MONOTONIC_RAW`,
+ * the process ID, the name of the event, `value`, and the
+ * name of the program without its directory
+ * 
+ * @param   program  The name of the program
+ * @param   event    The name of the event, must not contain whitespace
+ * @param   value    A number whose meaning depends on the event
+ * @return           Zero on success, -1 on error
+ */
+int
+bench_event(const char *program, const char *event, size_t value)
+{
+	const char *pathname = secure_getenv(BENCH_LOG_ENV);
+	const char *basename = strrchr(program, '/');
+	char line[3 * sizeof(intmax_t) + 3 * sizeof(long int) + 3 * sizeof(size_t) + 2 * 64];
+	struct timespec now;
+	int fd = -1, n, saved_errno;
+
+	/* `secure_getenv` returns `NULL` in set-user-ID and set-group-ID
+	   programs, but not after privileges have been regained in other ways. */
+	if (!pathname || !*pathname || getuid() != geteuid() || getgid() != getegid())
+		return 0;
+
+	fail_if (monotone(&now) < 0);
+	n = snprintf(line, sizeof(line), "%ji%09li %ji %.64s %zu %.64s\n",
+	             (intmax_t)(now.tv_sec), (long int)(now.tv_nsec), (intmax_t)getpid(),
+	             event, value, basename ? basename + 1 : program);
+	fail_if (n < 0);
+
+	fail_if ((fd = open(pathname, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0);
+	fail_if (full_write(fd, line, (size_t)n));
+	close(fd);
+	return 0;
+fail:
+	saved_errno = errno;
+	if (fd >= 0)
+		close(fd);
+	return errno = saved_errno, -1;
+}
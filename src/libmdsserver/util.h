@@ -21,6 +21,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sched.h>
 #include <sys/types.h>
 
 
@@ -90,6 +91,19 @@ int prepare_reexec(void);
  */
 void reexec_server(int argc, char **argv, int reexeced);
 
+/**
+ * Exec into the server's program with other command line
+ * arguments, this is used to start a new image of the server
+ * alongside the running one. This function only returns on failure.
+ * 
+ * If `prepare_reexec` failed or has not been called,
+ * `args[0]` will be used as a fallback.
+ * 
+ * @param  args  The command line arguments, `NULL`-terminated
+ */
+__attribute__((nonnull))
+void exec_server(char **args);
+
 /**
  * Set up a signal trap.
  * This function should only be used for common mds
@@ -355,6 +369,19 @@ int strict_ato64(const char *str, int64_t *value, int64_t min, int64_t max);
 __attribute__((nonnull))
 int strict_atou64(const char *str, uint64_t *value, uint64_t min, uint64_t max);
 
+/**
+ * Parse a list of CPUs, such as `0-3,6`, in the
+ * format of `taskset -c` and `/sys/devices/system/cpu/online`
+ * 
+ * @param   list  The list, comma-separated CPU numbers and ranges of CPU numbers
+ * @param   set   Output parameter for the CPUs in the list
+ * @return        Zero on success, -1 on error, `errno` is set to
+ *                `EINVAL` if the list is malformed or contains
+ *                a CPU that does not fit in a `cpu_set_t`
+ */
+__attribute__((nonnull))
+int parse_cpu_list(const char *list, cpu_set_t *set);
+
 /**
  * Send a buffer into a file and ignore interruptions
  * 
@@ -482,4 +509,20 @@ int send_error(const char *restrict recv_client_id, const char *restrict recv_me
                int socket_fd);
 
 
+/**
+ * Append an event to the benchmark log, that is named by
+ * the environment variable `BENCH_LOG_ENV`, nothing is
+ * recorded if the environment variable is not set, or
+ * if the process has privileges its user does not have,
+ * as the user could otherwise write to any file
+ * 
+ * @param   program  The name of the program
+ * @param   event    The name of the event, must not contain whitespace
+ * @param   value    A number whose meaning depends on the event
+ * @return           Zero on success, -1 on error
+ */
+__attribute__((nonnull))
+int bench_event(const char *program, const char *event, size_t value);
+
+
 #endif
@@ -20,6 +20,7 @@
 #include <libmdsserver/config.h>
 #include <libmdsserver/macros.h>
 #include <libmdsserver/util.h>
+#include <libmdsserver/hash-help.h>
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -30,10 +31,16 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 
 
 /**
@@ -105,6 +112,134 @@ volatile sig_atomic_t danger = 0;
  */
 int socket_fd = -1;
 
+/**
+ * The event loop of the server, created if
+ * `server_characteristics.use_event_loop`
+ * is non-zero
+ */
+event_loop_t server_event_loop = {
+	.epoll_fd = -1,
+	.signal_fd = -1,
+	.wakeup_fd = -1
+};
+
+/**
+ * The PSI trigger on memory pressure,
+ * -1 if memory pressure is not monitored
+ */
+static int pressure_fd = -1;
+
+/**
+ * Memory that the server can free when it is not needed
+ */
+typedef struct trimmable {
+	/**
+	 * The name of the memory, used in state dumps
+	 */
+	const char *name;
+
+	/**
+	 * Function that returns the number of bytes `trim` would free
+	 */
+	size_t (*reclaimable)(void *data);
+
+	/**
+	 * Function that frees the memory
+	 */
+	int (*trim)(void *data);
+
+	/**
+	 * Argument for `reclaimable` and `trim`
+	 */
+	void *data;
+} trimmable_t;
+
+/**
+ * Memory that the server can free when it is not needed
+ */
+static trimmable_t *trimmables = NULL;
+
+/**
+ * The number of elements in `trimmables`
+ */
+static size_t trimmable_count = 0;
+
+/**
+ * Scheduling attributes of a thread, the argument of the `sched_setattr`
+ * and `sched_getattr` system calls, that the C library may lack wrappers for
+ */
+typedef struct scheduling_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+} scheduling_attr_t;
+
+/**
+ * The CPUs the server shall run on, selected with --cpus
+ */
+static cpu_set_t scheduling_cpus;
+
+/**
+ * Whether --cpus has been used
+ */
+static int have_scheduling_cpus = 0;
+
+/**
+ * The scheduling policy selected with --sched, -1 if none
+ */
+static int scheduling_policy = -1;
+
+/**
+ * The real-time priority selected with --sched
+ */
+static int scheduling_priority = 0;
+
+/**
+ * The nice value selected with --nice, `INT_MIN` if none
+ */
+static int scheduling_nice = INT_MIN;
+
+/**
+ * The time slice, in nanoseconds, selected with --slice, 0 if none
+ */
+static uint64_t scheduling_slice = 0;
+
+/**
+ * Whether --mlock has been used
+ */
+static int scheduling_mlock = 0;
+
+/**
+ * Whether an invalid scheduling option has been used
+ */
+static int scheduling_invalid = 0;
+
+/**
+ * The CPUs the process could run on before --cpus was applied
+ */
+static cpu_set_t default_cpus;
+
+/**
+ * Whether `default_cpus` has been saved
+ */
+static int have_default_cpus = 0;
+
+/**
+ * The scheduling attributes the process had before
+ * --sched, --nice and --slice were applied
+ */
+static scheduling_attr_t default_attr;
+
+/**
+ * Whether `default_attr` has been saved
+ */
+static int have_default_attr = 0;
+
 
 
 /**
@@ -141,6 +276,8 @@ parse_cmdline(void)
 			on_init_sh = arg + strlen("--on-init-sh=");
 		} else if (strequals(arg, "--immortal")) { /* I return to serve. */
 			is_immortal = 1;
+		} else if (parse_scheduling_arg(arg)) { /* CPU affinity, scheduling policy or memory locking. */
+			/* Applied after `parse_cmdline`. */
 		}
 	}
 	if (is_reexec) {
@@ -157,6 +294,206 @@ parse_cmdline(void)
 }
 
 
+/**
+ * Parse a command line argument that configures how the
+ * server is scheduled: --cpus=LIST, --sched=POLICY[:PRIORITY],
+ * --nice=N, --slice=MICROSECONDS or --mlock; servers that
+ * implement `parse_cmdline` should pass their arguments to
+ * this function, the configuration is applied by the base,
+ * before any thread is created, after `parse_cmdline`
+ * 
+ * @param   arg  The argument
+ * @return       Whether the argument was recognised, an invalid
+ *               value is reported and makes the server fail
+ *               after `parse_cmdline` has returned
+ */
+int
+parse_scheduling_arg(const char *arg)
+{
+	static const struct {
+		const char *name;
+		int policy;
+	} policies[] = {
+		{"other", SCHED_OTHER},
+		{"batch", SCHED_BATCH},
+		{"idle",  SCHED_IDLE},
+		{"fifo",  SCHED_FIFO},
+		{"rr",    SCHED_RR}
+	};
+	const char *value;
+	size_t i, n;
+	int slice, realtime;
+
+	if (startswith(arg, "--cpus=")) { /* CPU affinity. */
+		if (parse_cpu_list(arg + strlen("--cpus="), &scheduling_cpus) < 0)
+			goto invalid;
+		have_scheduling_cpus = 1;
+	} else if (startswith(arg, "--sched=")) { /* Scheduling policy and real-time priority. */
+		value = arg + strlen("--sched=");
+		for (i = 0; i < sizeof(policies) / sizeof(*policies); i++) {
+			n = strlen(policies[i].name);
+			if (!strncmp(value, policies[i].name, n) && (!value[n] || value[n] == ':'))
+				break;
+		}
+		if (i == sizeof(policies) / sizeof(*policies))
+			goto invalid;
+		scheduling_policy = policies[i].policy;
+		realtime = scheduling_policy == SCHED_FIFO || scheduling_policy == SCHED_RR;
+		value += n;
+		if (!*value)
+			scheduling_priority = realtime;
+		else if (!realtime || strict_atoi(value + 1, &scheduling_priority, 1, 99) < 0)
+			goto invalid;
+	} else if (startswith(arg, "--nice=")) { /* Nice value. */
+		if (strict_atoi(arg + strlen("--nice="), &scheduling_nice, -20, 19) < 0)
+			goto invalid;
+	} else if (startswith(arg, "--slice=")) { /* Time slice, in microseconds. */
+		if (strict_atoi(arg + strlen("--slice="), &slice, 100, 100000) < 0)
+			goto invalid;
+		scheduling_slice = (uint64_t)slice * 1000;
+	} else if (strequals(arg, "--mlock")) { /* Keep memory that has been used in RAM. */
+		scheduling_mlock = 1;
+	} else {
+		return 0;
+	}
+	return 1;
+
+invalid:
+	eprintf("invalid value for %.*s: %s.", (int)(strchr(arg, '=') - arg), arg, strchr(arg, '=') + 1);
+	scheduling_invalid = 1;
+	return 1;
+}
+
+
+/**
+ * Set the scheduling policy, nice value and time slice
+ * selected with --sched, --nice and --slice, and save
+ * the previous attributes in `default_attr`
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+set_scheduling_attr(void)
+{
+	scheduling_attr_t attr;
+
+	fail_if (syscall(SYS_sched_getattr, 0, &default_attr, sizeof(default_attr), 0) < 0);
+	/* The runtime is reported as the current time slice, but
+	   setting it would make it a requested time slice. */
+	default_attr.size = sizeof(default_attr);
+	default_attr.sched_runtime = 0;
+	have_default_attr = 1;
+
+	attr = default_attr;
+	attr.sched_flags = 0;
+	if (scheduling_policy >= 0) {
+		attr.sched_policy = (uint32_t)scheduling_policy;
+		attr.sched_priority = (uint32_t)scheduling_priority;
+	}
+	if (scheduling_nice != INT_MIN)
+		attr.sched_nice = scheduling_nice;
+	/* With EEVDF, the runtime of a fair policy is the requested time slice,
+	   shorter slices shorten the latency after wakeups. Older kernels ignore it. */
+	attr.sched_runtime = scheduling_slice;
+	fail_if (syscall(SYS_sched_setattr, 0, &attr, 0) < 0);
+
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Apply the configuration from `parse_scheduling_arg`,
+ * failures are reported but are not fatal, as they
+ * are usually caused by missing privileges, this
+ * shall be done before any thread is created, as
+ * the configuration only applies to the calling
+ * thread and the threads it creates
+ * 
+ * In set-user-ID servers, the configuration is applied
+ * with the permissions of the real user, so that it
+ * cannot be used to gain real-time scheduling or locked
+ * memory that the real user is not allowed
+ * 
+ * @return  Zero on success, -1 on error, `errno` is
+ *          set to `EINVAL` if an option was invalid
+ */
+static int
+apply_scheduling(void)
+{
+	uid_t euid = geteuid();
+	int privileged = getuid() != euid;
+	struct rlimit limit;
+
+	if (scheduling_invalid)
+		return errno = EINVAL, -1;
+
+	if (privileged && seteuid(getuid()) < 0) {
+		xperror(*argv);
+		eprint("WARNING! ignoring the scheduling options, cannot drop privileges.");
+		return 0;
+	}
+
+	if (have_scheduling_cpus) {
+		have_default_cpus = !sched_getaffinity(0, sizeof(default_cpus), &default_cpus);
+		if (sched_setaffinity(0, sizeof(scheduling_cpus), &scheduling_cpus) < 0) {
+			xperror(*argv);
+			eprint("WARNING! cannot set the CPU affinity.");
+		}
+	}
+
+	if (scheduling_policy >= 0 || scheduling_nice != INT_MIN || scheduling_slice) {
+		if (set_scheduling_attr() < 0) {
+			xperror(*argv);
+			eprint("WARNING! cannot set the scheduling policy.");
+		}
+	}
+
+	if (scheduling_mlock) {
+		/* Memory mapped after privileges have been regained would be
+		   locked without regard to the real user's limit, so it must
+		   not have a limit. Otherwise, only lock pages as they are used,
+		   or the server would lock the entire stack of each thread it creates. */
+		if (privileged && (getrlimit(RLIMIT_MEMLOCK, &limit) < 0 || limit.rlim_cur != RLIM_INFINITY)) {
+			eprint("WARNING! cannot lock the server's memory, the real user's limit is not unlimited.");
+		} else if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) < 0 &&
+		           (errno != EINVAL || mlockall(MCL_CURRENT | MCL_FUTURE) < 0)) {
+			xperror(*argv);
+			eprint("WARNING! cannot lock the server's memory.");
+		}
+	}
+
+	fail_if (privileged && seteuid(euid) < 0);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Let a child process run on the CPUs the process
+ * was allowed to run on before the --cpus option was
+ * applied, with the scheduling policy it had before
+ * --sched, --nice and --slice were applied, this
+ * should be called in the child process before it
+ * execs another program
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int
+server_reset_scheduling(void)
+{
+	if (have_default_cpus)
+		fail_if (sched_setaffinity(0, sizeof(default_cpus), &default_cpus) < 0);
+	if (have_default_attr)
+		fail_if (syscall(SYS_sched_setattr, 0, &default_attr, 0) < 0);
+	return 0;
+fail:
+	return -1;
+}
+
+
 /**
  * Connect to the display
  * 
@@ -240,6 +577,62 @@ fail:
 }
 
 
+/**
+ * Tell the process that spawned the server that the server
+ * has been initialised, by writing to the file descriptor
+ * stored in the environment variable `READY_FD_ENV`, if set
+ */
+static void
+report_ready(void)
+{
+	const char *fd_env = getenv(READY_FD_ENV);
+	int ready_fd;
+
+	if (!fd_env)
+		return;
+	ready_fd = atoi(fd_env);
+	unsetenv(READY_FD_ENV);
+
+	/* Failure only delays the servers that depend on this server
+	   until this server exits, so it is not fatal. */
+	if (full_write(ready_fd, "\n", 1) < 0) {
+		xperror(*argv);
+		eprint("while reporting completed initialisation.");
+	}
+	xclose(ready_fd);
+}
+
+
+/**
+ * Wait, if this is a standby instance of the server, until
+ * the server shall start, a byte is then received on the file
+ * descriptor stored in the environment variable `STANDBY_FD_ENV`
+ * 
+ * @return  Zero if the server shall start, 1 if it shall
+ *          exit without starting, -1 on error
+ */
+static int
+await_activation(void)
+{
+	const char *fd_env = getenv(STANDBY_FD_ENV);
+	int standby_fd, saved_errno;
+	ssize_t r;
+	char c;
+
+	if (!fd_env)
+		return 0;
+	standby_fd = atoi(fd_env);
+	unsetenv(STANDBY_FD_ENV);
+
+	while ((r = read(standby_fd, &c, 1)) < 0 && errno == EINTR && !terminating);
+	saved_errno = errno;
+	xclose(standby_fd);
+	if (r < 0 && !terminating)
+		return errno = saved_errno, -1;
+	return r == 1 ? 0 : 1;
+}
+
+
 /**
  * This function should be called when the server has
  * been properly initialised but before initialisation
@@ -253,6 +646,9 @@ server_initialised(void)
 	pid_t r;
 	int saved_errno;
 
+	bench_event(*argv, "initialised", 0);
+	report_ready();
+
 	if (on_init_fork && (r = fork())) {
 		fail_if (r == (pid_t)-1);
 		exit(0);
@@ -397,59 +793,103 @@ received_danger(int signo)
  * 
  * @param  signo  The signal that has been received
  */
-#if defined(__GNUC__)
-# pragma GCC diagnostic push
-# pragma GCC diagnostic ignored "-Wsuggest-attribute=const"
-#endif
 void __attribute__((weak))
 received_info(int signo)
 {
+	SIGHANDLER_START;
+	server_dump_reclaimable();
+	SIGHANDLER_END;
 	(void) signo;
 }
-#if defined(__GNUC__)
-# pragma GCC diagnostic pop
-#endif
 
 
 /**
- * Unmarshal the server's saved state
+ * Map the server's saved state, from the memfd whose
+ * file descriptor is stored in the environment variable
+ * `REEXEC_FD_ENV`, or, if the old image of the server
+ * did not set it, from the shared memory object named
+ * by `SHM_PATH_PATTERN`
  * 
- * @return  Non-zero on error
+ * @param   state_n  Output parameter for the size of the mapping
+ * @return           The mapping, `MAP_FAILED` on error
  */
-static int
-base_unmarshal(void)
+static char *
+map_saved_state(size_t *restrict state_n)
 {
-	pid_t pid = getpid();
-	int reexec_fd, r;
+	const char *fd_env = getenv(REEXEC_FD_ENV);
 	char shm_path[NAME_MAX + 1];
-	char *state_buf;
-	char *state_buf_;
+	struct stat attr;
+	int reexec_fd = -1, saved_errno;
+	char *state_buf = MAP_FAILED;
 
 	/* Acquire access to marshalled data. */
-	xsnprintf(shm_path, SHM_PATH_PATTERN, (intmax_t)pid);
-	reexec_fd = shm_open(shm_path, O_RDONLY, S_IRWXU);
-	fail_if (reexec_fd < 0); /* Critical. */
+	if (fd_env) {
+		reexec_fd = atoi(fd_env);
+		fail_if (unsetenv(REEXEC_FD_ENV) < 0);
+	} else {
+		xsnprintf(shm_path, SHM_PATH_PATTERN, (intmax_t)getpid());
+		reexec_fd = shm_open(shm_path, O_RDONLY, S_IRWXU);
+		fail_if (reexec_fd < 0); /* Critical. */
+		shm_unlink(shm_path);
+	}
 
-	/* Read the state file. */
-	fail_if (!(state_buf = state_buf_ = full_read(reexec_fd, NULL)));
+	/* Map the state file. It is mapped privately, so the pages that are
+	 * not written to while the state is unmarshalled are never copied. */
+	fail_if (fstat(reexec_fd, &attr) < 0);
+	fail_if ((*state_n = (size_t)(attr.st_size)) < 2 * sizeof(int));
+	state_buf = mmap(NULL, *state_n, PROT_READ | PROT_WRITE, MAP_PRIVATE, reexec_fd, 0);
+	fail_if (state_buf == MAP_FAILED);
 
 	/* Release resources. */
 	xclose(reexec_fd);
-	shm_unlink(shm_path);
+	return state_buf;
+
+fail:
+	saved_errno = errno;
+	if (reexec_fd >= 0)
+		close(reexec_fd);
+	errno = saved_errno ? saved_errno : EBADMSG;
+	return MAP_FAILED;
+}
+
+
+/**
+ * Unmarshal the server's saved state
+ * 
+ * @return  Non-zero on error
+ */
+static int
+base_unmarshal(void)
+{
+	int r, version;
+	size_t state_n;
+	char *state_buf;
+	char *state_buf_;
+
+	/* Acquire access to marshalled data, the state is unmarshalled in place. */
+	fail_if ((state_buf = state_buf_ = map_saved_state(&state_n)) == MAP_FAILED);
 
 
 	/* Unmarshal state. */
 
-	/* Get the marshal protocal version. Not needed, there is only the one version right now. */
-	/* buf_get(state_buf_, int, 0, MDS_BASE_VARS_VERSION); */
-	buf_next(state_buf_, int, 1);
+	/* Get the marshal protocal version. */
+	buf_get_next(state_buf_, int, version);
 
 	buf_get_next(state_buf_, int, socket_fd);
+	/* An image without the seeded hash has stored byte-wise hashes. */
+	string_hash_bytewise = 1;
+	if (version >= 1)
+		buf_get_next(state_buf_, uint64_t, string_hash_seed);
+	if (version == 1)
+		string_hash_bytewise = 0;
+	if (version >= 2)
+		buf_get_next(state_buf_, int, string_hash_bytewise);
 	r = unmarshal_server(state_buf_);
 
 
 	/* Release resources. */
-	free(state_buf);
+	munmap(state_buf, state_n);
+	bench_event(*argv, "unmarshalled", state_n);
 
 	/* Recover after failure. */
 	fail_if (r && reexec_failure_recover());
@@ -464,22 +904,31 @@ fail:
 /**
  * Marshal the server's state
  * 
- * @param   reexec_fd  The file descriptor of the file into which the state shall be saved
+ * The state is marshalled directly into the memory
+ * of the file, rather than into a buffer that is then
+ * copied into the file
+ * 
+ * @param   reexec_fd  The file descriptor of the memfd into which the state shall be saved
  * @return             Non-zero on error
  */
 static int
 base_marshal(int reexec_fd)
 {
 	size_t state_n;
-	char *state_buf;
+	char *state_buf = MAP_FAILED;
 	char *state_buf_;
 
+	bench_event(*argv, "marshal", 0);
+
 	/* Calculate the size of the state data when it is marshalled. */
-	state_n = 2 * sizeof(int);
+	state_n = 3 * sizeof(int) + sizeof(uint64_t);
 	state_n += marshal_server_size();
 
-	/* Allocate a buffer for all data. */
-	fail_if (xbmalloc(state_buf = state_buf_, state_n));
+	/* Map the file, it is sized exactly for all data. */
+	fail_if (ftruncate(reexec_fd, (off_t)state_n) < 0);
+	state_buf = mmap(NULL, state_n, PROT_READ | PROT_WRITE, MAP_SHARED, reexec_fd, 0);
+	fail_if (state_buf == MAP_FAILED);
+	state_buf_ = state_buf;
 
 
 	/* Marshal the state of the server. */
@@ -489,18 +938,19 @@ base_marshal(int reexec_fd)
 
 	/* Store the state. */
 	buf_set_next(state_buf_, int, socket_fd);
+	buf_set_next(state_buf_, uint64_t, string_hash_seed);
+	buf_set_next(state_buf_, int, string_hash_bytewise);
 	fail_if (marshal_server(state_buf_));
 
 
-	/* Send the marshalled data into the file. */
-	fail_if (full_write(reexec_fd, state_buf, state_n) < 0);
-
-	free(state_buf);
+	munmap(state_buf, state_n);
+	bench_event(*argv, "marshalled", state_n);
 	return 0;
 
 fail:
 	xperror(*argv);
-	free(state_buf);
+	if (state_buf != MAP_FAILED)
+		munmap(state_buf, state_n);
 	return 1;
 }
 
@@ -508,36 +958,320 @@ fail:
 /**
  * Marshal and re-execute the server
  * 
+ * The state is marshalled into a memfd that is inherited
+ * by the new image, which finds it in the environment
+ * variable `REEXEC_FD_ENV`
+ * 
  * This function only returns on error,
  * in which case the error will have been printed.
  */
 static void
 perform_reexec(void)
 {
-	pid_t pid = getpid();
 	int reexec_fd;
-	char shm_path[NAME_MAX + 1];
+	char fd_env[3 * sizeof(int) + 1];
 
 	/* Marshal the state of the server. */
-	xsnprintf(shm_path, SHM_PATH_PATTERN, (unsigned long int)pid);
-	reexec_fd = shm_open(shm_path, O_RDWR | O_CREAT | O_EXCL, S_IRWXU);
+	reexec_fd = memfd_create("mds-reexec", 0);
 	fail_if (reexec_fd < 0);
 	fail_if (base_marshal(reexec_fd) < 0);
-	xclose(reexec_fd);
-	reexec_fd = -1;
+	xsnprintf(fd_env, "%i", reexec_fd);
+	fail_if (setenv(REEXEC_FD_ENV, fd_env, 1) < 0);
 
 	/* Re-exec the server. */
+	bench_event(*argv, "exec", 0);
 	reexec_server(argc, argv, is_reexec);
 
 fail:
 	xperror(*argv);
-	if (reexec_fd >= 0) {
+	unsetenv(REEXEC_FD_ENV);
+	if (reexec_fd >= 0)
 		xclose(reexec_fd);
-		shm_unlink(shm_path);
+}
+
+
+/**
+ * Register memory, such as a buffer or a cache, that the
+ * server can free when it is not needed, it is freed by
+ * `server_trim`, this should be done in `preinitialise_server`
+ * 
+ * @param   name         The name of the memory, used in state dumps
+ * @param   reclaimable  Function that returns the number of bytes
+ *                       that `trim` would free
+ * @param   trim         Function that frees the memory, it shall
+ *                       return zero on success and -1 on error
+ * @param   data         Argument for `reclaimable` and `trim`
+ * @return               Zero on success, -1 on error
+ */
+int
+server_add_trimmable(const char *name, size_t (*reclaimable)(void *data),
+                     int (*trim)(void *data), void *data)
+{
+	trimmable_t *new_trimmables = trimmables;
+	fail_if (xrealloc(new_trimmables, trimmable_count + 1, trimmable_t));
+	trimmables = new_trimmables;
+	trimmables[trimmable_count].name = name;
+	trimmables[trimmable_count].reclaimable = reclaimable;
+	trimmables[trimmable_count].trim = trim;
+	trimmables[trimmable_count].data = data;
+	trimmable_count++;
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Calculate the number of bytes that
+ * shrinking a message's read buffer would free
+ * 
+ * @param   data  The message
+ * @return        The number of bytes that would be freed
+ */
+static size_t
+message_reclaimable(void *data)
+{
+	return mds_message_reclaimable(data);
+}
+
+
+/**
+ * Shrink a message's read buffer
+ * 
+ * @param   data  The message
+ * @return        Zero on success, -1 on error
+ */
+static int
+trim_message(void *data)
+{
+	return mds_message_shrink(data);
+}
+
+
+/**
+ * Register the read buffer of a message with
+ * `server_add_trimmable`, so that it is shrunk
+ * after a large message has been read
+ * 
+ * @param   name     The name of the buffer, used in state dumps
+ * @param   message  The message
+ * @return           Zero on success, -1 on error
+ */
+int
+server_add_trimmable_message(const char *name, mds_message_t *message)
+{
+	return server_add_trimmable(name, message_reclaimable, trim_message, message);
+}
+
+
+/**
+ * Calculate the number of bytes the server
+ * can free by calling `server_trim`
+ * 
+ * @return  The number of bytes that can be freed
+ */
+size_t
+server_reclaimable(void)
+{
+	size_t i, rc = 0;
+	for (i = 0; i < trimmable_count; i++)
+		rc += trimmables[i].reclaimable(trimmables[i].data);
+	return rc;
+}
+
+
+/**
+ * Free all memory, registered with `server_add_trimmable`,
+ * that the server does not need, this should be done
+ * by the master thread, between messages, when `danger`
+ * is set; failures are reported but are not fatal
+ */
+void
+server_trim(void)
+{
+	size_t i;
+	for (i = 0; i < trimmable_count; i++) {
+		if (!trimmables[i].reclaimable(trimmables[i].data))
+			continue;
+		if (trimmables[i].trim(trimmables[i].data) < 0) {
+			xperror(*argv);
+			eprintf("while freeing %s.", trimmables[i].name);
+		}
 	}
 }
 
 
+/**
+ * Print, as part of a state dump, the memory, registered
+ * with `server_add_trimmable`, that the server can free
+ */
+void
+server_dump_reclaimable(void)
+{
+	size_t i, n, total = 0;
+	for (i = 0; i < trimmable_count; i++) {
+		n = trimmables[i].reclaimable(trimmables[i].data);
+		iprintf("reclaimable memory in %s: %zu bytes", trimmables[i].name, n);
+		total += n;
+	}
+	iprintf("reclaimable memory: %zu bytes", total);
+}
+
+
+/**
+ * This function is called, by the event loop, when the
+ * memory pressure has exceeded the PSI trigger
+ * 
+ * @param   fd         The PSI trigger
+ * @param   events     The events that occurred
+ * @param   user_data  Not used
+ * @return             Zero
+ */
+static int
+pressure_from_event_loop(int fd, uint32_t events, void *user_data)
+{
+	if (events & EPOLLERR) {
+		/* The trigger has been destroyed. */
+		event_loop_remove_fd(&server_event_loop, fd);
+		xclose(fd);
+		pressure_fd = -1;
+		eprint("stopped monitoring memory pressure.");
+	} else {
+		received_danger(SIGDANGER);
+	}
+	return 0;
+	(void) user_data;
+}
+
+
+/**
+ * This function is called, by the event loop, every
+ * `TRIM_INTERVAL_SECONDS` seconds, to let the master
+ * loop free memory that has not been freed since
+ * the last time the server was busy
+ * 
+ * @param   timer        The timer
+ * @param   expirations  The number of times the timer has expired
+ * @param   user_data    Not used
+ * @return               Zero
+ */
+static int
+trim_from_event_loop(int timer, uint64_t expirations, void *user_data)
+{
+	danger = 1;
+	return 0;
+	(void) timer;
+	(void) expirations;
+	(void) user_data;
+}
+
+
+/**
+ * Master function for the thread that, in servers that do
+ * not use the event loop, monitors memory pressure and
+ * periodically lets the master thread free memory
+ * 
+ * @param   data  Not used
+ * @return        `NULL`
+ */
+static void *
+memory_loop(void *data)
+{
+	int timeout = trimmable_count > 0 && TRIM_INTERVAL_SECONDS > 0 ? TRIM_INTERVAL_SECONDS * 1000 : -1;
+	nfds_t nfds = pressure_fd >= 0;
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = pressure_fd;
+	pfd.events = POLLPRI;
+	while (nfds || timeout >= 0) {
+		if ((r = poll(&pfd, nfds, timeout)) < 0) {
+			if (errno == EINTR)
+				continue;
+			xperror(*argv);
+			break;
+		}
+		if (!r) {
+			/* Let the master thread free memory left over from its last burst. */
+			danger = 1;
+			pthread_kill(master_thread, SIGRTMIN);
+		} else if (pfd.revents & POLLERR) {
+			/* The trigger has been destroyed. */
+			eprint("stopped monitoring memory pressure.");
+			nfds = 0;
+		} else if (pfd.revents & POLLPRI) {
+			/* Let the master thread free memory, as it would on `SIGDANGER`. */
+			received_danger(SIGDANGER);
+			pthread_kill(master_thread, SIGRTMIN);
+		}
+	}
+
+	return NULL;
+	(void) data;
+}
+
+
+/**
+ * Start freeing unneeded memory automatically: every
+ * `TRIM_INTERVAL_SECONDS` seconds, if the server has
+ * registered memory with `server_add_trimmable`, and
+ * when the memory pressure exceeds a PSI trigger, as
+ * if `SIGDANGER` had been received, but even if
+ * `server_characteristics.danger_is_deadly` is set
+ * 
+ * The trigger is `MEMORY_PRESSURE_TRIGGER`, unless overridden
+ * by the environment variable `MEMORY_PRESSURE_ENV`, memory
+ * pressure is not monitored if the kernel does not support PSI
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+monitor_memory(void)
+{
+	const char *trigger = getenv(MEMORY_PRESSURE_ENV);
+	struct timespec interval = {TRIM_INTERVAL_SECONDS, 0};
+	int periodic = trimmable_count > 0 && TRIM_INTERVAL_SECONDS > 0;
+	sigset_t set, old_set;
+	pthread_t thread;
+
+	if (!trigger)
+		trigger = MEMORY_PRESSURE_TRIGGER;
+	if (*trigger)
+		pressure_fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (pressure_fd >= 0 && write(pressure_fd, trigger, strlen(trigger) + 1) < 0) {
+		xperror(*argv);
+		eprint("WARNING! cannot monitor memory pressure.");
+		xclose(pressure_fd);
+		pressure_fd = -1;
+	}
+
+	if (server_characteristics.use_event_loop) {
+		if (pressure_fd >= 0)
+			fail_if (event_loop_add_fd(&server_event_loop, pressure_fd, EPOLLPRI,
+			                           pressure_from_event_loop, NULL) < 0);
+		if (periodic)
+			fail_if (event_loop_add_timer(&server_event_loop, &interval, &interval,
+			                              trim_from_event_loop, NULL) < 0);
+		return 0;
+	}
+
+	if (pressure_fd < 0 && !periodic)
+		return 0;
+
+	/* The thread shall not receive the signals meant for the other threads. */
+	sigfillset(&set);
+	fail_if ((errno = pthread_sigmask(SIG_SETMASK, &set, &old_set)));
+	errno = pthread_create(&thread, NULL, memory_loop, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	fail_if (errno);
+	pthread_detach(thread);
+	return 0;
+
+fail:
+	return -1;
+}
+
+
 /**
  * Entry point of the server
  * 
@@ -548,6 +1282,8 @@ fail:
 int
 main(int argc_, char **argv_)
 {
+	int r;
+
 	argc = argc_;
 	argv = argv_;
 
@@ -570,14 +1306,41 @@ main(int argc_, char **argv_)
 	/* Parse command line arguments. */
 	fail_if (parse_cmdline());
 
+	/* Set the CPU affinity, scheduling policy and memory locking, before
+	 * any thread is created, so that all threads of the server inherit it. */
+	fail_if (apply_scheduling());
+
+	/* Record when the image started, for benchmarks of start-up and re-exec. */
+	bench_event(*argv, "start", (size_t)is_reexec);
+
 
 	/* Store the current thread so it can be killed from elsewhere. */
 	master_thread = pthread_self();
 
+	/* Create the event loop, before the signals are trapped with it. */
+	if (server_characteristics.use_event_loop)
+		fail_if (event_loop_initialise(&server_event_loop));
+
 	/* Set up signal traps for all especially handled signals. */
 	trap_signals();
 
 
+	/* Randomise the string hash function, after a re-exec
+	 * the old seed is unmarshalled, as hashes are marshalled. */
+	if (!is_reexec && string_hash_seed_initialise() < 0) {
+		xperror(*argv);
+		eprint("WARNING! failed to read a random seed for string hashing.");
+	}
+
+	/* Wait until the server shall start, if this is a
+	 * standby instance of it, that has been loaded and
+	 * set up ahead of time to be started without delay. */
+	if (!is_reexec) {
+		fail_if ((r = await_activation()) < 0);
+		if (r)
+			goto done;
+	}
+
 	/* Initialise the server. */
 	fail_if (preinitialise_server());
 
@@ -597,7 +1360,14 @@ main(int argc_, char **argv_)
 	fail_if (postinitialise_server());
 
 
+	/* Free unneeded memory periodically, and when the memory pressure is high. */
+	if (monitor_memory() < 0) {
+		xperror(*argv);
+		eprint("WARNING! cannot free unneeded memory automatically.");
+	}
+
 	/* Run the server. */
+	bench_event(*argv, "running", (size_t)is_reexec);
 	fail_if (master_loop());
 
 
@@ -607,12 +1377,18 @@ main(int argc_, char **argv_)
 		fail_if (1);
 	}
 
-	xclose(socket_fd);
+done:
+	if (server_characteristics.use_event_loop)
+		event_loop_destroy(&server_event_loop);
+	if (socket_fd >= 0)
+		xclose(socket_fd);
 	return 0;
 
 
 fail:
 	xperror(*argv);
+	if (server_characteristics.use_event_loop)
+		event_loop_destroy(&server_event_loop);
 	if (socket_fd >= 0)
 		xclose(socket_fd);
 	return 1;
@@ -646,6 +1422,60 @@ commit_suicide(int signo)
 }
 
 
+/**
+ * This function is called by the event loop when
+ * an especially handled signal has been received,
+ * if `server_characteristics.use_event_loop` is
+ * non-zero
+ * 
+ * @param   signo      The signal that has been received
+ * @param   user_data  Not used
+ * @return             Zero
+ */
+static int
+received_from_event_loop(int signo, void *user_data)
+{
+	if (signo == SIGUPDATE)
+		received_reexec(signo);
+	else if (signo == SIGTERM || signo == SIGINT)
+		received_terminate(signo);
+	else if (signo == SIGDANGER)
+		received_danger(signo);
+	else if (signo == SIGINFO)
+		received_info(signo);
+	return 0;
+	(void) user_data;
+}
+
+
+/**
+ * Set up signal traps for all especially handled signals,
+ * with `server_event_loop` rather than with signal handlers
+ * 
+ * @return  Non-zero on error
+ */
+static int
+trap_signals_with_event_loop(void)
+{
+	event_loop_t *loop = &server_event_loop;
+
+	fail_if (event_loop_add_signal(loop, SIGUPDATE, received_from_event_loop, NULL) < 0);
+	fail_if (event_loop_add_signal(loop, SIGTERM, received_from_event_loop, NULL) < 0);
+	fail_if (event_loop_add_signal(loop, SIGINT, received_from_event_loop, NULL) < 0);
+	fail_if (xsigaction(SIGRTMIN, received_noop) < 0);
+	if (server_characteristics.danger_is_deadly && !is_immortal)
+		fail_if (xsigaction(SIGDANGER, commit_suicide) < 0);
+	else
+		fail_if (event_loop_add_signal(loop, SIGDANGER, received_from_event_loop, NULL) < 0);
+	fail_if (event_loop_add_signal(loop, SIGINFO, received_from_event_loop, NULL) < 0);
+
+	return 0;
+fail:
+	xperror(*argv);
+	return 1;
+}
+
+
 /**
  * Set up signal traps for all especially handled signals
  * 
@@ -654,6 +1484,9 @@ commit_suicide(int signo)
 int
 trap_signals(void)
 {
+	if (server_characteristics.use_event_loop)
+		return trap_signals_with_event_loop();
+
 	/* Make the server update without all slaves dying on SIGUPDATE. */
 	fail_if (xsigaction(SIGUPDATE, received_reexec) < 0);
 
@@ -19,11 +19,25 @@
 #define MDS_MDS_BASE_H
 
 
+#include <libmdsserver/event-loop.h>
+#include <libmdsserver/mds-message.h>
+
 #include <pthread.h>
 #include <signal.h>
 
 
-#define MDS_BASE_VARS_VERSION 0
+#define MDS_BASE_VARS_VERSION 2
+
+
+/**
+ * The number of seconds between the times the server frees
+ * memory, registered with `server_add_trimmable`, that it
+ * does not need, 0 to only free it on `SIGDANGER` and when
+ * the memory pressure is high
+ */
+#ifndef TRIM_INTERVAL_SECONDS
+# define TRIM_INTERVAL_SECONDS  60
+#endif
 
 
 
@@ -77,6 +91,19 @@ typedef struct server_characteristics {
 	 * --immortal is used.
 	 */
 	unsigned danger_is_deadly : 1;
+
+	/**
+	 * Setting this to non-zero will cause the server to create
+	 * `server_event_loop` before `preinitialise_server` is called,
+	 * and to receive the especially handled signals, except for
+	 * `SIGRTMIN` and a deadly `SIGDANGER`, with it rather than
+	 * with signal handlers. These signals are then blocked, so
+	 * they will not interrupt system calls, the server shall
+	 * rather wait in `event_loop_dispatch` and check `terminating`,
+	 * `reexecing` and `danger` when it returns. Threads and child
+	 * processes inherit the blocked signals.
+	 */
+	unsigned use_event_loop : 1;
 } __attribute__((packed)) server_characteristics_t;
 
 
@@ -148,7 +175,9 @@ extern volatile sig_atomic_t terminating;
 extern volatile sig_atomic_t reexecing;
 
 /**
- * Whether the server has been signaled to free unneeded memory
+ * Whether the server has been signaled to free unneeded memory,
+ * or shall do so because the memory pressure is high or because
+ * `TRIM_INTERVAL_SECONDS` seconds have elapsed
  */
 extern volatile sig_atomic_t danger;
 
@@ -159,6 +188,13 @@ extern volatile sig_atomic_t danger;
  */
 extern int socket_fd;
 
+/**
+ * The event loop of the server, created if
+ * `server_characteristics.use_event_loop`
+ * is non-zero
+ */
+extern event_loop_t server_event_loop;
+
 
 
 /**
@@ -194,6 +230,87 @@ int connect_to_display(void); /* __attribute__((weak)) */
 int server_initialised(void); /* __attribute__((weak)) */
 
 
+/**
+ * Register memory, such as a buffer or a cache, that the
+ * server can free when it is not needed, it is freed by
+ * `server_trim`, this should be done in `preinitialise_server`
+ * 
+ * @param   name         The name of the memory, used in state dumps
+ * @param   reclaimable  Function that returns the number of bytes
+ *                       that `trim` would free
+ * @param   trim         Function that frees the memory, it shall
+ *                       return zero on success and -1 on error
+ * @param   data         Argument for `reclaimable` and `trim`
+ * @return               Zero on success, -1 on error
+ */
+__attribute__((nonnull(1, 2, 3)))
+int server_add_trimmable(const char *name, size_t (*reclaimable)(void *data),
+                         int (*trim)(void *data), void *data);
+
+/**
+ * Register the read buffer of a message with
+ * `server_add_trimmable`, so that it is shrunk
+ * after a large message has been read
+ * 
+ * @param   name     The name of the buffer, used in state dumps
+ * @param   message  The message
+ * @return           Zero on success, -1 on error
+ */
+__attribute__((nonnull))
+int server_add_trimmable_message(const char *name, mds_message_t *message);
+
+/**
+ * Calculate the number of bytes the server
+ * can free by calling `server_trim`
+ * 
+ * @return  The number of bytes that can be freed
+ */
+size_t server_reclaimable(void);
+
+/**
+ * Free all memory, registered with `server_add_trimmable`,
+ * that the server does not need, this should be done
+ * by the master thread, between messages, when `danger`
+ * is set; failures are reported but are not fatal
+ */
+void server_trim(void);
+
+/**
+ * Print, as part of a state dump, the memory, registered
+ * with `server_add_trimmable`, that the server can free
+ */
+void server_dump_reclaimable(void);
+
+
+/**
+ * Parse a command line argument that configures how the
+ * server is scheduled: --cpus=LIST, --sched=POLICY[:PRIORITY],
+ * --nice=N, --slice=MICROSECONDS or --mlock; servers that
+ * implement `parse_cmdline` should pass their arguments to
+ * this function, the configuration is applied by the base,
+ * before any thread is created, after `parse_cmdline`
+ * 
+ * @param   arg  The argument
+ * @return       Whether the argument was recognised, an invalid
+ *               value is reported and makes the server fail
+ *               after `parse_cmdline` has returned
+ */
+__attribute__((nonnull))
+int parse_scheduling_arg(const char *arg);
+
+/**
+ * Let a child process run on the CPUs the process
+ * was allowed to run on before the --cpus option was
+ * applied, with the scheduling policy it had before
+ * --sched, --nice and --slice were applied, this
+ * should be called in the child process before it
+ * execs another program
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int server_reset_scheduling(void);
+
+
 /**
  * This function should be implemented by the actual server implementation
  * if the server is multi-threaded
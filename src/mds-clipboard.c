@@ -26,6 +26,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #define reconnect_to_display() -1
 
 
@@ -46,7 +47,8 @@ server_characteristics_t server_characteristics = {
 	.require_respawn_info = 1,
 	.sanity_check_argc = 1,
 	.fork_for_safety = 0,
-	.danger_is_deadly = 1
+	.danger_is_deadly = 1,
+	.use_event_loop = 1
 };
 
 
@@ -94,16 +96,49 @@ static clipitem_t *clipboard[CLIPBOARD_LEVELS];
 	((full_send)(socket_fd, message, length))
 
 
+/**
+ * Calculate the number of bytes that `trim_expired_entries` would free
+ * 
+ * @param   data  Not used
+ * @return        The number of bytes that would be freed
+ */
+static size_t
+expired_entries_reclaimable(void *data)
+{
+	return clipboard_reclaimable();
+	(void) data;
+}
+
+
+/**
+ * Remove expired entries
+ * 
+ * @param   data  Not used
+ * @return        Zero on success, -1 on error
+ */
+static int
+trim_expired_entries(void *data)
+{
+	return clipboard_danger();
+	(void) data;
+}
+
+
 /**
  * This function will be invoked before `initialise_server` (if not re-exec:ing)
  * or before `unmarshal_server` (if re-exec:ing)
  * 
  * @return  Non-zero on error
  */
-int __attribute__((const))
+int
 preinitialise_server(void)
 {
+	fail_if (server_add_trimmable("expired entries", expired_entries_reclaimable, trim_expired_entries, NULL));
+	fail_if (server_add_trimmable_message("receive buffer", &received));
 	return 0;
+fail:
+	xperror(*argv);
+	return 1;
 }
 
 
@@ -241,6 +276,7 @@ marshal_server(char *state_buf)
 	buf_set_next(state_buf, int, connected);
 	buf_set_next(state_buf, uint32_t, message_id);
 	mds_message_marshal(&received, state_buf);
+	state_buf += mds_message_marshal_size(&received) / sizeof(char);
 
 	/* Removed entires from the clipboard that may not be marshalled. */
 	for (i = 0; i < CLIPBOARD_LEVELS; i++) {
@@ -306,6 +342,7 @@ unmarshal_server(char *state_buf)
 	buf_get_next(state_buf, int, connected);
 	buf_get_next(state_buf, uint32_t, message_id);
 	fail_if (mds_message_unmarshal(&received, state_buf));
+	state_buf += mds_message_marshal_size(&received) / sizeof(char);
 
 	for (i = 0; i < CLIPBOARD_LEVELS; i++) {
 		buf_get_next(state_buf, size_t, clipboard_size[i]);
@@ -354,29 +391,29 @@ reexec_failure_recover(void)
 
 
 /**
- * Perform the server's mission
+ * Read and handle all messages that have been
+ * received, called when the socket is readable
  * 
- * @return  Non-zero on error
+ * @param   fd         The file descriptor of the socket
+ * @param   events     Not used
+ * @param   user_data  Not used
+ * @return             Zero on success, -1 on error
  */
-int
-master_loop(void)
+static int
+receive_messages(int fd, uint32_t events, void *user_data)
 {
-	int rc = 1, r;
-	size_t i, j;
-
-	while (!reexecing && !terminating) {
-		if (danger) {
-			danger = 0;
-			clipboard_danger();
-		}
+	int r;
 
-		if (r = mds_message_read(&received, socket_fd), r == 0)
-			if (r = handle_message(), r == 0)
+	for (;;) {
+		if (!(r = mds_message_read_nonblocking(&received, fd)))
+			if (!(r = handle_message()))
 				continue;
 
 		if (r == -2) {
 			eprint("corrupt message received, aborting.");
-			goto done;
+			fail_if ((errno = EBADMSG));
+		} else if (errno == EAGAIN) {
+			return 0;
 		} else if (errno == EINTR) {
 			continue;
 		} else {
@@ -384,11 +421,45 @@ master_loop(void)
 		}
 
 		eprint("lost connection to server.");
+		event_loop_remove_fd(&server_event_loop, fd);
 		mds_message_destroy(&received);
 		mds_message_initialise(&received);
 		connected = 0;
 		fail_if (reconnect_to_display());
 		connected = 1;
+		fail_if (event_loop_add_fd(&server_event_loop, socket_fd, EPOLLIN, receive_messages, NULL));
+		return 0;
+	}
+
+fail:
+	return -1;
+	(void) events;
+	(void) user_data;
+}
+
+
+/**
+ * Perform the server's mission
+ * 
+ * @return  Non-zero on error
+ */
+int
+master_loop(void)
+{
+	int rc = 1;
+	size_t i, j;
+
+	/* Handle messages that were received before a re-exec, then wait for more. */
+	fail_if (receive_messages(socket_fd, 0, NULL));
+	fail_if (event_loop_add_fd(&server_event_loop, socket_fd, EPOLLIN, receive_messages, NULL));
+
+	while (!reexecing && !terminating) {
+		if (danger) {
+			danger = 0;
+			server_trim();
+		}
+
+		fail_if (event_loop_dispatch(&server_event_loop, -1) < 0);
 	}
 
 	rc = 0;
@@ -554,6 +625,24 @@ fail:
 }
 
 
+/**
+ * Check whether a clipboard entry has timed out
+ * 
+ * @param   clip  The entry
+ * @param   now   The current time
+ * @return        Whether the entry has timed out
+ */
+static int __attribute__((pure, nonnull))
+clipboard_expired(const clipitem_t *clip, const struct timespec *now)
+{
+	if (!(clip->autopurge & CLIPITEM_AUTOPURGE_UPON_CLOCK))
+		return 0;
+	if (clip->dethklok.tv_sec != now->tv_sec)
+		return clip->dethklok.tv_sec < now->tv_sec;
+	return clip->dethklok.tv_nsec <= now->tv_nsec;
+}
+
+
 /**
  * Remove old entries from a clipstack
  * 
@@ -577,13 +666,8 @@ clipboard_purge(int level, const char *client_id)
 			if (clip->client == client)
 				goto removed;
 		}
-		if ((clip->autopurge & CLIPITEM_AUTOPURGE_UPON_CLOCK)) {
-			if (clip->dethklok.tv_sec > now.tv_sec)
-				goto removed;
-			if (clip->dethklok.tv_sec == now.tv_sec)
-				if (clip->dethklok.tv_nsec >= now.tv_nsec)
-					goto removed;
-		}
+		if (clipboard_expired(clip, &now))
+			goto removed;
 
 		continue;
 	removed:
@@ -618,6 +702,28 @@ fail:
 }
 
 
+/**
+ * Calculate the number of bytes that `clipboard_danger` would free
+ * 
+ * @return  The number of bytes in expired entries
+ */
+size_t
+clipboard_reclaimable(void)
+{
+	struct timespec now;
+	size_t i, rc = 0;
+	int level;
+
+	if (monotone(&now))
+		return 0;
+	for (level = 0; level < CLIPBOARD_LEVELS; level++)
+		for (i = 0; i < clipboard_used[level]; i++)
+			if (clipboard_expired(clipboard[level] + i, &now))
+				rc += clipboard[level][i].length * sizeof(char);
+	return rc;
+}
+
+
 /**
  * Remove entries in the clipboard added by a client
  * 
@@ -895,6 +1001,7 @@ received_info(int signo)
 		iprintf("current time: %ji.%09li", (intmax_t)(now.tv_sec), (long)(now.tv_nsec));
 	iprintf("next message ID: %" PRIu32, message_id);
 	iprintf("connected: %s", connected ? "yes" : "no");
+	server_dump_reclaimable();
 	for (i = 0; i < CLIPBOARD_LEVELS; i++) {
 		n = clipboard_used[i];
 		iprintf("clipstack %zu: allocated: %zu", i, clipboard_size[i]);
@@ -101,6 +101,13 @@ int handle_message(void);
  */
 int clipboard_danger(void);
 
+/**
+ * Calculate the number of bytes that `clipboard_danger` would free
+ * 
+ * @return  The number of bytes in expired entries
+ */
+size_t clipboard_reclaimable(void);
+
 /**
  * Remove entries in the clipboard added by a client
  * 
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #define reconnect_to_display() -1
 
 
@@ -50,7 +51,8 @@ server_characteristics_t server_characteristics = {
 	.require_respawn_info = 0,
 	.sanity_check_argc = 1,
 	.fork_for_safety = 0,
-	.danger_is_deadly = 0
+	.danger_is_deadly = 0,
+	.use_event_loop = 1
 };
 
 
@@ -150,16 +152,121 @@ static size_t colour_list_buffer_with_values_length = 0;
 	 ? -1 : ((message_id = message_id == INT32_MAX ? 0 : (message_id + 1)), 0))
 
 
+/**
+ * Calculate the number of bytes that `trim_send_buffer` would free
+ * 
+ * @param   data  Not used
+ * @return        The number of bytes that would be freed
+ */
+static size_t
+send_buffer_reclaimable(void *data)
+{
+	return send_buffer_size * sizeof(char);
+	(void) data;
+}
+
+
+/**
+ * Free `send_buffer`, it is reallocated when it is needed
+ * 
+ * @param   data  Not used
+ * @return        Zero
+ */
+static int
+trim_send_buffer(void *data)
+{
+	free(send_buffer);
+	send_buffer = NULL;
+	send_buffer_size = 0;
+	return 0;
+	(void) data;
+}
+
+
+/**
+ * Calculate the number of bytes that `trim_colour_list_buffers` would free
+ * 
+ * @param   data  Not used
+ * @return        The number of bytes that would be freed
+ */
+static size_t
+colour_list_buffers_reclaimable(void *data)
+{
+	size_t rc = 0;
+	if (colour_list_buffer_without_values)
+		rc += colour_list_buffer_without_values_length + 1;
+	if (colour_list_buffer_with_values)
+		rc += colour_list_buffer_with_values_length + 1;
+	return rc * sizeof(char);
+	(void) data;
+}
+
+
+/**
+ * Free the textual lists of all colours, they
+ * are recreated when a client queries them
+ * 
+ * @param   data  Not used
+ * @return        Zero
+ */
+static int
+trim_colour_list_buffers(void *data)
+{
+	free(colour_list_buffer_without_values);
+	colour_list_buffer_without_values = NULL;
+	free(colour_list_buffer_with_values);
+	colour_list_buffer_with_values = NULL;
+	return 0;
+	(void) data;
+}
+
+
+/**
+ * Calculate the number of bytes that `trim_colours` would free
+ * 
+ * @param   data  Not used
+ * @return        The number of bytes that would be freed
+ */
+static size_t
+colours_reclaimable(void *data)
+{
+	return colour_list_reclaimable(&colours);
+	(void) data;
+}
+
+
+/**
+ * Pack the list of all colours
+ * 
+ * @param   data  Not used
+ * @return        Zero on success, -1 on error
+ */
+static int
+trim_colours(void *data)
+{
+	return colour_list_pack(&colours);
+	(void) data;
+}
+
+
 /**
  * This function will be invoked before `initialise_server` (if not re-exec:ing)
  * or before `unmarshal_server` (if re-exec:ing)
  * 
  * @return  Non-zero on error
  */
-int __attribute__((const))
+int
 preinitialise_server(void)
 {
+	fail_if (server_add_trimmable("send buffer", send_buffer_reclaimable, trim_send_buffer, NULL));
+	fail_if (server_add_trimmable("colour list buffers", colour_list_buffers_reclaimable,
+	                              trim_colour_list_buffers, NULL));
+	fail_if (server_add_trimmable("colour list", colours_reclaimable, trim_colours, NULL));
+	fail_if (server_add_trimmable_message("receive buffer", &received));
 	return 0;
+fail:
+	xperror(*argv);
+	return 1;
 }
 
 
@@ -252,7 +359,7 @@ marshal_server(char *state_buf)
 	buf_set_next(state_buf, uint32_t, message_id);
 
 	mds_message_marshal(&received, state_buf);
-	state_buf += mds_message_marshal_size(&received) / sizeof(char*);
+	state_buf += mds_message_marshal_size(&received) / sizeof(char);
 
 	colour_list_marshal(&colours, state_buf);
 
@@ -283,7 +390,7 @@ unmarshal_server(char *state_buf)
 	buf_get_next(state_buf, uint32_t, message_id);
 
 	fail_if (mds_message_unmarshal(&received, state_buf));
-	state_buf += mds_message_marshal_size(&received) / sizeof(char*);
+	state_buf += mds_message_marshal_size(&received) / sizeof(char);
 	stage++;
 
 	fail_if (colour_list_unmarshal(&colours, state_buf));
@@ -311,35 +418,29 @@ reexec_failure_recover(void)
 
 
 /**
- * Perform the server's mission
+ * Read and handle all messages that have been
+ * received, called when the socket is readable
  * 
- * @return  Non-zero on error
+ * @param   fd         The file descriptor of the socket
+ * @param   events     Not used
+ * @param   user_data  Not used
+ * @return             Zero on success, -1 on error
  */
-int
-master_loop(void)
+static int
+receive_messages(int fd, uint32_t events, void *user_data)
 {
-	int rc = 1, r;
+	int r;
 
-	while (!reexecing && !terminating) {
-		if (danger) {
-			danger = 0;
-			free(send_buffer);
-			send_buffer = NULL;
-			send_buffer_size = 0;
-			colour_list_pack(&colours);
-			free(colour_list_buffer_without_values);
-			colour_list_buffer_without_values = NULL;
-			free(colour_list_buffer_with_values);
-			colour_list_buffer_with_values = NULL;
-		}
-
-		if (!(r = mds_message_read(&received, socket_fd)))
+	for (;;) {
+		if (!(r = mds_message_read_nonblocking(&received, fd)))
 			if (!(r = handle_message()))
 				continue;
 
 		if (r == -2) {
 			eprint("corrupt message received, aborting.");
-			goto done;
+			fail_if ((errno = EBADMSG));
+		} else if (errno == EAGAIN) {
+			return 0;
 		} else if (errno == EINTR) {
 			continue;
 		} else {
@@ -347,11 +448,44 @@ master_loop(void)
 		}
 
 		eprint("lost connection to server.");
+		event_loop_remove_fd(&server_event_loop, fd);
 		mds_message_destroy(&received);
 		mds_message_initialise(&received);
 		connected = 0;
 		fail_if (reconnect_to_display());
 		connected = 1;
+		fail_if (event_loop_add_fd(&server_event_loop, socket_fd, EPOLLIN, receive_messages, NULL));
+		return 0;
+	}
+
+fail:
+	return -1;
+	(void) events;
+	(void) user_data;
+}
+
+
+/**
+ * Perform the server's mission
+ * 
+ * @return  Non-zero on error
+ */
+int
+master_loop(void)
+{
+	int rc = 1;
+
+	/* Handle messages that were received before a re-exec, then wait for more. */
+	fail_if (receive_messages(socket_fd, 0, NULL));
+	fail_if (event_loop_add_fd(&server_event_loop, socket_fd, EPOLLIN, receive_messages, NULL));
+
+	while (!reexecing && !terminating) {
+		if (danger) {
+			danger = 0;
+			server_trim();
+		}
+
+		fail_if (event_loop_dispatch(&server_event_loop, -1) < 0);
 	}
 
 	rc = 0;
@@ -874,6 +1008,7 @@ void received_info(int signo)
 	iprintf("next message ID: %" PRIu32, message_id);
 	iprintf("connected: %s", connected ? "yes" : "no");
 	iprintf("send buffer size: %zu bytes", send_buffer_size);
+	server_dump_reclaimable();
 	iprint("DEFINED COLOURS (bytes red green blue name-hash name)");
 	foreach_hash_list_entry (colours, i, entry)
 		iprintf("%i %"PRIu64" %"PRIu64" %"PRIu64" %zu %s",
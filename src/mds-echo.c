@@ -26,6 +26,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #define reconnect_to_display() -1
 
 
@@ -46,7 +47,8 @@ server_characteristics_t server_characteristics = {
 	.require_respawn_info = 0,
 	.sanity_check_argc = 1,
 	.fork_for_safety = 0,
-	.danger_is_deadly = 1
+	.danger_is_deadly = 1,
+	.use_event_loop = 1
 };
 
 
@@ -227,23 +229,29 @@ reexec_failure_recover(void)
 
 
 /**
- * Perform the server's mission
+ * Read and handle all messages that have been
+ * received, called when the socket is readable
  * 
- * @return  Non-zero on error
+ * @param   fd         The file descriptor of the socket
+ * @param   events     Not used
+ * @param   user_data  Not used
+ * @return             Zero on success, -1 on error
  */
-int
-master_loop(void)
+static int
+receive_messages(int fd, uint32_t events, void *user_data)
 {
-	int rc = 1, r;
+	int r;
 
-	while (!reexecing && !terminating) {
-		if (!(r = mds_message_read(&received, socket_fd)))
+	for (;;) {
+		if (!(r = mds_message_read_nonblocking(&received, fd)))
 			if (!(r = echo_message()))
 				continue;
 
 		if (r == -2) {
 			eprint("corrupt message received, aborting.");
-			goto done;
+			fail_if ((errno = EBADMSG));
+		} else if (errno == EAGAIN) {
+			return 0;
 		} else if (errno == EINTR) {
 			continue;
 		} else {
@@ -251,11 +259,39 @@ master_loop(void)
 		}
 
 		eprint("lost connection to server.");
+		event_loop_remove_fd(&server_event_loop, fd);
 		mds_message_destroy(&received);
 		mds_message_initialise(&received);
 		connected = 0;
 		fail_if (reconnect_to_display());
 		connected = 1;
+		fail_if (event_loop_add_fd(&server_event_loop, socket_fd, EPOLLIN, receive_messages, NULL));
+		return 0;
+	}
+
+fail:
+	return -1;
+	(void) events;
+	(void) user_data;
+}
+
+
+/**
+ * Perform the server's mission
+ * 
+ * @return  Non-zero on error
+ */
+int
+master_loop(void)
+{
+	int rc = 1;
+
+	/* Handle messages that were received before a re-exec, then wait for more. */
+	fail_if (receive_messages(socket_fd, 0, NULL));
+	fail_if (event_loop_add_fd(&server_event_loop, socket_fd, EPOLLIN, receive_messages, NULL));
+
+	while (!reexecing && !terminating) {
+		fail_if (event_loop_dispatch(&server_event_loop, -1) < 0);
 	}
 
 	rc = 0;
@@ -259,6 +259,8 @@ parse_cmdline(void)
 		} else if (startswith(arg, "--led=")) { /* Remap LED:s. */
 			if (remap_led_cmdline(arg + strlen("--led=")) < 0)
 				return -1;
+		} else if (parse_scheduling_arg(arg)) { /* CPU affinity, scheduling policy or memory locking. */
+			/* Applied after `parse_cmdline`. */
 		}
 	}
 	if (is_reexec) {
@@ -275,16 +277,52 @@ parse_cmdline(void)
 }
 
 
+/**
+ * Calculate the number of bytes that `trim_send_buffer` would free
+ * 
+ * @param   data  Not used
+ * @return        The number of bytes that would be freed
+ */
+static size_t
+send_buffer_reclaimable(void *data)
+{
+	return send_buffer_size * sizeof(char);
+	(void) data;
+}
+
+
+/**
+ * Free `send_buffer`, it is reallocated when it is needed
+ * 
+ * @param   data  Not used
+ * @return        Zero
+ */
+static int
+trim_send_buffer(void *data)
+{
+	free(send_buffer);
+	send_buffer = NULL;
+	send_buffer_size = 0;
+	return 0;
+	(void) data;
+}
+
+
 /**
  * This function will be invoked before `initialise_server` (if not re-exec:ing)
  * or before `unmarshal_server` (if re-exec:ing)
  * 
  * @return  Non-zero on error
  */
-int __attribute__((const))
+int
 preinitialise_server(void)
 {
+	fail_if (server_add_trimmable("send buffer", send_buffer_reclaimable, trim_send_buffer, NULL));
+	fail_if (server_add_trimmable_message("receive buffer", &received));
 	return 0;
+fail:
+	xperror(*argv);
+	return 1;
 }
 
 
@@ -508,9 +546,7 @@ master_loop(void)
 	while (!reexecing && !terminating) {
 		if (danger) {
 			danger = 0;
-			free(send_buffer);
-			send_buffer = NULL;
-			send_buffer_size = 0;
+			server_trim();
 		}
 
 		if (!(r = mds_message_read(&received, socket_fd)))
@@ -1404,6 +1440,7 @@ handle_keycode_map(const char *recv_client_id, const char *recv_message_id,
 	} else if (strequals(recv_action, "reset")) {
 		with_mutex (mapping_mutex,
 		            free(mapping);
+		            mapping = NULL;
 		            mapping_size = 0;
 		           );
 	} else if (strequals(recv_action, "query")) {
@@ -1720,7 +1757,7 @@ shrink_map(void)
 	size_t i, greatest_mapping = 0;
 	int *old;
 
-	for (i = mapping_size; i > 0; i--) {
+	for (i = mapping_size - 1; i > 0; i--) {
 		if (mapping[i] != (int)i) {
 				greatest_mapping = i;
 				break;
@@ -1730,6 +1767,7 @@ shrink_map(void)
 	if (!greatest_mapping) {
 		if (!*mapping) {
 			free(mapping);
+			mapping = NULL;
 			mapping_size = 0;
 		}
 	} else if (greatest_mapping + 1 < mapping_size) {
@@ -1763,6 +1801,7 @@ received_info(int signo)
 	iprintf("scancode buffer pointer: %i", scancode_ptr);
 	iprintf("saved keyboard mode: %i", saved_kbd_mode);
 	iprintf("send buffer size: %zu bytes", send_buffer_size);
+	server_dump_reclaimable();
 	iprintf("keyboard thread started: %s", kbd_thread_started ? "yes" : "no");
 	iprintf("keycode remapping tabel size: %zu", mapping_size);
 	iprint("keycode remapping tabel:");
@@ -211,6 +211,8 @@ parse_cmdline(void)
 			is_immortal = 1;
 		} else if (startswith(arg, "--seat=")) { /* Seat to pass to libinput. */
 			seat = arg + strlen("--seat=");
+		} else if (parse_scheduling_arg(arg)) { /* CPU affinity, scheduling policy or memory locking. */
+			/* Applied after `parse_cmdline`. */
 		}
 	}
 	if (is_reexec) {
@@ -227,16 +229,86 @@ parse_cmdline(void)
 }
 
 
+/**
+ * Calculate the number of bytes that `trim_resp_send_buffer` would free
+ * 
+ * @param   data  Not used
+ * @return        The number of bytes that would be freed
+ */
+static size_t
+resp_send_buffer_reclaimable(void *data)
+{
+	return resp_send_buffer_size * sizeof(char);
+	(void) data;
+}
+
+
+/**
+ * Free `resp_send_buffer`, it is reallocated when it is needed
+ * 
+ * @param   data  Not used
+ * @return        Zero
+ */
+static int
+trim_resp_send_buffer(void *data)
+{
+	free(resp_send_buffer);
+	resp_send_buffer = NULL;
+	resp_send_buffer_size = 0;
+	return 0;
+	(void) data;
+}
+
+
+/**
+ * Calculate the number of bytes that `trim_event_thread` would free
+ * 
+ * @param   data  Not used
+ * @return        The number of bytes that would be freed
+ */
+static size_t
+event_thread_reclaimable(void *data)
+{
+	return anno_send_buffer_size * sizeof(char) + (devices_size - devices_used) * sizeof(*devices);
+	(void) data;
+}
+
+
+/**
+ * Let the event thread free `anno_send_buffer`
+ * and pack the device list, which it owns
+ * 
+ * @param   data  Not used
+ * @return        Zero
+ */
+static int
+trim_event_thread(void *data)
+{
+	ev_danger = 1;
+	if (ev_thread_started)
+		pthread_kill(ev_thread, SIGRTMIN);
+	return 0;
+	(void) data;
+}
+
+
 /**
  * This function will be invoked before `initialise_server` (if not re-exec:ing)
  * or before `unmarshal_server` (if re-exec:ing)
  * 
  * @return  Non-zero on error
  */
-int __attribute__((const))
+int
 preinitialise_server(void)
 {
+	fail_if (server_add_trimmable("response send buffer", resp_send_buffer_reclaimable,
+	                              trim_resp_send_buffer, NULL));
+	fail_if (server_add_trimmable("event thread", event_thread_reclaimable, trim_event_thread, NULL));
+	fail_if (server_add_trimmable_message("receive buffer", &received));
 	return 0;
+fail:
+	xperror(*argv);
+	return 1;
 }
 
 
@@ -384,27 +456,6 @@ signal_all(int signo)
 }
 
 
-/**
- * This function is called when a signal that
- * signals that the system is running out of memory
- * has been received
- * 
- * @param  signo  The signal that has been received
- */
-void
-received_danger(int signo)
-{
-	SIGHANDLER_START;
-	if (!danger || !ev_danger) {
-		danger = 1;
-		ev_danger = 1;
-		eprint("danger signal received.");
-	}
-	SIGHANDLER_END;
-	(void) signo;
-}
-
-
 /**
  * Perform the server's mission
  * 
@@ -425,9 +476,7 @@ master_loop(void)
 			dump_info();
 		if (danger) {
 			danger = 0;
-			free(resp_send_buffer), resp_send_buffer = NULL;
-			resp_send_buffer_size = 0;
-			pack_devices();
+			server_trim();
 		}
 
 		if (!(r = mds_message_read(&received, socket_fd)))
@@ -487,6 +536,7 @@ void *event_loop(void *data)
 			free(anno_send_buffer);
 			anno_send_buffer = NULL;
 			anno_send_buffer_size = 0;
+			pack_devices();
 		}
 
 		FD_SET(event_fd, &event_fd_set);
@@ -639,6 +689,8 @@ add_device(struct libinput_device *dev)
 	}
 
 	devices[devices_ptr++] = libinput_device_ref(dev);
+	if (devices_ptr > devices_used)
+		devices_used = devices_ptr;
 	while (devices_ptr < devices_used && devices[devices_ptr])
 		devices_ptr++;
 
@@ -718,7 +770,7 @@ received_info(int signo)
 void
 dump_info(void)
 {
-	info = 1;
+	info = 0;
 	iprintf("next message ID: %" PRIu32, message_id);
 	iprintf("connected: %s", connected ? "yes" : "no");
 	iprintf("libinput seat: %s", seat);
@@ -726,6 +778,7 @@ dump_info(void)
 	iprintf("sigdanger pending (event): %s", ev_danger ? "yes" : "no");
 	iprintf("response send buffer size: %zu bytes", resp_send_buffer_size);
 	iprintf("announce send buffer size: %zu bytes", anno_send_buffer_size);
+	server_dump_reclaimable();
 	iprintf("event file descriptor: %i", event_fd);
 	iprintf("event thread started: %s", ev_thread_started ? "yes" : "no");
 	/* TODO list devices -- with_mutex(dev_mutex, ); */
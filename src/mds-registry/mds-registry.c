@@ -20,6 +20,7 @@
 #include "util.h"
 #include "globals.h"
 #include "registry.h"
+#include "slave.h"
 
 #include <libmdsserver/util.h>
 #include <libmdsserver/macros.h>
@@ -60,6 +61,73 @@ server_characteristics_t server_characteristics = {
 	((full_send)(socket_fd, message, length))
 
 
+/**
+ * Calculate the number of bytes that `trim_send_buffer` would free
+ * 
+ * @param   data  Not used
+ * @return        The number of bytes that would be freed
+ */
+static size_t
+send_buffer_reclaimable(void *data)
+{
+	return send_buffer_size * sizeof(char);
+	(void) data;
+}
+
+
+/**
+ * Free `send_buffer`, it is reallocated when it is needed
+ * 
+ * @param   data  Not used
+ * @return        Zero
+ */
+static int
+trim_send_buffer(void *data)
+{
+	free(send_buffer);
+	send_buffer = NULL;
+	send_buffer_size = 0;
+	return 0;
+	(void) data;
+}
+
+
+/**
+ * Calculate the number of bytes that `trim_slave_list` would free
+ * 
+ * @param   data  Not used
+ * @return        The number of bytes that would be freed
+ */
+static size_t
+slave_list_reclaimable(void *data)
+{
+	return linked_list_reclaimable(&slave_list);
+	(void) data;
+}
+
+
+/**
+ * Pack the list of slaves, and update the
+ * slaves' nodes, which packing renumbers
+ * 
+ * @param   data  Not used
+ * @return        Zero on success, -1 on error
+ */
+static int
+trim_slave_list(void *data)
+{
+	ssize_t node;
+	int r;
+	with_mutex (slave_mutex,
+	            if (!(r = linked_list_pack(&slave_list)))
+	                    foreach_linked_list_node (slave_list, node)
+	                            ((slave_t *)(void *)(slave_list.values[node]))->node = node;
+	           );
+	return r;
+	(void) data;
+}
+
+
 /**
  * This function will be invoked before `initialise_server` (if not re-exec:ing)
  * or before `unmarshal_server` (if re-exec:ing)
@@ -76,6 +144,10 @@ preinitialise_server(void)
 
 	linked_list_create(&slave_list, 2);
 
+	fail_if (server_add_trimmable("send buffer", send_buffer_reclaimable, trim_send_buffer, NULL));
+	fail_if (server_add_trimmable("slave list", slave_list_reclaimable, trim_slave_list, NULL));
+	fail_if (server_add_trimmable_message("receive buffer", &received));
+
 	return 0;
 
 fail:
@@ -167,10 +239,7 @@ master_loop(void)
 	while (!reexecing && !terminating) {
 		if (danger) {
 			danger = 0;
-			free(send_buffer);
-			send_buffer = NULL;
-			send_buffer_size = 0;
-			with_mutex (slave_mutex, linked_list_pack(&slave_list););
+			server_trim();
 		}
 
 		if (!(r = mds_message_read(&received, socket_fd)))
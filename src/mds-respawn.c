@@ -26,12 +26,18 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/pidfd.h>
+#include <sys/epoll.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
 
 
 
-#define MDS_RESPAWN_VARS_VERSION 0
+#define MDS_RESPAWN_VARS_VERSION 1
 
 
 
@@ -47,7 +53,8 @@ server_characteristics_t server_characteristics = {
 	.require_respawn_info = 1,
 	.sanity_check_argc = 0,
 	.fork_for_safety = 0,
-	.danger_is_deadly = 0
+	.danger_is_deadly = 0,
+	.use_event_loop = 1
 };
 
 
@@ -57,6 +64,30 @@ server_characteristics_t server_characteristics = {
  */
 static int interval = RESPAWN_TIME_LIMIT_SECONDS;
 
+/**
+ * The number of milliseconds a server that crashes again,
+ * within the crash rate window, is delayed before it is
+ * respawned, doubled for each additional crash
+ */
+static unsigned backoff = RESPAWN_BACKOFF_MILLISECONDS;
+
+/**
+ * The maximum number of milliseconds a respawn is delayed
+ */
+static unsigned backoff_max = RESPAWN_BACKOFF_MAX_MILLISECONDS;
+
+/**
+ * The number of seconds within which crashes are counted
+ * towards the crash rate of a server
+ */
+static int window = RESPAWN_WINDOW_SECONDS;
+
+/**
+ * The number of crashes, within the crash rate window, a
+ * server may have before it is buried, zero for no limit
+ */
+static size_t budget = 0;
+
 /**
  * The number of servers managed by this process
  */
@@ -78,6 +109,56 @@ static char ***commands = NULL;
  */
 static server_state_t *states = NULL;
 
+/**
+ * The comma-separated protocols each server provides, `NULL` if none
+ */
+static const char **provisions = NULL;
+
+/**
+ * The comma-separated protocols each server requires, `NULL` if none
+ */
+static const char **requirements = NULL;
+
+/**
+ * For each server, the read end of the pipe over which the
+ * server reports that it has been initialised, -1 if the
+ * server is not being waited upon
+ */
+static int *ready_fds = NULL;
+
+/**
+ * For each server, whether a standby instance of the
+ * server shall be kept, to respawn the server with
+ */
+static char *standby_wanted = NULL;
+
+/**
+ * For each server, the socket over which its standby
+ * instance is started, -1 if there is no standby instance
+ */
+static int *standby_fds = NULL;
+
+/**
+ * For each server, the process ID of its standby instance
+ */
+static pid_t *standby_pids = NULL;
+
+/**
+ * For each server, the pidfd its standby instance is monitored with, -1 if none
+ */
+static int *standby_pidfds = NULL;
+
+/**
+ * For each server, the pidfd it is monitored with, -1 if none
+ */
+static int *pidfds = NULL;
+
+/**
+ * For each server, the ID of the timer used to delay its respawn,
+ * -1 if it has not been created
+ */
+static int *respawn_timers = NULL;
+
 /**
  * Whether a revive request has been received but not processed
  */
@@ -88,6 +169,32 @@ static volatile sig_atomic_t reviving = 0;
  */
 static size_t live_count = 0;
 
+/**
+ * The number of servers that will be respawned when their timer expires
+ */
+static size_t delayed_count = 0;
+
+
+
+/**
+ * Check whether a server provides a protocol
+ * 
+ * @param   index   The index of the server
+ * @param   name    The name of the protocol, need not be NUL-terminated
+ * @param   length  The length of `name`
+ * @return          Whether the server provides the protocol
+ */
+static int __attribute__((pure))
+provides_protocol(size_t index, const char *name, size_t length)
+{
+	const char *list = provisions[index], *end;
+	for (; list && *list; list = *end ? end + 1 : end) {
+		end = strchrnul(list, ',');
+		if ((size_t)(end - list) == length && !memcmp(list, name, length))
+			return 1;
+	}
+	return 0;
+}
 
 
 /**
@@ -99,7 +206,9 @@ int parse_cmdline(void)
 {
 	/* Parse command line arguments. */
 	int i;
-	size_t j, args = 0, stack = 0;
+	size_t j, k, args = 0, stack = 0;
+	const char *provides = NULL, *requires = NULL, *name, *end;
+	int standby = 0;
 	char* arg;
 
 	for (i = 1; i < argc; i++) {
@@ -108,8 +217,21 @@ int parse_cmdline(void)
 			alarm((unsigned)min(atou(arg + strlen("--alarm=")), 60)); /* At most 1 minute. */
 		} else if (startswith(arg, "--interval=")) {
 			interval = min(atoi(arg + strlen("--interval=")), 60); /* At most 1 minute. */
+		} else if (startswith(arg, "--backoff=")) {
+			backoff = min(atou(arg + strlen("--backoff=")), 60000); /* At most 1 minute. */
+		} else if (startswith(arg, "--backoff-max=")) {
+			backoff_max = min(atou(arg + strlen("--backoff-max=")), 600000); /* At most 10 minutes. */
+		} else if (startswith(arg, "--window=")) {
+			window = min(atoi(arg + strlen("--window=")), 3600); /* At most 1 hour. */
+		} else if (startswith(arg, "--budget=")) {
+			budget = min((size_t)atou(arg + strlen("--budget=")), (size_t)RESPAWN_HISTORY_SIZE);
 		} else if (strequals(arg, "--re-exec")) { /* Re-exec state-marshal. */
 			is_reexec = 1;
+		} else if (!stack && parse_scheduling_arg(arg)) { /* CPU affinity, scheduling policy or memory locking. */
+			/* Applied after `parse_cmdline`, not inherited by the servers. */
+		} else if (!stack && (startswith(arg, "--provides=") || startswith(arg, "--requires=") ||
+		                      strequals(arg, "--standby"))) {
+			/* Dependencies and options of the next server, stored below. */
 		} else if (strequals(arg, "{")) {
 			servers += stack++ == 0 ? 1 : 0;
 		} else if (strequals(arg, "}")) {
@@ -135,16 +257,49 @@ int parse_cmdline(void)
 	fail_if (xmalloc(commands_args, args + servers, char*));
 	fail_if (xmalloc(commands, servers, char**));
 	fail_if (xmalloc(states, servers, server_state_t));
+	fail_if (xcalloc(provisions, servers, const char*));
+	fail_if (xcalloc(requirements, servers, const char*));
+	fail_if (xmalloc(ready_fds, servers, int));
+	fail_if (xcalloc(standby_wanted, servers, char));
+	fail_if (xmalloc(standby_fds, servers, int));
+	fail_if (xcalloc(standby_pids, servers, pid_t));
+	fail_if (xmalloc(standby_pidfds, servers, int));
+	fail_if (xmalloc(pidfds, servers, int));
+	fail_if (xmalloc(respawn_timers, servers, int));
 
 	/* Fill command arrays. */
 	for (i = 1, args = j = 0; i < argc; i++) {
 		arg = argv[i];
-		if (strequals(arg, "}"))
+		if (strequals(arg, "}")) {
 			commands_args[args++] = --stack == 0 ? NULL : arg;
-		else if (stack > 0)
+		} else if (stack > 0) {
 			commands_args[args++] = arg;
-		else if (strequals(arg, "{") && !stack++)
+		} else if (startswith(arg, "--provides=")) {
+			provides = arg + strlen("--provides=");
+		} else if (startswith(arg, "--requires=")) {
+			requires = arg + strlen("--requires=");
+		} else if (strequals(arg, "--standby")) {
+			standby = 1;
+		} else if (strequals(arg, "{") && !stack++) {
+			ready_fds[j] = standby_fds[j] = standby_pidfds[j] = pidfds[j] = respawn_timers[j] = -1;
+			standby_wanted[j] = (char)standby, standby = 0;
+			provisions[j] = provides, provides = NULL;
+			requirements[j] = requires, requires = NULL;
 			commands[j++] = commands_args + args;
+		}
+	}
+
+	/* Validate dependencies. */
+	for (j = 0; j < servers; j++) {
+		for (name = requirements[j]; name && *name; name = *end ? end + 1 : end) {
+			end = strchrnul(name, ',');
+			for (k = 0; k < servers; k++)
+				if (k != j && provides_protocol(k, name, (size_t)(end - name)))
+					break;
+			if (k == servers && end != name)
+				eprintf("no server provides `%.*s', required by `%s'.",
+				        (int)(end - name), name, commands[j][0]);
+		}
 	}
 
 	return 0;
@@ -154,15 +309,275 @@ fail:
 }
 
 
+/**
+ * Check whether a server is ready to be spawned, that is,
+ * whether all servers that provide the protocols it requires
+ * have been initialised, or at least will not be
+ * 
+ * @param   index  The index of the server
+ * @return         Whether the server's dependencies are ready
+ */
+static int __attribute__((pure))
+dependencies_ready(size_t index)
+{
+	const char *name, *end;
+	size_t i;
+	for (name = requirements[index]; name && *name; name = *end ? end + 1 : end) {
+		end = strchrnul(name, ',');
+		for (i = 0; i < servers; i++)
+			if (i != index && provides_protocol(i, name, (size_t)(end - name)))
+				if (states[i].state == UNBORN || ready_fds[i] >= 0)
+					return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * Stop monitoring a child process
+ * 
+ * @param  pidfd  The pidfd the process is monitored with
+ */
+static void
+unwatch_process(int pidfd)
+{
+	size_t i;
+	event_loop_remove_fd(&server_event_loop, pidfd);
+	xclose(pidfd);
+	for (i = 0; i < servers; i++) {
+		if (pidfds[i] == pidfd)
+			pidfds[i] = -1;
+		if (standby_pidfds[i] == pidfd)
+			standby_pidfds[i] = -1;
+	}
+}
+
+
+static void joined_with_server(pid_t pid, int status);
+
+
+/**
+ * This function is called when a monitored child process has exited
+ * 
+ * @param   pidfd      The pidfd the process is monitored with
+ * @param   events     Not used
+ * @param   user_data  The process ID of the process
+ * @return             Zero on success, -1 on error
+ */
+static int
+process_exited(int pidfd, uint32_t events, void *user_data)
+{
+	pid_t pid = (pid_t)(intptr_t)user_data;
+	int status;
+
+	unwatch_process(pidfd);
+	fail_if (uninterruptable_waitpid(pid, &status, 0) == (pid_t)-1);
+	joined_with_server(pid, status);
+	return 0;
+fail:
+	return -1;
+	(void) events;
+}
+
+
+/**
+ * Monitor a child process, with a pidfd in the event loop,
+ * so that it is reaped and respawned if appropriate when it exits
+ * 
+ * @param   pid  The process ID of the child process
+ * @return       The pidfd, -1 on error
+ */
+static int
+watch_process(pid_t pid)
+{
+	int pidfd, saved_errno;
+
+	fail_if ((pidfd = pidfd_open(pid, 0)) < 0);
+	if (event_loop_add_fd(&server_event_loop, pidfd, EPOLLIN, process_exited, (void *)(intptr_t)pid) < 0) {
+		saved_errno = errno;
+		xclose(pidfd);
+		errno = saved_errno;
+		fail_if (1);
+	}
+	return pidfd;
+fail:
+	xperror(*argv);
+	eprintf("cannot monitor child process %li.", (long)pid);
+	return -1;
+}
+
+
+/**
+ * Prepare a child process for execution of a server
+ */
+static void
+prepare_child(void)
+{
+	/* Remove the alarm. */
+	alarm(0);
+
+	/* The signals the event loop receives are blocked,
+	   the server shall not inherit that. */
+	sigprocmask(SIG_UNBLOCK, &(server_event_loop.signals), NULL);
+
+	/* The servers have their own scheduling options. */
+	if (server_reset_scheduling() < 0)
+		xperror(*argv);
+}
+
+
+/**
+ * Start a standby instance of a server, if one shall be kept
+ * and there is none, the instance is loaded and set up, but
+ * it waits until it is activated to initialise the server
+ * 
+ * @param  index  The index of the server
+ */
+static void
+spawn_standby(size_t index)
+{
+	int standby[2];
+	char fd_env[3 * sizeof(int) + 1];
+	pid_t pid;
+
+	if (!standby_wanted[index] || standby_fds[index] >= 0 || states[index].state != ALIVE)
+		return;
+
+	/* A socket is used rather than a pipe, so that activating
+	   an instance that has died does not raise SIGPIPE. */
+	fail_if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, standby) < 0);
+	pid = fork();
+	if (pid == (pid_t)-1) {
+		xclose(standby[0]);
+		xclose(standby[1]);
+		fail_if (1);
+	}
+
+	/* In the parent process (respawner): store the standby instance. */
+	if (pid) {
+		xclose(standby[0]);
+		standby_fds[index] = standby[1];
+		standby_pids[index] = pid;
+		standby_pidfds[index] = watch_process(pid);
+		return;
+	}
+
+	/* In the child process (standby instance): let it inherit
+	   its end of the socket and change execution image to the server. */
+	prepare_child();
+	xsnprintf(fd_env, "%i", standby[0]);
+	if (fcntl(standby[0], F_SETFD, 0) < 0 || setenv(STANDBY_FD_ENV, fd_env, 1) < 0) {
+		xperror(commands[index][0]);
+		_exit(1);
+	}
+	execvp(commands[index][0], commands[index]);
+	xperror(commands[index][0]);
+	_exit(1);
+
+fail:
+	xperror(*argv);
+	eprintf("cannot start a standby instance of %s.", commands[index][0]);
+}
+
+
+/**
+ * Let the standby instance of a server, if it has one,
+ * become the server, a new standby instance is not started
+ * 
+ * @param   index  The index of the server
+ * @return         The process ID of the server, -1 if it
+ *                 has no standby instance or it could not
+ *                 be activated
+ */
+static pid_t
+activate_standby(size_t index)
+{
+	int fd = standby_fds[index];
+	ssize_t r;
+
+	if (fd < 0)
+		return (pid_t)-1;
+	standby_fds[index] = -1;
+
+	while ((r = send(fd, "\n", 1, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+	if (r < 0) {
+		xperror(*argv);
+		eprintf("cannot activate standby instance of %s.", commands[index][0]);
+	}
+	xclose(fd);
+	if (r < 0)
+		return (pid_t)-1;
+
+	/* The standby instance is monitored as the server now. */
+	pidfds[index] = standby_pidfds[index];
+	standby_pidfds[index] = -1;
+	return standby_pids[index];
+}
+
+
+/**
+ * Stop the standby instance of a server, if it has one, and wait for it to exit
+ * 
+ * @param  index  The index of the server
+ */
+static void
+retire_standby(size_t index)
+{
+	int status;
+
+	if (standby_fds[index] < 0)
+		return;
+	xclose(standby_fds[index]);
+	standby_fds[index] = -1;
+	if (standby_pidfds[index] >= 0)
+		unwatch_process(standby_pidfds[index]);
+	if (uninterruptable_waitpid(standby_pids[index], &status, 0) == (pid_t)-1)
+		xperror(*argv);
+}
+
+
+/**
+ * This function is called when a server that is being waited
+ * upon has reported that it has been initialised, or has exited
+ * 
+ * @param   fd         The read end of the pipe the server reports over
+ * @param   events     Not used
+ * @param   user_data  The index of the server
+ * @return             Zero
+ */
+static int
+server_ready(int fd, uint32_t events, void *user_data)
+{
+	size_t index = (size_t)(uintptr_t)user_data;
+	event_loop_remove_fd(&server_event_loop, fd);
+	xclose(fd);
+	ready_fds[index] = -1;
+	return 0;
+	(void) events;
+}
+
+
 /**
  * Spawn a server
  * 
+ * The server's standby instance is activated if it has one,
+ * and a new standby instance is started unless this is the
+ * first time the server is spawned
+ * 
+ * If the server has not been spawned before, and it provides
+ * protocols, a pipe is created over which the server reports
+ * that it has been initialised, so that the servers that
+ * depend on it can be spawned
+ * 
  * @param  index  The index of the server
  */
 static void
 spawn_server(size_t index)
 {
 	struct timespec started;
+	int ready[2] = {-1, -1};
+	char fd_env[3 * sizeof(int) + 1];
+	int unborn = states[index].state == UNBORN;
 	pid_t pid;
 
 	/* When did the spawned server start? */
@@ -174,12 +589,25 @@ spawn_server(size_t index)
 	}
 	states[index].started = started;
 
-	/* Fork process to spawn the server. */
-	pid = fork();
+	/* Create the pipe the server reports its initialisation over. The
+	   servers that depend on it are spawned regardless if this fails. */
+	if (unborn && provisions[index] && pipe2(ready, O_CLOEXEC) < 0) {
+		xperror(*argv);
+		eprintf("cannot wait for %s to be initialised.", commands[index][0]);
+	}
+
+	/* Activate the server's standby instance, or fork process to spawn the server. */
+	pid = activate_standby(index);
+	if (pid == (pid_t)-1 && (pid = fork()) > 0)
+		pidfds[index] = watch_process(pid);
 	if (pid == (pid_t)-1) {
 		xperror(*argv);
 		eprintf("cannot fork in order to start %s, burying.", commands[index][0]);
 		states[index].state = DEAD_AND_BURIED;
+		if (ready[0] >= 0) {
+			xclose(ready[0]);
+			xclose(ready[1]);
+		}
 		return;
 	}
 
@@ -187,12 +615,33 @@ spawn_server(size_t index)
 	if (pid) {
 		states[index].pid = pid;
 		states[index].state = ALIVE;
+		states[index].spawns++;
 		live_count++;
+		if (ready[0] >= 0) {
+			xclose(ready[1]);
+			ready_fds[index] = ready[0];
+			if (event_loop_add_fd(&server_event_loop, ready[0], EPOLLIN, server_ready,
+			                      (void *)(uintptr_t)index) < 0) {
+				xperror(*argv);
+				eprintf("cannot wait for %s to be initialised.", commands[index][0]);
+				xclose(ready[0]);
+				ready_fds[index] = -1;
+			}
+		}
+		if (!unborn)
+			spawn_standby(index);
 		return;
 	}
 
-	/* In the child process (server): remove the alarm and change execution image to the server..  */
-	alarm(0);
+	/* In the child process (server): remove the alarm, let the
+	   server inherit the write end of the pipe and change execution
+	   image to the server..  */
+	prepare_child();
+	if (ready[1] >= 0) {
+		xsnprintf(fd_env, "%i", ready[1]);
+		if (fcntl(ready[1], F_SETFD, 0) < 0 || setenv(READY_FD_ENV, fd_env, 1) < 0)
+			xperror(commands[index][0]);
+	}
 	execvp(commands[index][0], commands[index]);
 	xperror(commands[index][0]);
 	_exit(1);
@@ -200,20 +649,72 @@ spawn_server(size_t index)
 
 
 /**
- * This function is called when a signal that
- * signals the program to respawn all
+ * Spawn the servers that have not been spawned yet, each as
+ * soon as the servers it depends on have been initialised
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+spawn_unborn_servers(void)
+{
+	size_t i, unborn, waiting;
+	int spawned;
+
+	while (!reexecing && !terminating) {
+		/* Spawn all servers whose dependencies are ready, they are started in parallel. */
+		do {
+			for (i = 0, spawned = 0; i < servers; i++)
+				if (states[i].state == UNBORN && dependencies_ready(i))
+					spawn_server(i), spawned = 1;
+		} while (spawned);
+
+		for (i = unborn = waiting = 0; i < servers; i++) {
+			unborn  += states[i].state == UNBORN;
+			waiting += ready_fds[i] >= 0;
+		}
+		if (!unborn)
+			break;
+
+		/* If nothing is being waited upon the dependencies are circular. */
+		if (!waiting) {
+			eprint("circular dependencies, spawning remaining servers regardless.");
+			for (i = 0; i < servers; i++)
+				if (states[i].state == UNBORN)
+					spawn_server(i);
+			break;
+		}
+
+		/* Wait for servers to report, or for other events. */
+		fail_if (event_loop_dispatch(&server_event_loop, -1) < 0);
+	}
+
+	/* Servers that have not yet reported are no longer waited upon. */
+	for (i = 0; i < servers; i++)
+		if (ready_fds[i] >= 0)
+			server_ready(ready_fds[i], 0, (void *)(uintptr_t)i);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * This function is called, by the event loop, when a
+ * signal that signals the program to respawn all
  * `DEAD_AND_BURIED` server is received
  * 
- * @param  signo  The signal that has been received
+ * @param   signo      The signal that has been received
+ * @param   user_data  Not used
+ * @return             Zero
  */
-static void
-received_revive(int signo)
+static int
+received_revive(int signo, void *user_data)
 {
-	SIGHANDLER_START;
 	(void) signo;
+	(void) user_data;
 	reviving = 1;
 	eprint("revive signal received.");
-	SIGHANDLER_END;
+	return 0;
 }
 
 
@@ -226,8 +727,14 @@ received_revive(int signo)
 int
 preinitialise_server(void)
 {
+	struct timespec now;
+
 	/* Make the server revive all `DEAD_AND_BURIED` servers on SIGUSR2. */
-	fail_if (xsigaction(SIGUSR2, received_revive) < 0);
+	fail_if (event_loop_add_signal(&server_event_loop, SIGUSR2, received_revive, NULL) < 0);
+
+	/* Seed the jitter of the respawn delays. */
+	(void) monotone(&now);
+	srandom((unsigned)now.tv_nsec ^ (unsigned)getpid());
 
 	return 0;
 fail:
@@ -268,10 +775,13 @@ postinitialise_server(void)
 {
 	size_t i, j;
 
-	/* Spawn servers that has not been spawned yet. */
+	/* Monitor the servers that were spawned by the previous image. */
 	for (i = 0; i < servers; i++)
-		if (states[i].state == UNBORN)
-			spawn_server(i);
+		if (states[i].state == ALIVE && pidfds[i] < 0)
+			pidfds[i] = watch_process(states[i].pid);
+
+	/* Spawn servers that has not been spawned yet. */
+	fail_if (spawn_unborn_servers());
 
 	/* Forever mark newly spawned services (after this point in time) as respawned. */
   	for (i = j = 0; j < servers; i++) {
@@ -286,6 +796,10 @@ postinitialise_server(void)
 		if (states[i].state == DEAD || states[i].state == DEAD_AND_BURIED)
 			spawn_server(i);
 
+	/* Start standby instances, now that servers are spawned with --respawn. */
+	for (i = 0; i < servers; i++)
+		spawn_standby(i);
+
 	return 0;
 fail:
 	xperror(*argv);
@@ -305,8 +819,9 @@ size_t
 marshal_server_size(void)
 {
 	size_t rc = sizeof(int) + sizeof(sig_atomic_t);
-	rc += sizeof(time_t) + sizeof(long);
-	rc += servers * sizeof(server_state_t);
+	rc += sizeof(time_t) + sizeof(long) + sizeof(size_t);
+	rc += servers * (sizeof(pid_t) + 2 * sizeof(int) + sizeof(unsigned) + 3 * sizeof(size_t));
+	rc += servers * (1 + RESPAWN_HISTORY_SIZE) * (sizeof(time_t) + sizeof(long));
 	return rc;
 }
 
@@ -320,8 +835,9 @@ marshal_server_size(void)
 int
 marshal_server(char *state_buf)
 {
-	size_t i;
+	size_t i, j;
 	struct timespec antiepoch;
+	struct timespec crashed;
 	antiepoch.tv_sec = 0;
 	antiepoch.tv_nsec = 0;
 	(void) monotone(&antiepoch);
@@ -329,17 +845,54 @@ marshal_server(char *state_buf)
 	buf_set_next(state_buf, sig_atomic_t, reviving);
 	buf_set_next(state_buf, time_t, antiepoch.tv_sec);
 	buf_set_next(state_buf, long, antiepoch.tv_nsec);
+	buf_set_next(state_buf, size_t, (size_t)RESPAWN_HISTORY_SIZE);
 	for (i = 0; i < servers; i++) {
 		buf_set_next(state_buf, pid_t, states[i].pid);
 		buf_set_next(state_buf, int, states[i].state);
 		buf_set_next(state_buf, time_t, states[i].started.tv_sec);
 		buf_set_next(state_buf, long, states[i].started.tv_nsec);
+		buf_set_next(state_buf, size_t, states[i].spawns);
+		buf_set_next(state_buf, size_t, states[i].crashes);
+		buf_set_next(state_buf, size_t, states[i].forgiven);
+		buf_set_next(state_buf, int, states[i].status);
+		buf_set_next(state_buf, unsigned, states[i].backoff);
+		/* The most recent crash first, so that the history can be resized. */
+		for (j = 0; j < RESPAWN_HISTORY_SIZE; j++) {
+			crashed = states[i].crashed[(states[i].crashes - 1 - j) % RESPAWN_HISTORY_SIZE];
+			buf_set_next(state_buf, time_t, crashed.tv_sec);
+			buf_set_next(state_buf, long, crashed.tv_nsec);
+		}
 	}
 	free(states);
 	return 0;
 }
 
 
+/**
+ * Adjust a time on the monotonic clock, that was read
+ * before a re-exec, for a change of the clock's epoch
+ * 
+ * The epoch of the monotonic clock is unspecified,
+ * so we cannot know whether an exec with cause a time jump
+ * 
+ * @param  time   The time to adjust
+ * @param  epoch  The difference between the new and old epoch
+ */
+static void
+adjust_epoch(struct timespec *time, const struct timespec *epoch)
+{
+	time->tv_sec -= epoch->tv_sec;
+	time->tv_nsec -= epoch->tv_nsec;
+	if (time->tv_nsec < 0) {
+		time->tv_sec -= 1;
+		time->tv_nsec += 1000000000;
+	} else if (time->tv_nsec >= 1000000000) {
+		time->tv_sec += 1;
+		time->tv_nsec -= 1000000000;
+	}
+}
+
+
 /**
  * Unmarshal server implementation specific data and update the servers state accordingly
  * 
@@ -353,41 +906,49 @@ marshal_server(char *state_buf)
 int
 unmarshal_server(char *state_buf)
 {
-	size_t i;
+	size_t i, j, history_size = 0;
+	int version;
 	struct timespec antiepoch;
 	struct timespec epoch;
+	struct timespec crashed;
 	epoch.tv_sec = 0;
 	epoch.tv_nsec = 0;
 	(void) monotone(&epoch);
-	/* buf_get_next(state_buf, int, MDS_RESPAWN_VARS_VERSION); */
-	buf_next(state_buf, int, 1);
+	buf_get_next(state_buf, int, version);
 	buf_get_next(state_buf, sig_atomic_t, reviving);
 	buf_get_next(state_buf, time_t, antiepoch.tv_sec);
 	buf_get_next(state_buf, long, antiepoch.tv_nsec);
+	if (version >= 1)
+		buf_get_next(state_buf, size_t, history_size);
 	epoch.tv_sec -= antiepoch.tv_sec;
 	epoch.tv_nsec -= antiepoch.tv_nsec;
 	for (i = 0; i < servers; i++) {
+		memset(states + i, 0, sizeof(server_state_t));
 		buf_get_next(state_buf, pid_t, states[i].pid);
 		buf_get_next(state_buf, int, states[i].state);
 		buf_get_next(state_buf, time_t, states[i].started.tv_sec);
 		buf_get_next(state_buf, long, states[i].started.tv_nsec);
+		if (version >= 1) {
+			buf_get_next(state_buf, size_t, states[i].spawns);
+			buf_get_next(state_buf, size_t, states[i].crashes);
+			buf_get_next(state_buf, size_t, states[i].forgiven);
+			buf_get_next(state_buf, int, states[i].status);
+			buf_get_next(state_buf, unsigned, states[i].backoff);
+			for (j = 0; j < history_size; j++) {
+				buf_get_next(state_buf, time_t, crashed.tv_sec);
+				buf_get_next(state_buf, long, crashed.tv_nsec);
+				if (j < states[i].crashes && j < RESPAWN_HISTORY_SIZE) {
+					adjust_epoch(&crashed, &epoch);
+					states[i].crashed[(states[i].crashes - 1 - j) % RESPAWN_HISTORY_SIZE] = crashed;
+				}
+			}
+		}
 		if (validate_state(states[i].state) == 0) {
 			states[i].state = CREMATED;
 			eprintf("invalid state unmarshallaed for `%s', cremating.", commands[i][0]);
 		} else if (states[i].state == ALIVE) {
 			live_count++;
-			/* Monotonic time epoch adjusment, the epoch of the monotonic
-			   clock is unspecified, so we cannot know whether an exec
-			   with cause a time jump. */
-			states[i].started.tv_sec -= epoch.tv_sec;
-			states[i].started.tv_nsec -= epoch.tv_nsec;
-			if (states[i].started.tv_nsec < 0) {
-				states[i].started.tv_sec -= 1;
-				states[i].started.tv_nsec += 1000000000;
-			} else if (states[i].started.tv_nsec > 0) {
-				states[i].started.tv_sec += 1;
-				states[i].started.tv_nsec -= 1000000000;
-			}
+			adjust_epoch(&(states[i].started), &epoch);
 		}
 	}
 	return 0;
@@ -408,6 +969,100 @@ reexec_failure_recover(void)
 }
 
 
+/**
+ * Count the crashes of a server within the crash rate window
+ * 
+ * @param   index  The index of the server
+ * @param   now    The current time (monotonic)
+ * @return         The number of crashes
+ */
+static size_t __attribute__((pure, nonnull))
+recent_crashes(size_t index, const struct timespec *now)
+{
+	const server_state_t *state = states + index;
+	size_t n = state->crashes - state->forgiven, i;
+	n = min(n, (size_t)RESPAWN_HISTORY_SIZE);
+	for (i = 0; i < n; i++)
+		if (now->tv_sec - state->crashed[(state->crashes - 1 - i) % RESPAWN_HISTORY_SIZE].tv_sec >= window)
+			break;
+	return i;
+}
+
+
+/**
+ * Calculate how long the respawn of a server shall be
+ * delayed, a server that has only crashed once within the
+ * crash rate window is respawned immediately, thereafter
+ * the delay doubles with each crash, and is randomised
+ * between half and all of it, so that servers that crash
+ * because of each other do not respawn in lockstep
+ * 
+ * @param   crashes  The number of crashes within the crash rate window
+ * @return           The delay in milliseconds
+ */
+static unsigned
+backoff_delay(size_t crashes)
+{
+	unsigned long delay = backoff;
+	size_t i;
+	if (crashes < 2 || !delay)
+		return 0;
+	for (i = 2; i < crashes && delay < backoff_max; i++)
+		delay *= 2;
+	delay = min(delay, (unsigned long)backoff_max);
+	return (unsigned)(delay / 2 + (unsigned long)random() % (delay - delay / 2 + 1));
+}
+
+
+/**
+ * This function is called when the delay before
+ * a server is respawned has passed
+ * 
+ * @param   timer        The ID of the timer
+ * @param   expirations  Not used
+ * @param   user_data    The index of the server
+ * @return               Zero
+ */
+static int
+respawn_delayed(int timer, uint64_t expirations, void *user_data)
+{
+	size_t index = (size_t)(uintptr_t)user_data;
+	delayed_count--;
+	if (states[index].state == DEAD)
+		spawn_server(index);
+	return 0;
+	(void) timer;
+	(void) expirations;
+}
+
+
+/**
+ * Respawn a server after a delay
+ * 
+ * @param   index  The index of the server
+ * @param   delay  The delay in milliseconds
+ * @return         Zero on success, -1 on error
+ */
+static int
+delay_respawn(size_t index, unsigned delay)
+{
+	struct timespec timeout;
+	timeout.tv_sec = (time_t)(delay / 1000);
+	timeout.tv_nsec = (long)(delay % 1000) * 1000000L;
+	if (respawn_timers[index] < 0) {
+		respawn_timers[index] = event_loop_add_timer(&server_event_loop, &timeout, NULL,
+		                                             respawn_delayed, (void *)(uintptr_t)index);
+		fail_if (respawn_timers[index] < 0);
+	} else {
+		fail_if (event_loop_set_timer(&server_event_loop, respawn_timers[index], &timeout, NULL));
+	}
+	delayed_count++;
+	return 0;
+fail:
+	return -1;
+}
+
+
 /**
  * Respawn a server that has exited if appropriate
  * 
@@ -418,7 +1073,18 @@ static void
 joined_with_server(pid_t pid, int status)
 {
 	struct timespec ended;
-	size_t i;
+	size_t i, crashes;
+	unsigned delay;
+
+	/* A standby instance that exits is replaced when the server is respawned. */
+	for (i = 0; i < servers; i++) {
+		if (standby_fds[i] >= 0 && standby_pids[i] == pid) {
+			eprintf("standby instance of `%s' exited.", commands[i][0]);
+			xclose(standby_fds[i]);
+			standby_fds[i] = -1;
+			return;
+		}
+	}
 
 	/* Find index of reaped server. */
 	for (i = 0; i < servers; i++)
@@ -439,12 +1105,14 @@ joined_with_server(pid_t pid, int status)
 	if (states[i].state == ALIVE)
 		live_count--;
 	states[i].state = DEAD;
+	states[i].status = status;
 
 	/* Cremate server if it exited normally or was killed nicely. */
 	if (WIFEXITED(status) ? !WEXITSTATUS(status) :
 	    (WTERMSIG(status) == SIGTERM || WTERMSIG(status) == SIGINT)) {
 		eprintf("child process `%s' exited normally, cremating.", commands[i][0]);
 		states[i].state = CREMATED;
+		retire_standby(i);
 		return;
 	}
 
@@ -462,6 +1130,10 @@ joined_with_server(pid_t pid, int status)
 		return;
 	}
 
+	/* Remember the crash, for the server's crash rate. */
+	states[i].crashed[states[i].crashes++ % RESPAWN_HISTORY_SIZE] = ended;
+	crashes = recent_crashes(i, &ended);
+
 	/* Bury the server if it died abnormally too fast. */
 	if (ended.tv_sec - states[i].started.tv_sec < interval) {
 		eprintf("`%s' died abnormally, burying because it died too fast.", commands[i][0]);
@@ -469,8 +1141,25 @@ joined_with_server(pid_t pid, int status)
 		return;
 	}
 
-	/* Respawn server if it died abnormally in a responable time. */
-	eprintf("`%s' died abnormally, respawning.", commands[i][0]);
+	/* Bury the server if it has crashed too often. */
+	if (budget && crashes > budget) {
+		eprintf("`%s' died abnormally, burying because it crashed %zu times in %i seconds.",
+		        commands[i][0], crashes, window);
+		states[i].state = DEAD_AND_BURIED;
+		return;
+	}
+
+	/* Respawn server if it died abnormally in a responable time,
+	   but back off if it keeps crashing. */
+	states[i].backoff = delay = backoff_delay(crashes);
+	if (delay) {
+		eprintf("`%s' died abnormally, respawning in %u milliseconds.", commands[i][0], delay);
+		if (!delay_respawn(i, delay))
+			return;
+		xperror(*argv);
+	} else {
+		eprintf("`%s' died abnormally, respawning.", commands[i][0]);
+	}
 	spawn_server(i);
 }
 
@@ -483,29 +1172,49 @@ joined_with_server(pid_t pid, int status)
 int
 master_loop(void)
 {
-	int status, rc = 0;
+	int rc = 0;
 	size_t i;
-	pid_t pid;
 
-	while (!reexecing && !terminating && live_count) {
-		pid = uninterruptable_waitpid(-1, &status, 0);
+	/* Servers are reaped, and respawned, as their pidfds become readable. */
+	while (!reexecing && !terminating && (live_count || delayed_count)) {
+		if (event_loop_dispatch(&server_event_loop, -1) < 0) {
+			xperror(*argv);
+			rc = 1;
+			break;
+		}
 
 		if (reviving)
 			for (reviving = 0, i = 0; i < servers; i++)
-				if (states[i].state == DEAD_AND_BURIED)
+				if (states[i].state == DEAD_AND_BURIED) {
+					states[i].forgiven = states[i].crashes;
 					spawn_server(i);
+				}
+	}
 
-		if (pid == (pid_t)-1) {
-			xperror(*argv);
-			rc = 1;
-			break;
-		}
+	/* Standby instances are not kept over re-exec, the new image starts new ones. */
+	for (i = 0; i < servers; i++)
+		retire_standby(i);
 
-		joined_with_server(pid, status);
+	/* The new image monitors the servers with pidfds of its own, and respawns
+	   servers whose respawn has been delayed without delay. */
+	for (i = 0; i < servers; i++) {
+		if (pidfds[i] >= 0)
+			unwatch_process(pidfds[i]);
+		if (respawn_timers[i] >= 0)
+			event_loop_remove_timer(&server_event_loop, respawn_timers[i]);
 	}
 
 	free(commands_args);
 	free(commands);
+	free(provisions);
+	free(requirements);
+	free(ready_fds);
+	free(standby_wanted);
+	free(standby_fds);
+	free(standby_pids);
+	free(standby_pidfds);
+	free(pidfds);
+	free(respawn_timers);
 	if (!reexecing)
 		free(states);
 
@@ -525,14 +1234,18 @@ received_info(int signo)
 {
 	SIGHANDLER_START;
 	server_state_t state;
-	size_t i, n = servers;
+	size_t i, j, n = servers;
 	char **cmdline;
 	struct timespec now;
+	struct timespec crashed;
 	if (monotone(&now) < 0)
 		iprint("(unable to get current time)");
 	else
 		iprintf("current time: %ji.%09li", (intmax_t)(now.tv_sec), (long)(now.tv_nsec));
 	iprintf("do-not-resuscitate period: %i seconds", interval);
+	iprintf("respawn backoff: %u to %u milliseconds", backoff, backoff_max);
+	iprintf("crash rate window: %i seconds", window);
+	iprintf("restart budget: %zu crashes", budget);
 	iprintf("managed servers: %zu", n);
 	iprintf("alive servers: %zu", live_count);
 	iprintf("reviving: %s", reviving ? "yes" : "no");
@@ -550,9 +1263,28 @@ received_info(int signo)
 		iprintf("managed server %zu: started: %ji.%09li", i,
 		        (intmax_t)(state.started.tv_sec),
 		        (long)(state.started.tv_nsec));
+		iprintf("managed server %zu: spawns: %zu", i, state.spawns);
+		iprintf("managed server %zu: crashes: %zu, %zu since revived", i,
+		        state.crashes, state.crashes - state.forgiven);
+		for (j = 0; j < min(state.crashes, (size_t)RESPAWN_HISTORY_SIZE); j++) {
+			crashed = state.crashed[(state.crashes - 1 - j) % RESPAWN_HISTORY_SIZE];
+			iprintf("managed server %zu: crashed: %ji.%09li", i,
+			        (intmax_t)(crashed.tv_sec), (long)(crashed.tv_nsec));
+		}
+		if (state.spawns > 1 || state.state == DEAD || state.state == DEAD_AND_BURIED) {
+			if (WIFEXITED(state.status))
+				iprintf("managed server %zu: last exit: code %i", i, WEXITSTATUS(state.status));
+			else
+				iprintf("managed server %zu: last exit: signal %i", i, WTERMSIG(state.status));
+		}
+		iprintf("managed server %zu: last respawn delay: %u milliseconds", i, state.backoff);
+		iprintf("managed server %zu: provides: %s", i, provisions[i] ? provisions[i] : "");
+		iprintf("managed server %zu: requires: %s", i, requirements[i] ? requirements[i] : "");
+		iprintf("managed server %zu: standby: %s", i,
+		        standby_fds[i] >= 0 ? "ready" : standby_wanted[i] ? "not ready" : "not kept");
 		iprintf("managed server %zu: cmdline:", i);
 		while (*cmdline)
-			iprintf("  %z", *cmdline++);
+			iprintf("  %s", *cmdline++);
 	}
 	SIGHANDLER_END;
 	(void) signo;
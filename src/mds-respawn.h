@@ -26,6 +26,40 @@
 
 
 
+/**
+ * The number of milliseconds a server that has crashed
+ * again, within the crash rate window, is delayed before
+ * it is respawned, the delay is doubled for each crash
+ */
+#ifndef RESPAWN_BACKOFF_MILLISECONDS
+# define RESPAWN_BACKOFF_MILLISECONDS  100
+#endif
+
+/**
+ * The maximum number of milliseconds a respawn is delayed
+ */
+#ifndef RESPAWN_BACKOFF_MAX_MILLISECONDS
+# define RESPAWN_BACKOFF_MAX_MILLISECONDS  30000
+#endif
+
+/**
+ * The number of seconds within which crashes are
+ * counted towards a server's crash rate
+ */
+#ifndef RESPAWN_WINDOW_SECONDS
+# define RESPAWN_WINDOW_SECONDS  60
+#endif
+
+/**
+ * The number of crashes per server that are remembered,
+ * this is also the maximum restart budget
+ */
+#ifndef RESPAWN_HISTORY_SIZE
+# define RESPAWN_HISTORY_SIZE  16
+#endif
+
+
+
 /**
  * The server has not started yet
  */
@@ -81,6 +115,41 @@ typedef struct server_state {
 	 * The time (monotonic) the server started
 	 */
 	struct timespec started;
+
+	/**
+	 * The number of times the server has been spawned
+	 */
+	size_t spawns;
+
+	/**
+	 * The number of times the server has died abnormally
+	 */
+	size_t crashes;
+
+	/**
+	 * The value of `crashes` when the server was last
+	 * revived, earlier crashes do not count towards
+	 * its crash rate
+	 */
+	size_t forgiven;
+
+	/**
+	 * The status, as returned by waitpid(3), the server
+	 * last exited with, only meaningful if it has exited
+	 */
+	int status;
+
+	/**
+	 * The number of milliseconds the last respawn was delayed
+	 */
+	unsigned backoff;
+
+	/**
+	 * The times (monotonic) of the server's most recent crashes,
+	 * the crash with number `crashes - 1` is stored at index
+	 * `(crashes - 1) % RESPAWN_HISTORY_SIZE`
+	 */
+	struct timespec crashed[RESPAWN_HISTORY_SIZE];
 } server_state_t;
 
 
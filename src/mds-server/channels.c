@@ -0,0 +1,283 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "channels.h"
+
+#include "globals.h"
+#include "mds-server.h"
+#include "interceptors.h"
+#include "sending.h"
+#include "handover.h"
+
+#include <libmdsserver/linked-list.h>
+#include <libmdsserver/macros.h>
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+
+
+
+/**
+ * Compose the `Channel`-header that prefixes messages sent to a client,
+ * or the `Handover`-header if the client is the other image of the server
+ * 
+ * @param   client  The client
+ * @param   buf     Output buffer, of at least `CHANNEL_HEADER_MAX + 1` characters
+ * @return          The length of the header, zero if the client is neither
+ *                  a channel nor the other image of the server
+ */
+size_t
+channel_header(const client_t *restrict client, char *restrict buf)
+{
+	if (client == handover_bridge)
+		return (size_t)sprintf(buf, "%s", HANDOVER_MESSAGE_HEADER);
+	if (!client->connection)
+		return 0;
+	return (size_t)sprintf(buf, "Channel: %" PRIu32 ":%" PRIu32 "\n",
+	                       (uint32_t)(client->id >> 32),
+	                       (uint32_t)(client->id >>  0));
+}
+
+
+/**
+ * Open a channel over a client's connection
+ * 
+ * The channel is assigned an ID, listed as a client, and
+ * made to intercept messages addressed to it or to all
+ * clients, just like a client with its own connection
+ * 
+ * @param   connection  The client that owns the connection
+ * @return              The channel, `NULL` on error
+ */
+client_t *
+open_channel(client_t *connection)
+{
+	ssize_t entry = LINKED_LIST_UNUSED;
+	client_t *channel = NULL;
+	client_t **channels;
+	int saved_errno;
+	char buf[] = "To: all";
+	char to_buf[26];
+
+	/* Create information table, the channel has no socket of its own. */
+	fail_if (xmalloc(channel, 1, client_t));
+	client_initialise(channel);
+	mds_message_zero_initialise(&(channel->message));
+	channel->connection = connection;
+	channel->socket_fd = connection->socket_fd;
+	channel->open = 1;
+	fail_if (client_initialise_threading(channel));
+
+	/* Assign ID. */
+	with_mutex (slave_mutex, channel->id = next_client_id++;);
+
+	/* Register channel to receive broadcasts and messages addressed to it. */
+	add_intercept_condition(channel, buf, 0, 0, 0);
+	xsnprintf(to_buf, "To: %" PRIu32 ":%" PRIu32,
+	          (uint32_t)(channel->id >> 32),
+	          (uint32_t)(channel->id >>  0));
+	add_intercept_condition(channel, to_buf, 0, 0, 0);
+
+	/* Add to the connection's channels. */
+	fail_if ((errno = pthread_mutex_lock(&(connection->mutex))));
+	channels = connection->channels;
+	if (xrealloc(channels, connection->channels_count + 1, client_t *)) {
+		saved_errno = errno;
+		pthread_mutex_unlock(&(connection->mutex));
+		fail_if (errno = saved_errno, 1);
+	}
+	connection->channels = channels;
+	channels[connection->channels_count++] = channel;
+	pthread_mutex_unlock(&(connection->mutex));
+
+	/* Add to list of clients. */
+	with_mutex (slave_mutex,
+	            entry = linked_list_insert_end(&client_list, (size_t)(void *)channel);
+	            if (entry != LINKED_LIST_UNUSED)
+	                    channel->list_entry = entry;
+	           );
+	if (entry == LINKED_LIST_UNUSED) {
+		saved_errno = errno;
+		with_mutex (connection->mutex, connection->channels_count--;);
+		fail_if (errno = saved_errno, 1);
+	}
+
+	return channel;
+
+fail:
+	saved_errno = errno;
+	if (channel)
+		client_destroy(channel);
+	return errno = saved_errno, NULL;
+}
+
+
+/**
+ * Unlist a channel, remove it from its connection, and destroy it
+ * 
+ * @param  channel  The channel
+ */
+static void __attribute__((nonnull))
+remove_channel(client_t *channel)
+{
+	client_t *connection = channel->connection;
+	size_t i;
+
+	with_mutex (slave_mutex, linked_list_remove(&client_list, channel->list_entry););
+
+	with_mutex (connection->mutex,
+	            for (i = 0; i < connection->channels_count; i++)
+	                    if (connection->channels[i] == channel)
+	                            break;
+	            if (i < connection->channels_count)
+	                    memmove(connection->channels + i, connection->channels + i + 1,
+	                            (--(connection->channels_count) - i) * sizeof(client_t *));
+	           );
+
+	client_destroy(channel);
+}
+
+
+/**
+ * Close a channel, and announce that it has closed
+ * 
+ * @param  channel  The channel, it will be destroyed
+ */
+void
+close_channel(client_t *channel)
+{
+	char *msgbuf;
+	size_t n;
+
+	/* Stop delivering messages to the channel. */
+	channel->open = 0;
+
+	/* Multicast information about the channel closing. */
+	n = 2 * 10 + 1 + strlen("Client closed: :\n\n");
+	if (xmalloc(msgbuf, n, char)) {
+		xperror(*argv);
+	} else {
+		snprintf(msgbuf, n,
+		         "Client closed: %" PRIu32 ":%" PRIu32 "\n"
+		         "\n",
+		         (uint32_t)(channel->id >> 32),
+		         (uint32_t)(channel->id >>  0));
+		n = strlen(msgbuf);
+		queue_message_multicast(msgbuf, n, channel);
+	}
+	send_multicast_queue(channel);
+
+	remove_channel(channel);
+}
+
+
+/**
+ * Close all channels multiplexed over a client's connection
+ * 
+ * @param  connection  The client that owns the connection
+ * @param  announce    Whether to announce that the channels have closed
+ */
+void
+close_channels(client_t *connection, int announce)
+{
+	while (connection->channels_count > 0) {
+		if (announce)
+			close_channel(connection->channels[connection->channels_count - 1]);
+		else
+			remove_channel(connection->channels[connection->channels_count - 1]);
+	}
+}
+
+
+/**
+ * Find a channel multiplexed over a client's connection
+ * 
+ * @param   connection  The client that owns the connection
+ * @param   id          The ID of the channel
+ * @return              The channel, `NULL` if not found
+ */
+client_t *
+find_channel(client_t *connection, uint64_t id)
+{
+	client_t *channel = NULL;
+	size_t i;
+
+	with_mutex (connection->mutex,
+	            for (i = 0; i < connection->channels_count; i++)
+	                    if (connection->channels[i]->id == id) {
+	                            channel = connection->channels[i];
+	                            break;
+	                    }
+	           );
+
+	return channel;
+}
+
+
+/**
+ * Find the client a message, received over a client's
+ * connection, was sent from, and if it was sent from a
+ * channel, remove the `Channel`-header from the message
+ * 
+ * @param   connection  The client that owns the connection
+ * @param   message     Copy of the received message, its header list may be offset
+ * @return              The channel the message was sent on, `connection` if
+ *                      it was not sent on a channel, `NULL` if the channel
+ *                      does not exist
+ */
+client_t *
+demultiplex_message(client_t *connection, mds_message_t *message)
+{
+	client_t *channel = NULL;
+	uint32_t high, low;
+	int end = 0;
+
+	/* The `Channel`-header is always first, so the look up is cheap. */
+	if (!message->header_count || !startswith(message->headers[0], "Channel: "))
+		return connection;
+
+	if (sscanf(message->headers[0], "Channel: %" SCNu32 ":%" SCNu32 "%n", &high, &low, &end) == 2 &&
+	    !message->headers[0][end])
+		channel = find_channel(connection, ((uint64_t)high << 32) | (uint64_t)low);
+	if (!channel) {
+		eprint("received message on an unknown channel, ignoring.");
+		return NULL;
+	}
+
+	message->headers++;
+	message->header_count--;
+	return channel;
+}
+
+
+/**
+ * Send the queued multicast messages and replies of the
+ * channels multiplexed over a client's connection
+ * 
+ * @param  connection  The client that owns the connection
+ */
+void
+send_channel_queues(client_t *connection)
+{
+	size_t i;
+	for (i = 0; i < connection->channels_count; i++) {
+		send_multicast_queue(connection->channels[i]);
+		send_reply_queue(connection->channels[i]);
+	}
+}
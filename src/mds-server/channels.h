@@ -0,0 +1,113 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_MDS_SERVER_CHANNELS_H
+#define MDS_MDS_SERVER_CHANNELS_H
+
+
+#include "client.h"
+
+#include <libmdsserver/mds-message.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * The maximum length of a `Channel`-header, including its line feed
+ */
+#define CHANNEL_HEADER_MAX  (sizeof("Channel: 4294967295:4294967295\n") / sizeof(char) - 1)
+
+
+
+/**
+ * Compose the `Channel`-header that prefixes messages sent to a client,
+ * or the `Handover`-header if the client is the other image of the server
+ * 
+ * @param   client  The client
+ * @param   buf     Output buffer, of at least `CHANNEL_HEADER_MAX + 1` characters
+ * @return          The length of the header, zero if the client is neither
+ *                  a channel nor the other image of the server
+ */
+__attribute__((nonnull))
+size_t channel_header(const client_t *restrict client, char *restrict buf);
+
+/**
+ * Open a channel over a client's connection
+ * 
+ * The channel is assigned an ID, listed as a client, and
+ * made to intercept messages addressed to it or to all
+ * clients, just like a client with its own connection
+ * 
+ * @param   connection  The client that owns the connection
+ * @return              The channel, `NULL` on error
+ */
+__attribute__((nonnull))
+client_t *open_channel(client_t *connection);
+
+/**
+ * Close a channel, and announce that it has closed
+ * 
+ * @param  channel  The channel, it will be destroyed
+ */
+__attribute__((nonnull))
+void close_channel(client_t *channel);
+
+/**
+ * Close all channels multiplexed over a client's connection
+ * 
+ * @param  connection  The client that owns the connection
+ * @param  announce    Whether to announce that the channels have closed
+ */
+__attribute__((nonnull))
+void close_channels(client_t *connection, int announce);
+
+/**
+ * Find a channel multiplexed over a client's connection
+ * 
+ * @param   connection  The client that owns the connection
+ * @param   id          The ID of the channel
+ * @return              The channel, `NULL` if not found
+ */
+__attribute__((nonnull))
+client_t *find_channel(client_t *connection, uint64_t id);
+
+/**
+ * Find the client a message, received over a client's
+ * connection, was sent from, and if it was sent from a
+ * channel, remove the `Channel`-header from the message
+ * 
+ * @param   connection  The client that owns the connection
+ * @param   message     Copy of the received message, its header list may be offset
+ * @return              The channel the message was sent on, `connection` if
+ *                      it was not sent on a channel, `NULL` if the channel
+ *                      does not exist
+ */
+__attribute__((nonnull))
+client_t *demultiplex_message(client_t *connection, mds_message_t *message);
+
+/**
+ * Send the queued multicast messages and replies of the
+ * channels multiplexed over a client's connection
+ * 
+ * @param  connection  The client that owns the connection
+ */
+__attribute__((nonnull))
+void send_channel_queues(client_t *connection);
+
+
+#endif
@@ -20,6 +20,8 @@
 #include "multicast.h"
 
 #include <libmdsserver/macros.h>
+#include <libmdsserver/ring.h>
+#include <libmdsserver/binary.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -37,6 +39,7 @@
  * - mutex
  * - modify_mutex
  * - modify_cond
+ * - relay_cond
  * 
  * The follow fields will be initialised to `-1`:
  * - list_entry
@@ -61,6 +64,15 @@ client_initialise(client_t *restrict this)
 	this->modify_message = NULL;
 	this->modify_mutex_created = 0;
 	this->modify_cond_created = 0;
+	this->accept_memfd = 0;
+	this->relaying = 0;
+	this->relay_cond_created = 0;
+	this->connection = NULL;
+	this->channels = NULL;
+	this->channels_count = 0;
+	this->ring = NULL;
+	this->binary = NULL;
+	this->migrating = 0;
 }
 
 
@@ -72,6 +84,7 @@ client_initialise(client_t *restrict this)
  * - mutex
  * - modify_mutex
  * - modify_cond
+ * - relay_cond
  * 
  * @param   this  The client information
  * @return        Zero on success, -1 on error
@@ -82,6 +95,11 @@ client_initialise_threading(client_t *restrict this)
 	/* Store the thread so that other threads can kill it. */
 	this->thread = pthread_self();
 
+	/* A client that was taken over from the other image of
+	   the server already has them, but not its slave thread. */
+	if (this->mutex_created)
+		return 0;
+
 	/* Create mutex to make sure two thread to not try to send
 	   messages concurrently, and other client local actions. */
 	fail_if ((errno = pthread_mutex_init(&(this->mutex), NULL)));
@@ -93,6 +111,10 @@ client_initialise_threading(client_t *restrict this)
 	fail_if ((errno = pthread_cond_init(&(this->modify_cond), NULL)));
 	this->modify_cond_created = 1;
 
+	/* Create condition for waiting until a message has been relayed to the client. */
+	fail_if ((errno = pthread_cond_init(&(this->relay_cond), NULL)));
+	this->relay_cond_created = 1;
+
 	return 0;
  fail:
 	return -1;
@@ -130,6 +152,13 @@ client_destroy(client_t *restrict this)
 		pthread_mutex_destroy(&(this->modify_mutex));
 	if (this->modify_cond_created)
 		pthread_cond_destroy(&(this->modify_cond));
+	if (this->relay_cond_created)
+		pthread_cond_destroy(&(this->relay_cond));
+	free(this->channels);
+	ring_destroy(this->ring);
+	free(this->ring);
+	binary_encoder_destroy(this->binary);
+	free(this->binary);
 	free(this);
 }
 
@@ -143,7 +172,7 @@ client_destroy(client_t *restrict this)
 size_t
 client_marshal_size(const client_t *restrict this)
 {
-	size_t i, n = sizeof(ssize_t) + 3 * sizeof(int) + sizeof(uint64_t) + 5 * sizeof(size_t);
+	size_t i, n = sizeof(ssize_t) + 6 * sizeof(int) + sizeof(uint64_t) + 6 * sizeof(size_t);
 
 	n += mds_message_marshal_size(&(this->message));
 	for (i = 0; i < this->interception_conditions_count; i++)
@@ -152,6 +181,8 @@ client_marshal_size(const client_t *restrict this)
 		n += multicast_marshal_size(this->multicasts + i);
 	n += this->send_pending_size * sizeof(char);
 	n += !this->modify_message ? 0 : mds_message_marshal_size(this->modify_message);
+	n += !this->ring ? 0 : 3 * sizeof(int);
+	n += !this->binary ? 0 : sizeof(size_t) + sizeof(uint64_t) + this->binary->text_length * sizeof(char);
 
 	return n;
 }
@@ -192,6 +223,23 @@ client_marshal(const client_t *restrict this, char *restrict data)
 	buf_set_next(data, size_t, n);
 	if (this->modify_message)
 		mds_message_marshal(this->modify_message, data);
+	data += n / sizeof(char);
+	buf_set_next(data, int, this->accept_memfd);
+	buf_set_next(data, size_t, (size_t)(void *)(this->connection));
+	/* The ring is mapped again from its file descriptors, which survive the re-exec. */
+	buf_set_next(data, int, !!this->ring);
+	if (this->ring) {
+		buf_set_next(data, int, this->ring->memfd);
+		buf_set_next(data, int, this->ring->bell);
+		buf_set_next(data, int, this->ring->peer_bell);
+	}
+	/* A message may be in the middle of being translated to the binary encoding. */
+	buf_set_next(data, int, !!this->binary);
+	if (this->binary) {
+		buf_set_next(data, uint64_t, this->binary->payload_left);
+		buf_set_next(data, size_t, this->binary->text_length);
+		memcpy(data, this->binary->text, this->binary->text_length * sizeof(char));
+	}
 	return client_marshal_size(this);
 }
 
@@ -207,16 +255,23 @@ size_t
 client_unmarshal(client_t *restrict this, char *restrict data)
 {
 	size_t i, n, m, rc = sizeof(ssize_t) + 3 * sizeof(int) + sizeof(uint64_t) + 5 * sizeof(size_t);
-	int saved_errno, stage = 0;
+	int saved_errno, stage = 0, version, has_ring = 0, has_binary = 0, memfd, bell, peer_bell;
 	this->interception_conditions = NULL;
 	this->multicasts = NULL;
 	this->send_pending = NULL;
 	this->mutex_created = 0;
 	this->modify_mutex_created = 0;
 	this->modify_cond_created = 0;
+	this->relaying = 0;
+	this->relay_cond_created = 0;
 	this->multicasts_count = 0;
-	/* buf_get_next(data, int, CLIENT_T_VERSION); */
-	buf_next(data, int, 1);
+	this->connection = NULL;
+	this->channels = NULL;
+	this->channels_count = 0;
+	this->ring = NULL;
+	this->binary = NULL;
+	this->migrating = 0;
+	buf_get_next(data, int, version);
 	buf_get_next(data, ssize_t, this->list_entry);
 	buf_get_next(data, int, this->socket_fd);
 	buf_get_next(data, int, this->open);
@@ -257,6 +312,46 @@ client_unmarshal(client_t *restrict this, char *restrict data)
 	else
 		this->modify_message = NULL;
 	rc += n * sizeof(char);
+	this->accept_memfd = 0;
+	data += n / sizeof(char);
+	if (version >= 1) {
+		buf_get_next(data, int, this->accept_memfd);
+		rc += sizeof(int);
+	}
+	if (version >= 2) {
+		/* The address is remapped by `unmarshal_server`. */
+		buf_get_next(data, size_t, n);
+		this->connection = (void *)n;
+		rc += sizeof(size_t);
+	}
+	if (version >= 3) {
+		buf_get_next(data, int, has_ring);
+		rc += sizeof(int);
+	}
+	if (has_ring) {
+		buf_get_next(data, int, memfd);
+		buf_get_next(data, int, bell);
+		buf_get_next(data, int, peer_bell);
+		rc += 3 * sizeof(int);
+		fail_if (xmalloc(this->ring, 1, ring_t));
+		fail_if (ring_attach(this->ring, memfd, bell, peer_bell));
+		this->message.ring = this->ring;
+	}
+	if (version >= 4) {
+		buf_get_next(data, int, has_binary);
+		rc += sizeof(int);
+	}
+	if (has_binary) {
+		fail_if (xcalloc(this->binary, 1, binary_encoder_t));
+		buf_get_next(data, uint64_t, this->binary->payload_left);
+		buf_get_next(data, size_t, n);
+		rc += sizeof(uint64_t) + sizeof(size_t) + n * sizeof(char);
+		if (n > 0) {
+			fail_if (xmemdup(this->binary->text, data, n, char));
+			this->binary->text_size = this->binary->text_length = n;
+		}
+		this->message.binary = 1;
+	}
 	return rc;
 
 fail:
@@ -275,6 +370,9 @@ fail:
 		mds_message_destroy(this->modify_message);
 		free(this->modify_message);
 	}
+	free(this->ring);
+	binary_encoder_destroy(this->binary);
+	free(this->binary);
 done_failing:
 	return errno = saved_errno, (size_t)0;
 }
@@ -290,7 +388,9 @@ size_t
 client_unmarshal_skip(char *restrict data)
 {
 	size_t n, c, rc = sizeof(ssize_t) + 3 * sizeof(int) + sizeof(uint64_t) + 5 * sizeof(size_t);
-	buf_next(data, int, 1);
+	int version, has_ring, has_binary;
+	size_t text_length;
+	buf_get_next(data, int, version);
 	buf_next(data, ssize_t, 1);
 	buf_next(data, int, 2);
 	buf_next(data, uint64_t, 1);
@@ -313,6 +413,29 @@ client_unmarshal_skip(char *restrict data)
 	data += n;
 	rc += n * sizeof(char);
 	buf_get_next(data, size_t, n);
+	data += n / sizeof(char);
 	rc += n * sizeof(char);
+	if (version >= 1) {
+		buf_next(data, int, 1);
+		rc += sizeof(int);
+	}
+	if (version >= 2) {
+		buf_next(data, size_t, 1);
+		rc += sizeof(size_t);
+	}
+	if (version >= 3) {
+		buf_get_next(data, int, has_ring);
+		rc += sizeof(int) + (has_ring ? 3 * sizeof(int) : 0);
+		buf_next(data, int, has_ring ? 3 : 0);
+	}
+	if (version >= 4) {
+		buf_get_next(data, int, has_binary);
+		rc += sizeof(int);
+		if (has_binary) {
+			buf_next(data, uint64_t, 1);
+			buf_get_next(data, size_t, text_length);
+			rc += sizeof(uint64_t) + sizeof(size_t) + text_length * sizeof(char);
+		}
+	}
 	return rc;
 }
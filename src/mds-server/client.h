@@ -25,13 +25,17 @@
 #include <libmdsserver/mds-message.h>
 
 #include <stdlib.h>
+#include <signal.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <unistd.h>
 
 
 
-#define CLIENT_T_VERSION 0
+struct binary_encoder;
+
+
+#define CLIENT_T_VERSION 4
 
 /**
  * Client information structure
@@ -133,10 +137,89 @@ typedef struct client {
 	 * Whether `modify_cond` has been initialised
 	 */
 	int modify_cond_created;
+
+	/**
+	 * Whether the client accepts payloads in memfds
+	 */
+	int accept_memfd;
+
+	/**
+	 * Whether a message is being relayed to the client
+	 * while it is still being received from its sender,
+	 * no other message may be sent to the client meanwhile
+	 */
+	int relaying;
+
+	/**
+	 * Condition, used with `mutex`, for `relaying`
+	 */
+	pthread_cond_t relay_cond;
+
+	/**
+	 * Whether `relay_cond` has been initialised
+	 */
+	int relay_cond_created;
+
+	/**
+	 * If the client is a channel multiplexed over another
+	 * client's connection, that client, otherwise `NULL`
+	 * 
+	 * A channel has its own ID, interception conditions
+	 * and queues, but uses the socket, `mutex`, `relaying`
+	 * and `relay_cond` of its connection, and has no thread
+	 */
+	struct client *connection;
+
+	/**
+	 * The channels multiplexed over the client's connection,
+	 * guarded by `mutex`
+	 */
+	struct client **channels;
+
+	/**
+	 * The number of elements in `channels`
+	 */
+	size_t channels_count;
+
+	/**
+	 * If the client has set up a shared-memory ring pair,
+	 * see <libmdsserver/ring.h>, to communicate over instead
+	 * of the socket, the ring pair, otherwise `NULL`; only
+	 * connections, not channels, have rings
+	 */
+	struct ring *ring;
+
+	/**
+	 * If the client has switched to the binary encoding,
+	 * see <libmdsserver/binary.h>, the encoder that translates
+	 * the messages sent to it, otherwise `NULL`; only
+	 * connections, not channels, have encoders
+	 */
+	struct binary_encoder *binary;
+
+	/**
+	 * Whether the client shall be handed over to the other
+	 * image of the server, by its slave, at the next message
+	 * boundary, this is not marshalled
+	 */
+	volatile sig_atomic_t migrating;
 } client_t;
 
 
 
+/**
+ * Get the client that owns the socket a client
+ * communicates over, that is, the client itself
+ * unless it is a channel
+ * 
+ * @param   this:client_t*  The client
+ * @return  :client_t*      The client that owns the socket
+ */
+#define client_connection(this)\
+	((this)->connection ? (this)->connection : (this))
+
+
+
 /**
  * Initialise a client
  * 
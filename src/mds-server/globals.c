@@ -73,3 +73,42 @@ pthread_cond_t modify_cond;
  * Map from modification ID to waiting client
  */
 hash_table_t modify_map;
+
+/**
+ * Held for reading by slaves while they act upon a message,
+ * and for writing while a client is handed over to the other
+ * image of the server during a staged re-exec
+ */
+pthread_rwlock_t migration_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Socket connected to the other image of the server
+ * during a staged re-exec, -1 if none is in progress
+ */
+int handover_fd = -1;
+
+/**
+ * The process ID of the temporary image of the server during
+ * a staged re-exec, -1 if none is in progress or if this
+ * process is the temporary image
+ */
+pid_t handover_pid = -1;
+
+/**
+ * The client that stands in for the other image of the
+ * server during a staged re-exec, `NULL` if none is
+ * in progress
+ */
+struct client *handover_bridge = NULL;
+
+/**
+ * The CPUs, selected with --input-cpus, that the slaves of
+ * clients with a real-time scheduling policy, such as the
+ * input servers, run on, if `restrict_input_cpus` is set
+ */
+cpu_set_t input_cpus;
+
+/**
+ * Whether --input-cpus has been used
+ */
+int restrict_input_cpus = 0;
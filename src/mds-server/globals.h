@@ -27,11 +27,40 @@
 
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 
 
-#define MDS_SERVER_VARS_VERSION 0
+#define MDS_SERVER_VARS_VERSION 1
+
+
+/**
+ * Messages with payloads at least this large are relayed
+ * to their recipients while they are being received,
+ * rather than after the entire payload has been received
+ */
+#ifndef STREAM_THRESHOLD
+# define STREAM_THRESHOLD  (64 << 10)
+#endif
+
+/**
+ * The size of the buffer used when relaying a payload
+ */
+#ifndef STREAM_CHUNK_SIZE
+# define STREAM_CHUNK_SIZE  (16 << 10)
+#endif
+
+/**
+ * The number of milliseconds a recipient of a relayed message
+ * may go without accepting data before it is disconnected, and
+ * that a sender may stall before the rest of its payload is
+ * buffered rather than relayed as it is received
+ */
+#ifndef RELAY_TIMEOUT
+# define RELAY_TIMEOUT  1000
+#endif
 
 
 
@@ -91,5 +120,44 @@ extern pthread_cond_t modify_cond;
  */
 extern hash_table_t modify_map;
 
+/**
+ * Held for reading by slaves while they act upon a message,
+ * and for writing while a client is handed over to the other
+ * image of the server during a staged re-exec
+ */
+extern pthread_rwlock_t migration_lock;
+
+/**
+ * Socket connected to the other image of the server
+ * during a staged re-exec, -1 if none is in progress
+ */
+extern int handover_fd;
+
+/**
+ * The process ID of the temporary image of the server during
+ * a staged re-exec, -1 if none is in progress or if this
+ * process is the temporary image
+ */
+extern pid_t handover_pid;
+
+/**
+ * The client that stands in for the other image of the
+ * server during a staged re-exec, `NULL` if none is
+ * in progress
+ */
+extern struct client *handover_bridge;
+
+/**
+ * The CPUs, selected with --input-cpus, that the slaves of
+ * clients with a real-time scheduling policy, such as the
+ * input servers, run on, if `restrict_input_cpus` is set
+ */
+extern cpu_set_t input_cpus;
+
+/**
+ * Whether --input-cpus has been used
+ */
+extern int restrict_input_cpus;
+
 
 #endif
@@ -0,0 +1,1279 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "handover.h"
+
+#include "globals.h"
+#include "client.h"
+#include "slavery.h"
+#include "interceptors.h"
+#include "sending.h"
+#include "multicast.h"
+#include "queued-interception.h"
+#include "mds-server.h"
+
+#include <libmdsserver/linked-list.h>
+#include <libmdsserver/fd-table.h>
+#include <libmdsserver/hash-help.h>
+#include <libmdsserver/macros.h>
+#include <libmdsserver/memfd.h>
+#include <libmdsserver/ring.h>
+#include <libmdsserver/util.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+
+/*
+ * A staged re-exec is performed in two phases, in the
+ * first phase the old image of the server starts a new
+ * temporary image of the server and hands over all its
+ * clients to it, and re-exec:s; in the second phase the
+ * temporary image hands over all the clients to the
+ * re-exec:ed image, which keeps the process ID of the
+ * server, and exits
+ * 
+ * The images communicate over `handover_fd` with mds
+ * messages whose first header is `Handover`:
+ * 
+ *   ready         The taking image is ready to take clients
+ *   start         The giving image will start giving clients,
+ *                 with its next client ID and hash seed
+ *   client        A client, its channels and its file descriptors,
+ *                 with the number of messages the giving image has received
+ *                 and the number of file descriptors
+ *   message       A message that shall be multicast by the receiving
+ *                 image, followed by the rest of the message
+ *   done          The giving image has no more clients,
+ *                 with its next client ID
+ *   acknowledged  The taking image will forward no more messages
+ * 
+ * While clients are being handed over, both images multicast
+ * the messages they receive to the other image, via
+ * `handover_bridge`, which intercepts all messages with the
+ * lowest possible priority, without modifying them
+ * 
+ * A client record says how many messages the giving image has
+ * received, the messages that the taking image forwarded after
+ * those crossed the client on the way, and would be lost, so
+ * the taking image remembers them and delivers them to the client
+ * 
+ * Both images send records to each other while their slaves
+ * wait for each other, so one thread only reads the records,
+ * and queues them, and another thread acts upon them; if the
+ * same thread did both, the images could block each other
+ * when both ends of the bridge are full
+ */
+
+
+/**
+ * A message forwarded to the other image of the server
+ */
+struct forwarded_message {
+	/**
+	 * The number of messages forwarded before this message
+	 */
+	size_t index;
+
+	/**
+	 * The message, without the `Handover`-header
+	 */
+	char *message;
+
+	/**
+	 * The length of `message`
+	 */
+	size_t length;
+};
+
+
+/**
+ * A record read from the other image of the server,
+ * that has not yet been acted upon
+ */
+struct queued_record {
+	/**
+	 * The next record in the queue
+	 */
+	struct queued_record *next;
+
+	/**
+	 * The record
+	 */
+	mds_message_t message;
+};
+
+
+/**
+ * Whether the master thread shall hand over all
+ * clients to the other image of the server
+ */
+volatile sig_atomic_t handover_requested = 0;
+
+/**
+ * Whether the thread that reads from the other
+ * image of the server is running, guarded by `slave_mutex`
+ */
+static int bridge_running = 0;
+
+/**
+ * Whether this image of the server is giving its clients
+ */
+static volatile sig_atomic_t giving = 0;
+
+/**
+ * Whether the handover has been completed
+ */
+static volatile sig_atomic_t finished = 0;
+
+/**
+ * The messages forwarded to the other image of the
+ * server, that it may not have received, guarded
+ * by the mutex of `handover_bridge`
+ */
+static struct forwarded_message *forwarded = NULL;
+
+/**
+ * The number of elements in `forwarded`
+ */
+static size_t forwarded_count = 0;
+
+/**
+ * The number of messages forwarded to the other image
+ * of the server, guarded by the mutex of `handover_bridge`
+ */
+static size_t forwarded_total = 0;
+
+/**
+ * The number of messages forwarded by the other
+ * image of the server that have been multicast
+ */
+static size_t received_total = 0;
+
+/**
+ * The record that is being acted upon
+ */
+static mds_message_t *record = NULL;
+
+/**
+ * The records that have been read from the other image
+ * of the server, but not yet acted upon, guarded by `queue_mutex`
+ */
+static struct queued_record *queue = NULL;
+
+/**
+ * Where the next record shall be queued, guarded by `queue_mutex`
+ */
+static struct queued_record **queue_end = &queue;
+
+/**
+ * Whether the thread that reads records from the other
+ * image of the server is running, guarded by `queue_mutex`
+ */
+static int draining = 0;
+
+/**
+ * Mutex for `queue` and `draining`
+ */
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Condition for `queue` and `draining`
+ */
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+
+
+/**
+ * Add milliseconds to the current time
+ * 
+ * @param  deadline  Output parameter for the time, on `CLOCK_REALTIME`
+ * @param  ms        The number of milliseconds
+ */
+static void __attribute__((nonnull))
+deadline_after(struct timespec *deadline, long ms)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += ms / 1000L;
+	deadline->tv_nsec += (ms % 1000L) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec += 1;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+
+/**
+ * Send a record to the other image of the server
+ * 
+ * Unless the bridge is not listed, the caller must
+ * hold `migration_lock` for writing, lest the record
+ * is sent in the middle of a relayed message
+ * 
+ * @param   header   The headers of the record, including the empty line
+ * @param   payload  The payload of the record, `NULL` if none
+ * @param   length   The length of `payload`
+ * @param   fds      File descriptors to send with the record, `NULL` if none
+ * @param   count    The number of elements in `fds`
+ * @return           Zero on success, -1 on error
+ */
+static int __attribute__((nonnull(1)))
+send_record(const char *header, const char *payload, size_t length, const int *fds, size_t count)
+{
+	client_t *bridge = handover_bridge;
+	const char *msg = header;
+	size_t n = strlen(header);
+	ssize_t sent;
+	int part = 0, rc = 0;
+
+	with_mutex (bridge->mutex,
+	            while (count > 0) {
+	                    sent = memfd_send_fds(bridge->socket_fd, msg, n, fds, count);
+	                    if (sent < 0 && errno == EINTR)
+	                            continue;
+	                    if (sent < 0)
+	                            break;
+	                    msg += (size_t)sent / sizeof(char);
+	                    n -= (size_t)sent;
+	                    count = 0;
+	            }
+	            while (count == 0) {
+	                    if (n == 0 && (part++ || !(msg = payload) || !(n = length)))
+	                            break;
+	                    sent = send(bridge->socket_fd, msg, n, MSG_NOSIGNAL);
+	                    if (sent < 0 && errno == EINTR)
+	                            continue;
+	                    if (sent < 0)
+	                            break;
+	                    msg += (size_t)sent / sizeof(char);
+	                    n -= (size_t)sent;
+	            }
+	            rc = count || n ? -1 : 0;
+	           );
+
+	if (rc) {
+		xperror(*argv);
+		/* The stream is broken, let the bridge notice that the other image is gone. */
+		shutdown(bridge->socket_fd, SHUT_RDWR);
+	}
+	return rc;
+}
+
+
+/**
+ * Read a record from the other image of the server
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+read_record(void)
+{
+	client_t *bridge = handover_bridge;
+	int r;
+
+	while ((r = mds_message_read(&(bridge->message), bridge->socket_fd)) == -1 && errno == EINTR)
+		if (terminating && !giving)
+			return -1;
+	if (r == -2)
+		eprint("corrupt message received from the other image of the server.");
+	return r ? -1 : 0;
+}
+
+
+/**
+ * Get the value of a header in a record
+ * 
+ * @param   message  The record
+ * @param   name     The name of the header, including the colon and space
+ * @return           The value of the header, `NULL` if missing
+ */
+static const char *__attribute__((pure, nonnull))
+message_header(const mds_message_t *message, const char *name)
+{
+	size_t i;
+	for (i = 0; i < message->header_count; i++)
+		if (startswith(message->headers[i], name))
+			return message->headers[i] + strlen(name);
+	return NULL;
+}
+
+
+/**
+ * Get the value of a header in the record that is being acted upon
+ * 
+ * @param   name  The name of the header, including the colon and space
+ * @return        The value of the header, `NULL` if missing
+ */
+static const char *__attribute__((pure, nonnull))
+record_header(const char *name)
+{
+	return message_header(record, name);
+}
+
+
+/**
+ * Check the type of a record
+ * 
+ * @param   message  The record
+ * @param   type     The value of the `Handover`-header
+ * @return           Whether the record is of the type
+ */
+static int __attribute__((pure, nonnull))
+message_is(const mds_message_t *message, const char *type)
+{
+	return message->header_count && startswith(message->headers[0], "Handover: ") &&
+	       strequals(message->headers[0] + strlen("Handover: "), type);
+}
+
+
+/**
+ * Check the type of the record that is being acted upon
+ * 
+ * @param   type  The value of the `Handover`-header
+ * @return        Whether the record is of the type
+ */
+static int __attribute__((pure, nonnull))
+record_is(const char *type)
+{
+	return message_is(record, type);
+}
+
+
+/**
+ * Move the record that has just been read from the other
+ * image of the server, with the file descriptors that were
+ * sent with it, to the end of the queue of records that
+ * have not yet been acted upon
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+queue_record(void)
+{
+	mds_message_t *message = &(handover_bridge->message);
+	struct queued_record *queued;
+	const char *value = message_header(message, "File descriptors: ");
+	size_t i, n = value ? atoz(value) : message_is(message, "client") ? message->fd_count : 0;
+
+	/* File descriptors for the next record may have been received
+	   already, only those that were sent with this record are moved,
+	   older images do not say how many they sent with a client. */
+	fail_if (n > message->fd_count);
+	fail_if (xmalloc(queued, 1, struct queued_record));
+	mds_message_zero_initialise(&(queued->message));
+	queued->next = NULL;
+	if (n && xmalloc(queued->message.fds, n, int)) {
+		free(queued);
+		fail_if (1);
+	}
+	for (i = 0; i < n; i++)
+		queued->message.fds[queued->message.fd_count++] = memfd_take(message->fds, &(message->fd_count));
+
+	queued->message.headers      = message->headers,      message->headers      = NULL;
+	queued->message.header_count = message->header_count, message->header_count = 0;
+	queued->message.payload      = message->payload,      message->payload      = NULL;
+	queued->message.payload_size = message->payload_size, message->payload_size = 0;
+	queued->message.payload_ptr  = message->payload_ptr,  message->payload_ptr  = 0;
+	queued->message.payload_fd   = message->payload_fd,   message->payload_fd   = -1;
+
+	with_mutex (queue_mutex,
+	            *queue_end = queued;
+	            queue_end = &(queued->next);
+	            pthread_cond_signal(&queue_cond););
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Take the next record from the queue of records that have
+ * been read from the other image of the server, and wait
+ * for one if there is none
+ * 
+ * @return  The record, `NULL` if no more records will be read
+ */
+static struct queued_record *
+dequeue_record(void)
+{
+	struct queued_record *queued;
+	with_mutex (queue_mutex,
+	            while (!queue && draining)
+	                    pthread_cond_wait(&queue_cond, &queue_mutex);
+	            if ((queued = queue) && !(queue = queued->next))
+	                    queue_end = &queue;
+	           );
+	return queued;
+}
+
+
+/**
+ * Create the client that stands in for the other image of the server
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+create_bridge(void)
+{
+	client_t *bridge = NULL;
+	char condition[] = "";
+	int saved_errno;
+
+	fail_if (xmalloc(bridge, 1, client_t));
+	client_initialise(bridge);
+	fail_if (mds_message_initialise(&(bridge->message)));
+	bridge->socket_fd = handover_fd;
+	bridge->open = 1;
+	bridge->id = 0;
+	fail_if (client_initialise_threading(bridge));
+
+	/* Receive everything, after everyone else, without modifying it. */
+	add_intercept_condition(bridge, condition, INT64_MIN, 0, 0);
+	fail_if (!bridge->interception_conditions_count);
+
+	handover_bridge = bridge;
+	return 0;
+fail:
+	saved_errno = errno;
+	if (bridge)
+		client_destroy(bridge);
+	return errno = saved_errno, -1;
+}
+
+
+/**
+ * Make the bridge receive the messages multicast by the clients
+ * 
+ * Unless the bridge thread is not running, the caller
+ * must hold `migration_lock` for writing
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+list_bridge(void)
+{
+	ssize_t entry;
+	with_mutex (slave_mutex,
+	            entry = linked_list_insert_end(&client_list, (size_t)(void *)handover_bridge);
+	            if (entry != LINKED_LIST_UNUSED)
+	                    handover_bridge->list_entry = entry;
+	           );
+	fail_if (entry == LINKED_LIST_UNUSED);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Stop forwarding messages to the other image of the server
+ * 
+ * The caller must hold `migration_lock` for writing
+ */
+static void
+unlist_bridge(void)
+{
+	if (handover_bridge->list_entry < 0)
+		return;
+	with_mutex (slave_mutex, linked_list_remove(&client_list, handover_bridge->list_entry););
+	handover_bridge->list_entry = -1;
+}
+
+
+/**
+ * Forget the messages forwarded to the other image
+ * of the server that it is known to have received
+ * 
+ * The mutex of `handover_bridge` must be held,
+ * unless the bridge is not listed
+ * 
+ * @param  received  The number of messages the other image has received
+ */
+static void
+forget_forwarded(size_t received)
+{
+	size_t i, n = 0;
+	while (n < forwarded_count && forwarded[n].index < received)
+		free(forwarded[n++].message);
+	forwarded_count -= n;
+	for (i = 0; i < forwarded_count; i++)
+		forwarded[i] = forwarded[i + n];
+	if (!forwarded_count)
+		free(forwarded), forwarded = NULL;
+}
+
+
+/**
+ * Remember a message that has been forwarded to the
+ * other image of the server, so that it can be delivered
+ * to the clients the other image hands over before it
+ * has received the message
+ * 
+ * The mutex of `handover_bridge` must be held
+ * 
+ * @param  message  The message, without the `Handover`-header
+ * @param  length   The length of the message
+ */
+void
+handover_forwarded(const char *message, size_t length)
+{
+	struct forwarded_message *new;
+	size_t index = forwarded_total++;
+
+	if (giving)
+		return;
+	new = forwarded;
+	if (xrealloc(new, forwarded_count + 1, struct forwarded_message))
+		goto fail;
+	forwarded = new;
+	new += forwarded_count;
+	if (xmemdup(new->message, message, length, char))
+		goto fail;
+	new->index = index;
+	new->length = length;
+	forwarded_count++;
+	return;
+fail:
+	xperror(*argv);
+	eprint("a message may not reach a client that is being handed over.");
+}
+
+
+/**
+ * Deliver the messages that have been forwarded to the other
+ * image of the server, after it handed over a client, to that client
+ * 
+ * The caller must hold `migration_lock` for writing
+ * 
+ * @param  clients   The client and its channels
+ * @param  count     The number of elements in `clients`
+ * @param  received  The number of forwarded messages the other image had received
+ */
+static void __attribute__((nonnull))
+replay_forwarded(client_t **clients, size_t count, size_t received)
+{
+	queued_interception_t *interceptions;
+	multicast_t multicast;
+	size_t i, j, n;
+	char *message;
+
+	with_mutex (handover_bridge->mutex, forget_forwarded(received););
+
+	for (i = 0; i < forwarded_count; i++) {
+		if (xmemdup(message, forwarded[i].message, forwarded[i].length, char)) {
+			xperror(*argv);
+			continue;
+		}
+		/* Only the new clients are missing the message, and their slaves are
+		   not running, so they cannot be waited for to modify the message. */
+		interceptions = get_message_interceptors(message, forwarded[i].length, handover_bridge,
+		                                         clients, count, &n);
+		for (j = 0; interceptions && j < n; j++)
+			interceptions[j].modifying = 0;
+		if (!interceptions || !n) {
+			free(interceptions);
+			free(message);
+			continue;
+		}
+
+		multicast_initialise(&multicast);
+		multicast.interceptions = interceptions;
+		multicast.interceptions_count = n;
+		multicast.message = message;
+		multicast.message_length = forwarded[i].length;
+		multicast_message(&multicast);
+		multicast_destroy(&multicast);
+	}
+}
+
+
+/**
+ * Multicast a message forwarded by the other image of the server
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+forward_message(void)
+{
+	client_t *bridge = handover_bridge;
+	mds_message_t *message = record;
+	char *msgbuf;
+	size_t n;
+
+	/* Compose the message without the `Handover`-header. */
+	message->headers++;
+	message->header_count--;
+	n = mds_message_compose_size(message);
+	if (!xbmalloc(msgbuf, n))
+		mds_message_compose(message, msgbuf);
+	message->headers--;
+	message->header_count++;
+	fail_if (!msgbuf);
+
+	queue_message_multicast(msgbuf, n / sizeof(char), bridge);
+	send_multicast_queue(bridge);
+	return 0;
+fail:
+	return -1;
+}
+
+
+/**
+ * Take a client handed over by the other image of the server
+ * 
+ * The caller must hold `migration_lock` for writing
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+take_client(void)
+{
+	mds_message_t *message = record;
+	char *data = message->payload;
+	client_t **clients = NULL;
+	client_t *client;
+	size_t i, n, count = 0, taken = 0;
+	int has_ring, client_fd = -1, fds[3] = {-1, -1, -1};
+	const char *received = record_header("Received: ");
+	pthread_t slave_thread;
+	ssize_t entry;
+	int saved_errno;
+
+	fail_if (message->payload_size < sizeof(size_t) + sizeof(int));
+	buf_get_next(data, size_t, count);
+	buf_get_next(data, int, has_ring);
+
+	/* The socket comes first, then the ring, then file descriptors that were queued. */
+	fail_if ((client_fd = memfd_take(message->fds, &(message->fd_count))) < 0);
+	for (i = 0; has_ring && i < 3; i++)
+		fail_if ((fds[i] = memfd_take(message->fds, &(message->fd_count))) < 0);
+
+	fail_if (!count || xcalloc(clients, count, client_t *));
+	for (taken = 0; taken < count; taken++) {
+		buf_next(data, size_t, 1); /* The address, the channels belong to the first client. */
+		fail_if (xmalloc(clients[taken], 1, client_t));
+		client = clients[taken];
+		if (!(n = client_unmarshal(client, data))) {
+			free(client);
+			fail_if (1);
+		}
+		data += n / sizeof(char);
+		client->socket_fd = client_fd;
+		client->list_entry = -1;
+		client->connection = taken ? *clients : NULL;
+		if (taken)
+			continue;
+		/* The queued file descriptors are numbered as in the other image. */
+		for (i = 0; i < client->message.fd_count; i++) {
+			if ((client->message.fds[i] = memfd_take(message->fds, &(message->fd_count))) < 0) {
+				client->message.fd_count = i;
+				taken = 1;
+				fail_if (1);
+			}
+		}
+	}
+
+	client = *clients;
+	if (has_ring) {
+		fail_if (xmalloc(client->ring, 1, ring_t));
+		if (ring_attach(client->ring, fds[0], fds[1], fds[2])) {
+			free(client->ring), client->ring = NULL;
+			fds[0] = fds[1] = fds[2] = -1; /* Closed by `ring_attach`. */
+			fail_if (1);
+		}
+		fds[0] = fds[1] = fds[2] = -1;
+		client->message.ring = client->ring;
+	}
+	if (count > 1) {
+		fail_if (xmalloc(client->channels, count - 1, client_t *));
+		memcpy(client->channels, clients + 1, (count - 1) * sizeof(client_t *));
+		client->channels_count = count - 1;
+	}
+
+	/* Other slaves lock the clients as soon as they are listed. */
+	for (i = 0; i < count; i++)
+		fail_if (client_initialise_threading(clients[i]));
+
+	/* List the client and its channels and start its slave. */
+	pthread_mutex_lock(&slave_mutex);
+	for (i = 0; i < count; i++) {
+		entry = linked_list_insert_end(&client_list, (size_t)(void *)(clients[i]));
+		if (entry == LINKED_LIST_UNUSED)
+			break;
+		clients[i]->list_entry = entry;
+	}
+	if (i < count || (!fd_table_put(&client_map, client_fd, (size_t)(void *)client) && errno)) {
+		saved_errno = errno;
+		while (i--)
+			linked_list_remove(&client_list, clients[i]->list_entry);
+		pthread_mutex_unlock(&slave_mutex);
+		fail_if (errno = saved_errno, 1);
+	}
+	running_slaves++;
+	pthread_mutex_unlock(&slave_mutex);
+	replay_forwarded(clients, count, received ? atoz(received) : 0);
+	free(clients);
+	create_slave(&slave_thread, client_fd);
+	return 0;
+
+fail:
+	xperror(*argv);
+	eprint("a client could not be taken over from the other image of the server.");
+	for (i = 1; i < taken; i++)
+		client_destroy(clients[i]);
+	if (taken) {
+		(*clients)->channels_count = 0;
+		client_destroy(*clients);
+	}
+	if (client_fd >= 0)
+		close(client_fd);
+	for (i = 0; i < 3; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	free(clients);
+	return -1;
+}
+
+
+/**
+ * Act upon a record from the other image of the server
+ * 
+ * @return  Zero normally, 1 if the bridge shall
+ *          stop reading from the other image
+ */
+static int
+handle_record(void)
+{
+	char header[64];
+	const char *value;
+	uint64_t id;
+
+	if (record_is("message")) {
+		pthread_rwlock_rdlock(&migration_lock);
+		forward_message();
+		received_total++;
+		pthread_rwlock_unlock(&migration_lock);
+
+	} else if (record_is("client")) {
+		/* No message may be multicast between the client being
+		   listed and the forwarded messages it missed being sent. */
+		pthread_rwlock_wrlock(&migration_lock);
+		take_client();
+		pthread_rwlock_unlock(&migration_lock);
+
+	} else if (record_is("ready")) {
+		/* The re-exec:ed image wants the clients back. */
+		handover_requested = 1;
+		pthread_kill(master_thread, SIGRTMIN);
+
+	} else if (record_is("done")) {
+		pthread_rwlock_wrlock(&migration_lock);
+		unlist_bridge();
+		forget_forwarded(SIZE_MAX);
+		if ((value = record_header("Next client ID: ")) && (id = atou64(value)) > next_client_id)
+			with_mutex (slave_mutex, next_client_id = id;);
+		send_record("Handover: acknowledged\n\n", NULL, 0, NULL, 0);
+		pthread_rwlock_unlock(&migration_lock);
+		/* The temporary image will want the clients back once the
+		   old image has re-exec:ed, the re-exec:ed image is done. */
+		if (handover_pid > 0)
+			finished = 1;
+
+	} else if (record_is("acknowledged")) {
+		finished = 1;
+		return 1;
+
+	} else {
+		xsnprintf(header, "%s", record->header_count ? record->headers[0] : "");
+		eprintf("received unrecognised record from the other image of the server: %s", header);
+	}
+
+	return 0;
+}
+
+
+/**
+ * Master function for the thread that reads the
+ * records from the other image of the server
+ * 
+ * @param   data  Input data, unused
+ * @return        Output data, unused
+ */
+static void *
+drain_loop(void *data)
+{
+	int last = 0;
+
+	/* Nothing is read after the acknowledgement, the old
+	   image passes the rest to its re-exec:ed self. */
+	while (!last && !read_record()) {
+		last = message_is(&(handover_bridge->message), "acknowledged");
+		if (queue_record()) {
+			xperror(*argv);
+			break;
+		}
+	}
+
+	with_mutex (queue_mutex,
+	            draining = 0;
+	            pthread_cond_broadcast(&queue_cond););
+	return NULL;
+	(void) data;
+}
+
+
+/**
+ * Master function for the thread that acts upon
+ * the records from the other image of the server
+ * 
+ * @param   data  Input data, unused
+ * @return        Output data, unused
+ */
+static void *
+bridge_loop(void *data)
+{
+	client_t *bridge = handover_bridge;
+	struct queued_record *queued;
+	int status, stop = 0;
+
+	/* The reading thread is the bridge's thread, so that it is interrupted when terminating. */
+	with_mutex (queue_mutex, draining = 1;);
+	if ((errno = pthread_create(&(bridge->thread), NULL, drain_loop, NULL))) {
+		xperror(*argv);
+		with_mutex (queue_mutex, draining = 0;);
+	} else {
+		pthread_detach(bridge->thread);
+	}
+
+	while (!stop && (queued = dequeue_record())) {
+		record = &(queued->message);
+		stop = handle_record();
+		mds_message_destroy(record);
+		free(queued);
+	}
+	record = NULL;
+
+	/* The reading thread stops by itself after the acknowledgement. */
+	with_mutex (queue_mutex,
+	            while (draining)
+	                    pthread_cond_wait(&queue_cond, &queue_mutex);
+	            while ((queued = queue)) {
+	                    queue = queued->next;
+	                    mds_message_destroy(&(queued->message));
+	                    free(queued);
+	            }
+	            queue_end = &queue;
+	           );
+
+	if (!finished && !terminating) {
+		eprint("the other image of the server is gone during a staged re-exec.");
+		if (handover_pid < 0) {
+			/* The temporary image cannot continue on its own. */
+			terminating = 1;
+			signal_all(SIGRTMIN);
+		}
+	}
+
+	/* Stop forwarding messages to the other image, the
+	   old image passes the socket to its re-exec:ed self. */
+	pthread_rwlock_wrlock(&migration_lock);
+	unlist_bridge();
+	forget_forwarded(SIZE_MAX);
+	if (!(finished && giving && handover_pid > 0)) {
+		handover_bridge = NULL;
+		handover_fd = -1;
+	}
+	pthread_rwlock_unlock(&migration_lock);
+	if (!handover_bridge) {
+		close(bridge->socket_fd);
+		if (handover_pid > 0)
+			while (waitpid(handover_pid, &status, 0) < 0 && errno == EINTR);
+		handover_pid = -1;
+		client_destroy(bridge);
+	}
+
+	with_mutex (slave_mutex,
+	            bridge_running = 0;
+	            pthread_cond_broadcast(&slave_cond););
+	return NULL;
+	(void) data;
+}
+
+
+/**
+ * Start the threads that read from, and act upon
+ * the records from, the other image of the server
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+start_bridge(void)
+{
+	pthread_t thread;
+	with_mutex (slave_mutex, bridge_running = 1;);
+	fail_if ((errno = pthread_create(&thread, NULL, bridge_loop, NULL)));
+	fail_if ((errno = pthread_detach(thread)));
+	return 0;
+fail:
+	with_mutex (slave_mutex, bridge_running = 0;);
+	return -1;
+}
+
+
+/**
+ * Start the temporary image of the server, and wait
+ * until it is ready to take the clients
+ * 
+ * @return  Zero on success, -1 on error
+ */
+static int
+spawn_temporary_image(void)
+{
+	char socket_arg[sizeof("--socket-fd=") + 3 * sizeof(int)];
+	char handover_arg[sizeof("--handover-fd=") + 3 * sizeof(int)];
+	char respawn_arg[] = "--respawn";
+	char *args[] = {argv[0], respawn_arg, socket_arg, handover_arg, NULL};
+	int fds[2] = {-1, -1};
+	int saved_errno;
+	pid_t pid;
+
+	/* Neither end is close-on-exec, the temporary image closes the end that is
+	   not its own, and the old image passes its end to its re-exec:ed self. */
+	fail_if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	xsnprintf(socket_arg, "--socket-fd=%i", socket_fd);
+	xsnprintf(handover_arg, "--handover-fd=%i", fds[1]);
+
+	fail_if ((pid = fork()) < 0);
+	if (!pid) {
+		exec_server(args);
+		_exit(1);
+	}
+	close(fds[1]), fds[1] = -1;
+	handover_fd = fds[0];
+	handover_pid = pid;
+
+	fail_if (create_bridge());
+	record = &(handover_bridge->message);
+	fail_if (read_record());
+	if (!record_is("ready")) {
+		eprint("the temporary image of the server did not start properly.");
+		fail_if ((errno = 0, 1));
+	}
+	return 0;
+
+fail:
+	saved_errno = errno;
+	if (handover_bridge)
+		client_destroy(handover_bridge), handover_bridge = NULL;
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	if (handover_pid > 0) {
+		kill(handover_pid, SIGTERM);
+		while (waitpid(handover_pid, NULL, 0) < 0 && errno == EINTR);
+	}
+	handover_fd = -1;
+	handover_pid = -1;
+	return errno = saved_errno, -1;
+}
+
+
+/**
+ * Connect to the image of the server that is handing
+ * over its clients, `handover_fd` must be set
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int
+handover_take(void)
+{
+	const char *value;
+	uint64_t id;
+
+	finished = 0;
+	forwarded_total = 0;
+	fail_if (create_bridge());
+	record = &(handover_bridge->message);
+	fail_if (send_record("Handover: ready\n\n", NULL, 0, NULL, 0));
+	fail_if (read_record());
+	if (!record_is("start")) {
+		eprint("the other image of the server did not start the handover properly.");
+		fail_if ((errno = 0, 1));
+	}
+
+	/* The interception conditions are handed over with their hashes,
+	   the seed uses all 64 bits, so `atou64` would saturate it. */
+	if ((value = record_header("Hash seed: ")))
+		string_hash_seed = (uint64_t)strtoull(value, NULL, 10);
+	value = record_header("Hash function: ");
+	string_hash_bytewise = value && strequals(value, "bytewise");
+
+	/* The temporary image assigns IDs from a range of its own,
+	   the other image will take the greatest ID when it is done. */
+	id = (value = record_header("Next client ID: ")) ? atou64(value) : 1;
+	if (handover_pid < 0)
+		next_client_id = id + ((uint64_t)1 << 32);
+
+	fail_if (list_bridge());
+	fail_if (start_bridge());
+	return 0;
+
+fail:
+	xperror(*argv);
+	if (handover_bridge) {
+		unlist_bridge();
+		close(handover_bridge->socket_fd);
+		client_destroy(handover_bridge);
+		handover_bridge = NULL;
+	}
+	handover_fd = -1;
+	if (handover_pid > 0)
+		while (waitpid(handover_pid, NULL, 0) < 0 && errno == EINTR);
+	handover_pid = -1;
+	return -1;
+}
+
+
+/**
+ * Hand over all clients to the other image of the server,
+ * start the other image first if there is none, this is
+ * done by the master thread, which shall thereafter
+ * re-exec the server, or exit if this is the temporary
+ * image of the server
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int
+handover_give(void)
+{
+	char header[sizeof("Handover: start\nNext client ID: \nHash seed: \nHash function: bytewise\n\n")
+	            + 2 * 3 * sizeof(uint64_t)];
+	struct timespec deadline, timeout;
+	ssize_t node;
+	client_t *client;
+	size_t marked;
+	int r, temporary = handover_pid < 0 && handover_fd >= 0;
+
+	bench_event(*argv, "handover", (size_t)temporary);
+	giving = 1;
+	finished = 0;
+	received_total = 0;
+	if (handover_fd < 0) {
+		eprint("starting a new image of the server to hand over the clients to.");
+		fail_if (spawn_temporary_image());
+	}
+
+	/* Tell the other image to start taking clients. */
+	xsnprintf(header, "Handover: start\nNext client ID: %" PRIu64 "\nHash seed: %" PRIu64 "\n%s\n",
+	          next_client_id, string_hash_seed, string_hash_bytewise ? "Hash function: bytewise\n" : "");
+	pthread_rwlock_wrlock(&migration_lock);
+	r = send_record(header, NULL, 0, NULL, 0);
+	if (!r)
+		r = list_bridge();
+	pthread_rwlock_unlock(&migration_lock);
+	fail_if (r);
+	if (!temporary)
+		fail_if (start_bridge());
+
+	/* Let the slaves hand over their clients, a batch at a time. */
+	deadline_after(&deadline, HANDOVER_TIMEOUT);
+	pthread_mutex_lock(&slave_mutex);
+	while (running_slaves > 0 && bridge_running) {
+		marked = 0;
+		foreach_linked_list_node (client_list, node) {
+			client = (void *)(client_list.values[node]);
+			/* A client that a message is being relayed to cannot be handed over
+			   before the relay ends, so it shall not take the place of its sender. */
+			if (client == handover_bridge || client->connection || !client->mutex_created || client->relaying)
+				continue;
+			if (!client->migrating) {
+				if (marked >= HANDOVER_BATCH)
+					continue;
+				client->migrating = 1;
+			}
+			marked++;
+			/* Interrupt the slave, if it is waiting for a message. */
+			pthread_kill(client->thread, SIGRTMIN);
+		}
+		deadline_after(&timeout, HANDOVER_POLL_INTERVAL);
+		pthread_cond_timedwait(&slave_cond, &slave_mutex, &timeout);
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		if (!temporary && (timeout.tv_sec > deadline.tv_sec ||
+		                   (timeout.tv_sec == deadline.tv_sec && timeout.tv_nsec >= deadline.tv_nsec))) {
+			eprint("not all clients could be handed over in time, they will be re-exec:ed.");
+			break;
+		}
+	}
+	foreach_linked_list_node (client_list, node)
+		((client_t *)(void *)(client_list.values[node]))->migrating = 0;
+	pthread_mutex_unlock(&slave_mutex);
+
+	/* Tell the other image that everything has been handed over,
+	   and wait for it to stop forwarding messages to this image. */
+	if (handover_bridge) {
+		xsnprintf(header, "Handover: done\nNext client ID: %" PRIu64 "\n\n", next_client_id);
+		pthread_rwlock_wrlock(&migration_lock);
+		unlist_bridge();
+		send_record(header, NULL, 0, NULL, 0);
+		pthread_rwlock_unlock(&migration_lock);
+	}
+	with_mutex (slave_mutex,
+	            while (bridge_running)
+	                    pthread_cond_wait(&slave_cond, &slave_mutex););
+
+	giving = 0;
+	bench_event(*argv, "handed-over", (size_t)finished);
+	return finished ? 0 : -1;
+
+fail:
+	xperror(*argv);
+	giving = 0;
+	return -1;
+}
+
+
+/**
+ * Marshal a client for the other image of the server, without
+ * its ring, whose file descriptors are sent with it, and without
+ * its modification reply, that is only used while a slave
+ * waits for it, which no slave does during a handover
+ * 
+ * @param   client  The client
+ * @param   data    Output buffer for the marshalled data,
+ *                  `NULL` to only calculate its size
+ * @return          The size of the marshalled data
+ */
+static size_t __attribute__((nonnull(1)))
+marshal_client(client_t *client, char *data)
+{
+	struct ring *ring = client->ring;
+	struct mds_message *modify_message = client->modify_message;
+	size_t n;
+
+	client->ring = NULL;
+	client->modify_message = NULL;
+	n = data ? client_marshal(client, data) : client_marshal_size(client);
+	client->ring = ring;
+	client->modify_message = modify_message;
+	return n;
+}
+
+
+/**
+ * Hand over a client to the other image of the server,
+ * this is done by the client's slave between messages
+ * 
+ * @param   client  The client, it is destroyed if it is handed over
+ * @return          Zero if the client was handed over, 1 if it could
+ *                  not be handed over now
+ */
+int
+handover_client(client_t *client)
+{
+	char header[sizeof("Handover: client\nReceived: \nFile descriptors: \nLength: \n\n") + 3 * 3 * sizeof(size_t)];
+	int fds[MEMFD_RECV_FDS_MAX];
+	struct timespec deadline;
+	client_t *channel;
+	char *payload = NULL, *data;
+	size_t i, n, nfds = 0;
+
+	/* File descriptors that are being used, or that do not fit, must be claimed first. */
+	if (client->message.payload_fd >= 0 ||
+	    (client->ring ? 4 : 1) + client->message.fd_count > MEMFD_RECV_FDS_MAX)
+		return 1;
+
+	/* Wait for all other slaves to finish their messages, but
+	   do not keep them waiting if one of them waits for us. */
+	deadline_after(&deadline, HANDOVER_LOCK_TIMEOUT);
+	if (pthread_rwlock_timedwrlock(&migration_lock, &deadline))
+		return 1;
+
+	/* Do not start if the other image is gone, or if a multicast
+	   was interrupted, it would refer to clients in this image, or
+	   if a message is being relayed to the client. */
+	if (!handover_bridge || handover_bridge->list_entry < 0 || client->multicasts_count || client->relaying)
+		goto not_now;
+	for (i = 0; i < client->channels_count; i++)
+		if (client->channels[i]->multicasts_count)
+			goto not_now;
+
+	/* Marshal the client, followed by its channels. */
+	n = sizeof(size_t) + sizeof(int) + sizeof(size_t) + marshal_client(client, NULL);
+	for (i = 0; i < client->channels_count; i++)
+		n += sizeof(size_t) + marshal_client(client->channels[i], NULL);
+	if (xmalloc(payload, n, char)) {
+		xperror(*argv);
+		goto not_now;
+	}
+	data = payload;
+	buf_set_next(data, size_t, client->channels_count + 1);
+	buf_set_next(data, int, !!client->ring);
+	buf_set_next(data, size_t, (size_t)(void *)client);
+	data += marshal_client(client, data) / sizeof(char);
+	for (i = 0; i < client->channels_count; i++) {
+		buf_set_next(data, size_t, (size_t)(void *)(client->channels[i]));
+		data += marshal_client(client->channels[i], data) / sizeof(char);
+	}
+
+	/* Send it with its socket, ring, and queued file descriptors. */
+	fds[nfds++] = client->socket_fd;
+	if (client->ring) {
+		fds[nfds++] = client->ring->memfd;
+		fds[nfds++] = client->ring->bell;
+		fds[nfds++] = client->ring->peer_bell;
+	}
+	for (i = 0; i < client->message.fd_count; i++)
+		fds[nfds++] = client->message.fds[i];
+	xsnprintf(header, "Handover: client\nReceived: %zu\nFile descriptors: %zu\nLength: %zu\n\n",
+	          received_total, nfds, n);
+	if (send_record(header, payload, n, fds, nfds))
+		goto not_now;
+	free(payload);
+
+	/* The client now belongs to the other image. */
+	with_mutex (slave_mutex,
+	            for (i = 0; i < client->channels_count; i++)
+	                    linked_list_remove(&client_list, client->channels[i]->list_entry);
+	            linked_list_remove(&client_list, client->list_entry);
+	            fd_table_remove(&client_map, client->socket_fd););
+	pthread_rwlock_unlock(&migration_lock);
+
+	/* Release this image's copies of its file descriptors and its memory. */
+	close(client->socket_fd);
+	for (i = 0; i < client->channels_count; i++) {
+		channel = client->channels[i];
+		client_destroy(channel);
+	}
+	client_destroy(client);
+	return 0;
+
+not_now:
+	pthread_rwlock_unlock(&migration_lock);
+	free(payload);
+	return 1;
+}
@@ -0,0 +1,123 @@
+/**
+ * mds — A micro-display server
+ * Copyright © 2014, 2015, 2016, 2017  Mattias Andrée (maandree@kth.se)
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MDS_MDS_SERVER_HANDOVER_H
+#define MDS_MDS_SERVER_HANDOVER_H
+
+
+#include "client.h"
+
+#include <signal.h>
+
+
+
+/**
+ * The number of clients that are handed over concurrently
+ * during a staged re-exec
+ */
+#ifndef HANDOVER_BATCH
+# define HANDOVER_BATCH  16
+#endif
+
+/**
+ * The number of milliseconds a slave waits for the other slaves
+ * to finish their messages before it gives up handing over
+ * its client, and tries again after its next message
+ */
+#ifndef HANDOVER_LOCK_TIMEOUT
+# define HANDOVER_LOCK_TIMEOUT  10
+#endif
+
+/**
+ * The number of milliseconds between the reminders sent to
+ * slaves that have not yet handed over their clients
+ */
+#ifndef HANDOVER_POLL_INTERVAL
+# define HANDOVER_POLL_INTERVAL  5
+#endif
+
+/**
+ * The number of milliseconds the old image of the server
+ * waits for its clients to be handed over before the
+ * remaining clients are re-exec:ed with the server
+ */
+#ifndef HANDOVER_TIMEOUT
+# define HANDOVER_TIMEOUT  5000
+#endif
+
+/**
+ * The header that prefixes messages forwarded to
+ * the other image of the server during a staged re-exec
+ */
+#define HANDOVER_MESSAGE_HEADER  "Handover: message\n"
+
+
+
+/**
+ * Whether the master thread shall hand over all
+ * clients to the other image of the server
+ */
+extern volatile sig_atomic_t handover_requested;
+
+
+
+/**
+ * Connect to the image of the server that is handing
+ * over its clients, `handover_fd` must be set
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int handover_take(void);
+
+/**
+ * Hand over all clients to the other image of the server,
+ * start the other image first if there is none, this is
+ * done by the master thread, which shall thereafter
+ * re-exec the server, or exit if this is the temporary
+ * image of the server
+ * 
+ * @return  Zero on success, -1 on error
+ */
+int handover_give(void);
+
+/**
+ * Remember a message that has been forwarded to the
+ * other image of the server, so that it can be delivered
+ * to the clients the other image hands over before it
+ * has received the message
+ * 
+ * The mutex of `handover_bridge` must be held
+ * 
+ * @param  message  The message, without the `Handover`-header
+ * @param  length   The length of the message
+ */
+__attribute__((nonnull))
+void handover_forwarded(const char *message, size_t length);
+
+/**
+ * Hand over a client to the other image of the server,
+ * this is done by the client's slave between messages
+ * 
+ * @param   client  The client, it is destroyed if it is handed over
+ * @return          Zero if the client was handed over, 1 if it could
+ *                  not be handed over now
+ */
+__attribute__((nonnull))
+int handover_client(client_t *client);
+
+
+#endif
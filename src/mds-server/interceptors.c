@@ -209,11 +209,11 @@ int
 find_matching_condition(client_t *client, size_t *hashes, char **keys, char **headers,
                         size_t count, queued_interception_t *interception_out)
 {
-	pthread_mutex_t mutex = client->mutex;
-	interception_condition_t *conds = client->interception_conditions;
+	interception_condition_t *conds;
 	size_t n = 0, i;
 
-	fail_if ((errno = pthread_mutex_lock(&(mutex))));
+	fail_if ((errno = pthread_mutex_lock(&(client->mutex))));
+	conds = client->interception_conditions;
 
 	/* Look for a matching condition. */
 	if (client->open)
@@ -228,7 +228,7 @@ find_matching_condition(client_t *client, size_t *hashes, char **keys, char **he
 		}
 	}
 
-	pthread_mutex_unlock(&mutex);
+	pthread_mutex_unlock(&(client->mutex));
 
 	return i < n;
 fail:
@@ -236,10 +236,46 @@ fail:
 }
 
 
+/**
+ * List a client as an interceptor if it has at least
+ * one condition matching any of a set of acceptable patterns
+ * 
+ * @param   client                   The client
+ * @param   sender                   The original sender of the message
+ * @param   hashes                   The hashes of the accepted header names
+ * @param   keys                     The header names
+ * @param   headers                  The header name–value pairs
+ * @param   count                    The number of accepted patterns
+ * @param   interceptions            The list of found interceptors
+ * @param   interceptions_count_ptr  The number of found interceptors, will be updated
+ * @return                           Zero on success, -1 on error
+ */
+static int __attribute__((nonnull(1, 2, 7, 8)))
+list_if_intercepting(client_t *client, client_t *sender, size_t *hashes, char **keys, char **headers,
+                     size_t count, queued_interception_t *interceptions, size_t *interceptions_count_ptr)
+{
+	int r;
+	/* A client whose slave has not yet created its mutex is still being set up. */
+	if (client->open && client->mutex_created && (client != sender)) {
+		r = find_matching_condition(client, hashes, keys, headers, count,
+		                            interceptions + *interceptions_count_ptr);
+		fail_if (r == -1);
+		if (r)
+			/* List client of there was a matching condition. */
+			*interceptions_count_ptr += 1;
+	}
+	return 0;
+fail:
+	return -1;
+}
+
+
 /**
  * Get all interceptors who have at least one condition matching any of a set of acceptable patterns
  * 
  * @param   sender                   The original sender of the message
+ * @param   among                    The clients to search, `NULL` to search all clients
+ * @param   among_n                  The number of elements in `among`
  * @param   hashes                   The hashes of the accepted header names
  * @param   keys                     The header names
  * @param   headers                  The header name–value pairs
@@ -248,35 +284,31 @@ fail:
  * @return                           The found interceptors, `NULL` on error
  */
 queued_interception_t *
-get_interceptors(client_t *sender, size_t *hashes, char **keys, char **headers,
-                 size_t count, size_t *interceptions_count_out)
+get_interceptors(client_t *sender, client_t **among, size_t among_n, size_t *hashes,
+                 char **keys, char **headers, size_t count, size_t *interceptions_count_out)
 {
 	queued_interception_t *interceptions = NULL;
-	size_t interceptions_count = 0, n = 0;
+	size_t interceptions_count = 0, n = among_n, i;
 	ssize_t node;
-	int saved_errno, r;
-	client_t *client;
+	int saved_errno;
 
 	/* Count clients. */
-	foreach_linked_list_node (client_list, node)
-		n++;
+	if (!among)
+		foreach_linked_list_node (client_list, node)
+			n++;
 
 	/* Allocate interceptor list. */
 	fail_if (xmalloc(interceptions, n, queued_interception_t));
 
 	/* Search clients. */
-	foreach_linked_list_node (client_list, node) {
-		client = (void *)(client_list.values[node]);
-
-		/* Look for and list a matching condition. */
-		if (client->open && (client != sender)) {
-			r = find_matching_condition(client, hashes, keys, headers, count,
-			                            interceptions + interceptions_count);
-			fail_if (r == -1);
-			if (r)
-				/* List client of there was a matching condition. */
-				interceptions_count++;
-		}
+	if (among) {
+		for (i = 0; i < among_n; i++)
+			fail_if (list_if_intercepting(among[i], sender, hashes, keys, headers, count,
+			                              interceptions, &interceptions_count));
+	} else {
+		foreach_linked_list_node (client_list, node)
+			fail_if (list_if_intercepting((void *)(client_list.values[node]), sender, hashes, keys,
+			                              headers, count, interceptions, &interceptions_count));
 	}
 
 	*interceptions_count_out = interceptions_count;
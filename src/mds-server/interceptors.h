@@ -75,6 +75,8 @@ int find_matching_condition(client_t *client, size_t *hashes, char **keys, char
  * Get all interceptors who have at least one condition matching any of a set of acceptable patterns
  * 
  * @param   sender                   The original sender of the message
+ * @param   among                    The clients to search, `NULL` to search all clients
+ * @param   among_n                  The number of elements in `among`
  * @param   hashes                   The hashes of the accepted header names
  * @param   keys                     The header names
  * @param   headers                  The header name–value pairs
@@ -82,8 +84,9 @@ int find_matching_condition(client_t *client, size_t *hashes, char **keys, char
  * @param   interceptions_count_out  Slot at where to store the number of found interceptors
  * @return                           The found interceptors, `NULL` on error
  */
-__attribute__((pure, nonnull(1, 6)))
-queued_interception_t *get_interceptors(client_t *sender, size_t *hashes, char **keys, char **headers,
-                                        size_t count, size_t *interceptions_count_out);
+__attribute__((pure, nonnull(1, 8)))
+queued_interception_t *get_interceptors(client_t *sender, client_t **among, size_t among_n, size_t *hashes,
+                                        char **keys, char **headers, size_t count,
+                                        size_t *interceptions_count_out);
 
 #endif
@@ -26,6 +26,8 @@
 #include "sending.h"
 #include "slavery.h"
 #include "receiving.h"
+#include "channels.h"
+#include "handover.h"
 
 #include <libmdsserver/config.h>
 #include <libmdsserver/linked-list.h>
@@ -75,6 +77,42 @@ server_characteristics_t server_characteristics = {
 	if (CONDITION) { xperror(*argv); __free(I); return 1; }
 
 
+/**
+ * Calculate the number of bytes that `trim_client_list` would free
+ * 
+ * @param   data  Not used
+ * @return        The number of bytes that would be freed
+ */
+static size_t
+client_list_reclaimable(void *data)
+{
+	return linked_list_reclaimable(&client_list);
+	(void) data;
+}
+
+
+/**
+ * Pack the list of clients, and update the
+ * clients' list entries, which packing renumbers
+ * 
+ * @param   data  Not used
+ * @return        Zero on success, -1 on error
+ */
+static int
+trim_client_list(void *data)
+{
+	ssize_t node;
+	int r;
+	with_mutex (slave_mutex,
+	            if (!(r = linked_list_pack(&client_list)))
+	                    foreach_linked_list_node (client_list, node)
+	                            ((client_t *)(void *)(client_list.values[node]))->list_entry = node;
+	           );
+	return r;
+	(void) data;
+}
+
+
 /**
  * This function will be invoked before `initialise_server` (if not re-exec:ing)
  * or before `unmarshal_server` (if re-exec:ing)
@@ -103,8 +141,19 @@ preinitialise_server(void)
 			         eprintf("duplicate declaration of %s.", "--socket-fd"););
 			exit_if (strict_atoi(arg += strlen("--socket-fd="), &socket_fd, 0, INT_MAX) < 0,
 			         eprintf("invalid value for %s: %s.", "--socket-fd", arg););
+		} else if (startswith(arg, "--handover-fd=")) { /* Started to take the clients during a re-exec. */
+			exit_if (handover_fd != -1,
+			         eprintf("duplicate declaration of %s.", "--handover-fd"););
+			exit_if (strict_atoi(arg += strlen("--handover-fd="), &handover_fd, 0, INT_MAX) < 0,
+			         eprintf("invalid value for %s: %s.", "--handover-fd", arg););
 		} else if (startswith(arg, "--alarm=")) { /* Schedule an alarm signal for forced abort. */
 			alarm((unsigned)min(atou(arg + strlen("--alarm=")), 60)); /* At most 1 minute. */
+		} else if (startswith(arg, "--input-cpus=")) { /* CPUs for the slaves of real-time clients. */
+			exit_if (parse_cpu_list(arg += strlen("--input-cpus="), &input_cpus) < 0,
+			         eprintf("invalid value for %s: %s.", "--input-cpus", arg););
+			restrict_input_cpus = 1;
+		} else if (parse_scheduling_arg(arg)) { /* CPU affinity, scheduling policy or memory locking. */
+			/* Applied before this function, and not inherited by mdsinitrc. */
 		} else if (!strequals(arg, "--initial-spawn") && !strequals(arg, "--respawn")) {
 				/* Not recognised, it is probably for another server. */
 				unparsed_args[unparsed_args_ptr++] = arg;
@@ -116,8 +165,13 @@ preinitialise_server(void)
 	exit_if (socket_fd < 0, eprint("missing socket file descriptor argument."););
 
 
+	/* The temporary image of the server, during a staged re-exec, inherits
+	   all files of the old image, but it only needs the sockets. */
+	if (handover_fd >= 0)
+		close_files(fd > 2 && fd != socket_fd && fd != handover_fd);
+
 	/* Run mdsinitrc. */
-	if (!is_respawn) {
+	if (!is_respawn && handover_fd < 0) {
 		pid = fork();
 		fail_if (pid == (pid_t)-1);
 
@@ -126,6 +180,9 @@ preinitialise_server(void)
 			close_files(fd > 2 || fd == socket_fd);
 
 			/* Run mdsinitrc. */
+			bench_event(*argv, "initrc", 0);
+			if (server_reset_scheduling() < 0)
+				xperror(*argv);
 			run_initrc(unparsed_args); /* Does not return. */
 		}
 	}
@@ -140,6 +197,9 @@ preinitialise_server(void)
 	error_if (3, (errno = pthread_cond_init(&modify_cond, NULL)));
 	error_if (4, hash_table_create(&modify_map));
 
+	/* Let the client list be packed when the server frees unneeded memory. */
+	fail_if (server_add_trimmable("client list", client_list_reclaimable, trim_client_list, NULL));
+
 
 	return 0;
 
@@ -172,10 +232,15 @@ initialise_server(void)
  * 
  * @return  Non-zero on error
  */
-int __attribute__((const))
+int
 postinitialise_server(void)
 {
-	/* We do not need to initialise anything else. */
+	/* Take the clients from the other image of the server, if we are
+	   the temporary image or if we have been re-exec:ed during a staged
+	   re-exec. The temporary image has nothing to do if this fails. */
+	if (handover_fd >= 0 && handover_take() && handover_pid < 0)
+		return 1;
+
 	return 0;
 }
 
@@ -192,7 +257,24 @@ master_loop(void)
 	while (running && !terminating) {
 		if (danger) {
 			danger = 0;
-			with_mutex (slave_mutex, linked_list_pack(&client_list););
+			server_trim();
+		}
+
+		if (handover_requested) {
+			/* Hand over the clients to the other image of the server, and
+			   re-exec, or exit if this is the temporary image. Clients that
+			   could not be handed over are re-exec:ed as usual. */
+			handover_requested = 0;
+			if (handover_fd >= 0 && handover_pid < 0) {
+				handover_give();
+				terminating = 1;
+			} else {
+				if (handover_give())
+					eprint("staged re-exec failed, re-exec:ing all clients at once.");
+				reexecing = terminating = 1;
+				signal_all(SIGRTMIN);
+			}
+			break;
 		}
 
 		if (accept_connection() == 1)
@@ -263,7 +345,7 @@ slave_loop(void *data)
 	client_t *information = (void *)information_address;
 	char *msgbuf = NULL;
 	char buf[] = "To: all";
-	size_t n;
+	size_t i, n;
 	int r;
 
 
@@ -275,14 +357,30 @@ slave_loop(void *data)
 		add_intercept_condition(information, buf, 0, 0, 0);
 	}
 
-	/* Store slave thread and create mutexes and conditions. */
+	/* Store slave thread and create mutexes and conditions,
+	   also for the client's channels if we re-exec:ed. */
 	fail_if (client_initialise_threading(information));
+	for (i = 0; i < information->channels_count; i++)
+		fail_if (client_initialise_threading(information->channels[i]));
+
+	/* Relay large messages while they are being received,
+	   and pass on payloads in memfds without reading them. */
+	information->message.stream_threshold = STREAM_THRESHOLD;
+	information->message.keep_payload_fd = 1;
 
 	/* Set up traps for especially handled signals. */
 	fail_if (trap_signals() < 0);
 
+	/* Serve real-time clients, such as input servers, with their priority. */
+	if (follow_client_scheduling(information) < 0)
+		xperror(*argv);
+
 
-	/* Fetch messages from the slave. */
+	/* Fetch messages from the slave. The migration lock is held, except
+	   while waiting for messages, so that no other client is handed over
+	   to the other image of the server, during a staged re-exec, while
+	   a message is sent to it. */
+	pthread_rwlock_rdlock(&migration_lock);
 	while (!terminating && information->open) {
 		/* Send queued multicast messages. */
 		send_multicast_queue(information);
@@ -290,21 +388,48 @@ slave_loop(void *data)
 		/* Send queued messages. */
 		send_reply_queue(information);
 
+		/* Send queued messages for the client's channels. */
+		send_channel_queues(information);
+
+		/* Hand over the client to the other image of the server. */
+		if (information->migrating) {
+			pthread_rwlock_unlock(&migration_lock);
+			if (!handover_client(information))
+				goto migrated;
+			pthread_rwlock_rdlock(&migration_lock);
+		}
+
 		/* Fetch message. */
+		pthread_rwlock_unlock(&migration_lock);
 		r = fetch_message(information);
-		if (!r && message_received(information))
+		pthread_rwlock_rdlock(&migration_lock);
+		if (r == 1 && !message_headers_received(information))
+			continue;
+		else if (r == 1) { /* The message cannot be relayed, buffer its payload. */
+			pthread_rwlock_unlock(&migration_lock);
+			r = fetch_message(information);
+			pthread_rwlock_rdlock(&migration_lock);
+		}
+		if (!r && information->message.payload_fd >= 0 && !memfd_message_received(information))
+			continue;
+		if (!r && message_received(information)) {
+			pthread_rwlock_unlock(&migration_lock);
 			goto terminate;
-		else if (r == -2)
+		} else if (r == -2) {
+			pthread_rwlock_unlock(&migration_lock);
 			goto done;
-		else if (r && errno == EINTR && terminating)
+		} else if (r && errno == EINTR && terminating) {
+			pthread_rwlock_unlock(&migration_lock);
 			goto terminate; /* Stop the thread if we are re-exec:ing or terminating the server. */
+		}
 	}
+	pthread_rwlock_unlock(&migration_lock);
 	/* Stop the thread if we are re-exec:ing or terminating the server. */
 	if (terminating)
 		goto terminate;
 
 
-	/* Multicast information about the client closing. */
+	/* Close the client's channels, and multicast information about the client closing. */
 	n = 2 * 10 + 1 + strlen("Client closed: :\n\n");
 	fail_if (xmalloc(msgbuf, n, char));
 	snprintf(msgbuf, n,
@@ -313,9 +438,12 @@ slave_loop(void *data)
 	         (uint32_t)(information->id >> 32),
 	         (uint32_t)(information->id >>  0));
 	n = strlen(msgbuf);
+	pthread_rwlock_rdlock(&migration_lock);
+	close_channels(information, 1);
 	queue_message_multicast(msgbuf, n, information);
 	msgbuf = NULL;
 	send_multicast_queue(information);
+	pthread_rwlock_unlock(&migration_lock);
 
 
 terminate: /* This done on success as well. */
@@ -327,7 +455,8 @@ done:
 	xclose(slave_fd);
 	free(msgbuf);
 	if (information) {
-		/* Unlist and free client. */
+		/* Unlist and free client and its remaining channels. */
+		close_channels(information, 0);
 		with_mutex (slave_mutex, linked_list_remove(&client_list, information->list_entry););
 		client_destroy(information);
 	}
@@ -345,6 +474,14 @@ fail:
 	goto done;
 
 
+migrated:
+	/* The client has been handed over to the other image of the server. */
+	with_mutex (slave_mutex,
+	            running_slaves--;
+	            pthread_cond_signal(&slave_cond););
+	return NULL;
+
+
 reexec:
 	/* Tell the master thread that the slave has closed,
 	   this is done because re-exec causes a race-condition
@@ -374,14 +511,20 @@ cmp_queued_interception(const void *a, const void *b)
 
 
 /**
- * Queue a message for multicasting
+ * Get the clients that intercept a message, sorted by priority
  * 
- * @param  message  The message
- * @param  length   The length of the message
- * @param  sender   The original sender of the message
+ * @param   message    The message, only the headers are examined
+ * @param   length     The length of the message
+ * @param   sender     The original sender of the message
+ * @param   among      The clients to search, `NULL` to search all clients
+ * @param   among_n    The number of elements in `among`
+ * @param   count_out  Output parameter for the number of interceptors
+ * @return             The interceptors, `NULL` on error or if the message is invalid,
+ *                     `errno` will be set to zero in the latter case
  */
-void
-queue_message_multicast(char *message, size_t length, client_t *sender)
+queued_interception_t *
+get_message_interceptors(char *message, size_t length, client_t *sender,
+                         client_t **among, size_t among_n, size_t *count_out)
 {
 	char *msg = message;
 	size_t header_count = 0;
@@ -390,12 +533,7 @@ queue_message_multicast(char *message, size_t length, client_t *sender)
 	char **headers = NULL;
 	char **header_values = NULL;
 	queued_interception_t *interceptions = NULL;
-	size_t interceptions_count = 0;
-	multicast_t *multicast = NULL;
 	size_t i;
-	uint64_t modify_id;
-	char modify_id_header[13 + 3 * sizeof(uint64_t)];
-	void *new_buf;
 	int saved_errno;
 	char *end, *colon;
 
@@ -406,11 +544,7 @@ queue_message_multicast(char *message, size_t length, client_t *sender)
 				break;
 
 	if (!header_count)
-		return; /* Invalid message. */
-
-	/* Allocate multicast message. */
-	fail_if (xmalloc(multicast, 1, multicast_t));
-	multicast_initialise(multicast);
+		return errno = 0, NULL; /* Invalid message. */
 
 	/* Allocate header lists. */
 	fail_if (xmalloc(hashes,        header_count, size_t));
@@ -443,12 +577,51 @@ queue_message_multicast(char *message, size_t length, client_t *sender)
 
 	/* Get intercepting clients. */
 	pthread_mutex_lock(&(slave_mutex));
-	interceptions = get_interceptors(sender, hashes, headers, header_values, header_count, &interceptions_count);
+	interceptions = get_interceptors(sender, among, among_n, hashes, headers, header_values, header_count, count_out);
 	pthread_mutex_unlock(&(slave_mutex));
 	fail_if (!interceptions);
 
 	/* Sort interceptors. */
-	qsort(interceptions, interceptions_count, sizeof(queued_interception_t), cmp_queued_interception);
+	qsort(interceptions, *count_out, sizeof(queued_interception_t), cmp_queued_interception);
+
+fail:
+	/* Release resources. */
+	saved_errno = errno;
+	xfree(headers, header_count);
+	xfree(header_values, header_count);
+	free(hashes);
+	errno = saved_errno;
+	return interceptions;
+}
+
+
+/**
+ * Queue a message for multicasting
+ * 
+ * @param  message  The message
+ * @param  length   The length of the message
+ * @param  sender   The original sender of the message
+ */
+void
+queue_message_multicast(char *message, size_t length, client_t *sender)
+{
+	queued_interception_t *interceptions = NULL;
+	size_t interceptions_count = 0;
+	multicast_t *multicast = NULL;
+	size_t n;
+	uint64_t modify_id;
+	char modify_id_header[13 + 3 * sizeof(uint64_t)];
+	void *new_buf;
+
+	/* Get intercepting clients. */
+	interceptions = get_message_interceptors(message, length, sender, NULL, 0, &interceptions_count);
+	if (!interceptions && !errno)
+		goto done; /* Invalid message. */
+	fail_if (!interceptions);
+
+	/* Allocate multicast message. */
+	fail_if (xmalloc(multicast, 1, multicast_t));
+	multicast_initialise(multicast);
 
 	/* Add prefix to message with ‘Modify ID’ header. */
 	with_mutex (slave_mutex,
@@ -470,6 +643,7 @@ queue_message_multicast(char *message, size_t length, client_t *sender)
 	multicast->message = message;
 	multicast->message_length = length + n;
 	multicast->message_prefix = n;
+	interceptions = NULL;
 	message = NULL;
 
 #define fail fail_in_mutex
@@ -489,9 +663,7 @@ queue_message_multicast(char *message, size_t length, client_t *sender)
 
 done:
 	/* Release resources. */
-	xfree(headers, header_count);
-	xfree(header_values, header_count);
-	free(hashes);
+	free(interceptions);
 	free(message);
 	if (multicast)
 		multicast_destroy(multicast);
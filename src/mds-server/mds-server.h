@@ -20,6 +20,7 @@
 
 
 #include "client.h"
+#include "queued-interception.h"
 
 #include <stddef.h>
 
@@ -39,6 +40,22 @@ int accept_connection(void);
  */
 void *slave_loop(void *data);
 
+/**
+ * Get the clients that intercept a message, sorted by priority
+ * 
+ * @param   message    The message, only the headers are examined
+ * @param   length     The length of the message
+ * @param   sender     The original sender of the message
+ * @param   among      The clients to search, `NULL` to search all clients
+ * @param   among_n    The number of elements in `among`
+ * @param   count_out  Output parameter for the number of interceptors
+ * @return             The interceptors, `NULL` on error or if the message is invalid,
+ *                     `errno` will be set to zero in the latter case
+ */
+__attribute__((nonnull(1, 3, 6)))
+queued_interception_t *get_message_interceptors(char *message, size_t length, client_t *sender,
+                                                client_t **among, size_t among_n, size_t *count_out);
+
 /**
  * Queue a message for multicasting
  * 
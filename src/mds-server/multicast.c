@@ -149,11 +149,15 @@ fail:
 size_t
 multicast_unmarshal_skip(char *restrict data)
 {
-	size_t interceptions_count = buf_cast(data, size_t, 0);
-	size_t message_length = buf_cast(data, size_t, 2);
-	size_t n, rc = sizeof(int) + 5 * sizeof(size_t) + message_length * sizeof(char);
+	size_t interceptions_count, message_length, n, rc;
+	buf_next(data, int, 1);
+	buf_get_next(data, size_t, interceptions_count);
+	buf_next(data, size_t, 1);
+	buf_get_next(data, size_t, message_length);
+	buf_next(data, size_t, 2);
+	rc = sizeof(int) + 5 * sizeof(size_t) + message_length * sizeof(char);
 	while (interceptions_count--) {
-		n = queued_interception_unmarshal_skip();
+		n = queued_interception_unmarshal_skip(data);
 		data += n / sizeof(char);
 		rc += n;
 	}
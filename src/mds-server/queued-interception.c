@@ -29,7 +29,7 @@
 size_t
 queued_interception_marshal_size(void)
 {
-	return sizeof(int64_t) + 3 * sizeof(int);
+	return sizeof(int64_t) + 3 * sizeof(int) + sizeof(uint64_t);
 }
 
 
@@ -47,6 +47,7 @@ queued_interception_marshal(const queued_interception_t *restrict this, char *re
 	buf_set_next(data, int64_t, this->priority);
 	buf_set_next(data, int, this->modifying);
 	buf_set_next(data, int, this->client->socket_fd);
+	buf_set_next(data, uint64_t, this->client->connection ? this->client->id : 0);
 	return queued_interception_marshal_size();
 }
 
@@ -61,12 +62,16 @@ queued_interception_marshal(const queued_interception_t *restrict this, char *re
 size_t
 queued_interception_unmarshal(queued_interception_t *restrict this, char *restrict data)
 {
+	int version;
 	this->client = NULL;
-	/* buf_get_next(data, int, QUEUED_INTERCEPTION_T_VERSION); */
-	buf_next(data, int, 1);
+	this->channel = 0;
+	buf_get_next(data, int, version);
 	buf_get_next(data, int64_t, this->priority);
 	buf_get_next(data, int, this->modifying);
 	buf_get_next(data, int, this->socket_fd);
+	if (version < 1)
+		return sizeof(int64_t) + 3 * sizeof(int);
+	buf_get_next(data, uint64_t, this->channel);
 	return queued_interception_marshal_size();
 }
 
@@ -78,7 +83,9 @@ queued_interception_unmarshal(queued_interception_t *restrict this, char *restri
  * @return        The number of read bytes
  */
 size_t
-queued_interception_unmarshal_skip(void)
+queued_interception_unmarshal_skip(char *restrict data)
 {
+	if (buf_cast(data, int, 0) < 1)
+		return sizeof(int64_t) + 3 * sizeof(int);
 	return queued_interception_marshal_size();
 }
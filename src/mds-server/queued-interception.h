@@ -24,7 +24,7 @@
 #include <stdint.h>
 
 
-#define QUEUED_INTERCEPTION_T_VERSION 0
+#define QUEUED_INTERCEPTION_T_VERSION 1
 
 /**
  * A queued interception
@@ -49,6 +49,12 @@ typedef struct queued_interception {
 	 * The file descriptor of the intercepting client's socket (used for unmarshalling)
 	 */
 	int socket_fd;
+
+	/**
+	 * The ID of the intercepting client if it is a channel,
+	 * otherwise zero (used for unmarshalling)
+	 */
+	uint64_t channel;
 } queued_interception_t;
 
 
@@ -87,8 +93,8 @@ size_t queued_interception_unmarshal(queued_interception_t *restrict this, char
  * @param   data  In buffer with the marshalled data
  * @return        The number of read bytes
  */
-__attribute__((const, nonnull))
-size_t queued_interception_unmarshal_skip(void);
+__attribute__((pure, nonnull))
+size_t queued_interception_unmarshal_skip(char *restrict data);
 
 
 #endif
@@ -20,12 +20,19 @@
 #include "globals.h"
 #include "client.h"
 #include "interceptors.h"
+#include "sending.h"
+#include "channels.h"
 
 #include <libmdsserver/hash-table.h>
 #include <libmdsserver/mds-message.h>
 #include <libmdsserver/macros.h>
+#include <libmdsserver/memfd.h>
+#include <libmdsserver/ring.h>
+#include <libmdsserver/binary.h>
+#include <libmdsserver/util.h>
 
 #include <stddef.h>
+#include <stdarg.h>
 #include <inttypes.h>
 #include <errno.h>
 #include <string.h>
@@ -42,6 +49,22 @@
 __attribute__((nonnull))
 void queue_message_multicast(char *message, size_t length, client_t *sender);
 
+/**
+ * Get the clients that intercept a message, sorted by priority
+ * 
+ * @param   message    The message, only the headers are examined
+ * @param   length     The length of the message
+ * @param   sender     The original sender of the message
+ * @param   among      The clients to search, `NULL` to search all clients
+ * @param   among_n    The number of elements in `among`
+ * @param   count_out  Output parameter for the number of interceptors
+ * @return             The interceptors, `NULL` on error or if the message is invalid,
+ *                     `errno` will be set to zero in the latter case
+ */
+__attribute__((nonnull(1, 3, 6)))
+queued_interception_t *get_message_interceptors(char *message, size_t length, client_t *sender,
+                                                client_t **among, size_t among_n, size_t *count_out);
+
 
 /**
  * Notify waiting client about a received message modification
@@ -102,24 +125,26 @@ fail:
  * Add intercept conditions listed in the payload of a message
  * 
  * @param   client     The intercepting client
+ * @param   message    The message
  * @param   modifying  Whether then client may modify the messages
  * @param   priority   The client's interception priority
  * @param   stop       Whether to stop listening rather than start or reconfigure
  * @return             Zero on success, -1 on error
  */
 static int __attribute__((nonnull))
-add_intercept_conditions_from_message(client_t *client, int modifying, int64_t priority, int stop)
+add_intercept_conditions_from_message(client_t *client, const mds_message_t *message,
+                                      int modifying, int64_t priority, int stop)
 {
 	int saved_errno;
-	char *payload = client->message.payload;
-	size_t payload_size = client->message.payload_size;
+	char *payload = message->payload;
+	size_t payload_size = message->payload_size;
 	size_t size = 64, len;
 	char *buf, *end, *old_buf;
 
 	fail_if (xmalloc(buf, size + 1, char));
 
 	/* All messages. */
-	if (!client->message.payload_size) {
+	if (!message->payload_size) {
 		*buf = '\0';
 		add_intercept_condition(client, buf, priority, modifying, stop);
 		goto done;
@@ -161,40 +186,44 @@ fail:
 
 
 /**
- * Assign and ID to a client, if not already assigned, and send it to that client
+ * Send a reply to a client, and multicast it
  * 
- * @param   client      The client to who an ID should be assigned
- * @param   message_id  The message ID of the ID request
- * @return              Zero on success, -1 on error
+ * The message is queued to be sent when the slave loop gets
+ * back to the client, this done to simplify `multicast_message`
+ * for re-exec and termination. If the client is a channel, the
+ * queued message is prefixed with the `Channel`-header.
+ * 
+ * @param   client  The client to send the reply to
+ * @param   format  The format string for the reply
+ * @param   extra   The only string among the format arguments, the
+ *                  other arguments must be two `uint32_t`:s
+ * @param   ...     The format arguments
+ * @return          Zero on success, -1 on error
  */
-static int __attribute__((nonnull(1)))
-assign_and_send_id(client_t *client, const char *message_id)
+static int __attribute__((nonnull, format(printf, 2, 4)))
+send_reply(client_t *client, const char *format, const char *extra, ...)
 {
 	char *msgbuf = NULL;
 	char *msgbuf_;
 	char *msg_new;
-	size_t n, new_len;
+	size_t n, new_len, prefix;
+	va_list args;
 	int rc = -1;
 
 	/* Construct response. */
-	n = 2 * 10 + strlen(message_id);
-	n += sizeof("ID assignment: :\nIn response to: \n\n") / sizeof(char);
+	n = CHANNEL_HEADER_MAX + 2 * 10 + strlen(format) + strlen(extra) + 1;
 	fail_if (xmalloc(msgbuf, n, char));
-	snprintf(msgbuf, n,
-	         "ID assignment: %" PRIu32 ":%" PRIu32 "\n"
-	         "In response to: %s\n"
-	         "\n",
-	         (uint32_t)(client->id >> 32),
-	         (uint32_t)(client->id >>  0),
-	         !message_id ? "" : message_id);
+	prefix = channel_header(client, msgbuf);
+	va_start(args, extra);
+	vsnprintf(msgbuf + prefix, n - prefix, format, args);
+	va_end(args);
 	n = strlen(msgbuf);
 
 	/* Multicast the reply. */
-	fail_if (xstrdup(msgbuf_, msgbuf));
-	queue_message_multicast(msgbuf_, n, client);
+	fail_if (xstrdup(msgbuf_, msgbuf + prefix));
+	queue_message_multicast(msgbuf_, n - prefix, client);
 
-	/* Queue message to be sent when this function returns.
-	   This done to simplify `multicast_message` for re-exec and termination. */
+	/* Queue message to be sent when this function returns. */
 #define fail fail_in_mutex
 	with_mutex (client->mutex,
 	            if (!client->send_pending_size) {
@@ -222,6 +251,163 @@ fail: /* Also success. */
 }
 
 
+/**
+ * Start communicating with a client over a shared-memory ring
+ * pair, whose memfd and doorbells were passed with the request
+ * 
+ * The client writes to the ring as soon as it has sent the request,
+ * and reads from it as soon as it has received the reply, therefore
+ * the reply is sent immediately, rather than queued, and is the last
+ * message sent over the socket. If the ring cannot be set up, the
+ * client is disconnected, since it can no longer be understood.
+ * 
+ * @param   client      The client whom sent the request
+ * @param   message_id  The message ID of the request
+ * @return              Zero on success, -1 on error
+ */
+static int __attribute__((nonnull))
+set_up_ring(client_t *client, const char *message_id)
+{
+	client_t *connection = client_connection(client);
+	mds_message_t *message = &(connection->message);
+	ring_t *ring = NULL;
+	char *msgbuf = NULL;
+	const char *msg;
+	size_t i, n, sent;
+	int fds[3], ok;
+
+	for (i = 0; i < 3; i++)
+		fds[i] = memfd_take(message->fds, &(message->fd_count));
+	ok = fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0;
+
+	if (!ok || client->connection || connection->ring) {
+		eprint("received malformed ring request, disconnecting client.");
+		for (i = 0; i < 3; i++)
+			if (fds[i] >= 0)
+				close(fds[i]);
+		ok = 0;
+	} else if (xmalloc(ring, 1, ring_t)) {
+		for (i = 0; i < 3; i++)
+			close(fds[i]);
+		xperror(*argv);
+		ok = 0;
+	} else if (ring_attach(ring, fds[0], fds[1], fds[2])) {
+		xperror(*argv);
+		free(ring), ring = NULL;
+		ok = 0;
+	}
+
+	/* Everything that follows the request is in the ring. */
+	message->ring = ring;
+
+	n = strlen("Ring: yes\nIn response to: \n\n") + strlen(message_id) + 1;
+	fail_if (xmalloc(msgbuf, n, char));
+	snprintf(msgbuf, n, "Ring: %s\nIn response to: %s\n\n", ok ? "yes" : "no", message_id);
+	n = strlen(msgbuf);
+
+	/* Send the reply between any messages being sent, and switch. */
+	with_mutex (connection->mutex,
+	            while (connection->relaying)
+	                    pthread_cond_wait(&(connection->relay_cond), &(connection->mutex));
+	            for (msg = msgbuf; n > 0 && connection->open;) {
+	                    sent = send_to_connection(connection, msg, n);
+	                    n -= sent;
+	                    msg += sent / sizeof(char);
+	                    if (n > 0 && errno != EINTR) { /* Ignore EINTR */
+	                            xperror(*argv);
+	                            break;
+	                    }
+	            }
+	            if (ok && !n) {
+	                    connection->ring = ring;
+	                    connection->accept_memfd = 0;
+	            } else {
+	                    connection->open = 0;
+	            }
+	           );
+
+	free(msgbuf);
+	return 0;
+
+fail:
+	connection->open = 0;
+	return -1;
+}
+
+
+/**
+ * Switch the connection of a client to the binary encoding
+ * 
+ * The client sends in the binary encoding as soon as it has sent
+ * the request, and reads in it as soon as it has received the reply,
+ * therefore the reply is sent immediately, rather than queued, and is
+ * the last message sent in the text encoding. If the connection cannot
+ * be switched, the client is disconnected, since it can no longer be
+ * understood.
+ * 
+ * @param   client      The client whom sent the request
+ * @param   message_id  The message ID of the request
+ * @return              Zero on success, -1 on error
+ */
+static int __attribute__((nonnull))
+set_up_binary(client_t *client, const char *message_id)
+{
+	client_t *connection = client_connection(client);
+	binary_encoder_t *encoder = NULL;
+	char *msgbuf = NULL;
+	const char *msg;
+	size_t n, sent;
+	int ok = 1;
+
+	if (client->connection || connection->binary) {
+		eprint("received malformed binary encoding request, disconnecting client.");
+		ok = 0;
+	} else if (xcalloc(encoder, 1, binary_encoder_t)) {
+		xperror(*argv);
+		ok = 0;
+	}
+
+	/* Everything that follows the request is in the binary encoding. */
+	connection->message.binary = 1;
+
+	n = strlen("Binary: yes\nIn response to: \n\n") + strlen(message_id) + 1;
+	fail_if (xmalloc(msgbuf, n, char));
+	snprintf(msgbuf, n, "Binary: %s\nIn response to: %s\n\n", ok ? "yes" : "no", message_id);
+	n = strlen(msgbuf);
+
+	/* Send the reply between any messages being sent, and switch. */
+	with_mutex (connection->mutex,
+	            while (connection->relaying)
+	                    pthread_cond_wait(&(connection->relay_cond), &(connection->mutex));
+	            for (msg = msgbuf; n > 0 && connection->open;) {
+	                    sent = send_to_connection(connection, msg, n);
+	                    n -= sent;
+	                    msg += sent / sizeof(char);
+	                    if (n > 0 && errno != EINTR) { /* Ignore EINTR */
+	                            xperror(*argv);
+	                            break;
+	                    }
+	            }
+	            if (ok && !n) {
+	                    connection->binary = encoder;
+	                    connection->accept_memfd = 0;
+	                    encoder = NULL;
+	            } else {
+	                    connection->open = 0;
+	            }
+	           );
+
+	free(encoder);
+	free(msgbuf);
+	return 0;
+
+fail:
+	free(encoder);
+	connection->open = 0;
+	return -1;
+}
+
+
 /**
  * Perform actions that should be taken when
  * a message has been received from a client
@@ -236,23 +422,38 @@ message_received(client_t *client)
 	int assign_id = 0;
 	int modifying = 0;
 	int intercept = 0;
+	int memfd = 0;
+	int open_channel_ = 0;
+	int close_channel_ = 0;
+	int ring = 0;
+	int binary = 0;
 	int64_t priority = 0;
 	int stop = 0;
 	const char *message_id = NULL;
 	uint64_t modify_id = 0;
 	char *msgbuf = NULL;
+	client_t *channel;
 	size_t i, n;
 	const char *h;
 	char buf[26];
 
 
+	/* Messages sent on a channel are handled as sent by the channel. */
+	if (!(client = demultiplex_message(client, &message)))
+		return 0;
+
 	/* Parser headers. */
 	for (i = 0; i < message.header_count; i++) {
 		h = message.headers[i];
-		if      (strequals(h,  "Command: assign-id")) assign_id  = 1;
-		else if (strequals(h,  "Command: intercept")) intercept  = 1;
+		if      (strequals(h,  "Command: assign-id"))     assign_id      = 1;
+		else if (strequals(h,  "Command: intercept"))     intercept      = 1;
+		else if (strequals(h,  "Command: open-channel"))  open_channel_  = 1;
+		else if (strequals(h,  "Command: close-channel")) close_channel_ = 1;
+		else if (strequals(h,  "Command: ring"))          ring           = 1;
+		else if (strequals(h,  "Command: binary"))        binary         = 1;
 		else if (strequals(h,  "Modifying: yes"))     modifying  = 1;
 		else if (strequals(h,  "Stop: yes"))          stop       = 1;
+		else if (strequals(h,  "Memfd: yes"))         memfd      = 1;
 		else if (startswith(h, "Message ID: "))       message_id = strstr(h, ": ") + 2;
 		else if (startswith(h, "Priority: "))         priority   = ato64(strstr(h, ": ") + 2);
 		else if (startswith(h, "Modify ID: "))        modify_id  = atou64(strstr(h, ": ") + 2);
@@ -288,13 +489,15 @@ message_received(client_t *client)
 	if (intercept) {
 		pthread_mutex_lock(&(client->mutex));
 		if ((intercept & 1)) /* from payload */
-			fail_if (add_intercept_conditions_from_message(client, modifying, priority, stop) < 0);
+			fail_if (add_intercept_conditions_from_message(client, &message, modifying, priority, stop) < 0);
 		if ((intercept & 2)) { /* "To: $(client->id)" */
 			xsnprintf(buf, "To: %" PRIu32 ":%" PRIu32,
 			          (uint32_t)(client->id >> 32),
 			          (uint32_t)(client->id >>  0));
 			add_intercept_condition(client, buf, priority, modifying, 0);
 		}
+		if (memfd)
+			client->accept_memfd = 1;
 		pthread_mutex_unlock(&(client->mutex));
 	}
 
@@ -309,7 +512,43 @@ message_received(client_t *client)
 
 	/* Send asigned ID. */
 	if (assign_id)
-		fail_if (assign_and_send_id(client, message_id) < 0);
+		fail_if (send_reply(client,
+		                    "ID assignment: %" PRIu32 ":%" PRIu32 "\n"
+		                    "In response to: %s\n"
+		                    "\n",
+		                    message_id,
+		                    (uint32_t)(client->id >> 32),
+		                    (uint32_t)(client->id >>  0),
+		                    message_id) < 0);
+
+	/* Open a channel over the client's connection, and send its ID. */
+	if (open_channel_) {
+		fail_if (!(channel = open_channel(client_connection(client))));
+		fail_if (send_reply(client,
+		                    "Channel assignment: %" PRIu32 ":%" PRIu32 "\n"
+		                    "In response to: %s\n"
+		                    "\n",
+		                    message_id,
+		                    (uint32_t)(channel->id >> 32),
+		                    (uint32_t)(channel->id >>  0),
+		                    message_id) < 0);
+	}
+
+	/* Close the channel the message was sent on. */
+	if (close_channel_) {
+		if (client->connection)
+			close_channel(client);
+		else
+			eprint("received request to close a channel on a connection, ignoring.");
+	}
+
+	/* Continue the conversation over a shared-memory ring. */
+	if (ring)
+		fail_if (set_up_ring(client, message_id) < 0);
+
+	/* Continue the conversation in the binary encoding. */
+	if (binary)
+		fail_if (set_up_binary(client, message_id) < 0);
 
 	return 0;
 
@@ -318,3 +557,144 @@ fail:
 	free(msgbuf);
 	return 0;
 }
+
+
+/**
+ * Get the recipients of a message if it can be passed on
+ * to them without being buffered, inspected or modified
+ * 
+ * @param   client      The client whom sent the message
+ * @param   memfd       Whether the recipients must accept payloads in memfds
+ * @param   msgbuf_out  Output parameter for the composed headers of the message
+ * @param   length_out  Output parameter for the length of `*msgbuf_out`
+ * @param   count_out   Output parameter for the number of recipients
+ * @return              The recipients, `NULL` if the message cannot be passed on this way
+ */
+static queued_interception_t * __attribute__((nonnull))
+get_relay_recipients(client_t *client, int memfd, char **msgbuf_out, size_t *length_out, size_t *count_out)
+{
+	mds_message_t message = client->message;
+	queued_interception_t *interceptions = NULL;
+	int have_message_id = 0;
+	char *msgbuf = NULL;
+	size_t i, j, n;
+	const char *h;
+
+	/* Messages sent on a channel are relayed as sent by the channel. */
+	if (!(client = demultiplex_message(client, &message)))
+		return NULL;
+
+	/* Only plain multicasts can be relayed, messages that
+	   the server acts upon need their entire payload. */
+	for (i = 0; i < message.header_count; i++) {
+		h = message.headers[i];
+		if      (strequals(h,  "Command: assign-id"))     return NULL;
+		else if (strequals(h,  "Command: intercept"))     return NULL;
+		else if (strequals(h,  "Command: open-channel"))  return NULL;
+		else if (strequals(h,  "Command: close-channel")) return NULL;
+		else if (strequals(h,  "Command: ring"))          return NULL;
+		else if (strequals(h,  "Command: binary"))        return NULL;
+		else if (strequals(h,  "Modifying: yes"))         return NULL;
+		else if (startswith(h, "Message ID: "))           have_message_id = 1;
+	}
+	if (!have_message_id)
+		return NULL;
+
+	/* Compose the headers, the payload is not buffered. */
+	message.payload_size = 0;
+	n = mds_message_compose_size(&message);
+	fail_if (xbmalloc(msgbuf, n));
+	mds_message_compose(&message, msgbuf);
+	n /= sizeof(char);
+
+	/* Modifying interceptors need the entire payload. */
+	interceptions = get_message_interceptors(msgbuf, n, client, NULL, 0, count_out);
+	fail_if (!interceptions);
+	for (i = 0; i < *count_out; i++)
+		if (interceptions[i].modifying || (memfd && !interceptions[i].client->accept_memfd))
+			goto unrelayable;
+		else if (memfd && client_connection(interceptions[i].client)->ring)
+			goto unrelayable; /* File descriptors cannot be passed over rings. */
+		else if (memfd && client_connection(interceptions[i].client)->binary)
+			goto unrelayable; /* Nor in the binary encoding. */
+
+	/* Channels on the same connection would need their copies
+	   of the payload interleaved, which cannot be done. */
+	for (i = 0; i < *count_out; i++)
+		if (interceptions[i].client->connection)
+			for (j = 0; j < i; j++)
+				if (client_connection(interceptions[j].client) == interceptions[i].client->connection)
+					goto unrelayable;
+
+	*msgbuf_out = msgbuf;
+	*length_out = n;
+	return interceptions;
+
+fail:
+	xperror(*argv);
+unrelayable:
+	free(interceptions);
+	free(msgbuf);
+	return NULL;
+}
+
+
+/**
+ * Perform actions that should be taken when the headers of a
+ * message, whose payload is large enough to be relayed while
+ * it is being received, has been received from a client
+ * 
+ * @param   client  The client whom sent the message
+ * @return          Zero if the message was relayed, 1 if its payload must
+ *                  be buffered and the message be passed to `message_received`
+ */
+int
+message_headers_received(client_t *client)
+{
+	queued_interception_t *interceptions;
+	char *msgbuf;
+	size_t n, count;
+
+	interceptions = get_relay_recipients(client, 0, &msgbuf, &n, &count);
+	if (!interceptions)
+		return 1;
+
+	relay_message(client, interceptions, count, msgbuf, n);
+	free(interceptions);
+	free(msgbuf);
+	return 0;
+}
+
+
+/**
+ * Perform actions that should be taken when a message,
+ * whose payload was sent in a memfd, has been received
+ * from a client
+ * 
+ * @param   client  The client whom sent the message
+ * @return          Zero if the message was handled, 1 if its payload has
+ *                  been inlined and it shall be passed to `message_received`
+ */
+int
+memfd_message_received(client_t *client)
+{
+	queued_interception_t *interceptions;
+	char *msgbuf;
+	size_t n, count;
+
+	/* Pass on the memfd if all recipients accept it. */
+	interceptions = get_relay_recipients(client, 1, &msgbuf, &n, &count);
+	if (interceptions) {
+		forward_memfd_message(interceptions, count, msgbuf, n, client->message.payload_fd);
+		free(interceptions);
+		free(msgbuf);
+		return 0;
+	}
+
+	/* Otherwise, the message is handled like any other. */
+	if (mds_message_inline_payload(&(client->message))) {
+		xperror(*argv);
+		return 0;
+	}
+	return 1;
+}
@@ -32,5 +32,29 @@
 __attribute__((nonnull))
 int message_received(client_t *client);
 
+/**
+ * Perform actions that should be taken when the headers of a
+ * message, whose payload is large enough to be relayed while
+ * it is being received, has been received from a client
+ * 
+ * @param   client  The client whom sent the message
+ * @return          Zero if the message was relayed, 1 if its payload must
+ *                  be buffered and the message be passed to `message_received`
+ */
+__attribute__((nonnull))
+int message_headers_received(client_t *client);
+
+/**
+ * Perform actions that should be taken when a message,
+ * whose payload was sent in a memfd, has been received
+ * from a client
+ * 
+ * @param   client  The client whom sent the message
+ * @return          Zero if the message was handled, 1 if its payload has
+ *                  been inlined and it shall be passed to `message_received`
+ */
+__attribute__((nonnull))
+int memfd_message_received(client_t *client);
+
 
 #endif
@@ -24,6 +24,7 @@
 #include <libmdsserver/hash-table.h>
 #include <libmdsserver/fd-table.h>
 #include <libmdsserver/macros.h>
+#include <libmdsserver/ring.h>
 #include <libmdsserver/util.h>
 
 #include <stddef.h>
@@ -65,7 +66,7 @@ marshal_server_size(void)
 	}
 
 	/* Add the size of the rest of the program's state. */
-	state_n += sizeof(int) + sizeof(sig_atomic_t) + 2 * sizeof(uint64_t) + 2 * sizeof(size_t);
+	state_n += 2 * sizeof(int) + sizeof(pid_t) + sizeof(sig_atomic_t) + 2 * sizeof(uint64_t) + 2 * sizeof(size_t);
 	state_n += list_elements * sizeof(size_t) + list_size + map_size;
 
 	return state_n;
@@ -108,6 +109,10 @@ marshal_server(char *state_buf)
 	buf_set_next(state_buf, uint64_t, next_client_id);
 	buf_set_next(state_buf, uint64_t, next_modify_id);
 
+	/* Marshal the connection to the temporary image of the server, during a staged re-exec. */
+	buf_set_next(state_buf, int, handover_fd);
+	buf_set_next(state_buf, pid_t, handover_pid);
+
 	/* Tell the program how large the marshalled client list is and how any clients are marshalled. */
 	buf_set_next(state_buf, size_t, list_size);
 	buf_set_next(state_buf, size_t, list_elements);
@@ -135,6 +140,9 @@ marshal_server(char *state_buf)
 	/* Release resources. */
 	foreach_linked_list_node (client_list, node) {
 		client = (void *)(client_list.values[node]);
+		/* The file descriptors of a ring must survive the re-exec, only unmap it. */
+		if (client->ring)
+			client->ring->memfd = client->ring->bell = client->ring->peer_bell = -1;
 		client_destroy(client);
 	}
 	fd_table_destroy(&client_map, NULL, NULL);
@@ -182,8 +190,8 @@ unmarshal_server(char *state_buf)
 	ssize_t node;
 	pthread_t slave_thread;
 	size_t n, value_address, new_address;
-	client_t *value, *client;
-	int slave_fd;
+	client_t *value, *client, **channels;
+	int slave_fd, version;
 
 #define fail soft_fail
 
@@ -193,15 +201,20 @@ unmarshal_server(char *state_buf)
 #undef fail
 #define fail clients_fail
   
-	/* Get the marshal protocal version. Not needed, there is only the one version right now. */
-	/* buf_get(state_buf, int, 0, MDS_SERVER_VARS_VERSION); */
-	buf_next(state_buf, int, 1);
+	/* Get the marshal protocal version. */
+	buf_get_next(state_buf, int, version);
 
 	/* Unmarshal the miscellaneous state data. */
 	buf_get_next(state_buf, sig_atomic_t, running);
 	buf_get_next(state_buf, uint64_t, next_client_id);
 	buf_get_next(state_buf, uint64_t, next_modify_id);
 
+	/* Unmarshal the connection to the temporary image of the server, during a staged re-exec. */
+	if (version >= 1) {
+		buf_get_next(state_buf, int, handover_fd);
+		buf_get_next(state_buf, pid_t, handover_pid);
+	}
+
 	/* Get the marshalled size of the client list and how any clients that are marshalled. */
 	buf_get_next(state_buf, size_t, list_size);
 	buf_get_next(state_buf, size_t, list_elements);
@@ -266,6 +279,23 @@ unmarshal_server(char *state_buf)
 		client_list.values[node] = new_address;
 		if (new_address == 0) { /* Returned if missing (or if the address is the invalid NULL.) */
 			linked_list_remove(&client_list, node);
+		} else if (((client_t*)(void*)new_address)->connection) {
+			/* Give the channels back to their connections, they have no slaves. */
+			client = (client_t*)(void*)new_address;
+			value_address = unmarshal_remapper((size_t)(void *)(client->connection));
+			client->connection = (void *)value_address;
+			if (client->connection) {
+				channels = client->connection->channels;
+				if (!xrealloc(channels, client->connection->channels_count + 1, client_t *)) {
+					client->connection->channels = channels;
+					channels[client->connection->channels_count++] = client;
+					continue;
+				}
+				xperror(*argv);
+				with_error = 1;
+			}
+			linked_list_remove(&client_list, node);
+			client_destroy(client);
 		} else {
 			/* Start the clients. (Errors do not need to be reported.) */
 			client = (client_t*)(void*)new_address;
@@ -305,6 +335,6 @@ int
 reexec_failure_recover(void)
 {
 	/* Close all files (hopefully sockets) we do not know what they are. */
-	close_files(fd > 2 && fd != socket_fd && !fd_table_contains_key(&client_map, fd));
+	close_files(fd > 2 && fd != socket_fd && fd != handover_fd && !fd_table_contains_key(&client_map, fd));
 	return 0;
 }
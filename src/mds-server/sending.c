@@ -21,11 +21,19 @@
 #include "client.h"
 #include "queued-interception.h"
 #include "multicast.h"
+#include "channels.h"
+#include "handover.h"
+#include "slavery.h"
 
 #include <libmdsserver/mds-message.h>
 #include <libmdsserver/macros.h>
 #include <libmdsserver/util.h>
+#include <libmdsserver/memfd.h>
+#include <libmdsserver/ring.h>
+#include <libmdsserver/binary.h>
 
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <errno.h>
@@ -39,14 +47,123 @@
  * Get the client by its socket's file descriptor in a synchronised manner
  * 
  * @param   client_fd  The file descriptor of the client's socket
+ * @param   channel    The ID of the client if it is a channel multiplexed
+ *                     over the socket, zero otherwise
  * @return             The client
  */
 static client_t *
-client_by_socket(int client_fd)
+client_by_socket(int client_fd, uint64_t channel)
 {
 	size_t address;
+	client_t *client;
 	with_mutex (slave_mutex, address = fd_table_get(&client_map, client_fd););
-	return (client_t*)(void*)address;
+	client = (client_t*)(void*)address;
+	return (client && channel) ? find_channel(client, channel) : client;
+}
+
+
+/**
+ * Send data to a client over its shared-memory ring,
+ * if it has set one up, otherwise over its socket
+ * 
+ * The mutex of the connection must be held
+ * 
+ * @param   connection  The client that owns the connection
+ * @param   data        The data
+ * @param   length      The length of the data
+ * @return              The number of sent bytes, less than `length` on error,
+ *                      `errno` will be set accordingly, see `send_message`
+ */
+static size_t __attribute__((nonnull))
+send_raw(client_t *connection, const char *data, size_t length)
+{
+	if (connection->ring)
+		return ring_send(connection->ring, data, length, connection->socket_fd);
+	return send_message(connection->socket_fd, data, length);
+}
+
+
+/**
+ * Send a message to a client over its shared-memory ring, if it
+ * has set one up, otherwise over its socket, in the encoding it uses
+ * 
+ * The message may be sent in pieces, as in the text encoding.
+ * In the binary encoding, the frame, into which the headers are
+ * translated, cannot be resumed, so it is sent in full, whereas
+ * the payload is passed through as it is.
+ * 
+ * The mutex of the connection must be held
+ * 
+ * @param   connection  The client that owns the connection
+ * @param   message     The message, in the text encoding
+ * @param   length      The length of the message
+ * @return              The number of sent bytes, less than `length` on error,
+ *                      `errno` will be set accordingly, see `send_message`
+ */
+size_t
+send_to_connection(client_t *connection, const char *message, size_t length)
+{
+	binary_encoder_t *encoder = connection->binary;
+	const char *frame;
+	size_t sent = 0, n, got;
+	ssize_t r;
+
+	if (!encoder)
+		return send_raw(connection, message, length);
+
+	while (sent < length) {
+		if (encoder->payload_left) {
+			n = (size_t)min(encoder->payload_left, (uint64_t)(length - sent));
+			got = send_raw(connection, message + sent, n);
+			encoder->payload_left -= got;
+			sent += got;
+			if (got < n)
+				break;
+			continue;
+		}
+
+		if ((r = binary_encode_headers(encoder, message + sent, length - sent)) < 0)
+			break;
+		sent += (size_t)r;
+		for (frame = encoder->frame; encoder->frame_length; frame += got) {
+			got = send_raw(connection, frame, encoder->frame_length);
+			encoder->frame_length -= got;
+			if (encoder->frame_length && errno != EINTR) /* Ignore EINTR */
+				return encoder->frame_length = 0, 0;
+		}
+	}
+
+	return sent;
+}
+
+
+/**
+ * Send the `Channel`-header to a recipient, if it is a channel,
+ * or the `Handover`-header, if it is the other image of the server
+ * 
+ * The mutex of the recipient's connection must be held
+ * 
+ * @param   recipient  The recipient
+ * @return             Zero on success, -1 on error
+ */
+static int __attribute__((nonnull))
+send_channel_header(client_t *recipient)
+{
+	char buf[CHANNEL_HEADER_MAX + 1];
+	const char *msg = buf;
+	size_t sent, n = channel_header(recipient, buf);
+
+	/* The header cannot be resumed, so it is sent in full. */
+	while (n > 0) {
+		sent = send_to_connection(client_connection(recipient), msg, n);
+		n -= sent;
+		msg += sent / sizeof(char);
+		if (n > 0 && errno != EINTR) { /* Ignore EINTR */
+			xperror(*argv);
+			return -1;
+		}
+	}
+	return 0;
 }
 
 
@@ -61,8 +178,10 @@ client_by_socket(int client_fd)
 static int __attribute__((nonnull))
 send_multicast_to_recipient(multicast_t *multicast, client_t *recipient, int modifying)
 {
-	char *msg = multicast->message + multicast->message_ptr;
+	client_t *connection = client_connection(recipient);
+	char *msg = multicast->message;
 	size_t n = multicast->message_length - multicast->message_ptr;
+	int start = !multicast->message_ptr;
 	size_t sent;
 
 	/* Skip Modify ID header if the interceptors will not perform a modification. */
@@ -71,15 +190,25 @@ send_multicast_to_recipient(multicast_t *multicast, client_t *recipient, int mod
 		multicast->message_ptr += multicast->message_prefix;
 	}
 
-	/* Send the message. */
+	/* Send the message. A message to a channel is prefixed with a
+	   header that the message cannot be resumed after, so it is sent
+	   in full, interruptions notwithstanding. Other messages are only
+	   resumed later if we are re-exec:ing or terminating. */
 	n *= sizeof(char);
-	with_mutex (recipient->mutex,
-	            if (recipient->open) {
-	                    sent = send_message(recipient->socket_fd, msg + multicast->message_ptr, n);
-	                    n -= sent;
-	                    multicast->message_ptr += sent / sizeof(char);
+	with_mutex (connection->mutex,
+	            while (connection->relaying)
+	                    pthread_cond_wait(&(connection->relay_cond), &(connection->mutex));
+	            if (recipient->open && connection->open && (!start || !send_channel_header(recipient))) {
+	                    do {
+	                            sent = send_to_connection(connection, msg + multicast->message_ptr, n);
+	                            n -= sent;
+	                            multicast->message_ptr += sent / sizeof(char);
+	                    } while (n > 0 && errno == EINTR && (!terminating || (start && recipient->connection)));
 	                    if (n > 0 && errno != EINTR)
 	                            xperror(*argv);
+	                    else if (!n && start && recipient == handover_bridge)
+	                            handover_forwarded(msg + multicast->message_prefix,
+	                                               multicast->message_length - multicast->message_prefix);
 	            }
 	           );
 	
@@ -149,7 +278,9 @@ void multicast_message(multicast_t *multicast)
 
 		/* After unmarshalling at re-exec, client will be NULL and must be mapped from its socket. */
 		if (!client)
-			client_.client = client = client_by_socket(client_.socket_fd);
+			client_.client = client = client_by_socket(client_.socket_fd, client_.channel);
+		if (!client)
+			continue;
 
 		/* Send the message to the recipient. */
 		if (!send_multicast_to_recipient(multicast, client, client_.modifying)) {
@@ -238,6 +369,7 @@ send_multicast_queue(client_t *client)
 void
 send_reply_queue(client_t *client)
 {
+	client_t *connection = client_connection(client);
 	char *sendbuf = client->send_pending;
 	char *sendbuf_ = sendbuf;
 	size_t sent, n;
@@ -245,12 +377,15 @@ send_reply_queue(client_t *client)
 	if (!client->send_pending_size)
 		return;
 
+	/* Replies to a channel already carry its `Channel`-header. */
 	n = client->send_pending_size;
 	client->send_pending_size = 0;
 	client->send_pending = NULL;
-	with_mutex (client->mutex,
+	with_mutex (connection->mutex,
+	            while (connection->relaying)
+	                    pthread_cond_wait(&(connection->relay_cond), &(connection->mutex));
 	            while (n > 0) {
-	                    sent = send_message(client->socket_fd, sendbuf_, n);
+	                    sent = send_to_connection(connection, sendbuf_, n);
 	                    n -= sent;
 	                    sendbuf_ += sent / sizeof(char);
 	                    if (n > 0 && errno != EINTR) { /* Ignore EINTR */
@@ -261,3 +396,286 @@ send_reply_queue(client_t *client)
 	            free(sendbuf);
 	           );
 }
+
+
+/**
+ * Compare two queued interceptors by the address of their connections
+ * 
+ * @param   a:const queued_interception_t*  One of the interceptors
+ * @param   b:const queued_interception_t*  The other of the two interceptors
+ * @return                                  Negative if a before b, positive if a after b, otherwise zero
+ */
+static int __attribute__((nonnull))
+cmp_queued_interception_address(const void *a, const void *b)
+{
+	uintptr_t p = (uintptr_t)client_connection(((const queued_interception_t *)a)->client);
+	uintptr_t q = (uintptr_t)client_connection(((const queued_interception_t *)b)->client);
+	return p < q ? -1 : p > q;
+}
+
+
+/**
+ * Reserve a recipient of a relayed message, so that no other
+ * message is sent to it until it is released, and so that
+ * no send to it waits more than `RELAY_TIMEOUT` milliseconds
+ * for it to accept data
+ * 
+ * @param  recipient  The recipient
+ */
+static void __attribute__((nonnull))
+relay_reserve(client_t *recipient)
+{
+	client_t *connection = client_connection(recipient);
+	struct timeval timeout = {
+		.tv_sec  = RELAY_TIMEOUT / 1000,
+		.tv_usec = (RELAY_TIMEOUT % 1000) * 1000L
+	};
+	with_mutex (connection->mutex,
+	            while (connection->relaying)
+	                    pthread_cond_wait(&(connection->relay_cond), &(connection->mutex));
+	            connection->relaying = 1;
+	            setsockopt(connection->socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	           );
+}
+
+
+/**
+ * Send a part of a relayed message to one recipient
+ * 
+ * @param   recipient  The recipient
+ * @param   data       The data to send
+ * @param   n          The number of bytes to send
+ * @return             Zero on success, -1 on error
+ */
+static int __attribute__((nonnull))
+relay_to_recipient(client_t *recipient, const char *data, size_t n)
+{
+	client_t *connection = client_connection(recipient);
+	size_t sent;
+	with_mutex (connection->mutex,
+	            while (n > 0 && recipient->open && connection->open) {
+	                    sent = send_to_connection(connection, data, n);
+	                    n -= sent;
+	                    data += sent / sizeof(char);
+	                    if (n > 0 && errno == EAGAIN) {
+	                            eprint("recipient stalled while a message was being relayed to it, disconnecting.");
+	                            break;
+	                    } else if (n > 0 && errno != EINTR) { /* Ignore EINTR */
+	                            if (errno != ECONNRESET)
+	                                    xperror(*argv);
+	                            break;
+	                    }
+	            }
+	           );
+	return n ? -1 : 0;
+}
+
+
+/**
+ * Stop relaying a message to a recipient
+ * 
+ * @param  recipient  The recipient
+ */
+static void __attribute__((nonnull))
+relay_release(client_t *recipient)
+{
+	client_t *connection = client_connection(recipient);
+	struct timeval timeout = { .tv_sec = 0, .tv_usec = 0 };
+	with_mutex (connection->mutex,
+	            setsockopt(connection->socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	            connection->relaying = 0;
+	            pthread_cond_broadcast(&(connection->relay_cond));
+	           );
+}
+
+
+/**
+ * Stop relaying a message to a recipient that has not
+ * received all of it, and close its connection, as it
+ * cannot be sent anything else
+ * 
+ * @param  recipient  The recipient
+ */
+static void __attribute__((nonnull))
+relay_close(client_t *recipient)
+{
+	/* The recipient's slave will find the connection closed. */
+	shutdown(client_connection(recipient)->socket_fd, SHUT_RDWR);
+	relay_release(recipient);
+}
+
+
+/**
+ * Send a part of a relayed message to all recipients, and
+ * close those that cannot receive it
+ * 
+ * @param  interceptions  The recipients, closed recipients are set to `NULL`
+ * @param  count          The number of recipients
+ * @param  data           The data to send
+ * @param  n              The number of bytes to send
+ */
+static void __attribute__((nonnull))
+relay_to_recipients(queued_interception_t *interceptions, size_t count, const char *data, size_t n)
+{
+	size_t i;
+	for (i = 0; i < count; i++) {
+		if (interceptions[i].client && relay_to_recipient(interceptions[i].client, data, n)) {
+			relay_close(interceptions[i].client);
+			interceptions[i].client = NULL;
+		}
+	}
+}
+
+
+/**
+ * Relay a message, to non-modifying recipients, while its
+ * payload is being received, rather than buffering it
+ * 
+ * All recipients receive the message concurrently, so the
+ * order of the interceptors is not preserved. The recipients
+ * are reserved in address order for the entire relay so that
+ * no other message is interleaved with the relayed message and
+ * so that concurrent relays cannot deadlock. A recipient that
+ * accepts nothing for `RELAY_TIMEOUT` milliseconds is closed,
+ * so that two clients relaying to each other cannot deadlock.
+ * If the sender sends nothing for `RELAY_TIMEOUT` milliseconds,
+ * the rest of the payload is buffered, as if the message was
+ * not relayed, and forwarded once it has been received. A relay
+ * cannot be resumed after re-exec, or by the other image of the
+ * server, so if we are re-exec:ing, terminating, or handing over
+ * the sender when it stalls, the sender is closed.
+ * Recipients that do not receive the entire message are closed.
+ * 
+ * @param  sender         The client that owns the connection the message is received over
+ * @param  interceptions  The recipients, must not be modifying, and no two may
+ *                        be channels multiplexed over the same connection
+ * @param  count          The number of recipients
+ * @param  headers        The composed headers of the message, including the terminating empty line
+ * @param  length         The length of `headers`
+ */
+void
+relay_message(client_t *sender, queued_interception_t *interceptions, size_t count, const char *headers, size_t length)
+{
+	mds_message_t *message = &(sender->message);
+	char buf[STREAM_CHUNK_SIZE];
+	struct timespec now, progress;
+	size_t i, got, n, offset;
+	long stalled;
+	int r;
+
+	/* Reserve the recipients and send the headers. */
+	qsort(interceptions, count, sizeof(queued_interception_t), cmp_queued_interception_address);
+	for (i = 0; i < count; i++)
+		relay_reserve(interceptions[i].client);
+	for (i = 0; i < count; i++) {
+		n = channel_header(interceptions[i].client, buf);
+		if ((n && relay_to_recipient(interceptions[i].client, buf, n)) ||
+		    relay_to_recipient(interceptions[i].client, headers, length)) {
+			relay_close(interceptions[i].client);
+			interceptions[i].client = NULL;
+		}
+	}
+
+	/* Forward the payload as it is received, until the sender stalls. */
+	monotone(&progress);
+	while (message->payload_ptr < message->payload_size) {
+		monotone(&now);
+		stalled = (now.tv_sec - progress.tv_sec) * 1000L + (now.tv_nsec - progress.tv_nsec) / 1000000L;
+		if (stalled >= RELAY_TIMEOUT)
+			break;
+		r = mds_message_read_chunk(message, sender->socket_fd, buf, sizeof(buf), &got,
+		                           (int)(RELAY_TIMEOUT - stalled));
+		if (r && errno != EINTR && errno != EAGAIN) {
+			/* Cannot be recovered from, treat as if the sender closed the connection. */
+			if (errno != ECONNRESET)
+				xperror(*argv);
+			sender->open = 0;
+			break;
+		}
+		if (!got)
+			continue;
+		relay_to_recipients(interceptions, count, buf, got);
+		monotone(&progress);
+	}
+
+	/* Buffer the rest of the payload of a stalled sender, and forward it.
+	   As when waiting for a message, the migration lock is released, so
+	   that other clients can be handed over meanwhile. */
+	if (message->payload_ptr < message->payload_size && sender->open) {
+		offset = message->payload_ptr;
+		do {
+			if (terminating || sender->migrating) {
+				r = -1;
+				break;
+			}
+			pthread_rwlock_unlock(&migration_lock);
+			r = fetch_message(sender);
+			pthread_rwlock_rdlock(&migration_lock);
+		} while (r == -1 && errno == EINTR && sender->open);
+		if (r)
+			sender->open = 0;
+		else
+			relay_to_recipients(interceptions, count, message->payload + offset,
+			                    message->payload_size - offset);
+	}
+
+	/* Release the recipients, and close those that
+	   did not receive the entire message. */
+	for (i = 0; i < count; i++) {
+		if (!interceptions[i].client)
+			continue;
+		else if (message->payload_ptr < message->payload_size)
+			relay_close(interceptions[i].client);
+		else
+			relay_release(interceptions[i].client);
+	}
+}
+
+
+/**
+ * Forward a message, whose payload is in a memfd, by passing
+ * the memfd along with the message's headers
+ * 
+ * @param  interceptions  The recipients, must accept memfds and must not be modifying
+ * @param  count          The number of recipients
+ * @param  headers        The composed headers of the message, including the terminating empty line
+ * @param  length         The length of `headers`
+ * @param  fd             The memfd with the payload
+ */
+void
+forward_memfd_message(queued_interception_t *interceptions, size_t count, const char *headers, size_t length, int fd)
+{
+	client_t *recipient, *connection;
+	const char *msg;
+	size_t i, n, sent;
+	ssize_t r;
+
+	for (i = 0; i < count; i++) {
+		recipient = interceptions[i].client;
+		connection = client_connection(recipient);
+		msg = headers;
+		n = length;
+		with_mutex (connection->mutex,
+		            while (connection->relaying)
+		                    pthread_cond_wait(&(connection->relay_cond), &(connection->mutex));
+		            if (!recipient->open || !connection->open || send_channel_header(recipient))
+		                    break;
+		            while ((r = memfd_send(connection->socket_fd, msg, n, fd)) < 0 && errno == EINTR);
+		            if (r < 0) {
+		                    xperror(*argv);
+		                    break;
+		            }
+		            msg += (size_t)r / sizeof(char);
+		            n -= (size_t)r;
+		            while (n > 0) {
+		                    sent = send_to_connection(connection, msg, n);
+		                    n -= sent;
+		                    msg += sent / sizeof(char);
+		                    if (n > 0 && errno != EINTR) { /* Ignore EINTR */
+		                            xperror(*argv);
+		                            break;
+		                    }
+		            }
+		           );
+	}
+}
@@ -21,8 +21,26 @@
 
 #include "multicast.h"
 #include "client.h"
+#include "queued-interception.h"
+
+#include <stddef.h>
 
 
+/**
+ * Send a message to a client over its shared-memory ring, if it
+ * has set one up, otherwise over its socket, in the encoding it uses
+ * 
+ * The mutex of the connection must be held
+ * 
+ * @param   connection  The client that owns the connection
+ * @param   message     The message, in the text encoding
+ * @param   length      The length of the message
+ * @return              The number of sent bytes, less than `length` on error,
+ *                      `errno` will be set accordingly, see `send_message`
+ */
+__attribute__((nonnull))
+size_t send_to_connection(client_t *connection, const char *message, size_t length);
+
 /**
  * Multicast a message
  * 
@@ -47,5 +65,33 @@ void send_multicast_queue(client_t *client);
 __attribute__((nonnull))
 void send_reply_queue(client_t *client);
 
+/**
+ * Relay a message, to non-modifying recipients, while its
+ * payload is being received, rather than buffering it
+ * 
+ * @param  sender         The client whom sent the message
+ * @param  interceptions  The recipients, must not be modifying
+ * @param  count          The number of recipients
+ * @param  headers        The composed headers of the message, including the terminating empty line
+ * @param  length         The length of `headers`
+ */
+__attribute__((nonnull))
+void relay_message(client_t *sender, queued_interception_t *interceptions, size_t count,
+                   const char *headers, size_t length);
+
+/**
+ * Forward a message, whose payload is in a memfd, by passing
+ * the memfd along with the message's headers
+ * 
+ * @param  interceptions  The recipients, must accept memfds and must not be modifying
+ * @param  count          The number of recipients
+ * @param  headers        The composed headers of the message, including the terminating empty line
+ * @param  length         The length of `headers`
+ * @param  fd             The memfd with the payload
+ */
+__attribute__((nonnull))
+void forward_memfd_message(queued_interception_t *interceptions, size_t count,
+                           const char *headers, size_t length, int fd);
+
 
 #endif
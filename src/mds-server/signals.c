@@ -18,6 +18,7 @@
 
 #include "globals.h"
 #include "client.h"
+#include "handover.h"
 
 #include <libmdsserver/linked-list.h>
 #include <libmdsserver/macros.h>
@@ -49,3 +50,29 @@ void signal_all(int signo)
 	            }
 	           );
 }
+
+
+/**
+ * This function is called when a signal that
+ * signals the server to re-exec has been received
+ * 
+ * Rather than stopping all slaves and re-exec:ing at once,
+ * the master thread is told to perform a staged re-exec,
+ * where the clients are handed over to a new image of the
+ * server, while the other clients continue to be served
+ * 
+ * @param  signo  The signal that has been received
+ */
+void
+received_reexec(int signo)
+{
+	SIGHANDLER_START;
+	if (!reexecing && !handover_requested && handover_fd < 0) {
+		handover_requested = 1;
+		eprint("re-exec signal received.");
+		if (!pthread_equal(pthread_self(), master_thread))
+			pthread_kill(master_thread, SIGRTMIN);
+	}
+	SIGHANDLER_END;
+	(void) signo;
+}
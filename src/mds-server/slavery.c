@@ -27,6 +27,8 @@
 #include <stdint.h>
 #include <errno.h>
 #include <stdio.h>
+#include <sched.h>
+#include <sys/socket.h>
 
 
 /**
@@ -42,15 +44,16 @@ void *slave_loop(void *);
  * Receive a full message and update open status if the client closes
  * 
  * @param   client  The client
- * @return          Zero on success, -2 on failure, otherwise -1
+ * @return          Zero on success, 1 if the payload is to be streamed,
+ *                  -2 on failure, otherwise -1
  */
 int
 fetch_message(client_t *client)
 {
 	int r = mds_message_read(&(client->message), client->socket_fd);
 
-	if (!r) {
-		return 0;
+	if (r >= 0) {
+		return r;
 	} else if (r == -2) {
 		eprint("corrupt message received.");
 		fail_if (1);
@@ -104,7 +107,7 @@ fail:
 client_t *
 initialise_client(int client_fd)
 {
-	ssize_t entry = LINKED_LIST_UNUSED;
+	ssize_t entry;
 	client_t *information;
 	int locked = 0, saved_errno;
 	size_t tmp;
@@ -113,11 +116,13 @@ initialise_client(int client_fd)
 	fail_if (xmalloc(information, 1, client_t));
 	client_initialise(information);
 
-	/* Add to list of clients. */
+	/* Add to list of clients. The list entry is set while `slave_mutex`
+	   is held, lest the list is packed, and renumbered, in between. */
 	fail_if ((errno = pthread_mutex_lock(&slave_mutex)));
 	locked = 1;
 	entry = linked_list_insert_end(&client_list, (size_t)(void *)information);
 	fail_if (entry == LINKED_LIST_UNUSED);
+	information->list_entry = entry;
 
 	/* Add client to table. */
 	tmp = fd_table_put(&client_map, client_fd, (size_t)(void *)information);
@@ -126,7 +131,6 @@ initialise_client(int client_fd)
 	locked = 0;
 
 	/* Fill information table. */
-	information->list_entry = entry;
 	information->socket_fd = client_fd;
 	information->open = 1;
 	fail_if (mds_message_initialise(&(information->message)));
@@ -135,10 +139,57 @@ initialise_client(int client_fd)
 
 fail:
 	saved_errno = errno;
+	if (information && information->list_entry >= 0) {
+		if (!locked)
+			pthread_mutex_lock(&slave_mutex);
+		locked = 1;
+		if (information->socket_fd >= 0)
+			fd_table_remove(&client_map, client_fd);
+		linked_list_remove(&client_list, information->list_entry);
+	}
 	if (locked)
 		pthread_mutex_unlock(&slave_mutex);
 	free(information);
-	if (entry != LINKED_LIST_UNUSED)
-		with_mutex (slave_mutex, linked_list_remove(&client_list, entry););
 	return errno = saved_errno, NULL;
 }
+
+
+/**
+ * Let the slave of a client that runs with a real-time
+ * scheduling policy, such as an input server, run with
+ * the same policy and priority, and on the CPUs selected
+ * with --input-cpus, so that the messages on the input
+ * path are not delayed by other servers' clients; this
+ * shall be called by the slave
+ * 
+ * @param   client  The client
+ * @return          Zero on success, -1 on error
+ */
+int
+follow_client_scheduling(client_t *client)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	struct sched_param param;
+	int policy;
+
+	fail_if (getsockopt(client->socket_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0);
+	if (cred.pid <= 0) /* The client is in another PID namespace. */
+		return 0;
+
+	/* ESRCH if the client has already exited, it does not matter. */
+	if ((policy = sched_getscheduler(cred.pid)) < 0)
+		return errno == ESRCH ? 0 : -1;
+	policy &= ~SCHED_RESET_ON_FORK;
+	if (policy != SCHED_FIFO && policy != SCHED_RR)
+		return 0;
+	if (sched_getparam(cred.pid, &param) < 0)
+		return errno == ESRCH ? 0 : -1;
+
+	fail_if ((errno = pthread_setschedparam(pthread_self(), policy, &param)));
+	if (restrict_input_cpus)
+		fail_if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(input_cpus), &input_cpus)));
+	return 0;
+fail:
+	return -1;
+}
@@ -28,7 +28,8 @@
  * Receive a full message and update open status if the client closes
  * 
  * @param   client  The client
- * @return          Zero on success, -2 on failure, otherwise -1
+ * @return          Zero on success, 1 if the payload is to be streamed,
+ *                  -2 on failure, otherwise -1
  */
 __attribute__((nonnull))
 int fetch_message(client_t *client);
@@ -51,5 +52,19 @@ int create_slave(pthread_t *thread_slot, int slave_fd);
  */
 client_t *initialise_client(int client_fd);
 
+/**
+ * Let the slave of a client that runs with a real-time
+ * scheduling policy, such as an input server, run with
+ * the same policy and priority, and on the CPUs selected
+ * with --input-cpus, so that the messages on the input
+ * path are not delayed by other servers' clients; this
+ * shall be called by the slave
+ * 
+ * @param   client  The client
+ * @return          Zero on success, -1 on error
+ */
+__attribute__((nonnull))
+int follow_client_scheduling(client_t *client);
+
 
 #endif
@@ -292,14 +292,19 @@ fail:
 int
 postinitialise_server(void)
 {
-	if (connected)
-		return 0;
+	if (!connected) {
+		if (reconnect_to_display()) {
+			mds_message_destroy(&received);
+			fail_if (1);
+		}
+		connected = 1;
+	}
 
-	if (reconnect_to_display()) {
-		mds_message_destroy(&received);
-		fail_if (1);
+	/* Signal handlers do not survive exec(3). */
+	if (is_reexec) {
+		fail_if (xsigaction(SIGRTMIN + 2, received_switch_vt) < 0);
+		fail_if (xsigaction(SIGRTMIN + 3, received_switch_vt) < 0);
 	}
-	connected = 1;
 
 	fail_if ((errno = pthread_create(&secondary_thread, NULL, secondary_loop, NULL)));
 
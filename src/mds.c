@@ -336,6 +336,7 @@ spawn_and_respawn_server(int fd)
 #endif
 
 respawn:
+	bench_event(*argv, "spawn", 0);
 	pid = fork();
 	fail_if (pid == (pid_t)-1);
 